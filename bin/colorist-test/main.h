@@ -6,6 +6,7 @@
 // ---------------------------------------------------------------------------
 
 #include "colorist/colorist.h"
+#include "colorist/transform.h"
 
 #include <cJSON.h>
 #include <stdlib.h>
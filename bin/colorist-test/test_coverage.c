@@ -7,6 +7,11 @@
 
 #include "main.h"
 
+#include "context_report.h"
+#include "transform_ccmm.h"
+
+#include <math.h>
+
 // ------------------------------------------------------------------------------------------------
 // The tests in here are to attempt to hit 100% code coverage (when running scripts/coverage.sh).
 // colorist-test shouldn't have to run any other test suites but test_coverage() to achieve this.
@@ -286,6 +291,32 @@ static void test_clContextParseArgs(void)
         TEST_ASSERT_FALSE(clContextParseArgs(C, ARGS(argv)));
     }
 
+    {
+        // repeated resize: extra output sizes
+        const char * argv[] = { "colorist", "convert", "input.png", "output.png", "-r", "640", "-r", "320x200,nearest", "-r", "0,64" };
+        TEST_ASSERT_TRUE(clContextParseArgs(C, ARGS(argv)));
+        TEST_ASSERT_EQUAL_INT(C->params.resizeW, 640);
+        TEST_ASSERT_EQUAL_INT(C->params.resizeLevelCount, 2);
+        TEST_ASSERT_EQUAL_INT(C->params.resizeLevels[0].width, 320);
+        TEST_ASSERT_EQUAL_INT(C->params.resizeLevels[0].height, 200);
+        TEST_ASSERT_EQUAL_INT(C->params.resizeLevels[0].filter, CL_FILTER_NEAREST);
+        TEST_ASSERT_EQUAL_INT(C->params.resizeLevels[1].width, 0);
+        TEST_ASSERT_EQUAL_INT(C->params.resizeLevels[1].height, 64);
+        TEST_ASSERT_EQUAL_INT(C->params.resizeLevels[1].filter, CL_FILTER_AUTO);
+    }
+
+    {
+        // repeated resize: too many output sizes
+        const char * argv[(CL_MAX_RESIZE_LEVELS + 2) * 2 + 4] = { "colorist", "convert", "input.png", "output.png" };
+        for (int i = 0; i < (CL_MAX_RESIZE_LEVELS + 2); ++i) {
+            argv[4 + (i * 2)] = "-r";
+            argv[5 + (i * 2)] = "16";
+        }
+        TEST_ASSERT_FALSE(clContextParseArgs(C, ARGS(argv)));
+        TEST_ASSERT_TRUE(clContextParseArgs(C, (CL_MAX_RESIZE_LEVELS + 1) * 2 + 4, argv)); // without the last -r
+        TEST_ASSERT_EQUAL_INT(C->params.resizeLevelCount, CL_MAX_RESIZE_LEVELS);
+    }
+
     {
         // -r requires an argument
         const char * argv[] = { "colorist", "convert", "input.png", "output.png", "-r" };
@@ -296,7 +327,7 @@ static void test_clContextParseArgs(void)
         // coverage kitchen sink
         const char * argv[] = { "colorist", "convert", "input.png", "output.png", "-a", "-b", "16", "-c", "copyright",
                                 "-d", "description", "-f", "png", "-g", "2.2", "-g", "s", "-h", "--hald", "hald.png",
-                                "--iccin", "iccin.icc", "-j", "4", "-j", "0", "--json", "-l", "1000", "-l", "s",
+                                "--iccin", "iccin.icc", "-j", "4", "-j", "0", "--json", "-l", "1000", "-l", "s", "--lut", "33",
                                 "--iccout", "iccout.icc", "-q", "50", "--striptags", "lumi", "-t", "on", "-v",
                                 "--cmm", "lcms", "--cmm", "ccmm", "--rect", "0,0,1,1", "--crop", "0,0,1,1",
                                 "-2", "50", "--jp2rate", "50", "--rate", "50" };
@@ -309,10 +340,16 @@ static void test_clContextParseArgs(void)
         TEST_ASSERT_FALSE(clContextParseArgs(C, ARGS(argv)));
     }
 
+    {
+        // invalid lut size
+        const char * argv[] = { "colorist", "convert", "input.png", "output.png", "--lut", "1" };
+        TEST_ASSERT_FALSE(clContextParseArgs(C, ARGS(argv)));
+    }
+
     {
         // test everything that requires an argument
         const char * needsArgs[] = { "-b", "-c", "-d", "-f", "-g", "--hald", "--iccin", "-j", "-l",
-                                     "--iccout", "-p", "-q", "--striptags", "-t", "--cms", "--crop", "--rate" };
+                                     "--lut", "--iccout", "-p", "-q", "--striptags", "-t", "--cms", "--crop", "--rate" };
         const int needsArgsCount = sizeof(needsArgs) / sizeof(needsArgs[0]);
         const char * argv[] = { "colorist", "convert", "input.png", "output.png", NULL };
         for (int i = 0; i < needsArgsCount; ++i) {
@@ -541,6 +578,38 @@ static void test_debugDump(void)
     clContextDestroy(C);
 }
 
+// Opaque gradients, smooth enough that no resize filter rings outside of [0,1]
+static clImage * createPatternImage(clContext * C, int width, int height, int depth)
+{
+    clImage * image = clImageCreate(C, width, height, depth, NULL);
+    float maxChannel = (float)((1 << depth) - 1);
+    for (int j = 0; j < height; ++j) {
+        for (int i = 0; i < width; ++i) {
+            int channels[4];
+            for (int c = 0; c < 3; ++c) {
+                channels[c] = (int)(maxChannel * (0.5f + 0.3f * sinf((float)(i * (c + 1)) * 0.05f + (float)j * 0.03f) * cosf((float)j * 0.04f)));
+            }
+            channels[3] = (int)maxChannel;
+            clImageSetPixel(C, image, i, j, channels[0], channels[1], channels[2], channels[3]);
+        }
+    }
+    return image;
+}
+
+// The float resize, as clImageResize() did it before it had native depth paths
+static clImage * resizeViaFloats(clContext * C, clImage * image, int width, int height, clFilter filter)
+{
+    clImage * resized = clImageCreate(C, width, height, image->depth, image->profile);
+    float * srcFloats = clAllocate(4 * sizeof(float) * image->width * image->height);
+    float * dstFloats = clAllocate(4 * sizeof(float) * width * height);
+    clPixelMathUNormToFloat(C, image->pixels, image->depth, srcFloats, image->width * image->height);
+    clPixelMathResize(C, 1, image->width, image->height, srcFloats, width, height, dstFloats, filter);
+    clPixelMathFloatToUNorm(C, dstFloats, resized->pixels, resized->depth, width * height);
+    clFree(srcFloats);
+    clFree(dstFloats);
+    return resized;
+}
+
 static void test_resize(void)
 {
     clContext * C = clContextCreate(&silentSystem);
@@ -551,22 +620,692 @@ static void test_resize(void)
 
     // Large to small
     large = clImageParseString(C, "512x512,#ff0000", 8, NULL);
-    small = clImageResize(C, large, 256, 256, CL_FILTER_AUTO);
+    small = clImageResize(C, large, 1, 256, 256, CL_FILTER_AUTO);
     clImageDestroy(C, large);
     clImageDestroy(C, small);
 
     // Small to large
     small = clImageParseString(C, "256x256,#ff0000", 8, NULL);
-    large = clImageResize(C, small, 512, 512, CL_FILTER_AUTO);
+    large = clImageResize(C, small, 1, 512, 512, CL_FILTER_AUTO);
     clImageDestroy(C, large);
     clImageDestroy(C, small);
 
     // test CL_FILTER_NEAREST
     large = clImageParseString(C, "512x512,#ff0000", 8, NULL);
-    small = clImageResize(C, large, 280, 380, CL_FILTER_NEAREST);
+    small = clImageResize(C, large, 1, 280, 380, CL_FILTER_NEAREST);
     clImageDestroy(C, large);
     clImageDestroy(C, small);
 
+    // Multithreaded resizes split the output into bands; the seams must not show
+    large = createPatternImage(C, 300, 250, 16);
+    for (int filter = CL_FILTER_AUTO; filter <= CL_FILTER_NEAREST; ++filter) {
+        for (int scale = 0; scale < 2; ++scale) {
+            int width = scale ? 457 : 131;
+            int height = scale ? 389 : 97;
+            clImage * expected = clImageResize(C, large, 1, width, height, (clFilter)filter);
+            clImage * actual = clImageResize(C, large, 5, width, height, (clFilter)filter);
+            uint16_t * expectedPixels = (uint16_t *)expected->pixels;
+            uint16_t * actualPixels = (uint16_t *)actual->pixels;
+            for (int i = 0; i < 4 * actual->width * actual->height; ++i) {
+                TEST_ASSERT_INT_WITHIN(1, expectedPixels[i], actualPixels[i]);
+            }
+            clImageDestroy(C, expected);
+            clImageDestroy(C, actual);
+        }
+    }
+    clImageDestroy(C, large);
+
+    clContextDestroy(C);
+}
+
+static void test_resizeNative(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    // Nearest neighbor copies pixels at their own depth, and must pick the same ones
+    for (int depth = 8; depth <= 16; depth += 8) {
+        clImage * src = createPatternImage(C, 300, 250, depth);
+        clImage * expected = resizeViaFloats(C, src, 131, 397, CL_FILTER_NEAREST);
+        clImage * actual = clImageResize(C, src, 1, 131, 397, CL_FILTER_NEAREST);
+        clImage * banded = clImageResize(C, src, 4, 131, 397, CL_FILTER_NEAREST);
+        TEST_ASSERT_EQUAL_MEMORY(expected->pixels, actual->pixels, expected->size);
+        TEST_ASSERT_EQUAL_MEMORY(expected->pixels, banded->pixels, expected->size);
+        clImageDestroy(C, expected);
+        clImageDestroy(C, actual);
+        clImageDestroy(C, banded);
+        clImageDestroy(C, src);
+    }
+
+    // Opaque 8-bit images are filtered in fixed point, to within a code of the float path
+    clImage * src = createPatternImage(C, 300, 250, 8);
+    const int sizes[][2] = { { 131, 97 }, { 457, 389 }, { 600, 77 } };
+    for (int filter = CL_FILTER_AUTO; filter < CL_FILTER_NEAREST; ++filter) {
+        for (int s = 0; s < 3; ++s) {
+            clImage * expected = resizeViaFloats(C, src, sizes[s][0], sizes[s][1], (clFilter)filter);
+            for (int taskCount = 1; taskCount <= 3; taskCount += 2) {
+                clImage * actual = clImageResize(C, src, taskCount, sizes[s][0], sizes[s][1], (clFilter)filter);
+                for (int i = 0; i < actual->size; ++i) {
+                    TEST_ASSERT_INT_WITHIN(1, expected->pixels[i], actual->pixels[i]);
+                }
+                clImageDestroy(C, actual);
+            }
+            clImageDestroy(C, expected);
+        }
+    }
+
+    // Translucent 8-bit images still take the (premultiplying) float path
+    clImageSetPixel(C, src, 10, 10, 255, 0, 0, 128);
+    clImage * expected = resizeViaFloats(C, src, 131, 97, CL_FILTER_MITCHELL);
+    clImage * actual = clImageResize(C, src, 1, 131, 97, CL_FILTER_MITCHELL);
+    TEST_ASSERT_EQUAL_MEMORY(expected->pixels, actual->pixels, expected->size);
+    clImageDestroy(C, expected);
+    clImageDestroy(C, actual);
+    clImageDestroy(C, src);
+
+    clContextDestroy(C);
+}
+
+// A haldDims^3 Hald CLUT image mapping every channel through f(x) = invert ? 1 - x : x
+static clImage * createHaldImage(clContext * C, int haldDims, clBool invert)
+{
+    int size = (int)(sqrtf((float)(haldDims * haldDims * haldDims)) + 0.5f);
+    clImage * hald = clImageCreate(C, size, size, 16, NULL);
+    for (int b = 0; b < haldDims; ++b) {
+        for (int g = 0; g < haldDims; ++g) {
+            for (int r = 0; r < haldDims; ++r) {
+                int index = r + (g * haldDims) + (b * haldDims * haldDims);
+                int node[3] = { r, g, b };
+                int channels[3];
+                for (int c = 0; c < 3; ++c) {
+                    int v = (int)(65535.0f * (float)node[c] / (float)(haldDims - 1) + 0.5f);
+                    channels[c] = invert ? (65535 - v) : v;
+                }
+                clImageSetPixel(C, hald, index % size, index / size, channels[0], channels[1], channels[2], 65535);
+            }
+        }
+    }
+    return hald;
+}
+
+static void test_hald(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * src = createPatternImage(C, 200, 150, 16);
+    uint16_t * srcPixels = (uint16_t *)src->pixels;
+    for (int invert = 0; invert < 2; ++invert) {
+        // Interpolation must reproduce a linear mapping exactly, whichever thread runs it
+        clImage * hald = createHaldImage(C, 16, invert ? clTrue : clFalse);
+        clImage * applied = clImageApplyHALD(C, src, 1, hald, 16);
+        clImage * appliedThreaded = clImageApplyHALD(C, src, 4, hald, 16);
+        uint16_t * appliedPixels = (uint16_t *)applied->pixels;
+        for (int i = 0; i < src->width * src->height * 4; ++i) {
+            int expected = ((i % 4) == 3) ? srcPixels[i] : (invert ? (65535 - srcPixels[i]) : srcPixels[i]);
+            TEST_ASSERT_INT_WITHIN(1, expected, appliedPixels[i]);
+        }
+        TEST_ASSERT_EQUAL_MEMORY(applied->pixels, appliedThreaded->pixels, applied->size);
+
+        // In place, and straight from 8-bit pixels
+        clImage * inPlace = clImageCrop(C, src, 0, 0, src->width, src->height, clTrue);
+        clImageApplyHALDInPlace(C, inPlace, 3, hald, 16);
+        TEST_ASSERT_EQUAL_MEMORY(applied->pixels, inPlace->pixels, applied->size);
+        clImage * src8 = createPatternImage(C, 200, 150, 8);
+        clImage * applied8 = clImageApplyHALD(C, src8, 1, hald, 16);
+        for (int i = 0; i < src8->size; ++i) {
+            int expected = ((i % 4) == 3) ? src8->pixels[i] : (invert ? (255 - src8->pixels[i]) : src8->pixels[i]);
+            TEST_ASSERT_INT_WITHIN(1, expected, applied8->pixels[i]);
+        }
+        clImageDestroy(C, inPlace);
+        clImageDestroy(C, src8);
+        clImageDestroy(C, applied8);
+        clImageDestroy(C, applied);
+        clImageDestroy(C, appliedThreaded);
+        clImageDestroy(C, hald);
+    }
+    clImageDestroy(C, src);
+
+    clContextDestroy(C);
+}
+
+static void test_haldConvert(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * src = createPatternImage(C, 200, 150, 16);
+    clImage * hald = createHaldImage(C, 16, clTrue);
+
+    clProfilePrimaries primaries = { { 0.68f, 0.32f }, { 0.265f, 0.69f }, { 0.15f, 0.06f }, { 0.3127f, 0.3290f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.2f };
+    clProfile * dstProfile = clProfileCreate(C, &primaries, &curve, 300, "P3 300");
+
+    // Applying the Hald CLUT inside the conversion (directly or baked into the LUT) must match
+    // converting and then applying it as a separate pass
+    clImage * converted = clImageConvert(C, src, 1, src->width, src->height, 8, dstProfile, CL_TONEMAP_OFF, 0, NULL, 0);
+    clImage * expected = clImageApplyHALD(C, converted, 1, hald, 16);
+    for (int lutSize = 0; lutSize <= 33; lutSize += 33) {
+        clImage * actual = clImageConvert(C, src, 3, src->width, src->height, 8, dstProfile, CL_TONEMAP_OFF, lutSize, hald, 16);
+        for (int i = 0; i < actual->size; ++i) {
+            TEST_ASSERT_INT_WITHIN(1, expected->pixels[i], actual->pixels[i]);
+        }
+        clImageDestroy(C, actual);
+    }
+    clImage * resized = clImageResizeConvert(C, src, 2, src->width, src->height, CL_FILTER_BOX, 8, dstProfile, CL_TONEMAP_OFF, hald, 16);
+    for (int i = 0; i < resized->size; ++i) {
+        TEST_ASSERT_INT_WITHIN(1, expected->pixels[i], resized->pixels[i]);
+    }
+    clImageDestroy(C, resized);
+    clImageDestroy(C, expected);
+    clImageDestroy(C, converted);
+
+    // Matching profiles would normally skip color math entirely; the Hald CLUT must still apply
+    clImage * same = clImageConvert(C, src, 1, src->width, src->height, 16, src->profile, CL_TONEMAP_OFF, 0, hald, 16);
+    uint16_t * srcPixels = (uint16_t *)src->pixels;
+    uint16_t * samePixels = (uint16_t *)same->pixels;
+    for (int i = 0; i < src->width * src->height * 4; ++i) {
+        int expectedValue = ((i % 4) == 3) ? srcPixels[i] : (65535 - srcPixels[i]);
+        TEST_ASSERT_INT_WITHIN(1, expectedValue, samePixels[i]);
+    }
+    clImageDestroy(C, same);
+
+    clProfileDestroy(C, dstProfile);
+    clImageDestroy(C, hald);
+    clImageDestroy(C, src);
+    clContextDestroy(C);
+}
+
+static void test_resizeConvert(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * src = createPatternImage(C, 300, 250, 16);
+
+    clProfilePrimaries primaries = { { 0.68f, 0.32f }, { 0.265f, 0.69f }, { 0.15f, 0.06f }, { 0.3127f, 0.3290f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.2f };
+    clProfile * dstProfile = clProfileCreate(C, &primaries, &curve, 300, "P3 300");
+
+    // The fused, banded pass must match resizing and converting separately, at every band count
+    const clFilter filters[] = { CL_FILTER_AUTO, CL_FILTER_NEAREST, CL_FILTER_BOX, CL_FILTER_TRIANGLE, CL_FILTER_CATMULLROM, CL_FILTER_MITCHELL };
+    const int sizes[][2] = { { 117, 83 }, { 451, 389 } };
+    for (int f = 0; f < (int)(sizeof(filters) / sizeof(filters[0])); ++f) {
+        for (int s = 0; s < 2; ++s) {
+            clImage * resized = clImageResize(C, src, 1, sizes[s][0], sizes[s][1], filters[f]);
+            clImage * expected = clImageConvert(C, resized, 1, resized->width, resized->height, 8, dstProfile, CL_TONEMAP_OFF, 0, NULL, 0);
+            for (int taskCount = 1; taskCount <= 7; taskCount += 3) {
+                clImage * actual = clImageResizeConvert(C, src, taskCount, sizes[s][0], sizes[s][1], filters[f], 8, dstProfile, CL_TONEMAP_OFF, NULL, 0);
+                TEST_ASSERT_EQUAL_INT(expected->size, actual->size);
+                for (int i = 0; i < actual->size; ++i) {
+                    TEST_ASSERT_INT_WITHIN(1, expected->pixels[i], actual->pixels[i]);
+                }
+                clImageDestroy(C, actual);
+            }
+            clImageDestroy(C, expected);
+            clImageDestroy(C, resized);
+        }
+    }
+
+    clProfileDestroy(C, dstProfile);
+    clImageDestroy(C, src);
+    clContextDestroy(C);
+}
+
+static void test_convertLevels(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * src = createPatternImage(C, 300, 200, 16);
+    TEST_ASSERT_TRUE(clContextWrite(C, src, "test_levels_src.png", "png", 90, 0));
+
+    // Level 1 is a pure downscale of level 0, so it cascades from it. Level 2 is bigger than
+    // level 1, which stops the cascade: it comes from level 0. Level 3 cascades from level 2.
+    // (The bundled stb resizer asserts on some odd downscale ratios in debug builds, e.g. 150x100 -> 100x66.)
+    const char * argv[] = { "colorist", "convert", "test_levels_src.png", "test_levels.png", "-r", "150,triangle", "-r", "75,triangle", "-r", "0x140,triangle", "-r", "40x30,triangle" };
+    const char * names[] = { "test_levels.150x100.png", "test_levels.75x50.png", "test_levels.210x140.png", "test_levels.40x30.png" };
+    const int sizes[][2] = { { 150, 100 }, { 75, 50 }, { 210, 140 }, { 40, 30 } };
+    const int fromLevels[] = { -1, 0, 0, 2 };
+    clImage * levels[4];
+    TEST_ASSERT_TRUE(clContextParseArgs(C, ARGS(argv)));
+    TEST_ASSERT_EQUAL_INT(0, clContextConvert(C));
+    for (int i = 0; i < 4; ++i) {
+        levels[i] = clContextRead(C, names[i], NULL, NULL);
+        TEST_ASSERT_NOT_NULL(levels[i]);
+        TEST_ASSERT_EQUAL_INT(sizes[i][0], levels[i]->width);
+        TEST_ASSERT_EQUAL_INT(sizes[i][1], levels[i]->height);
+        TEST_ASSERT_EQUAL_INT(16, levels[i]->depth);
+        if (fromLevels[i] >= 0) {
+            clImage * expected = clImageResize(C, levels[fromLevels[i]], 1, sizes[i][0], sizes[i][1], CL_FILTER_TRIANGLE);
+            TEST_ASSERT_EQUAL_MEMORY(expected->pixels, levels[i]->pixels, expected->size);
+            clImageDestroy(C, expected);
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        clImageDestroy(C, levels[i]);
+    }
+
+    // Without an extension, the size is simply appended
+    {
+        const char * noExtArgv[] = { "colorist", "convert", "test_levels_src.png", "test_levels_noext", "-f", "png", "-r", "30", "-r", "15" };
+        TEST_ASSERT_TRUE(clContextParseArgs(C, ARGS(noExtArgv)));
+        TEST_ASSERT_EQUAL_INT(0, clContextConvert(C));
+        TEST_ASSERT_TRUE(clFileSize("test_levels_noext.30x20") > 0);
+        TEST_ASSERT_TRUE(clFileSize("test_levels_noext.15x10") > 0);
+        remove("test_levels_noext.30x20");
+        remove("test_levels_noext.15x10");
+    }
+    for (int i = 0; i < 4; ++i) {
+        remove(names[i]);
+    }
+    remove("test_levels_src.png");
+
+    clImageDestroy(C, src);
+    clContextDestroy(C);
+}
+
+static void test_convertRows(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * src = createPatternImage(C, 600, 500, 16);
+    clImage * hald = createHaldImage(C, 16, clTrue);
+
+    clProfilePrimaries primaries = { { 0.68f, 0.32f }, { 0.265f, 0.69f }, { 0.15f, 0.06f }, { 0.3127f, 0.3290f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.2f };
+    clProfile * dstProfile = clProfileCreate(C, &primaries, &curve, 300, "P3 300");
+
+    // Streaming rows (in several bands) from decoder to encoder must write the same pixels as
+    // decoding, converting and encoding whole images
+    const char * formats[] = { "png", "tiff", "jpg" };
+    const int depths[] = { 16, 16, 8 };
+    for (int f = 0; f < 3; ++f) {
+        char srcName[32], expectedName[32], actualName[32];
+        sprintf(srcName, "test_rows_src.%s", formats[f]);
+        sprintf(expectedName, "test_rows_expected.%s", formats[f]);
+        sprintf(actualName, "test_rows_actual.%s", formats[f]);
+        TEST_ASSERT_TRUE(clContextWrite(C, src, srcName, formats[f], 90, 0));
+
+        clImage * decoded = clContextRead(C, srcName, NULL, NULL);
+        TEST_ASSERT_NOT_NULL(decoded);
+        clImage * converted = clImageConvert(C, decoded, 1, decoded->width, decoded->height, depths[f], dstProfile, CL_TONEMAP_OFF, 0, hald, 16);
+        TEST_ASSERT_TRUE(clContextWrite(C, converted, expectedName, formats[f], 90, 0));
+
+        clRowReader * reader = NULL;
+        TEST_ASSERT_TRUE(clContextReadRows(C, srcName, NULL, &reader));
+        TEST_ASSERT_NOT_NULL(reader);
+        TEST_ASSERT_EQUAL_INT(src->width, reader->width);
+        TEST_ASSERT_EQUAL_INT(src->height, reader->height);
+        TEST_ASSERT_EQUAL_INT(decoded->depth, reader->depth);
+        clRowWriter * writer = clContextWriteRows(C, actualName, formats[f], reader->width, reader->height, depths[f], dstProfile, 90, 0);
+        TEST_ASSERT_NOT_NULL(writer);
+        TEST_ASSERT_TRUE(clImageConvertRows(C, reader, writer, 3, depths[f], dstProfile, CL_TONEMAP_OFF, 0, hald, 16));
+        clRowWriterDestroy(C, writer);
+        clRowReaderDestroy(C, reader);
+
+        clImage * expected = clContextRead(C, expectedName, NULL, NULL);
+        clImage * actual = clContextRead(C, actualName, NULL, NULL);
+        TEST_ASSERT_NOT_NULL(expected);
+        TEST_ASSERT_NOT_NULL(actual);
+        TEST_ASSERT_EQUAL_INT(expected->size, actual->size);
+        TEST_ASSERT_EQUAL_MEMORY(expected->pixels, actual->pixels, expected->size);
+        clImageDestroy(C, actual);
+        clImageDestroy(C, expected);
+        clImageDestroy(C, converted);
+        clImageDestroy(C, decoded);
+        remove(expectedName);
+        remove(actualName);
+    }
+
+    // Formats without row support and missing files
+    clRowReader * reader = NULL;
+    TEST_ASSERT_TRUE(clContextWrite(C, src, "test_rows_src.bmp", "bmp", 0, 0));
+    TEST_ASSERT_TRUE(clContextReadRows(C, "test_rows_src.bmp", NULL, &reader));
+    TEST_ASSERT_NULL(reader);
+    TEST_ASSERT_NULL(clContextWriteRows(C, "test_rows_actual.bmp", "bmp", 4, 4, 8, dstProfile, 0, 0));
+    TEST_ASSERT_FALSE(clContextReadRows(C, "test_rows_missing.png", NULL, &reader));
+    TEST_ASSERT_NULL(reader);
+
+    // A source that fails to decode partway through must not leave a partial streamed output behind
+    {
+        clRaw raw = CL_RAW_EMPTY;
+        TEST_ASSERT_TRUE(clRawReadFile(C, &raw, "test_rows_src.png"));
+        raw.size /= 2;
+        TEST_ASSERT_TRUE(clRawWriteFile(C, &raw, "test_rows_truncated.png"));
+        clRawFree(C, &raw);
+
+        const char * argv[] = { "colorist", "convert", "test_rows_truncated.png", "test_rows_truncated_out.png" };
+        TEST_ASSERT_TRUE(clContextParseArgs(C, ARGS(argv)));
+        TEST_ASSERT_EQUAL_INT(1, clContextConvert(C));
+        TEST_ASSERT_EQUAL_INT(-1, clFileSize("test_rows_truncated_out.png"));
+        remove("test_rows_truncated.png");
+    }
+
+    // Converting a file onto itself must not stream (the encoder would truncate the mapped input),
+    // and must write the same image as converting it elsewhere
+    {
+        clRaw raw = CL_RAW_EMPTY;
+        TEST_ASSERT_TRUE(clRawReadFile(C, &raw, "test_rows_src.png"));
+        TEST_ASSERT_TRUE(raw.size > (256 * 1024)); // big enough to be mapped
+        TEST_ASSERT_TRUE(clRawWriteFile(C, &raw, "test_rows_self.png"));
+        clRawFree(C, &raw);
+
+        const char * elsewhereArgv[] = { "colorist", "convert", "test_rows_src.png", "test_rows_elsewhere.png", "-g", "2.2" };
+        TEST_ASSERT_TRUE(clContextParseArgs(C, ARGS(elsewhereArgv)));
+        TEST_ASSERT_EQUAL_INT(0, clContextConvert(C));
+        const char * selfArgv[] = { "colorist", "convert", "test_rows_self.png", "test_rows_self.png", "-g", "2.2" };
+        TEST_ASSERT_TRUE(clContextParseArgs(C, ARGS(selfArgv)));
+        TEST_ASSERT_EQUAL_INT(0, clContextConvert(C));
+
+        clImage * expected = clContextRead(C, "test_rows_elsewhere.png", NULL, NULL);
+        clImage * actual = clContextRead(C, "test_rows_self.png", NULL, NULL);
+        TEST_ASSERT_NOT_NULL(expected);
+        TEST_ASSERT_NOT_NULL(actual);
+        TEST_ASSERT_EQUAL_INT(src->width, actual->width);
+        TEST_ASSERT_EQUAL_INT(src->height, actual->height);
+        TEST_ASSERT_EQUAL_INT(expected->size, actual->size);
+        TEST_ASSERT_EQUAL_MEMORY(expected->pixels, actual->pixels, expected->size);
+        clImageDestroy(C, actual);
+        clImageDestroy(C, expected);
+        remove("test_rows_elsewhere.png");
+        remove("test_rows_self.png");
+    }
+    remove("test_rows_src.png");
+    remove("test_rows_src.tiff");
+    remove("test_rows_src.jpg");
+    remove("test_rows_src.bmp");
+
+    clProfileDestroy(C, dstProfile);
+    clImageDestroy(C, hald);
+    clImageDestroy(C, src);
+    clContextDestroy(C);
+}
+
+static void test_readRegion(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * src16 = createPatternImage(C, 300, 250, 16);
+    clImage * src8 = createPatternImage(C, 300, 250, 8);
+
+    // Each format's region read (dedicated, by rows, or whole then cropped) must match cropping the
+    // whole decoded image, including rects hanging off the edges
+    const char * formats[] = { "png", "tiff", "jpg", "jp2", "j2k", "bmp", "webp" };
+    const int depths[] = { 16, 16, 8, 16, 16, 8, 8 };
+    const int rects[][4] = { { 0, 0, 1, 1 }, { 17, 33, 100, 120 }, { 250, 200, 100, 100 }, { 500, 500, 10, 10 }, { 0, 249, 300, 1 } };
+    for (int f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); ++f) {
+        char filename[32];
+        sprintf(filename, "test_region.%s", formats[f]);
+        TEST_ASSERT_TRUE(clContextWrite(C, (depths[f] == 16) ? src16 : src8, filename, formats[f], 90, 0));
+        clImage * whole = clContextRead(C, filename, NULL, NULL);
+        TEST_ASSERT_NOT_NULL(whole);
+        for (int r = 0; r < (int)(sizeof(rects) / sizeof(rects[0])); ++r) {
+            clImage * expected = clImageCrop(C, whole, rects[r][0], rects[r][1], rects[r][2], rects[r][3], clTrue);
+            clImage * actual = clContextReadRegion(C, filename, NULL, rects[r][0], rects[r][1], rects[r][2], rects[r][3]);
+            TEST_ASSERT_NOT_NULL(expected);
+            TEST_ASSERT_NOT_NULL(actual);
+            TEST_ASSERT_EQUAL_INT(expected->width, actual->width);
+            TEST_ASSERT_EQUAL_INT(expected->height, actual->height);
+            TEST_ASSERT_EQUAL_INT(expected->depth, actual->depth);
+            TEST_ASSERT_EQUAL_MEMORY(expected->pixels, actual->pixels, expected->size);
+            clImageDestroy(C, actual);
+            clImageDestroy(C, expected);
+        }
+
+        // No rect reads the whole image
+        clImage * uncropped = clContextReadRegion(C, filename, NULL, -1, -1, -1, -1);
+        TEST_ASSERT_NOT_NULL(uncropped);
+        TEST_ASSERT_EQUAL_INT(whole->size, uncropped->size);
+        TEST_ASSERT_EQUAL_MEMORY(whole->pixels, uncropped->pixels, whole->size);
+        clImageDestroy(C, uncropped);
+        clImageDestroy(C, whole);
+        remove(filename);
+    }
+    TEST_ASSERT_NULL(clContextReadRegion(C, "test_region_missing.png", NULL, 0, 0, 1, 1));
+
+    clImageDestroy(C, src8);
+    clImageDestroy(C, src16);
+    clContextDestroy(C);
+}
+
+static void test_readScaled(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clImage * src = createPatternImage(C, 400, 300, 8);
+
+    TEST_ASSERT_EQUAL_INT(0, clFormatScaleReduction(C, 400, 300, 0, 0, 3));
+    TEST_ASSERT_EQUAL_INT(2, clFormatScaleReduction(C, 400, 300, 90, 0, 3));
+    TEST_ASSERT_EQUAL_INT(1, clFormatScaleReduction(C, 400, 300, 90, 100, 3));
+    TEST_ASSERT_EQUAL_INT(1, clFormatScaleReduction(C, 400, 300, 10, 10, 1));
+    TEST_ASSERT_EQUAL_INT(0, clFormatScaleReduction(C, 400, 300, 800, 0, 3));
+
+    // Formats which can decode at a reduced size stop at the smallest power-of-two reduction still
+    // covering the hint; the rest decode in full. The full size is reported either way.
+    const char * formats[] = { "jpg", "jp2", "j2k", "webp", "png", "tiff" };
+    const int reduced[] = { 1, 1, 1, 1, 0, 0 };
+    for (int f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); ++f) {
+        char filename[32];
+        int fullWidth = 0, fullHeight = 0;
+        sprintf(filename, "test_scaled.%s", formats[f]);
+        TEST_ASSERT_TRUE(clContextWrite(C, src, filename, formats[f], 90, 0));
+
+        clImage * scaled = clContextReadScaled(C, filename, NULL, 90, 0, &fullWidth, &fullHeight);
+        TEST_ASSERT_NOT_NULL(scaled);
+        TEST_ASSERT_EQUAL_INT(400, fullWidth);
+        TEST_ASSERT_EQUAL_INT(300, fullHeight);
+        TEST_ASSERT_EQUAL_INT(reduced[f] ? 100 : 400, scaled->width);
+        TEST_ASSERT_EQUAL_INT(reduced[f] ? 75 : 300, scaled->height);
+        clImageDestroy(C, scaled);
+
+        // No hint decodes exactly what clContextRead does
+        clImage * whole = clContextRead(C, filename, NULL, NULL);
+        clImage * unscaled = clContextReadScaled(C, filename, NULL, 0, 0, &fullWidth, &fullHeight);
+        TEST_ASSERT_NOT_NULL(whole);
+        TEST_ASSERT_NOT_NULL(unscaled);
+        TEST_ASSERT_EQUAL_INT(whole->size, unscaled->size);
+        TEST_ASSERT_EQUAL_MEMORY(whole->pixels, unscaled->pixels, whole->size);
+        clImageDestroy(C, unscaled);
+        clImageDestroy(C, whole);
+        remove(filename);
+    }
+    int missingWidth, missingHeight;
+    TEST_ASSERT_NULL(clContextReadScaled(C, "test_scaled_missing.jpg", NULL, 90, 0, &missingWidth, &missingHeight));
+
+    clImageDestroy(C, src);
+    clContextDestroy(C);
+}
+
+static void test_reportHighlight(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    // A wide gamut, bright image with an odd size, so the slices are uneven and some pixels are
+    // overbright, out of sRGB's gamut, or both
+    clProfilePrimaries primaries = { { 0.708f, 0.292f }, { 0.170f, 0.797f }, { 0.131f, 0.046f }, { 0.3127f, 0.3290f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.4f };
+    clProfile * bt2020 = clProfileCreate(C, &primaries, &curve, 1000, "BT2020 1000");
+    clImage * image = clImageCreate(C, 37, 23, 16, bt2020);
+    for (int j = 0; j < image->height; ++j) {
+        for (int i = 0; i < image->width; ++i) {
+            int channels[3];
+            for (int c = 0; c < 3; ++c) {
+                channels[c] = (int)(65535.0f * (0.5f + 0.5f * sinf((float)(i * (c + 1)) * 0.4f + (float)j * (c + 2) * 0.3f)));
+            }
+            clImageSetPixel(C, image, i, j, channels[0], channels[1], channels[2], 65535);
+        }
+    }
+
+    clSRGBHighlightStats expectedStats, actualStats;
+    clImage * expected = clReportCreateSRGBHighlight(C, image, 300, 1, &expectedStats);
+    clImage * actual = clReportCreateSRGBHighlight(C, image, 300, 4, &actualStats);
+    TEST_ASSERT_NOT_NULL(expected);
+    TEST_ASSERT_NOT_NULL(actual);
+    TEST_ASSERT_TRUE(expectedStats.overbrightPixelCount > 0);
+    TEST_ASSERT_TRUE(expectedStats.outOfGamutPixelCount > 0);
+    TEST_ASSERT_TRUE(expectedStats.bothPixelCount > 0);
+    TEST_ASSERT_EQUAL_INT(image->width * image->height, actualStats.pixelCount);
+    TEST_ASSERT_EQUAL_INT(expectedStats.pixelCount, actualStats.pixelCount);
+    TEST_ASSERT_EQUAL_INT(expectedStats.overbrightPixelCount, actualStats.overbrightPixelCount);
+    TEST_ASSERT_EQUAL_INT(expectedStats.outOfGamutPixelCount, actualStats.outOfGamutPixelCount);
+    TEST_ASSERT_EQUAL_INT(expectedStats.bothPixelCount, actualStats.bothPixelCount);
+    TEST_ASSERT_EQUAL_INT(expectedStats.hdrPixelCount, actualStats.hdrPixelCount);
+    TEST_ASSERT_EQUAL_INT(expectedStats.brightestPixelX, actualStats.brightestPixelX);
+    TEST_ASSERT_EQUAL_INT(expectedStats.brightestPixelY, actualStats.brightestPixelY);
+    TEST_ASSERT_EQUAL_FLOAT(expectedStats.brightestPixelNits, actualStats.brightestPixelNits);
+    TEST_ASSERT_EQUAL_INT(expected->size, actual->size);
+    TEST_ASSERT_EQUAL_MEMORY(expected->pixels, actual->pixels, expected->size);
+
+    clImageDestroy(C, actual);
+    clImageDestroy(C, expected);
+    clImageDestroy(C, image);
+    clProfileDestroy(C, bt2020);
+    clContextDestroy(C);
+}
+
+// The max Y of one xy chromaticity, computed directly (how the report did it per pixel before the table)
+static float directMaxY(clContext * C, clTransform * fromXYZ, clTransform * toXYZ, float x, float y)
+{
+    float floatXYZ[3];
+    float floatRGBA[4];
+    float maxChannel;
+    cmsCIEXYZ XYZ;
+    cmsCIExyY xyY;
+    xyY.x = x;
+    xyY.y = y;
+    xyY.Y = 1.0f;
+    cmsxyY2XYZ(&XYZ, &xyY);
+    floatXYZ[0] = (float)XYZ.X;
+    floatXYZ[1] = (float)XYZ.Y;
+    floatXYZ[2] = (float)XYZ.Z;
+    clTransformRun(C, fromXYZ, 1, floatXYZ, floatRGBA, 1);
+    maxChannel = floatRGBA[0];
+    if (maxChannel < floatRGBA[1])
+        maxChannel = floatRGBA[1];
+    if (maxChannel < floatRGBA[2])
+        maxChannel = floatRGBA[2];
+    floatRGBA[0] /= maxChannel;
+    floatRGBA[1] /= maxChannel;
+    floatRGBA[2] /= maxChannel;
+    floatRGBA[3] = 1.0f;
+    clTransformRun(C, toXYZ, 1, floatRGBA, floatXYZ, 1);
+    return floatXYZ[1];
+}
+
+static void test_reportMaxYTable(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clProfilePrimaries bt2020Primaries = { { 0.708f, 0.292f }, { 0.170f, 0.797f }, { 0.131f, 0.046f }, { 0.3127f, 0.3290f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.4f };
+    clProfile * profiles[2];
+    profiles[0] = clProfileCreateStock(C, CL_PS_SRGB);
+    profiles[1] = clProfileCreate(C, &bt2020Primaries, &curve, 10000, "BT2020 10000");
+    for (int p = 0; p < 2; ++p) {
+        clTransform * toXYZ = clTransformCreate(C, profiles[p], CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+        clTransform * fromXYZ = clTransformCreate(C, NULL, CL_XF_XYZ, 32, profiles[p], CL_XF_RGB, 32, CL_TONEMAP_OFF);
+        float * maxYTable = clReportCreateMaxYTable(C, fromXYZ, toXYZ, 2);
+
+        // The whole table range down to y = 0.005 (the bottom of the visible colors), including the
+        // gamut corners
+        for (int j = 0; j <= 200; ++j) {
+            for (int i = 0; i <= 200; ++i) {
+                float x = (float)i / 200.0f;
+                float y = (j == 0) ? 0.005f : ((float)j / 200.0f);
+                float expected = directMaxY(C, fromXYZ, toXYZ, x, y);
+                float actual = clReportLookupMaxY(maxYTable, x, y);
+                TEST_ASSERT_FLOAT_WITHIN(0.02f * expected, expected, actual);
+            }
+        }
+        clFree(maxYTable);
+        clTransformDestroy(C, fromXYZ);
+        clTransformDestroy(C, toXYZ);
+    }
+    clProfileDestroy(C, profiles[1]);
+    clProfileDestroy(C, profiles[0]);
+    clContextDestroy(C);
+}
+
+static void countTaskFunc(int * counter)
+{
+    ++*counter;
+}
+
+typedef struct clSerialTaskState
+{
+    int active;
+    int maxActive;
+} clSerialTaskState;
+
+static void serialTaskFunc(clSerialTaskState * state)
+{
+    volatile int spin = 0;
+    ++state->active;
+    if (state->maxActive < state->active) {
+        state->maxActive = state->active;
+    }
+    for (int i = 0; i < 10000; ++i) {
+        spin += i;
+    }
+    --state->active;
+}
+
+static void test_clTaskPool(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    // Run a few batches through the context's pool, growing it in between
+    enum { TASK_COUNT = 100 };
+    clTask tasks[TASK_COUNT];
+    int counters[TASK_COUNT];
+    memset(counters, 0, sizeof(counters));
+    for (int threadCount = 1; threadCount <= 4; ++threadCount) {
+        clTaskPool * pool = clContextTaskPool(C, threadCount);
+        clTaskBatch batch;
+        TEST_ASSERT_EQUAL_INT(threadCount - 1, pool->threadCount);
+        clTaskBatchInit(&batch, threadCount);
+        for (int i = 0; i < TASK_COUNT; ++i) {
+            clTaskPoolSubmit(C, pool, &batch, &tasks[i], (clTaskFunc)countTaskFunc, &counters[i]);
+        }
+        clTaskPoolWait(C, pool, &batch);
+        TEST_ASSERT_EQUAL_INT(0, batch.pending);
+        for (int i = 0; i < TASK_COUNT; ++i) {
+            TEST_ASSERT_EQUAL_INT(threadCount, counters[i]);
+        }
+    }
+
+    // A batch limited to one task at a time stays serialized even though the pool has grown
+    {
+        clTaskPool * pool = clContextTaskPool(C, 1);
+        clTaskBatch batch;
+        clSerialTaskState state = { 0, 0 };
+        TEST_ASSERT_EQUAL_INT(3, pool->threadCount);
+        clTaskBatchInit(&batch, 1);
+        for (int i = 0; i < TASK_COUNT; ++i) {
+            clTaskPoolSubmit(C, pool, &batch, &tasks[i], (clTaskFunc)serialTaskFunc, &state);
+        }
+        clTaskPoolWait(C, pool, &batch);
+        TEST_ASSERT_EQUAL_INT(0, state.active);
+        TEST_ASSERT_EQUAL_INT(1, state.maxActive);
+    }
+
+    // A standalone pool, destroyed while idle
+    clTaskPool * pool = clTaskPoolCreate(C, 2);
+    clTaskBatch batch;
+    TEST_ASSERT_TRUE(clTaskPoolReserve(C, pool, 2));
+    clTaskBatchInit(&batch, 0);
+    clTaskPoolSubmit(C, pool, &batch, &tasks[0], (clTaskFunc)countTaskFunc, &counters[0]);
+    clTaskPoolWait(C, pool, &batch);
+    TEST_ASSERT_EQUAL_INT(5, counters[0]);
+    clTaskPoolDestroy(C, pool);
+
     clContextDestroy(C);
 }
 
@@ -598,12 +1337,118 @@ static void test_clTask(void)
     gamma = 0.0f;
     clPixelMathColorGrade(C, taskLimit, profile, srcPixels, pixelCount, width, 300, 16, &luminance, &gamma, clTrue);
 
+    // The worker pool's thread count must not change the outcome
+    int pooledLuminance = 0;
+    float pooledGamma = 0.0f;
+    clPixelMathColorGrade(C, 4, profile, srcPixels, pixelCount, width, 300, 16, &pooledLuminance, &pooledGamma, clFalse);
+    TEST_ASSERT_EQUAL_INT(luminance, pooledLuminance);
+    TEST_ASSERT_EQUAL_FLOAT(gamma, pooledGamma);
+
     clFree(srcPixels);
     clProfileDestroy(C, profile);
 
     clContextDestroy(C);
 }
 
+static void test_colorGradeGamma(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clProfile * profile = clProfileCreateStock(C, CL_PS_SRGB);
+    int width = 64;
+    int height = 64;
+    int pixelCount = width * height;
+    float * srcPixels = clAllocate(sizeof(float) * 4 * pixelCount);
+    for (int i = 0; i < pixelCount; ++i) {
+        // Dark heavy, like most HDR content once scaled down
+        float t = (float)i / (float)(pixelCount - 1);
+        srcPixels[(i * 4) + 0] = t * t * t;
+        srcPixels[(i * 4) + 1] = t * t;
+        srcPixels[(i * 4) + 2] = (float)((i * 7919) % 65536) / 65535.0f;
+        srcPixels[(i * 4) + 3] = 1.0f;
+    }
+
+    // The histogram's coarse-to-fine search must land on the same gamma as trying every candidate on every pixel
+    for (int depth = 8; depth <= 10; depth += 2) {
+        float maxChannel = (float)((1 << depth) - 1);
+        float expectedGamma = 0.0f;
+        double minErrorTerm = -1.0;
+        for (int gammaInt = 20; gammaInt <= 80; ++gammaInt) {
+            float attemptGamma = (float)gammaInt / 20.0f;
+            double errorTerm = 0.0;
+            for (int i = 0; i < pixelCount * 4; ++i) {
+                if ((i % 4) != 3) {
+                    float v = srcPixels[i];
+                    errorTerm += fabsf(v - powf(floorf((powf(v, 1.0f / attemptGamma) * maxChannel) + 0.5f) / maxChannel, attemptGamma));
+                }
+            }
+            if ((minErrorTerm < 0.0) || (minErrorTerm > errorTerm)) {
+                minErrorTerm = errorTerm;
+                expectedGamma = attemptGamma;
+            }
+        }
+
+        int luminance = 300;
+        float gamma = 0.0f;
+        clPixelMathColorGrade(C, 3, profile, srcPixels, pixelCount, width, 300, depth, &luminance, &gamma, clFalse);
+        TEST_ASSERT_EQUAL_FLOAT(expectedGamma, gamma);
+    }
+
+    // Grading native pixels must agree with grading a float copy of them, at any task count
+    for (int depth = 8; depth <= 16; depth += 8) {
+        clImage * image = createPatternImage(C, 150, 100, depth);
+        int imagePixelCount = image->width * image->height;
+        float * floatPixels = clAllocate(sizeof(float) * 4 * imagePixelCount);
+        clPixelMathUNormToFloat(C, image->pixels, image->depth, floatPixels, imagePixelCount);
+        int floatLuminance = 0;
+        float floatGamma = 0.0f;
+        clPixelMathColorGrade(C, 1, image->profile, floatPixels, imagePixelCount, image->width, 1000, 10, &floatLuminance, &floatGamma, clFalse);
+        for (int taskCount = 1; taskCount <= 4; taskCount += 3) {
+            int luminance = 0;
+            float gamma = 0.0f;
+            clPixelMathColorGradeUNorm(C, taskCount, image->profile, image->pixels, image->depth, imagePixelCount, image->width, 1000, 10, &luminance, &gamma, clFalse);
+            TEST_ASSERT_EQUAL_INT(floatLuminance, luminance);
+            TEST_ASSERT_EQUAL_FLOAT(floatGamma, gamma);
+        }
+        clFree(floatPixels);
+        clImageDestroy(C, image);
+    }
+
+    // NaN channels must land in the first histogram bin (grading like 0), not index out of the bins
+    {
+        float * nanPixels = clAllocate(sizeof(float) * 4 * pixelCount);
+        float * zeroPixels = clAllocate(sizeof(float) * 4 * pixelCount);
+        memcpy(nanPixels, srcPixels, sizeof(float) * 4 * pixelCount);
+        memcpy(zeroPixels, srcPixels, sizeof(float) * 4 * pixelCount);
+        for (int i = 0; i < pixelCount; i += 97) {
+            nanPixels[(i * 4) + (i % 3)] = NAN;
+            zeroPixels[(i * 4) + (i % 3)] = 0.0f;
+        }
+        int nanLuminance = 300;
+        float nanGamma = 0.0f;
+        int zeroLuminance = 300;
+        float zeroGamma = 0.0f;
+        clPixelMathColorGrade(C, 3, profile, nanPixels, pixelCount, width, 300, 10, &nanLuminance, &nanGamma, clFalse);
+        clPixelMathColorGrade(C, 3, profile, zeroPixels, pixelCount, width, 300, 10, &zeroLuminance, &zeroGamma, clFalse);
+        TEST_ASSERT_EQUAL_FLOAT(zeroGamma, nanGamma);
+        clFree(zeroPixels);
+        clFree(nanPixels);
+    }
+
+    // No pixels at all still picks a gamma
+    {
+        int luminance = 300;
+        float gamma = 0.0f;
+        clPixelMathColorGrade(C, 3, profile, srcPixels, 0, width, 300, 10, &luminance, &gamma, clFalse);
+        TEST_ASSERT_TRUE(gamma > 0.0f);
+    }
+
+    clFree(srcPixels);
+    clProfileDestroy(C, profile);
+    clContextDestroy(C);
+}
+
 static void test_types(void)
 {
     clContext * C = clContextCreate(&silentSystem);
@@ -666,6 +1511,483 @@ static void test_raw(void)
     clContextDestroy(C);
 }
 
+static void test_rawSink(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    // Start on a raw with stale contents; the sink must reuse it but read as empty
+    clRaw raw = CL_RAW_EMPTY;
+    clRawRealloc(C, &raw, 16);
+    memset(raw.ptr, 0xff, raw.size);
+
+    clRawSink sink;
+    clRawSinkStart(C, &sink, &raw);
+    TEST_ASSERT_EQUAL_UINT(0, raw.size);
+
+    // Append lots of small writes, as encoders do
+    uint8_t bytes[256];
+    for (int i = 0; i < 256; ++i) {
+        bytes[i] = (uint8_t)i;
+    }
+    for (int i = 0; i < 1000; ++i) {
+        clRawSinkWrite(&sink, raw.size, bytes, 100);
+    }
+    TEST_ASSERT_EQUAL_UINT(100000, raw.size);
+    TEST_ASSERT_TRUE(sink.capacity >= raw.size);
+    TEST_ASSERT_TRUE(sink.capacity < 2 * raw.size);
+    TEST_ASSERT_EQUAL_MEMORY(bytes, raw.ptr + 99900, 100);
+
+    // Rewrite in place (a header fixup) without changing the size
+    clRawSinkWrite(&sink, 0, bytes + 200, 4);
+    TEST_ASSERT_EQUAL_UINT(100000, raw.size);
+    TEST_ASSERT_EQUAL_MEMORY(bytes + 200, raw.ptr, 4);
+
+    // Seek past the end; the gap is zero filled
+    clRawSinkWrite(&sink, 200000, bytes, 10);
+    TEST_ASSERT_EQUAL_UINT(200010, raw.size);
+    TEST_ASSERT_EQUAL_UINT8(0, raw.ptr[150000]);
+    TEST_ASSERT_EQUAL_MEMORY(bytes, raw.ptr + 200000, 10);
+
+    clRawFree(C, &raw);
+
+    // Starting on an empty raw
+    clRawSinkStart(C, &sink, &raw);
+    clRawSinkWrite(&sink, 0, bytes, 1);
+    TEST_ASSERT_EQUAL_UINT(1, raw.size);
+    clRawFree(C, &raw);
+
+    clContextDestroy(C);
+}
+
+static void test_rawReadFile(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    // Large enough to be memory-mapped where supported; contents must be the same either way
+    clRaw raw = CL_RAW_EMPTY;
+    clRawRealloc(C, &raw, 1024 * 1024 + 3);
+    for (size_t i = 0; i < raw.size; ++i) {
+        raw.ptr[i] = (uint8_t)(i * 7);
+    }
+    TEST_ASSERT_TRUE(clRawWriteFile(C, &raw, "test_raw_big.bin"));
+
+    clRaw readBack = CL_RAW_EMPTY;
+    TEST_ASSERT_TRUE(clRawReadFile(C, &readBack, "test_raw_big.bin"));
+#ifdef __linux__
+    TEST_ASSERT_TRUE(readBack.mapped);
+#endif
+    TEST_ASSERT_EQUAL_UINT(raw.size, readBack.size);
+    TEST_ASSERT_EQUAL_MEMORY(raw.ptr, readBack.ptr, raw.size);
+
+    // Resizing (even a mapping) leaves an owned, writable copy
+    clRawRealloc(C, &readBack, 100);
+    TEST_ASSERT_FALSE(readBack.mapped);
+    TEST_ASSERT_EQUAL_MEMORY(raw.ptr, readBack.ptr, 100);
+    readBack.ptr[0] = 1;
+    clRawFree(C, &readBack);
+
+    // Reading over a previous (possibly mapped) read, then a sink starting on it
+    TEST_ASSERT_TRUE(clRawReadFile(C, &readBack, "test_raw_big.bin"));
+    TEST_ASSERT_TRUE(clRawReadFile(C, &readBack, "test_raw_big.bin"));
+    clRawSink sink;
+    clRawSinkStart(C, &sink, &readBack);
+    clRawSinkWrite(&sink, 0, raw.ptr, 10);
+    TEST_ASSERT_EQUAL_UINT(10, readBack.size);
+    clRawFree(C, &readBack);
+
+    TEST_ASSERT_FALSE(clRawReadFile(C, &readBack, "test_raw_missing.bin"));
+    remove("test_raw_big.bin");
+
+    clRawFree(C, &raw);
+    clContextDestroy(C);
+}
+
+typedef struct StreamCapture
+{
+    clContext * C;
+    clRaw raw;
+} StreamCapture;
+
+static clBool streamCaptureWrite(void * userData, const uint8_t * data, size_t size)
+{
+    StreamCapture * capture = (StreamCapture *)userData;
+    size_t oldSize = capture->raw.size;
+    clRawRealloc(capture->C, &capture->raw, oldSize + size);
+    memcpy(capture->raw.ptr + oldSize, data, size);
+    return clTrue;
+}
+
+static void test_rawStream(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    // Big enough to span several deflate and base64 chunks, compressible but not trivially so
+    clRaw raw = CL_RAW_EMPTY;
+    clRawRealloc(C, &raw, 300001);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < raw.size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        raw.ptr[i] = (uint8_t)(((seed >> 16) & 0x0f) + (i / 1000));
+    }
+
+    // Deflate + base64 both at once and streamed must produce identical output
+    clRaw deflated = CL_RAW_EMPTY;
+    TEST_ASSERT_TRUE(clRawDeflate(C, &deflated, &raw));
+    char * expected = clRawToBase64(C, &deflated);
+    TEST_ASSERT_NOT_NULL(expected);
+
+    StreamCapture capture;
+    capture.C = C;
+    memset(&capture.raw, 0, sizeof(capture.raw));
+    clRawBase64Stream stream;
+    clRawBase64StreamStart(&stream, streamCaptureWrite, &capture);
+    TEST_ASSERT_TRUE(clRawDeflateStream(C, &raw, clRawBase64StreamWrite, &stream));
+    TEST_ASSERT_TRUE(clRawBase64StreamFinish(&stream));
+    TEST_ASSERT_EQUAL_UINT(strlen(expected), capture.raw.size);
+    TEST_ASSERT_EQUAL_MEMORY(expected, capture.raw.ptr, capture.raw.size);
+    clRawFree(C, &capture.raw);
+    clFree(expected);
+    clRawFree(C, &deflated);
+
+    // Base64 alone, fed in awkward chunk sizes (carry of 0, 1 and 2 bytes) and with tails of each length
+    static const size_t chunkSizes[] = { 1, 2, 3, 4, 5, 7, 4096, 65537 };
+    static const size_t tails[] = { 0, 1, 2 };
+    for (int t = 0; t < 3; ++t) {
+        clRaw src;
+        src.ptr = raw.ptr;
+        src.size = 10000 + tails[t];
+        src.mapped = clFalse;
+        expected = clRawToBase64(C, &src);
+        for (size_t c = 0; c < sizeof(chunkSizes) / sizeof(chunkSizes[0]); ++c) {
+            memset(&capture.raw, 0, sizeof(capture.raw));
+            clRawBase64StreamStart(&stream, streamCaptureWrite, &capture);
+            for (size_t offset = 0; offset < src.size; offset += chunkSizes[c]) {
+                size_t size = src.size - offset;
+                if (size > chunkSizes[c]) {
+                    size = chunkSizes[c];
+                }
+                TEST_ASSERT_TRUE(clRawBase64StreamWrite(&stream, src.ptr + offset, size));
+            }
+            TEST_ASSERT_TRUE(clRawBase64StreamFinish(&stream));
+            TEST_ASSERT_EQUAL_UINT(strlen(expected), capture.raw.size);
+            TEST_ASSERT_EQUAL_MEMORY(expected, capture.raw.ptr, capture.raw.size);
+            clRawFree(C, &capture.raw);
+        }
+        clFree(expected);
+    }
+
+    clRawFree(C, &raw);
+    clContextDestroy(C);
+}
+
+static void test_transformKernels(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clProfilePrimaries primaries = { { 0.708f, 0.292f }, { 0.170f, 0.797f }, { 0.131f, 0.046f }, { 0.3127f, 0.3290f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.4f };
+    clProfile * srgb = clProfileCreateStock(C, CL_PS_SRGB);
+    clProfile * bt2020 = clProfileCreate(C, &primaries, &curve, 10000, "BT2020 10000");
+
+    const int pixelCount = 1003; // not a multiple of any SIMD width
+    float * pixels = clAllocate(sizeof(float) * 4 * pixelCount);
+    float * expected = clAllocate(sizeof(float) * 4 * pixelCount);
+    float * actual = clAllocate(sizeof(float) * 4 * pixelCount);
+    for (int i = 0; i < pixelCount * 4; ++i) {
+        pixels[i] = (float)((i * 7919) % 1201) / 1000.0f; // [0, 1.2]
+    }
+
+    // Compare the chosen SIMD kernel against the scalar reference, with and without luminance scaling/tonemapping
+    for (int direction = 0; direction < 2; ++direction) {
+        for (int xtf = CL_XTF_NONE; xtf <= CL_XTF_PQ; ++xtf) {
+            clTransform * transform = (direction == 0) ? clTransformCreate(C, srgb, CL_XF_RGBA, 32, bt2020, CL_XF_RGBA, 32, CL_TONEMAP_AUTO)
+                                                       : clTransformCreate(C, bt2020, CL_XF_RGBA, 32, srgb, CL_XF_RGBA, 32, CL_TONEMAP_AUTO);
+            clTransformPrepare(C, transform);
+            TEST_ASSERT_NOT_NULL(transform->ccmmFunc);
+
+            memcpy(expected, pixels, sizeof(float) * 4 * pixelCount);
+            memcpy(actual, pixels, sizeof(float) * 4 * pixelCount);
+            clTransformCCMMScalar(C, transform, (clTransformTransferFunction)xtf, (clTransformTransferFunction)xtf, expected, pixelCount);
+            transform->ccmmFunc(C, transform, (clTransformTransferFunction)xtf, (clTransformTransferFunction)xtf, actual, pixelCount);
+            for (int i = 0; i < pixelCount * 4; ++i) {
+                TEST_ASSERT_FLOAT_WITHIN(0.00001f, expected[i], actual[i]);
+            }
+            clTransformDestroy(C, transform);
+        }
+    }
+
+    // Run every depth/format combination through clTransformRun(), and check every output pixel
+    // against a float RGBA conversion of the same (quantized) source values. The output must also
+    // stop exactly at pixelCount pixels of its own depth and channel count.
+    static const int depths[] = { 8, 16, 32 };
+    static const clTransformFormat formats[] = { CL_XF_RGB, CL_XF_RGBA };
+    const size_t dstAllocBytes = sizeof(float) * 4 * pixelCount + 64;
+    uint8_t * srcPixels = clAllocate(sizeof(float) * 4 * pixelCount);
+    uint8_t * dstPixels = clAllocate(dstAllocBytes);
+    clTransform * reference = clTransformCreate(C, srgb, CL_XF_RGBA, 32, bt2020, CL_XF_RGBA, 32, CL_TONEMAP_AUTO);
+    for (int srcDepthIndex = 0; srcDepthIndex < 3; ++srcDepthIndex) {
+        for (int dstDepthIndex = 0; dstDepthIndex < 3; ++dstDepthIndex) {
+            for (int formatIndex = 0; formatIndex < 4; ++formatIndex) {
+                int srcDepth = depths[srcDepthIndex];
+                int dstDepth = depths[dstDepthIndex];
+                int srcChannels = (formatIndex & 1) ? 4 : 3;
+                int dstChannels = (formatIndex >> 1) ? 4 : 3;
+                float srcMax = (srcDepth == 32) ? 1.0f : (float)((1 << srcDepth) - 1);
+                float dstMax = (dstDepth == 32) ? 1.0f : (float)((1 << dstDepth) - 1);
+                size_t dstBytes = (size_t)pixelCount * dstChannels * ((dstDepth == 32) ? sizeof(float) : (size_t)clDepthToBytes(C, dstDepth));
+
+                // expected: the source as float RGBA (opaque when it has no alpha); actual: its reference conversion
+                for (int i = 0; i < pixelCount; ++i) {
+                    for (int c = 0; c < 4; ++c) {
+                        float v = CL_CLAMP(pixels[(i * 4) + c], 0.0f, 1.0f);
+                        int srcIndex = (i * srcChannels) + c;
+                        if (c >= srcChannels) {
+                            expected[(i * 4) + c] = 1.0f;
+                            continue;
+                        }
+                        if (srcDepth == 8) {
+                            srcPixels[srcIndex] = (uint8_t)((v * srcMax) + 0.5f);
+                            v = (float)srcPixels[srcIndex] / srcMax;
+                        } else if (srcDepth == 16) {
+                            ((uint16_t *)srcPixels)[srcIndex] = (uint16_t)((v * srcMax) + 0.5f);
+                            v = (float)((uint16_t *)srcPixels)[srcIndex] / srcMax;
+                        } else {
+                            ((float *)srcPixels)[srcIndex] = v;
+                        }
+                        expected[(i * 4) + c] = v;
+                    }
+                }
+                clTransformRun(C, reference, 1, expected, actual, pixelCount);
+
+                clTransform * transform = clTransformCreate(C, srgb, formats[formatIndex & 1], srcDepth, bt2020, formats[formatIndex >> 1], dstDepth, CL_TONEMAP_AUTO);
+                memset(dstPixels, 0xab, dstAllocBytes);
+                clTransformRun(C, transform, 2, srcPixels, dstPixels, pixelCount);
+                clTransformDestroy(C, transform);
+
+                for (size_t b = dstBytes; b < dstAllocBytes; ++b) {
+                    TEST_ASSERT_EQUAL_HEX8(0xab, dstPixels[b]);
+                }
+                for (int i = 0; i < pixelCount; ++i) {
+                    for (int c = 0; c < dstChannels; ++c) {
+                        int dstIndex = (i * dstChannels) + c;
+                        float want = actual[(i * 4) + c];
+                        float got;
+                        if (dstDepth == 8) {
+                            got = (float)dstPixels[dstIndex] / dstMax;
+                        } else if (dstDepth == 16) {
+                            got = (float)((uint16_t *)dstPixels)[dstIndex] / dstMax;
+                        } else {
+                            got = ((float *)dstPixels)[dstIndex];
+                        }
+                        if (dstDepth != 32) {
+                            want = CL_CLAMP(want, 0.0f, 1.0f);
+                        }
+                        TEST_ASSERT_FLOAT_WITHIN((dstDepth == 32) ? 0.0001f : (1.01f / dstMax), want, got);
+                    }
+                }
+            }
+        }
+    }
+    clTransformDestroy(C, reference);
+
+    // Chunked multithreaded runs must match a single threaded run exactly: chunks dividing the
+    // pixels evenly, leaving a short last chunk, and more than all of the pixels (default size)
+    {
+        const int chunkRuns[][2] = { { 1000, 100 }, { pixelCount, 100 }, { pixelCount, 59 }, { 50, 0 }, { 2, 0 } }; // pixels, chunkPixels
+        for (int run = 0; run < (int)(sizeof(chunkRuns) / sizeof(chunkRuns[0])); ++run) {
+            clTransform * transform = clTransformCreate(C, srgb, CL_XF_RGBA, 32, bt2020, CL_XF_RGBA, 32, CL_TONEMAP_AUTO);
+            memset(expected, 0, sizeof(float) * 4 * pixelCount);
+            memset(actual, 0, sizeof(float) * 4 * pixelCount);
+            clTransformRun(C, transform, 1, pixels, expected, chunkRuns[run][0]);
+            transform->chunkPixels = chunkRuns[run][1];
+            C->verbose = clTrue; // chunk stats
+            clTransformRun(C, transform, 3, pixels, actual, chunkRuns[run][0]);
+            C->verbose = clFalse;
+            TEST_ASSERT_EQUAL_MEMORY(expected, actual, sizeof(float) * 4 * pixelCount);
+            clTransformDestroy(C, transform);
+        }
+    }
+
+    // Transfer function tables (16bit -> 16bit) must land within a code of the exact float path
+    uint16_t * src16 = (uint16_t *)srcPixels;
+    uint16_t * dst16 = (uint16_t *)dstPixels;
+    for (int i = 0; i < pixelCount * 4; ++i) {
+        src16[i] = (uint16_t)((i * 7919) % 65536);
+    }
+    clTransform * tableTransform = clTransformCreate(C, srgb, CL_XF_RGBA, 16, bt2020, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+    clTransform * exactTransform = clTransformCreate(C, srgb, CL_XF_RGBA, 16, bt2020, CL_XF_RGBA, 32, CL_TONEMAP_AUTO);
+    clTransformRun(C, tableTransform, 1, src16, dst16, pixelCount);
+    clTransformRun(C, exactTransform, 1, src16, actual, pixelCount);
+    TEST_ASSERT_NOT_NULL(tableTransform->ccmmSrcEOTFTable);
+    TEST_ASSERT_NOT_NULL(tableTransform->ccmmDstOETFTable);
+    for (int i = 0; i < pixelCount * 4; ++i) {
+        TEST_ASSERT_FLOAT_WITHIN(1.0f, actual[i] * 65535.0f, (float)dst16[i]);
+    }
+    clTransformDestroy(C, tableTransform);
+    clTransformDestroy(C, exactTransform);
+
+    // A baked 3D LUT must stay close to the exact path, for both CMMs
+    for (int cmmIndex = 0; cmmIndex < 2; ++cmmIndex) {
+        C->ccmmAllowed = (cmmIndex == 0) ? clTrue : clFalse;
+        C->verbose = clTrue; // log the LUT's measured error
+        clTransform * lutTransform = clTransformCreate(C, srgb, CL_XF_RGBA, 16, bt2020, CL_XF_RGBA, 16, CL_TONEMAP_AUTO);
+        lutTransform->lutSize = 33;
+        exactTransform = clTransformCreate(C, srgb, CL_XF_RGBA, 16, bt2020, CL_XF_RGBA, 32, CL_TONEMAP_AUTO);
+        clTransformRun(C, lutTransform, 2, src16, dst16, pixelCount);
+        clTransformRun(C, exactTransform, 1, src16, actual, pixelCount);
+        C->verbose = clFalse;
+        TEST_ASSERT_NOT_NULL(lutTransform->lut);
+        for (int i = 0; i < pixelCount * 4; ++i) {
+            TEST_ASSERT_FLOAT_WITHIN(0.005f * 65535.0f, actual[i] * 65535.0f, (float)dst16[i]);
+        }
+        clTransformDestroy(C, lutTransform);
+        clTransformDestroy(C, exactTransform);
+    }
+    C->ccmmAllowed = clTrue;
+
+    // Batched LittleCMS must agree with CCMM on pure gamma profiles, with and without luminance scaling
+    {
+        clProfilePrimaries p3Primaries = { { 0.68f, 0.32f }, { 0.265f, 0.69f }, { 0.15f, 0.06f }, { 0.3127f, 0.3290f } };
+        clProfileCurve p3Curve = { CL_PCT_GAMMA, 1.0f, 2.2f };
+        clProfile * p3Bright = clProfileCreate(C, &p3Primaries, &p3Curve, 10000, "P3 10000");
+        clProfile * p3Dim = clProfileCreate(C, &p3Primaries, &p3Curve, 300, "P3 300");
+        clProfile * dstProfiles[2] = { p3Bright, p3Dim };
+        for (int dstIndex = 0; dstIndex < 2; ++dstIndex) {
+            for (int formatIndex = 0; formatIndex < 2; ++formatIndex) {
+                clTransformFormat format = formats[formatIndex];
+                int floatCount = (format == CL_XF_RGBA) ? 4 : 3;
+                clTransform * lcmsTransform = clTransformCreate(C, bt2020, format, 32, dstProfiles[dstIndex], format, 32, CL_TONEMAP_OFF);
+                clTransform * ccmmTransform = clTransformCreate(C, bt2020, format, 32, dstProfiles[dstIndex], format, 32, CL_TONEMAP_OFF);
+                C->ccmmAllowed = clFalse;
+                clTransformRun(C, lcmsTransform, 1, pixels, actual, pixelCount);
+                C->ccmmAllowed = clTrue;
+                clTransformRun(C, ccmmTransform, 1, pixels, expected, pixelCount);
+                TEST_ASSERT_EQUAL_INT(dstIndex == 1, lcmsTransform->luminanceScaleEnabled);
+                for (int i = 0; i < pixelCount * floatCount; ++i) {
+                    TEST_ASSERT_FLOAT_WITHIN(0.001f, expected[i], actual[i]);
+                }
+                clTransformDestroy(C, lcmsTransform);
+                clTransformDestroy(C, ccmmTransform);
+            }
+        }
+
+        // Unscaled 8-bit LittleCMS conversions run natively, and must land close to the float path
+        C->ccmmAllowed = clFalse;
+        for (int i = 0; i < pixelCount * 4; ++i) {
+            srcPixels[i] = (uint8_t)((i * 7919) % 256);
+        }
+        clTransform * nativeTransform = clTransformCreate(C, bt2020, CL_XF_RGB, 8, p3Bright, CL_XF_RGBA, 8, CL_TONEMAP_OFF);
+        clTransform * floatTransform = clTransformCreate(C, bt2020, CL_XF_RGB, 8, p3Bright, CL_XF_RGBA, 32, CL_TONEMAP_OFF);
+        clTransformRun(C, nativeTransform, 2, srcPixels, dstPixels, pixelCount);
+        clTransformRun(C, floatTransform, 1, srcPixels, actual, pixelCount);
+        TEST_ASSERT_NOT_NULL(nativeTransform->lcmsNative);
+        TEST_ASSERT_NULL(floatTransform->lcmsNative);
+        for (int i = 0; i < pixelCount * 4; ++i) {
+            TEST_ASSERT_FLOAT_WITHIN(1.5f, actual[i] * 255.0f, (float)dstPixels[i]);
+        }
+        clTransformDestroy(C, nativeTransform);
+        clTransformDestroy(C, floatTransform);
+        C->ccmmAllowed = clTrue;
+
+        // A transform prepared for the CCMM (building its curve tables) and then run through
+        // LittleCMS must not apply those tables on top of LittleCMS's own curves
+        {
+            uint16_t * src16 = clAllocate(sizeof(uint16_t) * 4 * pixelCount);
+            uint16_t * reused16 = clAllocate(sizeof(uint16_t) * 4 * pixelCount);
+            uint16_t * fresh16 = clAllocate(sizeof(uint16_t) * 4 * pixelCount);
+            for (int i = 0; i < pixelCount * 4; ++i) {
+                src16[i] = (uint16_t)((i * 7919) % 65536);
+            }
+            clTransform * reusedTransform = clTransformCreate(C, bt2020, CL_XF_RGBA, 16, p3Dim, CL_XF_RGBA, 16, CL_TONEMAP_OFF);
+            clTransform * freshTransform = clTransformCreate(C, bt2020, CL_XF_RGBA, 16, p3Dim, CL_XF_RGBA, 16, CL_TONEMAP_OFF);
+            clTransformRun(C, reusedTransform, 1, src16, reused16, pixelCount);
+            TEST_ASSERT_NOT_NULL(reusedTransform->ccmmSrcEOTFTable);
+            TEST_ASSERT_NOT_NULL(reusedTransform->ccmmDstOETFTable);
+            C->ccmmAllowed = clFalse;
+            clTransformRun(C, reusedTransform, 1, src16, reused16, pixelCount);
+            clTransformRun(C, freshTransform, 1, src16, fresh16, pixelCount);
+            C->ccmmAllowed = clTrue;
+            TEST_ASSERT_EQUAL_MEMORY(fresh16, reused16, sizeof(uint16_t) * 4 * pixelCount);
+            clTransformDestroy(C, reusedTransform);
+            clTransformDestroy(C, freshTransform);
+            clFree(fresh16);
+            clFree(reused16);
+            clFree(src16);
+        }
+
+        clProfileDestroy(C, p3Bright);
+        clProfileDestroy(C, p3Dim);
+    }
+
+    clFree(srcPixels);
+    clFree(dstPixels);
+
+    clFree(pixels);
+    clFree(expected);
+    clFree(actual);
+    clProfileDestroy(C, srgb);
+    clProfileDestroy(C, bt2020);
+    clContextDestroy(C);
+}
+
+static void test_transformSpecializations(void)
+{
+    clContext * C = clContextCreate(&silentSystem);
+    TEST_ASSERT_NOT_NULL(C);
+
+    clProfilePrimaries primaries = { { 0.708f, 0.292f }, { 0.170f, 0.797f }, { 0.131f, 0.046f }, { 0.3127f, 0.3290f } };
+    clProfileCurve curve = { CL_PCT_GAMMA, 1.0f, 2.4f };
+    clProfile * srgb = clProfileCreateStock(C, CL_PS_SRGB);
+    clProfile * bt2020 = clProfileCreate(C, &primaries, &curve, 10000, "BT2020 10000");
+
+    const int pixelCount = 1003;
+    float * pixels = clAllocate(sizeof(float) * 4 * pixelCount);
+    float * expected = clAllocate(sizeof(float) * 4 * pixelCount);
+    float * actual = clAllocate(sizeof(float) * 4 * pixelCount);
+    for (int i = 0; i < pixelCount * 4; ++i) {
+        pixels[i] = (float)((i * 7919) % 1201) / 1000.0f; // [0, 1.2]
+    }
+
+    // Every specialized kernel must match its generic kernel bit-for-bit, for every reachable
+    // luminance scale/tonemap/clamp combination and every pair of transfer functions
+    for (int dstIndex = 0; dstIndex < 2; ++dstIndex) {
+        clTransform * transform = clTransformCreate(C, srgb, CL_XF_RGBA, 32, (dstIndex == 0) ? bt2020 : NULL, CL_XF_RGBA, 32, CL_TONEMAP_AUTO);
+        clTransformPrepare(C, transform);
+        for (int mode = 0; mode < 3; ++mode) {
+            transform->luminanceScaleEnabled = (mode > 0) ? clTrue : clFalse;
+            transform->tonemapEnabled = (mode > 1) ? clTrue : clFalse;
+
+            const char * name;
+            clTransformCCMMFunc generic[2] = { clTransformCCMMScalar, clTransformCCMMChooseFunc(C, transform, clFalse, &name) };
+            clTransformCCMMFunc specialized[2] = { clTransformCCMMScalarSpecialized(transform), clTransformCCMMChooseFunc(C, transform, clTrue, &name) };
+            for (int kernel = 0; kernel < 2; ++kernel) {
+                TEST_ASSERT_TRUE(generic[kernel] != specialized[kernel]);
+                for (int srcEOTF = CL_XTF_NONE; srcEOTF <= CL_XTF_PQ; ++srcEOTF) {
+                    for (int dstOETF = CL_XTF_NONE; dstOETF <= CL_XTF_PQ; ++dstOETF) {
+                        memcpy(expected, pixels, sizeof(float) * 4 * pixelCount);
+                        memcpy(actual, pixels, sizeof(float) * 4 * pixelCount);
+                        generic[kernel](C, transform, (clTransformTransferFunction)srcEOTF, (clTransformTransferFunction)dstOETF, expected, pixelCount);
+                        specialized[kernel](C, transform, (clTransformTransferFunction)srcEOTF, (clTransformTransferFunction)dstOETF, actual, pixelCount);
+                        TEST_ASSERT_EQUAL_MEMORY(expected, actual, sizeof(float) * 4 * pixelCount);
+                    }
+                }
+            }
+        }
+        clTransformDestroy(C, transform);
+    }
+
+    clFree(pixels);
+    clFree(expected);
+    clFree(actual);
+    clProfileDestroy(C, srgb);
+    clProfileDestroy(C, bt2020);
+    clContextDestroy(C);
+}
+
 int test_coverage(void)
 {
     UNITY_BEGIN();
@@ -680,10 +2002,27 @@ int test_coverage(void)
     RUN_TEST(test_clContextParseArgs);
     RUN_TEST(test_debugDump);
     RUN_TEST(test_resize);
+    RUN_TEST(test_resizeNative);
+    RUN_TEST(test_resizeConvert);
+    RUN_TEST(test_convertLevels);
+    RUN_TEST(test_convertRows);
+    RUN_TEST(test_readRegion);
+    RUN_TEST(test_readScaled);
+    RUN_TEST(test_reportHighlight);
+    RUN_TEST(test_reportMaxYTable);
+    RUN_TEST(test_hald);
+    RUN_TEST(test_haldConvert);
     RUN_TEST(test_clTask);
+    RUN_TEST(test_colorGradeGamma);
+    RUN_TEST(test_clTaskPool);
     RUN_TEST(test_types);
     RUN_TEST(test_floorRound);
     RUN_TEST(test_raw);
+    RUN_TEST(test_rawStream);
+    RUN_TEST(test_rawSink);
+    RUN_TEST(test_rawReadFile);
+    RUN_TEST(test_transformKernels);
+    RUN_TEST(test_transformSpecializations);
 
     return UNITY_END();
 }
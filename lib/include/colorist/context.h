@@ -18,8 +18,10 @@
 
 struct clContext;
 struct clImage;
+struct clProfile;
 struct clProfilePrimaries;
 struct clRaw;
+struct clTaskPool;
 struct cJSON;
 
 typedef enum clAction
@@ -46,6 +48,36 @@ typedef struct clWriteParams
 typedef struct clImage * (* clFormatReadFunc)(struct clContext * C, const char * formatName, struct clRaw * input);
 typedef clBool (* clFormatWriteFunc)(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
 
+// Row streaming: decoding/encoding a band of rows at a time, so a conversion which doesn't need the
+// whole image never holds it (see clContextConvert()). Rows are RGBA laid out as in a clImage.
+typedef struct clRowReader
+{
+    int width;
+    int height;
+    int depth;
+    struct clProfile * profile; // never NULL, owned by the reader
+    struct clRaw * input;       // owned by the reader, set by clContextReadRows()
+    clBool (* readRowsFunc)(struct clContext * C, struct clRowReader * reader, uint8_t * pixels, int rowCount);
+    clBool (* skipRowsFunc)(struct clContext * C, struct clRowReader * reader, int rowCount); // optional, otherwise skipped rows are read and dropped
+    void (* destroyFunc)(struct clContext * C, struct clRowReader * reader); // frees the format's state and the reader itself
+} clRowReader;
+
+typedef struct clRowWriter
+{
+    clBool (* writeRowsFunc)(struct clContext * C, struct clRowWriter * writer, const uint8_t * pixels, int rowCount);
+    clBool (* finishFunc)(struct clContext * C, struct clRowWriter * writer);
+    void (* destroyFunc)(struct clContext * C, struct clRowWriter * writer);
+} clRowWriter;
+
+// A NULL reader means this particular input can't be streamed; the caller falls back to clFormatReadFunc.
+typedef clRowReader * (* clFormatReadRowsFunc)(struct clContext * C, const char * formatName, struct clRaw * input);
+// Decodes only as much as the format needs to for the rect (clamped as in clImageAdjustRect()), see clContextReadRegion()
+typedef struct clImage * (* clFormatReadRegionFunc)(struct clContext * C, const char * formatName, struct clRaw * input, int x, int y, int w, int h);
+// Decodes at a reduced size (both dimensions halved, rounding up, as many times as the codec cheaply
+// allows) no smaller than minWidth x minHeight (0 is unconstrained); see clContextReadScaled().
+typedef struct clImage * (* clFormatReadScaledFunc)(struct clContext * C, const char * formatName, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight);
+typedef clRowWriter * (* clFormatWriteRowsFunc)(struct clContext * C, const char * formatName, const char * filename, int width, int height, int depth, struct clProfile * profile, struct clWriteParams * writeParams);
+
 typedef enum clFormatDepth
 {
     CL_FORMAT_DEPTH_8 = 0,
@@ -69,12 +101,17 @@ typedef struct clFormat
     clBool usesRate;
     clFormatReadFunc readFunc;
     clFormatWriteFunc writeFunc;
+    clFormatReadRowsFunc readRowsFunc;     // optional
+    clFormatWriteRowsFunc writeRowsFunc;   // optional
+    clFormatReadRegionFunc readRegionFunc; // optional
+    clFormatReadScaledFunc readScaledFunc; // optional
 } clFormat;
 
 clBool clFormatExists(struct clContext * C, const char * formatName);
 int clFormatMaxDepth(struct clContext * C, const char * formatName);
 int clFormatBestDepth(struct clContext * C, const char * formatName, int reqDepth);
 const char * clFormatDetect(struct clContext * C, const char * filename);
+int clFormatScaleReduction(struct clContext * C, int width, int height, int minWidth, int minHeight, int maxReduction); // How many times width x height can be halved for a clFormatReadScaledFunc
 
 typedef enum clTonemap
 {
@@ -123,6 +160,16 @@ typedef struct clContextSystem
     clContextLogErrorFunc error;
 } clContextSystem;
 
+// Every -r after the first adds another output size, written alongside the first
+#define CL_MAX_RESIZE_LEVELS 16
+
+typedef struct clResizeLevel
+{
+    int width;
+    int height;
+    clFilter filter;
+} clResizeLevel;
+
 typedef struct clConversionParams
 {
     clBool autoGrade;            // -a
@@ -134,12 +181,15 @@ typedef struct clConversionParams
     const char * hald;           // --hald
     int jobs;                    // -j
     int luminance;               // -l
+    int lutSize;                 // --lut
     const char * iccOverrideOut; // -o
     float primaries[8];          // -p
     int quality;                 // -q
     int resizeW;                 // -r
     int resizeH;                 // -r
     clFilter resizeFilter;       // -r
+    int resizeLevelCount;        // -r (repeated)
+    clResizeLevel resizeLevels[CL_MAX_RESIZE_LEVELS]; // -r (repeated)
     const char * stripTags;      // -s
     clTonemap tonemap;           // -t
     int rect[4];                 // -z
@@ -165,6 +215,8 @@ typedef struct clContext
 
     clFormatRecord * formats;
 
+    struct clTaskPool * taskPool; // starts without threads, see clContextTaskPool()
+
     clAction action;
     clConversionParams params;   // see above
     clBool help;                 // -h
@@ -188,6 +240,11 @@ clContext * clContextCreate(clContextSystem * system);
 void clContextDestroy(clContext * C);
 void clContextRegisterFormat(clContext * C, clFormat * format);
 
+// Returns the context's worker pool, grown to serve taskCount concurrent tasks (the caller of
+// clTaskPoolWait() is one of them). The pool never shrinks, so pass the same taskCount to
+// clTaskBatchInit() to keep a batch from spreading over threads added for an earlier, larger one.
+struct clTaskPool * clContextTaskPool(clContext * C, int taskCount);
+
 void clContextLog(clContext * C, const char * section, int indent, const char * format, ...);
 void clContextLogError(clContext * C, const char * format, ...);
 
@@ -199,6 +256,12 @@ clBool clContextParseArgs(clContext * C, int argc, const char * argv[]);
 struct clImage * clContextRead(clContext * C, const char * filename, const char * iccOverride, const char ** outFormatName);
 clBool clContextWrite(clContext * C, struct clImage * image, const char * filename, const char * formatName, int quality, int rate);
 char * clContextWriteURI(struct clContext * C, struct clImage * image, const char * formatName, int quality, int rate);
+struct clImage * clContextReadRegion(clContext * C, const char * filename, const char * iccOverride, int x, int y, int w, int h); // The same as clContextRead() then clImageCrop()
+struct clImage * clContextReadScaled(clContext * C, const char * filename, const char * iccOverride, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight); // Possibly smaller than the file, never smaller than minWidth x minHeight
+clBool clContextReadRows(clContext * C, const char * filename, const char * iccOverride, clRowReader ** outReader); // *outReader is NULL if the input can't be streamed
+void clRowReaderDestroy(clContext * C, clRowReader * reader);
+clRowWriter * clContextWriteRows(clContext * C, const char * filename, const char * formatName, int width, int height, int depth, struct clProfile * profile, int quality, int rate);
+void clRowWriterDestroy(clContext * C, clRowWriter * writer);
 
 clBool clContextGetStockPrimaries(struct clContext * C, const char * name, struct clProfilePrimaries * outPrimaries);
 clBool clContextGetRawStockPrimaries(struct clContext * C, const char * name, float outPrimaries[8]);
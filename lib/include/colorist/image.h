@@ -27,11 +27,15 @@ typedef struct clImage
 
 clImage * clImageCreate(struct clContext * C, int width, int height, int depth, struct clProfile * profile);
 clImage * clImageRotate(struct clContext * C, clImage * image, int cwTurns);
-clImage * clImageConvert(struct clContext * C, clImage * srcImage, int taskCount, int width, int height, int depth, struct clProfile * dstProfile, clTonemap tonemap);
+clImage * clImageConvert(struct clContext * C, clImage * srcImage, int taskCount, int width, int height, int depth, struct clProfile * dstProfile, clTonemap tonemap, int lutSize, clImage * hald, int haldDims);
+clBool clImageConvertRows(struct clContext * C, clRowReader * reader, clRowWriter * writer, int taskCount, int depth, struct clProfile * dstProfile, clTonemap tonemap, int lutSize, clImage * hald, int haldDims); // Finishes the writer
 clImage * clImageCrop(struct clContext * C, clImage * srcImage, int x, int y, int w, int h, clBool keepSrc);
-clImage * clImageApplyHALD(struct clContext * C, clImage * image, clImage * hald, int haldDims);
-clImage * clImageResize(struct clContext * C, clImage * image, int width, int height, clFilter resizeFilter);
+clImage * clImageApplyHALD(struct clContext * C, clImage * image, int taskCount, clImage * hald, int haldDims);
+void clImageApplyHALDInPlace(struct clContext * C, clImage * image, int taskCount, clImage * hald, int haldDims);
+clImage * clImageResize(struct clContext * C, clImage * image, int taskCount, int width, int height, clFilter resizeFilter);
+clImage * clImageResizeConvert(struct clContext * C, clImage * srcImage, int taskCount, int width, int height, clFilter resizeFilter, int depth, struct clProfile * dstProfile, clTonemap tonemap, clImage * hald, int haldDims);
 clBool clImageAdjustRect(struct clContext * C, clImage * image, int * x, int * y, int * w, int * h);
+clBool clImageAdjustRectForSize(struct clContext * C, int width, int height, int * x, int * y, int * w, int * h);
 void clImageColorGrade(struct clContext * C, clImage * image, int taskCount, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose);
 void clImageSetPixel(struct clContext * C, clImage * image, int x, int y, int r, int g, int b, int a);
 void clImageDebugDump(struct clContext * C, clImage * image, int x, int y, int w, int h, int extraIndent);
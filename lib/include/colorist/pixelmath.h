@@ -22,7 +22,15 @@ void clPixelMathUNormToFloat(struct clContext * C, uint8_t * inPixels, int inDep
 void clPixelMathFloatToUNorm(struct clContext * C, float * inPixels, uint8_t * outPixels, int outDepth, int pixelCount);
 void clPixelMathScaleLuminance(struct clContext * C, float * pixels, int pixelCount, float luminanceScale, clBool tonemap);
 void clPixelMathColorGrade(struct clContext * C, int taskCount, struct clProfile * pixelProfile, float * pixels, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose);
-void clPixelMathResize(struct clContext * C, int srcW, int srcH, float * srcPixels, int dstW, int dstH, float * dstPixels, clFilter filter);
+void clPixelMathColorGradeUNorm(struct clContext * C, int taskCount, struct clProfile * pixelProfile, const uint8_t * pixels, int depth, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose);
+void clPixelMathResize(struct clContext * C, int taskCount, int srcW, int srcH, float * srcPixels, int dstW, int dstH, float * dstPixels, clFilter filter);
+void clPixelMathResizeBandSrcRows(struct clContext * C, int srcH, int dstH, int dstY, int dstRowCount, clFilter filter, int * outSrcY, int * outSrcRowCount); // Which source rows clPixelMathResizeBand() needs
+void clPixelMathResizeBand(struct clContext * C, int srcW, int srcH, int srcY, int srcRowCount, float * srcPixels, int dstW, int dstH, int dstY, int dstRowCount, float * dstPixels, clFilter filter);
+void clPixelMathResizeNearest(struct clContext * C, int taskCount, int pixelBytes, int srcW, int srcH, uint8_t * srcPixels, int dstW, int dstH, uint8_t * dstPixels);
+void clPixelMathResizeU8(struct clContext * C, int taskCount, int srcW, int srcH, uint8_t * srcPixels, int dstW, int dstH, uint8_t * dstPixels, clFilter filter); // 8-bit RGBA, fixed point; doesn't premultiply alpha
 void clPixelMathHaldCLUTLookup(struct clContext * C, float * haldData, int haldDims, const float src[4], float dst[4]);
+float * clPixelMathHaldCLUTLattice(struct clContext * C, const uint8_t * haldPixels, int haldDepth, int haldDims); // haldDims^3 RGB floats, red fastest; clFree() it
+void clPixelMathHaldCLUTApply(struct clContext * C, int taskCount, const float * lattice, int haldDims, const float * srcPixels, float * dstPixels, int pixelCount); // Tetrahedral
+void clPixelMathHaldCLUTApplyUNorm(struct clContext * C, int taskCount, const float * lattice, int haldDims, const uint8_t * srcPixels, uint8_t * dstPixels, int depth, int pixelCount); // srcPixels may equal dstPixels
 
 #endif
@@ -14,9 +14,10 @@ typedef struct clRaw
 {
     uint8_t * ptr;
     size_t size;
+    clBool mapped; // ptr is a read-only file mapping (see clRawReadFile()), released by clRawFree()
 } clRaw;
 
-#define CL_RAW_EMPTY { NULL, 0 }
+#define CL_RAW_EMPTY { NULL, 0, clFalse }
 
 typedef struct clStructArraySchema
 {
@@ -26,10 +27,42 @@ typedef struct clStructArraySchema
 
 struct clContext;
 
+// Receives streamed output (see clRawDeflateStream() and clRawBase64Stream) in bounded chunks
+typedef clBool (* clRawWriteFunc)(void * userData, const uint8_t * data, size_t size);
+
+#define CL_RAW_BASE64_STREAM_BUFFER_SIZE 4096
+
+typedef struct clRawBase64Stream
+{
+    clRawWriteFunc writeFunc;
+    void * userData;
+    uint8_t carry[2]; // input bytes short of a full 3 byte group
+    int carryCount;
+    char buffer[CL_RAW_BASE64_STREAM_BUFFER_SIZE];
+    size_t bufferSize;
+    clBool failed;
+} clRawBase64Stream;
+
+// Growable encoder output: raw->size is always the number of bytes written so far, while the
+// allocation behind it (capacity) grows geometrically, so appending is amortized linear.
+typedef struct clRawSink
+{
+    struct clContext * C;
+    clRaw * raw;
+    size_t capacity;
+} clRawSink;
+
 void clRawRealloc(struct clContext * C, clRaw * raw, size_t newSize);
 void clRawClone(struct clContext * C, clRaw * dst, const clRaw * src);
 clBool clRawDeflate(struct clContext * C, clRaw * dst, const clRaw * src);
 char * clRawToBase64(struct clContext * C, clRaw * src);
+clBool clRawDeflateStream(struct clContext * C, const clRaw * src, clRawWriteFunc writeFunc, void * userData);
+void clRawBase64StreamStart(clRawBase64Stream * stream, clRawWriteFunc writeFunc, void * userData);
+clBool clRawBase64StreamWrite(void * stream, const uint8_t * data, size_t size); // a clRawWriteFunc
+clBool clRawBase64StreamFinish(clRawBase64Stream * stream);
+void clRawSinkStart(struct clContext * C, clRawSink * sink, clRaw * raw); // empties raw, reusing its allocation
+void clRawSinkReserve(clRawSink * sink, size_t size);                       // room for size more bytes after raw->size
+void clRawSinkWrite(clRawSink * sink, size_t offset, const uint8_t * data, size_t size);
 void clRawSet(struct clContext * C, clRaw * raw, const uint8_t * data, size_t len);
 void clRawFree(struct clContext * C, clRaw * raw);
 clBool clRawReadFile(struct clContext * C, clRaw * raw, const char * filename);
@@ -14,17 +14,46 @@ struct clContext;
 
 typedef void (* clTaskFunc)(void * userData);
 
+// One unit of work for a clTaskPool. The storage is owned by the caller and must stay valid until
+// clTaskPoolWait() returns for its batch.
 typedef struct clTask
 {
     clTaskFunc func;
-    void * nativeData;
     void * userData;
-    clBool joined;
+    struct clTaskBatch * batch;
+    struct clTask * next; // queue link
 } clTask;
 
-clTask * clTaskCreate(struct clContext * C, clTaskFunc func, void * userData);
-void clTaskJoin(struct clContext * C, clTask * task);
-void clTaskDestroy(struct clContext * C, clTask * task);
+// Tracks a group of submitted tasks, so clTaskPoolWait() only waits on the work its caller queued.
+// At most limit of a batch's tasks run at once (<= 0 is unlimited); set it with clTaskBatchInit().
+typedef struct clTaskBatch
+{
+    int pending;
+    int limit;
+    int running;
+    clTask * head; // queued, not yet running
+    clTask * tail;
+    struct clTaskBatch * next; // link in the pool's list of batches with queued tasks
+} clTaskBatch;
+
+// Persistent worker threads serving the queued batches in FIFO order. The thread calling
+// clTaskPoolWait() also runs queued tasks while it waits, so a pool with N threads runs up to N+1
+// tasks at once. clContextTaskPool() owns one of these per clContext.
+typedef struct clTaskPool
+{
+    void * nativeData;
+    int threadCount;
+    clTaskBatch * head;
+    clTaskBatch * tail;
+    clBool quit;
+} clTaskPool;
+
+clTaskPool * clTaskPoolCreate(struct clContext * C, int threadCount);
+clBool clTaskPoolReserve(struct clContext * C, clTaskPool * pool, int threadCount); // Grows the pool to at least threadCount threads; clFalse if some couldn't be started
+void clTaskPoolDestroy(struct clContext * C, clTaskPool * pool);
+void clTaskBatchInit(clTaskBatch * batch, int limit);
+void clTaskPoolSubmit(struct clContext * C, clTaskPool * pool, clTaskBatch * batch, clTask * task, clTaskFunc func, void * userData);
+void clTaskPoolWait(struct clContext * C, clTaskPool * pool, clTaskBatch * batch);
 int clTaskLimit(void);
 
 #endif // ifndef COLORIST_TASK_H
@@ -54,15 +54,24 @@ typedef struct clTransform
     clTonemap tonemap;
     clBool tonemapEnabled;        // calculated from incoming tonemap value
     clBool luminanceScaleEnabled; // optimization; if false, avoid all luminance scaling math
+    int lutSize;                  // If > 1 (set before clTransformPrepare()), integer sources are converted via a baked lutSize^3 3D LUT
+    float * lut;                  // lutSize^3 RGB floats, R-major
+    const float * haldLattice;    // If set (before clTransformPrepare()), this Hald CLUT is applied to every converted pixel; not owned
+    int haldDims;                 // Nodes per axis of haldLattice
+    int chunkPixels;              // Pixels per work item when clTransformRun() uses multiple threads; 0 for the default
 
     // Cache for CCMM objects
     clTransformTransferFunction ccmmSrcEOTF;
     clTransformTransferFunction ccmmDstOETF;
     float ccmmSrcGamma;
     float ccmmDstInvGamma;
+    float * ccmmSrcEOTFTable; // Integer sources only: linear value for every possible code
+    float * ccmmDstOETFTable; // Integer destinations only: piecewise linear OETF over [0,1]
     gbMat3 ccmmSrcToXYZ;
     gbMat3 ccmmXYZToDst;
     gbMat3 ccmmCombined;
+    void (* ccmmFunc)(struct clContext * C, struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, float * pixels, int pixelCount); // chosen in clTransformPrepare() based on CPU features
+    const char * ccmmFuncName;
     clBool ccmmReady;
 
     // Cache for LittleCMS objects
@@ -70,6 +79,7 @@ typedef struct clTransform
     cmsHTRANSFORM lcmsSrcToXYZ;
     cmsHTRANSFORM lcmsXYZToDst;
     cmsHTRANSFORM lcmsCombined;
+    cmsHTRANSFORM lcmsNative; // src -> dst in the actual 8-bit pixel formats, only without luminance scaling
     clBool lcmsReady;
 } clTransform;
 
@@ -44,6 +44,8 @@ typedef int clBool;
 #define clFalse 0
 #define clTrue 1
 
+clBool clFileSame(const char * filename1, const char * filename2); // same file on disk, e.g. through a different path
+
 typedef struct Timer
 {
     double start;
@@ -192,6 +192,21 @@ clBool clFormatExists(struct clContext * C, const char * formatName)
     return clContextFindFormat(C, formatName) != NULL;
 }
 
+int clFormatScaleReduction(struct clContext * C, int width, int height, int minWidth, int minHeight, int maxReduction)
+{
+    COLORIST_UNUSED(C);
+
+    // Rounding down here (the codecs round up) also keeps a dimension derived from the aspect ratio in bounds
+    int reduction = 0;
+    if ((minWidth <= 0) && (minHeight <= 0)) {
+        return 0;
+    }
+    while ((reduction < maxReduction) && ((width >> (reduction + 1)) >= minWidth) && ((height >> (reduction + 1)) >= minHeight)) {
+        ++reduction;
+    }
+    return reduction;
+}
+
 // ------------------------------------------------------------------------------------------------
 // clTonemap
 
@@ -285,6 +300,7 @@ void clConversionParamsSetDefaults(clContext * C, clConversionParams * params)
     params->hald = NULL;
     params->jobs = clTaskLimit();
     params->iccOverrideOut = NULL;
+    params->lutSize = 0;
     params->quality = 90; // ?
     params->jp2rate = 0;  // Choosing a value here is dangerous as it is heavily impacted by image size
     params->rect[0] = 0;
@@ -294,6 +310,7 @@ void clConversionParamsSetDefaults(clContext * C, clConversionParams * params)
     params->resizeW = 0;
     params->resizeH = 0;
     params->resizeFilter = CL_FILTER_AUTO;
+    params->resizeLevelCount = 0;
     params->stripTags = NULL;
     params->tonemap = CL_TONEMAP_AUTO;
 }
@@ -341,6 +358,7 @@ clContext * clContextCreate(clContextSystem * system)
     // to fully honor the chad tags in the profiles (if any).
     cmsSetAdaptationStateTHR(C->lcms, 0);
 
+    C->taskPool = clTaskPoolCreate(C, 0);
     clContextSetDefaultArgs(C);
     clContextRegisterBuiltinFormats(C);
     return C;
@@ -355,6 +373,7 @@ void clContextDestroy(clContext * C)
         clFree(freeme);
     }
     C->formats = NULL;
+    clTaskPoolDestroy(C, C->taskPool);
     cmsDeleteContext(C->lcms);
     clFree(C);
 }
@@ -376,6 +395,15 @@ void clContextRegisterFormat(clContext * C, clFormat * format)
     }
 }
 
+struct clTaskPool * clContextTaskPool(clContext * C, int taskCount)
+{
+    if (!clTaskPoolReserve(C, C->taskPool, taskCount - 1)) {
+        // The caller's thread runs whatever the pool can't, so this only costs parallelism
+        clContextLog(C, "task", 1, "Warning: only %d of %d worker threads could be started", C->taskPool->threadCount, taskCount - 1);
+    }
+    return C->taskPool;
+}
+
 struct clFormat * clContextFindFormat(struct clContext * C, const char * formatName)
 {
     clFormatRecord * record = C->formats;
@@ -483,7 +511,7 @@ static clBool parseRect(clContext * C, int rect[4], const char * arg)
     return clTrue;
 }
 
-static clBool parseResize(clContext * C, clConversionParams * params, const char * arg)
+static clBool parseResize(clContext * C, int * outWidth, int * outHeight, clFilter * outFilter, const char * arg)
 {
     static const char * delims = ",x";
 
@@ -494,12 +522,12 @@ static clBool parseResize(clContext * C, clConversionParams * params, const char
         if (isdigit(token[0])) {
             if (!gotWidth) {
                 gotWidth = clTrue;
-                params->resizeW = atoi(token);
+                *outWidth = atoi(token);
                 continue;
             }
             if (!gotHeight) {
                 gotHeight = clTrue;
-                params->resizeH = atoi(token);
+                *outHeight = atoi(token);
                 continue;
             }
 
@@ -508,31 +536,31 @@ static clBool parseResize(clContext * C, clConversionParams * params, const char
         }
 
         if (!strcmp(token, "auto")) {
-            params->resizeFilter = CL_FILTER_AUTO;
+            *outFilter = CL_FILTER_AUTO;
             continue;
         }
         if (!strcmp(token, "bo")) { // Awful hack: Delims include 'x', which truncates box. Allow 'bo' to mean box.
-            params->resizeFilter = CL_FILTER_BOX;
+            *outFilter = CL_FILTER_BOX;
             continue;
         }
         if (!strcmp(token, "triangle")) {
-            params->resizeFilter = CL_FILTER_TRIANGLE;
+            *outFilter = CL_FILTER_TRIANGLE;
             continue;
         }
         if (!strcmp(token, "cubic")) {
-            params->resizeFilter = CL_FILTER_CUBICBSPLINE;
+            *outFilter = CL_FILTER_CUBICBSPLINE;
             continue;
         }
         if (!strcmp(token, "catmullrom")) {
-            params->resizeFilter = CL_FILTER_CATMULLROM;
+            *outFilter = CL_FILTER_CATMULLROM;
             continue;
         }
         if (!strcmp(token, "mitchell")) {
-            params->resizeFilter = CL_FILTER_MITCHELL;
+            *outFilter = CL_FILTER_MITCHELL;
             continue;
         }
         if (!strcmp(token, "nearest")) {
-            params->resizeFilter = CL_FILTER_NEAREST;
+            *outFilter = CL_FILTER_NEAREST;
             continue;
         }
 
@@ -540,7 +568,7 @@ static clBool parseResize(clContext * C, clConversionParams * params, const char
         return clFalse;
     }
     clFree(buffer);
-    if ((params->resizeW == 0) && (params->resizeH == 0)) {
+    if ((*outWidth == 0) && (*outHeight == 0)) {
         clContextLogError(C, "Resize (-r) missing at least one non-zero dimension");
         return clFalse;
     }
@@ -618,6 +646,13 @@ clBool clContextParseArgs(clContext * C, int argc, const char * argv[])
                 } else {
                     C->params.luminance = atoi(arg);
                 }
+            } else if (!strcmp(arg, "--lut")) {
+                NEXTARG();
+                C->params.lutSize = atoi(arg);
+                if ((C->params.lutSize < 0) || (C->params.lutSize == 1) || (C->params.lutSize > 256)) {
+                    clContextLogError(C, "Invalid --lut: %s", arg);
+                    return clFalse;
+                }
             } else if (!strcmp(arg, "-o") || !strcmp(arg, "--iccout")) {
                 NEXTARG();
                 C->params.iccOverrideOut = arg;
@@ -630,8 +665,23 @@ clBool clContextParseArgs(clContext * C, int argc, const char * argv[])
                 C->params.quality = atoi(arg);
             } else if (!strcmp(arg, "-r") || !strcmp(arg, "--resize")) {
                 NEXTARG();
-                if (!parseResize(C, &C->params, arg))
-                    return clFalse;
+                if ((C->params.resizeW == 0) && (C->params.resizeH == 0)) {
+                    if (!parseResize(C, &C->params.resizeW, &C->params.resizeH, &C->params.resizeFilter, arg))
+                        return clFalse;
+                } else {
+                    clResizeLevel * level;
+                    if (C->params.resizeLevelCount == CL_MAX_RESIZE_LEVELS) {
+                        clContextLogError(C, "Too many output sizes (-r), max is %d", CL_MAX_RESIZE_LEVELS + 1);
+                        return clFalse;
+                    }
+                    level = &C->params.resizeLevels[C->params.resizeLevelCount];
+                    level->width = 0;
+                    level->height = 0;
+                    level->filter = CL_FILTER_AUTO;
+                    if (!parseResize(C, &level->width, &level->height, &level->filter, arg))
+                        return clFalse;
+                    ++C->params.resizeLevelCount;
+                }
             } else if (!strcmp(arg, "-s") || !strcmp(arg, "--striptags")) {
                 NEXTARG();
                 C->params.stripTags = arg;
@@ -804,6 +854,10 @@ void clContextPrintArgs(clContext * C)
     } else {
         clContextLog(C, "syntax", 1, "luminance   : auto");
     }
+    if (C->params.lutSize)
+        clContextLog(C, "syntax", 1, "lut         : %dx%dx%d", C->params.lutSize, C->params.lutSize, C->params.lutSize);
+    else
+        clContextLog(C, "syntax", 1, "lut         : disabled");
     if (C->params.primaries[0] > 0.0f)
         clContextLog(C, "syntax", 1, "primaries   : r:(%.4g,%.4g) g:(%.4g,%.4g) b:(%.4g,%.4g) w:(%.4g,%.4g)",
             C->params.primaries[0], C->params.primaries[1],
@@ -815,6 +869,10 @@ void clContextPrintArgs(clContext * C)
     clContextLog(C, "syntax", 1, "resizeW     : %d", C->params.resizeW);
     clContextLog(C, "syntax", 1, "resizeH     : %d", C->params.resizeH);
     clContextLog(C, "syntax", 1, "resizeFilter: %s", clFilterToString(C, C->params.resizeFilter));
+    for (int i = 0; i < C->params.resizeLevelCount; ++i) {
+        const clResizeLevel * level = &C->params.resizeLevels[i];
+        clContextLog(C, "syntax", 1, "resizeLevel : %dx%d [filter:%s]", level->width, level->height, clFilterToString(C, level->filter));
+    }
     clContextLog(C, "syntax", 1, "rect        : (%d,%d) %dx%d", C->params.rect[0], C->params.rect[1], C->params.rect[2], C->params.rect[3]);
     clContextLog(C, "syntax", 1, "stripTags   : %s", C->params.stripTags ? C->params.stripTags : "--");
     clContextLog(C, "syntax", 1, "tonemap     : %s", clTonemapToString(C, C->params.tonemap));
@@ -869,9 +927,10 @@ void clContextPrintSyntax(clContext * C)
     clContextLog(C, NULL, 0, "    -t,--tonemap TONEMAP     : Set tonemapping. auto (default), on, or off");
     clContextLog(C, NULL, 0, "");
     clContextLog(C, NULL, 0, "Convert Options:");
-    clContextLog(C, NULL, 0, "    -r,--resize w,h,filter   : Resize dst image to WxH. Use optional filter (auto (default), box, triangle, cubic, catmullrom, mitchell, nearest)");
+    clContextLog(C, NULL, 0, "    -r,--resize w,h,filter   : Resize dst image to WxH. Use optional filter (auto (default), box, triangle, cubic, catmullrom, mitchell, nearest). Repeat for more output sizes");
     clContextLog(C, NULL, 0, "    -z,--rect,--crop x,y,w,h : Crop source image to rect (before conversion). x,y,w,h");
     clContextLog(C, NULL, 0, "    --hald FILENAME          : Image containing valid Hald CLUT to be used after color conversion");
+    clContextLog(C, NULL, 0, "    --lut SIZE               : Bake the conversion into a SIZE^3 3D LUT (2 - 256, 33 or 65 recommended). 0 to disable (default)");
     clContextLog(C, NULL, 0, "");
     clContextLog(C, NULL, 0, "Identify / Calc Options:");
     clContextLog(C, NULL, 0, "    -z,--rect x,y,w,h        : Pixels to dump. x,y,w,h");
@@ -12,6 +12,7 @@
 #include "colorist/profile.h"
 #include "colorist/task.h"
 
+#include <stdio.h>
 #include <string.h>
 
 #define FAIL() { returnCode = 1; goto convertCleanup; }
@@ -27,6 +28,117 @@ struct ImageInfo
     int luminance;
 };
 
+// A conversion which only changes color (no crop, resize, grading or extra sizes) can stream rows
+// from the decoder through the transform to the encoder without ever holding the whole image.
+static clBool canStream(clContext * C, clConversionParams * params)
+{
+    clFormat * format;
+    if (!strcmp(params->formatName, "icc") || params->autoGrade || (params->resizeW > 0) || (params->resizeH > 0) || (params->resizeLevelCount > 0)) {
+        return clFalse;
+    }
+    if ((params->rect[0] >= 0) && (params->rect[1] >= 0) && (params->rect[2] > 0) && (params->rect[3] > 0)) {
+        return clFalse; // cropping
+    }
+    if (clFileSame(C->inputFilename, C->outputFilename)) {
+        return clFalse; // the encoder would truncate the (possibly mapped) input while it is still being read
+    }
+    format = clContextFindFormat(C, params->formatName);
+    return (format && format->writeRowsFunc) ? clTrue : clFalse;
+}
+
+// Fills in a missing resize dimension using the source's aspect ratio
+static void resizeDimensions(const struct ImageInfo * srcInfo, int resizeW, int resizeH, int * outWidth, int * outHeight)
+{
+    if (resizeW <= 0) {
+        *outWidth = (int)(((float)srcInfo->width / (float)srcInfo->height) * resizeH);
+        *outHeight = resizeH;
+    } else if (resizeH <= 0) {
+        *outWidth = resizeW;
+        *outHeight = (int)(((float)srcInfo->height / (float)srcInfo->width) * resizeW);
+    } else {
+        *outWidth = resizeW;
+        *outHeight = resizeH;
+    }
+    if (*outWidth <= 0)
+        *outWidth = 1;
+    if (*outHeight <= 0)
+        *outHeight = 1;
+}
+
+// The smallest size every requested output can still be resized down from, so a format may decode
+// at a reduced size (0 leaves that axis unconstrained, and no resize means no reduction)
+static void decodeMinimumSize(const clConversionParams * params, int * minWidth, int * minHeight)
+{
+    *minWidth = 0;
+    *minHeight = 0;
+    if ((params->resizeW <= 0) && (params->resizeH <= 0)) {
+        return;
+    }
+    *minWidth = params->resizeW;
+    *minHeight = params->resizeH;
+    for (int i = 0; i < params->resizeLevelCount; ++i) {
+        const clResizeLevel * level = &params->resizeLevels[i];
+        if (level->width > *minWidth) {
+            *minWidth = level->width;
+        }
+        if (level->height > *minHeight) {
+            *minHeight = level->height;
+        }
+    }
+}
+
+// When writing several sizes, each output is named after its size: out.png -> out.640x480.png
+static char * levelFilename(clContext * C, const char * filename, int width, int height)
+{
+    const char * lastSlash = strrchr(filename, '/');
+    const char * lastBackslash = strrchr(filename, '\\');
+    const char * basename = filename;
+    const char * extension;
+    size_t stemLength;
+    size_t levelNameSize = strlen(filename) + 32;
+    char * levelName = clAllocate(levelNameSize);
+
+    if (lastSlash)
+        basename = lastSlash + 1;
+    if (lastBackslash && (lastBackslash + 1 > basename))
+        basename = lastBackslash + 1;
+    extension = strrchr(basename, '.');
+    if (!extension)
+        extension = basename + strlen(basename);
+
+    stemLength = (size_t)(extension - filename);
+    memcpy(levelName, filename, stemLength);
+    snprintf(levelName + stemLength, levelNameSize - stemLength, ".%dx%d%s", width, height, extension);
+    return levelName;
+}
+
+static void logWriting(clContext * C, clConversionParams * params, const char * filename)
+{
+    clFormat * format = clContextFindFormat(C, params->formatName);
+    COLORIST_ASSERT(format);
+    if (format->usesRate && format->usesQuality) {
+        clContextLog(C, "encode", 0, "Writing %s [%s:%d]: %s", format->description, (params->jp2rate) ? "R" : "Q", (params->jp2rate) ? params->jp2rate : params->quality, filename);
+    } else if (format->usesQuality) {
+        clContextLog(C, "encode", 0, "Writing %s [Q:%d]: %s", format->description, params->quality, filename);
+    } else {
+        clContextLog(C, "encode", 0, "Writing %s: %s", format->description, filename);
+    }
+}
+
+static clBool writeOutput(clContext * C, clConversionParams * params, clImage * image, const char * filename)
+{
+    Timer t;
+
+    logWriting(C, params, filename);
+    timerStart(&t);
+    if (!clContextWrite(C, image, filename, params->formatName, params->quality, params->jp2rate)) {
+        return clFalse;
+    }
+    clContextLog(C, "encode", 1, "Wrote %d bytes.", clFileSize(filename));
+    clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
+    return clTrue;
+}
+
 int clContextConvert(clContext * C)
 {
     Timer overall, t;
@@ -37,10 +149,26 @@ int clContextConvert(clContext * C)
     clImage * dstImage = NULL;
     clProfile * dstProfile = NULL;
 
+    // Streaming (see canStream()); srcProfile belongs to whichever of srcImage / rowReader exists
+    clRowReader * rowReader = NULL;
+    clRowWriter * rowWriter = NULL;
+    clProfile * srcProfile = NULL;
+
+    // Size of the image actually decoded, which can be smaller than srcInfo (see decodeMinimumSize())
+    int decodedWidth = 0;
+    int decodedHeight = 0;
+
     // Information about the src&dst images, used to make all decisions
     struct ImageInfo srcInfo;
     struct ImageInfo dstInfo;
 
+    // Resize during conversion instead of as its own pass
+    clBool fuseResize = clFalse;
+
+    // Extra output sizes (repeated -r)
+    clImage * levelImage = NULL;
+    char * levelName = NULL;
+
     // Hald CLUT
     clImage * haldImage = NULL;
     int haldDims = 0;
@@ -60,19 +188,42 @@ int clContextConvert(clContext * C)
 
     clContextLog(C, "decode", 0, "Reading: %s (%d bytes)", C->inputFilename, clFileSize(C->inputFilename));
     timerStart(&t);
-    srcImage = clContextRead(C, C->inputFilename, C->iccOverrideIn, NULL);
-    if (srcImage == NULL) {
+    if (canStream(C, &params) && !clContextReadRows(C, C->inputFilename, C->iccOverrideIn, &rowReader)) {
         return 1;
     }
+    if (rowReader) {
+        srcProfile = rowReader->profile;
+    } else {
+        // A crop is applied while decoding, so only as much of the source as the format needs is decoded
+        if ((params.rect[0] >= 0) && (params.rect[1] >= 0) && (params.rect[2] > 0) && (params.rect[3] > 0)) {
+            clContextLog(C, "crop", 0, "Cropping source image to: +%d+%d %dx%d", params.rect[0], params.rect[1], params.rect[2], params.rect[3]);
+            srcImage = clContextReadRegion(C, C->inputFilename, C->iccOverrideIn, params.rect[0], params.rect[1], params.rect[2], params.rect[3]);
+            if (srcImage) {
+                srcInfo.width = srcImage->width;
+                srcInfo.height = srcImage->height;
+            }
+        } else {
+            int minWidth, minHeight;
+            decodeMinimumSize(&params, &minWidth, &minHeight);
+            srcImage = clContextReadScaled(C, C->inputFilename, C->iccOverrideIn, minWidth, minHeight, &srcInfo.width, &srcInfo.height);
+        }
+        if (srcImage == NULL) {
+            return 1;
+        }
+        srcProfile = srcImage->profile;
+        if ((srcImage->width != srcInfo.width) || (srcImage->height != srcInfo.height)) {
+            clContextLog(C, "decode", 0, "Decoded at reduced size: %dx%d (from %dx%d)", srcImage->width, srcImage->height, srcInfo.width, srcInfo.height);
+        }
+    }
     clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
 
     if (!strcmp(params.formatName, "icc")) {
         // Just dump out the profile to disk and bail out
 
         clContextLog(C, "encode", 0, "Writing ICC: %s", C->outputFilename);
-        clProfileDebugDump(C, srcImage->profile, C->verbose, 0);
+        clProfileDebugDump(C, srcProfile, C->verbose, 0);
 
-        if (!clProfileWrite(C, srcImage->profile, C->outputFilename)) {
+        if (!clProfileWrite(C, srcProfile, C->outputFilename)) {
             FAIL();
         }
         goto convertCleanup;
@@ -109,23 +260,22 @@ int clContextConvert(clContext * C)
         }
     }
 
-    int crop[4];
-    memcpy(crop, C->params.rect, 4 * sizeof(int));
-    if (clImageAdjustRect(C, srcImage, &crop[0], &crop[1], &crop[2], &crop[3])) {
-        timerStart(&t);
-        clContextLog(C, "crop", 0, "Cropping source image from %dx%d to: +%d+%d %dx%d", srcImage->width, srcImage->height, crop[0], crop[1], crop[2], crop[3]);
-        srcImage = clImageCrop(C, srcImage, crop[0], crop[1], crop[2], crop[3], clFalse);
-        clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
-    }
-
     // -----------------------------------------------------------------------
     // Parse source image and conversion params, make decisions about dst
 
     // Populate srcInfo
-    srcInfo.width = srcImage->width;
-    srcInfo.height = srcImage->height;
-    srcInfo.depth = srcImage->depth;
-    clProfileQuery(C, srcImage->profile, &srcInfo.primaries, &srcInfo.curve, &srcInfo.luminance);
+    if (rowReader) {
+        srcInfo.width = rowReader->width;
+        srcInfo.height = rowReader->height;
+        srcInfo.depth = rowReader->depth;
+        decodedWidth = rowReader->width;
+        decodedHeight = rowReader->height;
+    } else {
+        decodedWidth = srcImage->width;
+        decodedHeight = srcImage->height;
+        srcInfo.depth = srcImage->depth;
+    }
+    clProfileQuery(C, srcProfile, &srcInfo.primaries, &srcInfo.curve, &srcInfo.luminance);
     srcInfo.luminance = (srcInfo.luminance != 0) ? srcInfo.luminance : COLORIST_DEFAULT_LUMINANCE;
     if ((srcInfo.curve.type != CL_PCT_GAMMA) && (srcInfo.curve.gamma > 0.0f)) {
         clContextLog(C, "info", 0, "Estimated source gamma: %g", srcInfo.curve.gamma);
@@ -190,20 +340,7 @@ int clContextConvert(clContext * C)
 
     // Override width and height
     if ((params.resizeW > 0) || (params.resizeH > 0)) {
-        if (params.resizeW <= 0) {
-            dstInfo.width = (int)(((float)srcInfo.width / (float)srcInfo.height) * params.resizeH);
-            dstInfo.height = params.resizeH;
-        } else if (params.resizeH <= 0) {
-            dstInfo.width = params.resizeW;
-            dstInfo.height = (int)(((float)srcInfo.height / (float)srcInfo.width) * params.resizeW);
-        } else {
-            dstInfo.width = params.resizeW;
-            dstInfo.height = params.resizeH;
-        }
-        if (dstInfo.width <= 0)
-            dstInfo.width = 1;
-        if (dstInfo.height <= 0)
-            dstInfo.height = 1;
+        resizeDimensions(&srcInfo, params.resizeW, params.resizeH, &dstInfo.width, &dstInfo.height);
     }
 
     // Override depth
@@ -222,11 +359,17 @@ int clContextConvert(clContext * C)
     // -----------------------------------------------------------------------
     // Resize, if necessary
 
-    if (((dstInfo.width != srcInfo.width) || (dstInfo.height != srcInfo.height))) {
-        clContextLog(C, "resize", 0, "Resizing %dx%d -> [filter:%s] -> %dx%d", srcInfo.width, srcInfo.height, clFilterToString(C, params.resizeFilter), dstInfo.width, dstInfo.height);
+    // Unless something needs the resized pixels before conversion (grading, or a baked LUT which
+    // only applies to integer sources), the resize is fused into the conversion below.
+    if (((dstInfo.width != decodedWidth) || (dstInfo.height != decodedHeight))) {
+        clContextLog(C, "resize", 0, "Resizing %dx%d -> [filter:%s] -> %dx%d", decodedWidth, decodedHeight, clFilterToString(C, params.resizeFilter), dstInfo.width, dstInfo.height);
+        fuseResize = !params.autoGrade && (params.lutSize == 0);
+    }
+
+    if (((dstInfo.width != decodedWidth) || (dstInfo.height != decodedHeight)) && !fuseResize) {
         timerStart(&t);
 
-        clImage * resizedImage = clImageResize(C, srcImage, dstInfo.width, dstInfo.height, params.resizeFilter);
+        clImage * resizedImage = clImageResize(C, srcImage, params.jobs, dstInfo.width, dstInfo.height, params.resizeFilter);
         if (!resizedImage) {
             clContextLogError(C, "Failed to resize image");
             FAIL();
@@ -234,6 +377,7 @@ int clContextConvert(clContext * C)
 
         clImageDestroy(C, srcImage);
         srcImage = resizedImage;
+        srcProfile = srcImage->profile;
 
         clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
     }
@@ -311,57 +455,113 @@ int clContextConvert(clContext * C)
             }
         } else {
             // just clone the source one
-            clContextLog(C, "profile", 0, "Using unmodified source ICC profile: \"%s\"", srcImage->profile->description);
-            dstProfile = clProfileClone(C, srcImage->profile);
+            clContextLog(C, "profile", 0, "Using unmodified source ICC profile: \"%s\"", srcProfile->description);
+            dstProfile = clProfileClone(C, srcProfile);
+        }
+    }
+
+    if (rowReader) {
+        // Encoding happens alongside conversion, so this times both, like writeOutput() times the encode
+        logWriting(C, &params, C->outputFilename);
+        timerStart(&t);
+        rowWriter = clContextWriteRows(C, C->outputFilename, params.formatName, dstInfo.width, dstInfo.height, dstInfo.depth, dstProfile, params.quality, params.jp2rate);
+        if (!rowWriter || !clImageConvertRows(C, rowReader, rowWriter, params.jobs, dstInfo.depth, dstProfile, params.tonemap, params.lutSize, haldImage, haldDims)) {
+            // Close the file first, then don't leave a partial (or header only) image behind
+            if (rowWriter) {
+                clRowWriterDestroy(C, rowWriter);
+                rowWriter = NULL;
+            }
+            remove(C->outputFilename);
+            FAIL();
         }
+        clContextLog(C, "encode", 1, "Wrote %d bytes.", clFileSize(C->outputFilename));
+        clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
+        goto convertCleanup;
     }
 
-    dstImage = clImageConvert(C, srcImage, params.jobs, dstInfo.width, dstInfo.height, dstInfo.depth, dstProfile, params.autoGrade ? CL_TONEMAP_OFF : params.tonemap);
+    if (fuseResize) {
+        dstImage = clImageResizeConvert(C, srcImage, params.jobs, dstInfo.width, dstInfo.height, params.resizeFilter, dstInfo.depth, dstProfile, params.tonemap, haldImage, haldDims);
+    } else {
+        dstImage = clImageConvert(C, srcImage, params.jobs, dstInfo.width, dstInfo.height, dstInfo.depth, dstProfile, params.autoGrade ? CL_TONEMAP_OFF : params.tonemap, params.lutSize, haldImage, haldDims);
+    }
     if (!dstImage) {
         FAIL();
     }
 
-    if (haldImage) {
-        clContextLog(C, "hald", 0, "Performing Hald CLUT postprocessing...");
-        timerStart(&t);
-
-        clImage * appliedImage = clImageApplyHALD(C, dstImage, haldImage, haldDims);
-        if (!appliedImage) {
-            clContextLogError(C, "Failed to apply HALD");
+    if (params.resizeLevelCount == 0) {
+        if (!writeOutput(C, &params, dstImage, C->outputFilename)) {
+            FAIL();
+        }
+    } else {
+        // Several output sizes: every level comes from this one decode and color conversion. Each
+        // is resized from the previous level when that's a pure downscale (the smaller source makes
+        // it cheaper), otherwise from the first, full conversion.
+        clImage * prevImage = dstImage;
+        int prevLevel = 0;
+
+        levelName = levelFilename(C, C->outputFilename, dstImage->width, dstImage->height);
+        clContextLog(C, "level", 0, "Level 0: %dx%d", dstImage->width, dstImage->height);
+        if (!writeOutput(C, &params, dstImage, levelName)) {
             FAIL();
         }
+        clFree(levelName);
+        levelName = NULL;
+
+        for (int i = 0; i < params.resizeLevelCount; ++i) {
+            const clResizeLevel * level = &params.resizeLevels[i];
+            clImage * fromImage = dstImage;
+            int fromLevel = 0;
+            int levelWidth, levelHeight;
+            Timer levelTimer;
+
+            timerStart(&levelTimer);
+            resizeDimensions(&srcInfo, level->width, level->height, &levelWidth, &levelHeight);
+            if ((levelWidth <= prevImage->width) && (levelHeight <= prevImage->height)) {
+                fromImage = prevImage;
+                fromLevel = prevLevel;
+            }
 
-        clImageDestroy(C, dstImage);
-        dstImage = appliedImage;
+            clContextLog(C, "level", 0, "Level %d: %dx%d -> [filter:%s] -> %dx%d (from level %d)", i + 1, fromImage->width, fromImage->height, clFilterToString(C, level->filter), levelWidth, levelHeight, fromLevel);
+            timerStart(&t);
+            clImage * resizedImage = clImageResize(C, fromImage, params.jobs, levelWidth, levelHeight, level->filter);
+            if (!resizedImage) {
+                clContextLogError(C, "Failed to resize image");
+                FAIL();
+            }
+            clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
 
-        clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
-    }
+            if (levelImage) {
+                clImageDestroy(C, levelImage);
+            }
+            levelImage = resizedImage;
+            prevImage = levelImage;
+            prevLevel = i + 1;
 
-    {
-        clFormat * format = clContextFindFormat(C, params.formatName);
-        COLORIST_ASSERT(format);
-        if (format->usesRate && format->usesQuality) {
-            clContextLog(C, "encode", 0, "Writing %s [%s:%d]: %s", format->description, (params.jp2rate) ? "R" : "Q", (params.jp2rate) ? params.jp2rate : params.quality, C->outputFilename);
-        } else if (format->usesQuality) {
-            clContextLog(C, "encode", 0, "Writing %s [Q:%d]: %s", format->description, params.quality, C->outputFilename);
-        } else {
-            clContextLog(C, "encode", 0, "Writing %s: %s", format->description, C->outputFilename);
+            levelName = levelFilename(C, C->outputFilename, levelWidth, levelHeight);
+            if (!writeOutput(C, &params, levelImage, levelName)) {
+                FAIL();
+            }
+            clFree(levelName);
+            levelName = NULL;
+            clContextLog(C, "level", 1, "Level %d took %g sec.", i + 1, timerElapsedSeconds(&levelTimer));
         }
     }
-    timerStart(&t);
-    if (!clContextWrite(C, dstImage, C->outputFilename, params.formatName, params.quality, params.jp2rate)) {
-        FAIL();
-    }
-    clContextLog(C, "encode", 1, "Wrote %d bytes.", clFileSize(C->outputFilename));
-    clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
 
 convertCleanup:
+    if (rowWriter)
+        clRowWriterDestroy(C, rowWriter);
+    if (rowReader)
+        clRowReaderDestroy(C, rowReader);
     if (dstProfile)
         clProfileDestroy(C, dstProfile);
     if (srcImage)
         clImageDestroy(C, srcImage);
     if (dstImage)
         clImageDestroy(C, dstImage);
+    if (levelImage)
+        clImageDestroy(C, levelImage);
+    if (levelName)
+        clFree(levelName);
     if (haldImage)
         clImageDestroy(C, haldImage);
 
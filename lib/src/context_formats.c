@@ -14,18 +14,28 @@ clBool clFormatWriteBMP(struct clContext * C, struct clImage * image, const char
 
 struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWriteJPG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clRowReader * clFormatReadRowsJPG(struct clContext * C, const char * formatName, struct clRaw * input);
+clRowWriter * clFormatWriteRowsJPG(struct clContext * C, const char * formatName, const char * filename, int width, int height, int depth, struct clProfile * profile, struct clWriteParams * writeParams);
+struct clImage * clFormatReadScaledJPG(struct clContext * C, const char * formatName, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight);
 
 struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWriteJP2(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+struct clImage * clFormatReadRegionJP2(struct clContext * C, const char * formatName, struct clRaw * input, int x, int y, int w, int h);
+struct clImage * clFormatReadScaledJP2(struct clContext * C, const char * formatName, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight);
 
 struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clRowReader * clFormatReadRowsPNG(struct clContext * C, const char * formatName, struct clRaw * input);
+clRowWriter * clFormatWriteRowsPNG(struct clContext * C, const char * formatName, const char * filename, int width, int height, int depth, struct clProfile * profile, struct clWriteParams * writeParams);
 
 struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWriteTIFF(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clRowReader * clFormatReadRowsTIFF(struct clContext * C, const char * formatName, struct clRaw * input);
+clRowWriter * clFormatWriteRowsTIFF(struct clContext * C, const char * formatName, const char * filename, int width, int height, int depth, struct clProfile * profile, struct clWriteParams * writeParams);
 
 struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWriteWebP(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+struct clImage * clFormatReadScaledWebP(struct clContext * C, const char * formatName, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight);
 
 void clContextRegisterBuiltinFormats(struct clContext * C)
 {
@@ -67,6 +77,9 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesRate = clFalse;
         format.readFunc = clFormatReadJPG;
         format.writeFunc = clFormatWriteJPG;
+        format.readRowsFunc = clFormatReadRowsJPG;
+        format.writeRowsFunc = clFormatWriteRowsJPG;
+        format.readScaledFunc = clFormatReadScaledJPG;
         clContextRegisterFormat(C, &format);
     }
 
@@ -87,6 +100,8 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesRate = clTrue;
         format.readFunc = clFormatReadJP2;
         format.writeFunc = clFormatWriteJP2;
+        format.readRegionFunc = clFormatReadRegionJP2;
+        format.readScaledFunc = clFormatReadScaledJP2;
         clContextRegisterFormat(C, &format);
     }
 
@@ -107,6 +122,8 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesRate = clTrue;
         format.readFunc = clFormatReadJP2;
         format.writeFunc = clFormatWriteJP2;
+        format.readRegionFunc = clFormatReadRegionJP2;
+        format.readScaledFunc = clFormatReadScaledJP2;
         clContextRegisterFormat(C, &format);
     }
 
@@ -126,6 +143,8 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesRate = clFalse;
         format.readFunc = clFormatReadPNG;
         format.writeFunc = clFormatWritePNG;
+        format.readRowsFunc = clFormatReadRowsPNG;
+        format.writeRowsFunc = clFormatWriteRowsPNG;
         clContextRegisterFormat(C, &format);
     }
 
@@ -150,6 +169,8 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesRate = clFalse;
         format.readFunc = clFormatReadTIFF;
         format.writeFunc = clFormatWriteTIFF;
+        format.readRowsFunc = clFormatReadRowsTIFF;
+        format.writeRowsFunc = clFormatWriteRowsTIFF;
         clContextRegisterFormat(C, &format);
     }
 
@@ -170,6 +191,7 @@ void clContextRegisterBuiltinFormats(struct clContext * C)
         format.usesRate = clFalse;
         format.readFunc = clFormatReadWebP;
         format.writeFunc = clFormatWriteWebP;
+        format.readScaledFunc = clFormatReadScaledWebP;
         clContextRegisterFormat(C, &format);
     }
 }
@@ -6,11 +6,13 @@
 // ---------------------------------------------------------------------------
 
 #include "colorist/context.h"
+#include "context_report.h"
 
 #include "colorist/embedded.h"
 #include "colorist/image.h"
 #include "colorist/pixelmath.h"
 #include "colorist/profile.h"
+#include "colorist/task.h"
 #include "colorist/transform.h"
 
 #include "cJSON.h"
@@ -20,40 +22,97 @@
 
 #define FAIL() { returnCode = 1; goto reportCleanup; }
 
-// Calculates the max Y for a given xy chromaticity, this is an awful hack
-static float calcMaxY(clContext * C, float x, float y, clTransform * fromXYZ, clTransform * toXYZ)
+// The max Y for a given xy chromaticity is sampled on a MAXY_TABLE_SIZE^2 grid over [0,1]x[0,1]
+// once per highlight, and bilinearly interpolated per pixel. For sRGB and BT.2020 the lookup stays
+// within 2% of the direct calculation wherever y >= 0.005 (all visible colors); it is worst at the
+// gamut's corners, where max Y has a kink. Below that the error grows quickly, as the bottom row is
+// nudged off y == 0. See test_reportMaxYTable.
+#define MAXY_TABLE_SIZE 512
+
+// Calculates the max Y for every xy chromaticity in the table, this is an awful hack
+float * clReportCreateMaxYTable(clContext * C, clTransform * fromXYZ, clTransform * toXYZ, int taskCount)
+{
+    const int nodeCount = MAXY_TABLE_SIZE * MAXY_TABLE_SIZE;
+    const float step = 1.0f / (float)(MAXY_TABLE_SIZE - 1);
+    float * maxYTable = clAllocate(sizeof(float) * nodeCount);
+    float * nodeXYZ = clAllocate(3 * sizeof(float) * nodeCount);
+    float * nodeRGB = clAllocate(3 * sizeof(float) * nodeCount);
+    float * nodeRGBA = clAllocate(4 * sizeof(float) * nodeCount);
+    int i;
+
+    for (i = 0; i < nodeCount; ++i) {
+        cmsCIEXYZ XYZ;
+        cmsCIExyY xyY;
+        xyY.x = (float)(i % MAXY_TABLE_SIZE) * step;
+        xyY.y = (float)(i / MAXY_TABLE_SIZE) * step;
+        if (xyY.y <= 0.0f) {
+            // No light has y == 0; nudge the bottom row off of it
+            xyY.y = step * 0.5f;
+        }
+        xyY.Y = 1.0f; // Filthy lies
+        cmsxyY2XYZ(&XYZ, &xyY);
+        nodeXYZ[(i * 3) + 0] = (float)XYZ.X;
+        nodeXYZ[(i * 3) + 1] = (float)XYZ.Y;
+        nodeXYZ[(i * 3) + 2] = (float)XYZ.Z;
+    }
+    clTransformRun(C, fromXYZ, taskCount, nodeXYZ, nodeRGB, nodeCount);
+
+    for (i = 0; i < nodeCount; ++i) {
+        float * rgb = &nodeRGB[i * 3];
+        float * rgba = &nodeRGBA[i * 4];
+        float maxChannel = rgb[0];
+        if (maxChannel < rgb[1])
+            maxChannel = rgb[1];
+        if (maxChannel < rgb[2])
+            maxChannel = rgb[2];
+        if (maxChannel > 0.0f) {
+            rgba[0] = rgb[0] / maxChannel;
+            rgba[1] = rgb[1] / maxChannel;
+            rgba[2] = rgb[2] / maxChannel;
+        } else {
+            rgba[0] = 1.0f;
+            rgba[1] = 1.0f;
+            rgba[2] = 1.0f;
+        }
+        rgba[3] = 1.0f;
+    }
+    clTransformRun(C, toXYZ, taskCount, nodeRGBA, nodeXYZ, nodeCount);
+
+    for (i = 0; i < nodeCount; ++i) {
+        maxYTable[i] = nodeXYZ[(i * 3) + 1];
+    }
+    clFree(nodeXYZ);
+    clFree(nodeRGB);
+    clFree(nodeRGBA);
+    return maxYTable;
+}
+
+float clReportLookupMaxY(const float * maxYTable, float x, float y)
 {
-    float floatXYZ[3];
-    float floatRGB[3];
-    float maxChannel;
-    cmsCIEXYZ XYZ;
-    cmsCIExyY xyY;
-    xyY.x = x;
-    xyY.y = y;
-    xyY.Y = 1.0f; // Filthy lies
-    cmsxyY2XYZ(&XYZ, &xyY);
-    floatXYZ[0] = (float)XYZ.X;
-    floatXYZ[1] = (float)XYZ.Y;
-    floatXYZ[2] = (float)XYZ.Z;
-    clTransformRun(C, fromXYZ, 1, floatXYZ, floatRGB, 1);
-    maxChannel = floatRGB[0];
-    if (maxChannel < floatRGB[1])
-        maxChannel = floatRGB[1];
-    if (maxChannel < floatRGB[2])
-        maxChannel = floatRGB[2];
-    floatRGB[0] /= maxChannel;
-    floatRGB[1] /= maxChannel;
-    floatRGB[2] /= maxChannel;
-    clTransformRun(C, toXYZ, 1, floatRGB, floatXYZ, 1);
-    return floatXYZ[1];
+    const float scale = (float)(MAXY_TABLE_SIZE - 1);
+    float fx = CL_CLAMP(x, 0.0f, 1.0f) * scale;
+    float fy = CL_CLAMP(y, 0.0f, 1.0f) * scale;
+    int ix = (int)fx;
+    int iy = (int)fy;
+    if (ix > MAXY_TABLE_SIZE - 2)
+        ix = MAXY_TABLE_SIZE - 2;
+    if (iy > MAXY_TABLE_SIZE - 2)
+        iy = MAXY_TABLE_SIZE - 2;
+    float dx = fx - (float)ix;
+    float dy = fy - (float)iy;
+    const float * row0 = &maxYTable[(iy * MAXY_TABLE_SIZE) + ix];
+    const float * row1 = row0 + MAXY_TABLE_SIZE;
+    float top = row0[0] + ((row0[1] - row0[0]) * dx);
+    float bottom = row1[0] + ((row1[1] - row1[0]) * dx);
+    return top + ((bottom - top) * dy);
 }
 
-static float calcOverbright(clContext * C, float x, float y, float Y, float overbrightScale, clTransform * fromXYZ, clTransform * toXYZ)
+static float calcOverbright(float x, float y, float Y, float overbrightScale, const float * maxYTable)
 {
     // Even at 10,000 nits, this is only 1 nit difference. If its less than this, we're not over.
     static const float REASONABLY_OVERBRIGHT = 0.0001f;
 
-    float maxY = calcMaxY(C, x, y, fromXYZ, toXYZ);
+    float maxY = clReportLookupMaxY(maxYTable, x, y);
     float p = (Y / maxY) * overbrightScale;
     if (p > (1.0f + REASONABLY_OVERBRIGHT)) {
         p = (p - 1.0f) / (overbrightScale - 1.0f);
@@ -63,45 +122,69 @@ static float calcOverbright(clContext * C, float x, float y, float Y, float over
     return 0.0f;
 }
 
-static void calcGamutDistances(float x, float y, const clProfilePrimaries * primaries, float outDistances[3])
+// Each gamut edge (RG, GB, RB) as a line a*x + b*y + c, normalized so that it gives the signed
+// distance of an xy chromaticity from that edge. Computed once per gamut, not per pixel.
+typedef struct GamutEdges
 {
-    float rX = primaries->red[0];
-    float rY = primaries->red[1];
-    float gX = primaries->green[0];
-    float gY = primaries->green[1];
-    float bX = primaries->blue[0];
-    float bY = primaries->blue[1];
-
-    float distBetweenRG = sqrtf(((rY - gY) * (rY - gY)) + ((rX - gX) * (rX - gX)));
-    float distBetweenGB = sqrtf(((gY - bY) * (gY - bY)) + ((gX - bX) * (gX - bX)));
-    float distBetweenRB = sqrtf(((rY - bY) * (rY - bY)) + ((rX - bX) * (rX - bX)));
-    float distFromRGEdge = ((x * (gY - rY)) - (y * (gX - rX)) + (gX * rY) - (gY * rX)) / distBetweenRG;
-    float distFromGBEdge = ((x * (bY - gY)) - (y * (bX - gX)) + (bX * gY) - (bY * gX)) / distBetweenGB;
-    float distFromRBEdge = ((x * (rY - bY)) - (y * (rX - bX)) + (rX * bY) - (rY * bX)) / distBetweenRB;
-
-    outDistances[0] = distFromRGEdge;
-    outDistances[1] = distFromGBEdge;
-    outDistances[2] = distFromRBEdge;
+    float a[3];
+    float b[3];
+    float c[3];
+} GamutEdges;
+
+static void calcGamutEdges(const clProfilePrimaries * primaries, GamutEdges * edges)
+{
+    const float * from[3] = { primaries->red, primaries->green, primaries->blue };
+    const float * to[3] = { primaries->green, primaries->blue, primaries->red };
+    int i;
+
+    for (i = 0; i < 3; ++i) {
+        float dX = to[i][0] - from[i][0];
+        float dY = to[i][1] - from[i][1];
+        float dist = sqrtf((dY * dY) + (dX * dX));
+        edges->a[i] = dY / dist;
+        edges->b[i] = -dX / dist;
+        edges->c[i] = ((to[i][0] * from[i][1]) - (to[i][1] * from[i][0])) / dist;
+    }
 }
 
-static float calcOutofSRGB(clContext * C, float x, float y, clProfilePrimaries * primaries)
+static void calcGamutDistances(float x, float y, const GamutEdges * edges, float outDistances[3])
 {
-    COLORIST_UNUSED(C);
+    int i;
+    for (i = 0; i < 3; ++i) {
+        outDistances[i] = (edges->a[i] * x) + (edges->b[i] * y) + edges->c[i];
+    }
+}
+
+typedef struct HighlightGamut
+{
+    clBool isSRGB; // the source is (probably) sRGB already, so nothing is out of it
+    GamutEdges gamutEdges;
+    GamutEdges srgbEdges;
+} HighlightGamut;
 
+static void calcHighlightGamut(const clProfilePrimaries * primaries, HighlightGamut * gamut)
+{
     static const clProfilePrimaries srgbPrimaries = { { 0.64f, 0.33f }, { 0.30f, 0.60f }, { 0.15f, 0.06f }, { 0.3127f, 0.3290f } };
 
+    gamut->isSRGB = (fabsf(srgbPrimaries.green[1] - primaries->green[1]) < 0.0001f) ? clTrue : clFalse;
+    calcGamutEdges(primaries, &gamut->gamutEdges);
+    calcGamutEdges(&srgbPrimaries, &gamut->srgbEdges);
+}
+
+static float calcOutofSRGB(float x, float y, const HighlightGamut * gamut)
+{
     float gamutDistances[3];
     float srgbDistances[3];
     float srgbMaxDist, gamutMaxDist = 0.0f, totalDist, ratio;
     int i;
 
-    if (fabsf(srgbPrimaries.green[1] - primaries->green[1]) < 0.0001f) {
+    if (gamut->isSRGB) {
         // We're probably in sRGB, just say we're in-gamut
         return 0;
     }
 
-    calcGamutDistances(x, y, primaries, gamutDistances);
-    calcGamutDistances(x, y, &srgbPrimaries, srgbDistances);
+    calcGamutDistances(x, y, &gamut->gamutEdges, gamutDistances);
+    calcGamutDistances(x, y, &gamut->srgbEdges, srgbDistances);
 
     srgbMaxDist = srgbDistances[0];
     for (i = 0; i < 3; ++i) {
@@ -140,55 +223,31 @@ static uint8_t intensityToU8(float intensity)
     return (uint8_t)intensity;
 }
 
-typedef struct SRGBHighlightStats
+// One band of highlight pixels; stats are only for this band, and merged in order afterwards
+typedef struct SRGBHighlightTask
 {
-    int overbrightPixelCount;
-    int outOfGamutPixelCount;
-    int bothPixelCount; // overbright + out-of-gamut
-    int hdrPixelCount;  // the sum of the above values
+    const float * xyzPixels;
+    uint8_t * dstPixels;
+    int firstPixel;
     int pixelCount;
-    int brightestPixelX;
-    int brightestPixelY;
-    float brightestPixelNits;
-} SRGBHighlightStats;
+    int imageWidth;
+    int srcLuminance;
+    float luminanceScale;
+    float overbrightScale;
+    const float * maxYTable;
+    const HighlightGamut * gamut;
+    clSRGBHighlightStats stats;
+} SRGBHighlightTask;
 
-static clImage * createSRGBHighlight(clContext * C, clImage * srcImage, int srgbLuminance, SRGBHighlightStats * stats)
+static void highlightTaskFunc(SRGBHighlightTask * info)
 {
     const float minHighlight = 0.4f;
-    float luminanceScale;
-    float overbrightScale;
-    float * srcFloats;
-    clProfilePrimaries srcPrimaries;
-    clProfileCurve srcCurve;
-    int srcLuminance = 0;
-    float * xyzPixels;
-    int pixelCount = 0;
-    clImage * highlight = NULL;
+    clSRGBHighlightStats * stats = &info->stats;
     int i;
 
-    clTransform * toXYZ = clTransformCreate(C, srcImage->profile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
-    clTransform * fromXYZ = clTransformCreate(C, NULL, CL_XF_XYZ, 32, srcImage->profile, CL_XF_RGB, 32, CL_TONEMAP_OFF);
-
-    clContextLog(C, "encode", 1, "Creating sRGB highlight (%d nits, %s)...", srgbLuminance, clTransformCMMName(C, toXYZ));
-
-    memset(stats, 0, sizeof(SRGBHighlightStats));
-    stats->pixelCount = pixelCount = srcImage->width * srcImage->height;
-
-    clProfileQuery(C, srcImage->profile, &srcPrimaries, &srcCurve, &srcLuminance);
-    srcLuminance = (srcLuminance != 0) ? srcLuminance : COLORIST_DEFAULT_LUMINANCE;
-
-    srcFloats = clAllocate(4 * sizeof(float) * pixelCount);
-    clPixelMathUNormToFloat(C, srcImage->pixels, srcImage->depth, srcFloats, pixelCount);
-
-    xyzPixels = clAllocate(3 * sizeof(float) * pixelCount);
-    clTransformRun(C, toXYZ, C->params.jobs, (uint8_t *)srcFloats, (uint8_t *)xyzPixels, pixelCount);
-
-    highlight = clImageCreate(C, srcImage->width, srcImage->height, 8, NULL);
-    luminanceScale = (float)srcLuminance / 300.0f;
-    overbrightScale = (float)srcLuminance / (float)srgbLuminance * srcCurve.implicitScale;
-    for (i = 0; i < pixelCount; ++i) {
-        float * srcXYZ = &xyzPixels[i * 3];
-        uint8_t * dstPixel = &highlight->pixels[i * 4];
+    for (i = 0; i < info->pixelCount; ++i) {
+        const float * srcXYZ = &info->xyzPixels[i * 3];
+        uint8_t * dstPixel = &info->dstPixels[i * 4];
         float baseIntensity;
         uint8_t intensity8;
         float overbright, outOfSRGB;
@@ -210,16 +269,16 @@ static clImage * createSRGBHighlight(clContext * C, clImage * srcImage, int srgb
         pixelNits = (float)xyY.Y;
         if (stats->brightestPixelNits < pixelNits) {
             stats->brightestPixelNits = pixelNits;
-            stats->brightestPixelX = i % srcImage->width;
-            stats->brightestPixelY = i / srcImage->width;
+            stats->brightestPixelX = (info->firstPixel + i) % info->imageWidth;
+            stats->brightestPixelY = (info->firstPixel + i) / info->imageWidth;
         }
 
-        baseIntensity = luminanceScale * (float)xyY.Y / (float)srcLuminance;
+        baseIntensity = info->luminanceScale * (float)xyY.Y / (float)info->srcLuminance;
         baseIntensity = CL_CLAMP(baseIntensity, 0.0f, 1.0f);
         intensity8 = intensityToU8(baseIntensity);
 
-        overbright = calcOverbright(C, (float)xyY.x, (float)xyY.y, (float)xyY.Y, overbrightScale, fromXYZ, toXYZ);
-        outOfSRGB = calcOutofSRGB(C, (float)xyY.x, (float)xyY.y, &srcPrimaries);
+        overbright = calcOverbright((float)xyY.x, (float)xyY.y, (float)xyY.Y, info->overbrightScale, info->maxYTable);
+        outOfSRGB = calcOutofSRGB((float)xyY.x, (float)xyY.y, info->gamut);
 
         if ((overbright > 0.0f) && (outOfSRGB > 0.0f)) {
             float biggerHighlight = (overbright > outOfSRGB) ? overbright : outOfSRGB;
@@ -251,34 +310,212 @@ static clImage * createSRGBHighlight(clContext * C, clImage * srcImage, int srgb
         }
         dstPixel[3] = 255;
     }
+}
+
+clImage * clReportCreateSRGBHighlight(clContext * C, clImage * srcImage, int srgbLuminance, int taskCount, clSRGBHighlightStats * stats)
+{
+    float * srcFloats;
+    clProfilePrimaries srcPrimaries;
+    clProfileCurve srcCurve;
+    HighlightGamut gamut;
+    int srcLuminance = 0;
+    float * xyzPixels;
+    float * maxYTable;
+    int pixelCount = 0;
+    clImage * highlight = NULL;
+    int slicePixels, sliceCount;
+    SRGBHighlightTask * infos;
+    int i;
+
+    clTransform * toXYZ = clTransformCreate(C, srcImage->profile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
+    clTransform * fromXYZ = clTransformCreate(C, NULL, CL_XF_XYZ, 32, srcImage->profile, CL_XF_RGB, 32, CL_TONEMAP_OFF);
+
+    clContextLog(C, "encode", 1, "Creating sRGB highlight (%d nits, %s)...", srgbLuminance, clTransformCMMName(C, toXYZ));
+
+    memset(stats, 0, sizeof(clSRGBHighlightStats));
+    stats->pixelCount = pixelCount = srcImage->width * srcImage->height;
+
+    clProfileQuery(C, srcImage->profile, &srcPrimaries, &srcCurve, &srcLuminance);
+    srcLuminance = (srcLuminance != 0) ? srcLuminance : COLORIST_DEFAULT_LUMINANCE;
+    calcHighlightGamut(&srcPrimaries, &gamut);
+
+    srcFloats = clAllocate(4 * sizeof(float) * pixelCount);
+    clPixelMathUNormToFloat(C, srcImage->pixels, srcImage->depth, srcFloats, pixelCount);
+
+    xyzPixels = clAllocate(3 * sizeof(float) * pixelCount);
+    clTransformRun(C, toXYZ, taskCount, (uint8_t *)srcFloats, (uint8_t *)xyzPixels, pixelCount);
+
+    maxYTable = clReportCreateMaxYTable(C, fromXYZ, toXYZ, taskCount);
+
+    highlight = clImageCreate(C, srcImage->width, srcImage->height, 8, NULL);
+
+    if (taskCount < 1) {
+        taskCount = 1;
+    }
+    if (taskCount > pixelCount) {
+        taskCount = pixelCount;
+    }
+    slicePixels = (pixelCount + taskCount - 1) / taskCount;
+    sliceCount = (pixelCount + slicePixels - 1) / slicePixels;
+    infos = clAllocate(sliceCount * sizeof(SRGBHighlightTask));
+    for (i = 0; i < sliceCount; ++i) {
+        SRGBHighlightTask * info = &infos[i];
+        info->firstPixel = i * slicePixels;
+        info->pixelCount = ((pixelCount - info->firstPixel) < slicePixels) ? (pixelCount - info->firstPixel) : slicePixels;
+        info->xyzPixels = &xyzPixels[(size_t)info->firstPixel * 3];
+        info->dstPixels = &highlight->pixels[(size_t)info->firstPixel * 4];
+        info->imageWidth = srcImage->width;
+        info->srcLuminance = srcLuminance;
+        info->luminanceScale = (float)srcLuminance / 300.0f;
+        info->overbrightScale = (float)srcLuminance / (float)srgbLuminance * srcCurve.implicitScale;
+        info->maxYTable = maxYTable;
+        info->gamut = &gamut;
+        memset(&info->stats, 0, sizeof(clSRGBHighlightStats));
+    }
+    if (sliceCount == 1) {
+        highlightTaskFunc(&infos[0]);
+    } else {
+        clTaskPool * pool = clContextTaskPool(C, sliceCount);
+        clTaskBatch batch;
+        clTask * tasks = clAllocate(sliceCount * sizeof(clTask));
+        clContextLog(C, "encode", 1, "Using %d threads to highlight.", sliceCount);
+        clTaskBatchInit(&batch, sliceCount);
+        for (i = 0; i < sliceCount; ++i) {
+            clTaskPoolSubmit(C, pool, &batch, &tasks[i], (clTaskFunc)highlightTaskFunc, &infos[i]);
+        }
+        clTaskPoolWait(C, pool, &batch);
+        clFree(tasks);
+    }
+
+    // Merge in order, so the brightest pixel is the first one found, as if it had been a single pass
+    for (i = 0; i < sliceCount; ++i) {
+        const clSRGBHighlightStats * sliceStats = &infos[i].stats;
+        stats->overbrightPixelCount += sliceStats->overbrightPixelCount;
+        stats->outOfGamutPixelCount += sliceStats->outOfGamutPixelCount;
+        stats->bothPixelCount += sliceStats->bothPixelCount;
+        if (stats->brightestPixelNits < sliceStats->brightestPixelNits) {
+            stats->brightestPixelNits = sliceStats->brightestPixelNits;
+            stats->brightestPixelX = sliceStats->brightestPixelX;
+            stats->brightestPixelY = sliceStats->brightestPixelY;
+        }
+    }
     stats->hdrPixelCount = stats->bothPixelCount + stats->overbrightPixelCount + stats->outOfGamutPixelCount;
+    clFree(infos);
 
     clTransformDestroy(C, fromXYZ);
     clTransformDestroy(C, toXYZ);
     clFree(srcFloats);
     clFree(xyzPixels);
+    clFree(maxYTable);
     return highlight;
 }
 
-static clBool addSRGBHighlight(clContext * C, clImage * image, int maxLuminance, cJSON * payload, const char * name)
+// ----------------------------------------------------------------------------
+// Report output
+//
+// The payload is streamed into the template as it is produced: small fields are built as cJSON
+// objects and printed, while raw pixels and PNG visuals are deflated and/or base64 encoded
+// straight into the file, so no copy of the full payload is ever held in memory.
+
+typedef struct ReportWriter
+{
+    clContext * C;
+    FILE * f;
+    clBool failed;
+} ReportWriter;
+
+static clBool reportWrite(void * userData, const uint8_t * data, size_t size)
+{
+    ReportWriter * writer = (ReportWriter *)userData;
+    if (!writer->failed && size && (fwrite(data, size, 1, writer->f) != 1)) {
+        clContextLogError(writer->C, "Failed to write report: %s", writer->C->outputFilename);
+        writer->failed = clTrue;
+    }
+    return !writer->failed;
+}
+
+static clBool reportWriteString(ReportWriter * writer, const char * text)
+{
+    return reportWrite(writer, (const uint8_t *)text, strlen(text));
+}
+
+// Writes the members of a (small) object without its braces, and destroys it
+static clBool reportWriteMembers(ReportWriter * writer, cJSON * object)
+{
+    clBool ret = clTrue;
+    char * text = cJSON_PrintUnformatted(object);
+    cJSON_Delete(object);
+    if (!text) {
+        clContextLogError(writer->C, "failed to create payload string!");
+        return clFalse;
+    }
+    size_t textLen = strlen(text);
+    if (textLen > 2) {
+        ret = reportWrite(writer, (const uint8_t *)(text + 1), textLen - 2);
+    }
+    cJSON_free(text);
+    return ret;
+}
+
+// Writes raw as a base64 JSON string (after prefix, if any), deflating it first if asked to
+static clBool reportWriteBase64(ReportWriter * writer, const char * prefix, const clRaw * raw, clBool deflate)
+{
+    clRawBase64Stream stream;
+
+    if (!reportWriteString(writer, "\"") || (prefix && !reportWriteString(writer, prefix))) {
+        return clFalse;
+    }
+    clRawBase64StreamStart(&stream, reportWrite, writer);
+    if (deflate) {
+        if (!clRawDeflateStream(writer->C, raw, clRawBase64StreamWrite, &stream)) {
+            return clFalse;
+        }
+    } else if (!clRawBase64StreamWrite(&stream, raw->ptr, raw->size)) {
+        return clFalse;
+    }
+    if (!clRawBase64StreamFinish(&stream)) {
+        return clFalse;
+    }
+    return reportWriteString(writer, "\"");
+}
+
+// Writes image as a PNG data URI string
+static clBool reportWriteVisual(ReportWriter * writer, clImage * image)
 {
+    clContext * C = writer->C;
+    clFormat * format = clContextFindFormat(C, "png");
+    clWriteParams writeParams;
+    clRaw png = CL_RAW_EMPTY;
+    char prefix[512];
+    clBool ret;
+
+    COLORIST_ASSERT(format && format->writeFunc);
+    writeParams.quality = 0;
+    writeParams.rate = 0;
+    if (!format->writeFunc(C, image, "png", &png, &writeParams)) {
+        clRawFree(C, &png);
+        return clFalse;
+    }
+    sprintf(prefix, "data:%s;base64,", format->mimeType);
+    ret = reportWriteBase64(writer, prefix, &png, clFalse);
+    clRawFree(C, &png);
+    return ret;
+}
+
+static clBool writeSRGBHighlight(ReportWriter * writer, clImage * image, int maxLuminance, const char * name)
+{
+    clContext * C = writer->C;
     clImage * highlight;
-    char * pngB64;
-    SRGBHighlightStats stats;
+    clSRGBHighlightStats stats;
     cJSON * base;
+    char key[64];
 
-    highlight = createSRGBHighlight(C, image, maxLuminance, &stats);
+    highlight = clReportCreateSRGBHighlight(C, image, maxLuminance, C->params.jobs, &stats);
     if (!highlight) {
         return clFalse;
     }
-    pngB64 = clContextWriteURI(C, highlight, "png", 0, 0);
-    clImageDestroy(C, highlight);
-    if (!pngB64) {
-        return clFalse;
-    }
 
     base = cJSON_CreateObject();
-    cJSON_AddItemToObject(base, "visual", cJSON_CreateString(pngB64));
     cJSON_AddItemToObject(base, "overbrightPixelCount", cJSON_CreateNumber(stats.overbrightPixelCount));
     cJSON_AddItemToObject(base, "outOfGamutPixelCount", cJSON_CreateNumber(stats.outOfGamutPixelCount));
     cJSON_AddItemToObject(base, "bothPixelCount", cJSON_CreateNumber(stats.bothPixelCount));
@@ -287,37 +524,48 @@ static clBool addSRGBHighlight(clContext * C, clImage * image, int maxLuminance,
     cJSON_AddItemToObject(base, "brightestPixelX", cJSON_CreateNumber(stats.brightestPixelX));
     cJSON_AddItemToObject(base, "brightestPixelY", cJSON_CreateNumber(stats.brightestPixelY));
     cJSON_AddItemToObject(base, "brightestPixelNits", cJSON_CreateNumber(stats.brightestPixelNits));
-    cJSON_AddItemToObject(payload, name, base);
-    clFree(pngB64);
+
+    sprintf(key, ",\"%s\":{", name);
+    if (!reportWriteString(writer, key) || !reportWriteMembers(writer, base) || !reportWriteString(writer, ",\"visual\":") || !reportWriteVisual(writer, highlight)
+        || !reportWriteString(writer, "}")) {
+        clImageDestroy(C, highlight);
+        return clFalse;
+    }
+    clImageDestroy(C, highlight);
     return clTrue;
 }
 
-static clBool reportBasicInfo(clContext * C, clImage * image, cJSON * payload)
+// Everything small about the image: checked and built before anything is written
+static cJSON * reportBasicInfo(clContext * C, clImage * image)
 {
-    Timer t;
     clProfilePrimaries primaries;
     clProfileCurve curve;
     int maxLuminance;
+    cJSON * payload;
     cJSON * jsonICC;
     cJSON * jsonPrimaries;
     char * text;
     char * rawProfileB64;
 
-    jsonICC = cJSON_CreateObject();
-    cJSON_AddItemToObject(payload, "icc", jsonICC);
-
     if (!clProfileQuery(C, image->profile, &primaries, &curve, &maxLuminance)) {
-        return clFalse;
+        return NULL;
     }
 
+    payload = cJSON_CreateObject();
+    cJSON_AddItemToObject(payload, "filename", cJSON_CreateString(C->inputFilename));
+    jsonICC = cJSON_CreateObject();
+    cJSON_AddItemToObject(payload, "icc", jsonICC);
+
     clRaw rawProfile = CL_RAW_EMPTY;
     if (!clProfilePack(C, image->profile, &rawProfile)) {
-        return clFalse;
+        cJSON_Delete(payload);
+        return NULL;
     }
     rawProfileB64 = clRawToBase64(C, &rawProfile);
     if (!rawProfileB64) {
         clRawFree(C, &rawProfile);
-        return clFalse;
+        cJSON_Delete(payload);
+        return NULL;
     }
     cJSON_AddItemToObject(jsonICC, "raw", cJSON_CreateString(rawProfileB64));
     clRawFree(C, &rawProfile);
@@ -327,46 +575,103 @@ static clBool reportBasicInfo(clContext * C, clImage * image, cJSON * payload)
     cJSON_AddItemToObject(payload, "height", cJSON_CreateNumber(image->height));
     cJSON_AddItemToObject(payload, "depth", cJSON_CreateNumber(image->depth));
 
+    text = clProfileGetMLU(C, image->profile, "desc", "en", "US");
+    if (text == NULL) {
+        text = clContextStrdup(C, "Unknown");
+    }
+    cJSON_AddItemToObject(jsonICC, "description", cJSON_CreateString(text));
+    clFree(text);
+
+    if (clProfileHasPQSignature(C, image->profile, &primaries)) {
+        curve.gamma = 0.0f;
+        maxLuminance = 10000;
+        cJSON_AddItemToObject(jsonICC, "pq", cJSON_CreateBool(clTrue));
+    } else {
+        // Check for profiles that we can't make valid reports for
+        if (curve.type != CL_PCT_GAMMA) {
+            clContextLogError(C, "Can't create report: the supplied tone curve can't be interpreted by current report JS");
+            cJSON_Delete(payload);
+            return NULL;
+        }
+    }
+
+    jsonPrimaries = cJSON_CreateArray();
     {
-        char * channelFormat = "u8";
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.red[0]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.red[1]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.green[0]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.green[1]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.blue[0]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.blue[1]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.white[0]));
+        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.white[1]));
+    }
+
+    cJSON_AddItemToObject(jsonICC, "primaries", jsonPrimaries);
+    cJSON_AddItemToObject(jsonICC, "gamma", cJSON_CreateNumber(curve.gamma));
+    cJSON_AddItemToObject(jsonICC, "luminance", cJSON_CreateNumber(maxLuminance));
+    return payload;
+}
+
+// Streams the payload object, starting with the (already built) basic info
+static clBool reportWritePayload(ReportWriter * writer, clImage * image, cJSON * basicInfo)
+{
+    clContext * C = writer->C;
+    Timer t;
+
+    if (!reportWriteString(writer, "{")) {
+        cJSON_Delete(basicInfo);
+        return clFalse;
+    }
+    if (!reportWriteMembers(writer, basicInfo)) {
+        return clFalse;
+    }
+
+    {
+        const char * channelFormat = (image->depth > 8) ? "u16" : "u8";
+        static const char * channelNames[4] = { "r", "g", "b", "a" };
+        cJSON * rawInfo = cJSON_CreateObject();
+        cJSON * jsonSchema = cJSON_CreateArray();
         clRaw rawPixels;
-        clStructArraySchema imageSchema[4];
-        if (image->depth > 8) {
-            channelFormat = "u16";
+        int i;
+
+        cJSON_AddItemToObject(rawInfo, "width", cJSON_CreateNumber(image->width));
+        cJSON_AddItemToObject(rawInfo, "height", cJSON_CreateNumber(image->height));
+        cJSON_AddItemToObject(rawInfo, "schema", jsonSchema);
+        for (i = 0; i < 4; ++i) {
+            cJSON * jsonEntry = cJSON_CreateObject();
+            cJSON_AddItemToObject(jsonEntry, "format", cJSON_CreateString(channelFormat));
+            cJSON_AddItemToObject(jsonEntry, "name", cJSON_CreateString(channelNames[i]));
+            cJSON_AddItemToArray(jsonSchema, jsonEntry);
         }
-        imageSchema[0].format = channelFormat;
-        imageSchema[0].name = "r";
-        imageSchema[1].format = channelFormat;
-        imageSchema[1].name = "g";
-        imageSchema[2].format = channelFormat;
-        imageSchema[2].name = "b";
-        imageSchema[3].format = channelFormat;
-        imageSchema[3].name = "a";
+
         rawPixels.ptr = image->pixels;
         rawPixels.size = image->size;
+        rawPixels.mapped = clFalse;
         clContextLog(C, "encode", 0, "Packing raw pixels...");
         timerStart(&t);
-        cJSON_AddItemToObject(payload, "raw", clRawToStructArray(C, &rawPixels, image->width, image->height, imageSchema, 4));
+        if (!reportWriteString(writer, ",\"raw\":{") || !reportWriteMembers(writer, rawInfo) || !reportWriteString(writer, ",\"data\":")
+            || !reportWriteBase64(writer, NULL, &rawPixels, clTrue) || !reportWriteString(writer, "}")) {
+            return clFalse;
+        }
         clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
     }
 
     {
         clImage * visual;
-        char * pngB64;
+        clBool written;
         clContextLog(C, "encode", 0, "Creating raw pixels visual...");
         timerStart(&t);
-        visual = clImageConvert(C, image, C->params.jobs, image->width, image->height, 8, NULL, CL_TONEMAP_AUTO);
+        visual = clImageConvert(C, image, C->params.jobs, image->width, image->height, 8, NULL, CL_TONEMAP_AUTO, 0, NULL, 0);
         if (!visual) {
             return clFalse;
         }
         clContextLog(C, "encode", 1, "Generating Base64 encoded PNG...");
-        pngB64 = clContextWriteURI(C, visual, "png", 0, 0);
+        written = reportWriteString(writer, ",\"visual\":") && reportWriteVisual(writer, visual);
         clImageDestroy(C, visual);
-        if (!pngB64) {
+        if (!written) {
             return clFalse;
         }
-        cJSON_AddItemToObject(payload, "visual", cJSON_CreateString(pngB64));
-        clFree(pngB64);
         clContextLog(C, "encode", 0, "Visual generation complete.");
         clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
     }
@@ -375,10 +680,10 @@ static clBool reportBasicInfo(clContext * C, clImage * image, cJSON * payload)
         clContextLog(C, "encode", 0, "Creating out-of-gamut highlights...");
         timerStart(&t);
 
-        // if (!addSRGBHighlight(C, image, 100, payload, "srgb100")) {
+        // if (!writeSRGBHighlight(writer, image, 100, "srgb100")) {
         //     return clFalse;
         // }
-        if (!addSRGBHighlight(C, image, 300, payload, "srgb300")) {
+        if (!writeSRGBHighlight(writer, image, 300, "srgb300")) {
             return clFalse;
         }
 
@@ -386,41 +691,7 @@ static clBool reportBasicInfo(clContext * C, clImage * image, cJSON * payload)
         clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
     }
 
-    text = clProfileGetMLU(C, image->profile, "desc", "en", "US");
-    if (text == NULL) {
-        text = clContextStrdup(C, "Unknown");
-    }
-    cJSON_AddItemToObject(jsonICC, "description", cJSON_CreateString(text));
-    clFree(text);
-
-    if (clProfileHasPQSignature(C, image->profile, &primaries)) {
-        curve.gamma = 0.0f;
-        maxLuminance = 10000;
-        cJSON_AddItemToObject(jsonICC, "pq", cJSON_CreateBool(clTrue));
-    } else {
-        // Check for profiles that we can't make valid reports for
-        if (curve.type != CL_PCT_GAMMA) {
-            clContextLogError(C, "Can't create report: the supplied tone curve can't be interpreted by current report JS");
-            return clFalse;
-        }
-    }
-
-    jsonPrimaries = cJSON_CreateArray();
-    {
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.red[0]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.red[1]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.green[0]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.green[1]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.blue[0]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.blue[1]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.white[0]));
-        cJSON_AddItemToArray(jsonPrimaries, cJSON_CreateNumber(primaries.white[1]));
-    }
-
-    cJSON_AddItemToObject(jsonICC, "primaries", jsonPrimaries);
-    cJSON_AddItemToObject(jsonICC, "gamma", cJSON_CreateNumber(curve.gamma));
-    cJSON_AddItemToObject(jsonICC, "luminance", cJSON_CreateNumber(maxLuminance));
-    return clTrue;
+    return reportWriteString(writer, "}");
 }
 
 int clContextReport(clContext * C)
@@ -429,9 +700,13 @@ int clContextReport(clContext * C)
     int returnCode = 0;
 
     clImage * image = NULL;
+    cJSON * basicInfo = NULL;
+    ReportWriter writer;
+    clBool outputOpened = clFalse;
 
-    cJSON * payload = cJSON_CreateObject();
-    FILE * outf = NULL;
+    writer.C = C;
+    writer.f = NULL;
+    writer.failed = clFalse;
 
     clContextLog(C, "action", 0, "Report: %s -> %s", C->inputFilename, C->outputFilename);
     timerStart(&overall);
@@ -445,22 +720,18 @@ int clContextReport(clContext * C)
     clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
 
     // Basic Info
-    {
-        timerStart(&t);
-        cJSON_AddItemToObject(payload, "filename", cJSON_CreateString(C->inputFilename));
-        if (!reportBasicInfo(C, image, payload)) {
-            FAIL();
-        }
+    basicInfo = reportBasicInfo(C, image);
+    if (!basicInfo) {
+        FAIL();
     }
 
-    timerStart(&t);
     {
         static const char payloadPrefix[] = "var COLORIST_DATA = ";
         static const char coloristDataMarker[] = "__COLORIST_DATA__";
         const char * coloristDataInjectLoc = strstr((const char *)reportTemplateBinaryData, coloristDataMarker);
         const char * afterPtr;
-        size_t beforeLen, afterLen;
-        char * payloadString;
+        size_t beforeLen;
+        cJSON * payloadInfo = basicInfo;
         if (!coloristDataInjectLoc) {
             clContextLogError(C, "Template does not contain the string \"%s\", bailing out", coloristDataMarker);
             FAIL();
@@ -468,26 +739,26 @@ int clContextReport(clContext * C)
 
         beforeLen = (coloristDataInjectLoc - (const char *)reportTemplateBinaryData);
         afterPtr = coloristDataInjectLoc + strlen(coloristDataMarker);
-        afterLen = strlen(afterPtr);
 
-        outf = fopen(C->outputFilename, "wb");
-        if (!outf) {
+        writer.f = fopen(C->outputFilename, "wb");
+        if (!writer.f) {
             clContextLogError(C, "Cant open report file for write: %s", C->outputFilename);
             FAIL();
         }
+        outputOpened = clTrue;
 
-        payloadString = cJSON_Print(payload);
-        if (!payloadString) {
-            clContextLogError(C, "failed to create payload string!");
+        timerStart(&t);
+        basicInfo = NULL; // reportWritePayload() owns it now
+        if (!reportWrite(&writer, reportTemplateBinaryData, beforeLen) || !reportWriteString(&writer, payloadPrefix) || !reportWritePayload(&writer, image, payloadInfo)
+            || !reportWriteString(&writer, afterPtr)) {
             FAIL();
         }
-
-        fwrite(reportTemplateBinaryData, beforeLen, 1, outf);
-        fwrite(payloadPrefix, strlen(payloadPrefix), 1, outf);
-        fwrite(payloadString, strlen(payloadString), 1, outf);
-        fwrite(afterPtr, afterLen, 1, outf);
-        fclose(outf);
-        outf = NULL;
+        if (fclose(writer.f) != 0) {
+            writer.f = NULL;
+            clContextLogError(C, "Failed to write report file: %s", C->outputFilename);
+            FAIL();
+        }
+        writer.f = NULL;
     }
 
     clContextLog(C, "encode", 1, "Wrote %d bytes.", clFileSize(C->outputFilename));
@@ -497,9 +768,14 @@ reportCleanup:
     if (image)
         clImageDestroy(C, image);
 
-    cJSON_Delete(payload);
-    if (outf)
-        fclose(outf);
+    if (basicInfo)
+        cJSON_Delete(basicInfo);
+    if (writer.f)
+        fclose(writer.f);
+    if (returnCode && outputOpened) {
+        // Don't leave a truncated report behind
+        remove(C->outputFilename);
+    }
 
     if (returnCode == 0) {
         clContextLog(C, "action", 0, "Conversion complete.");
@@ -0,0 +1,39 @@
+// ---------------------------------------------------------------------------
+//                         Copyright Joe Drago 2018.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+// Internal to context_report.c (and its tests): the sRGB highlight behind every report
+
+#ifndef COLORIST_CONTEXT_REPORT_H
+#define COLORIST_CONTEXT_REPORT_H
+
+#include "colorist/context.h"
+
+struct clImage;
+struct clTransform;
+
+// Max Y of every xy chromaticity a profile can reach, sampled on a grid (see MAXY_TABLE_SIZE).
+// fromXYZ is XYZ -> RGB and toXYZ is RGBA -> XYZ, both 32-bit and through the same profile.
+float * clReportCreateMaxYTable(clContext * C, struct clTransform * fromXYZ, struct clTransform * toXYZ, int taskCount); // clFree() it
+float clReportLookupMaxY(const float * maxYTable, float x, float y);                                                   // Bilinear
+
+typedef struct clSRGBHighlightStats
+{
+    int overbrightPixelCount;
+    int outOfGamutPixelCount;
+    int bothPixelCount; // overbright + out-of-gamut
+    int hdrPixelCount;  // the sum of the above values
+    int pixelCount;
+    int brightestPixelX;
+    int brightestPixelY;
+    float brightestPixelNits;
+} clSRGBHighlightStats;
+
+// Marks every pixel of srcImage which is overbright and/or out of gamut for an sRGB display of
+// srgbLuminance nits. The result is the same for any taskCount.
+struct clImage * clReportCreateSRGBHighlight(clContext * C, struct clImage * srcImage, int srgbLuminance, int taskCount, clSRGBHighlightStats * stats);
+
+#endif // ifndef COLORIST_CONTEXT_REPORT_H
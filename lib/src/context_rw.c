@@ -12,6 +12,21 @@
 
 #include <string.h>
 
+// Takes ownership of image
+static clImage * applyICCOverride(clContext * C, clImage * image, const char * iccOverride)
+{
+    clProfile * overrideProfile = clProfileRead(C, iccOverride);
+    if (!overrideProfile) {
+        clContextLogError(C, "Bad ICC override file [-i]: %s", iccOverride);
+        clImageDestroy(C, image);
+        return NULL;
+    }
+    clContextLog(C, "profile", 1, "Overriding src profile with file: %s", iccOverride);
+    clProfileDestroy(C, image->profile);
+    image->profile = overrideProfile; // take ownership
+    return image;
+}
+
 struct clImage * clContextRead(clContext * C, const char * filename, const char * iccOverride, const char ** outFormatName)
 {
     clImage * image = NULL;
@@ -37,22 +52,189 @@ struct clImage * clContextRead(clContext * C, const char * filename, const char
     }
 
     if (image && iccOverride) {
-        clProfile * overrideProfile = clProfileRead(C, iccOverride);
-        if (overrideProfile) {
-            clContextLog(C, "profile", 1, "Overriding src profile with file: %s", iccOverride);
-            clProfileDestroy(C, image->profile);
-            image->profile = overrideProfile; // take ownership
-        } else {
-            clContextLogError(C, "Bad ICC override file [-i]: %s", iccOverride);
-            clImageDestroy(C, image);
-            image = NULL;
+        image = applyICCOverride(C, image, iccOverride);
+    }
+
+    clRawFree(C, &input);
+    return image;
+}
+
+// Only the rows up to the end of the rect are decoded, and only the rect is kept
+static clImage * readRegionRows(clContext * C, clRowReader * reader, int x, int y, int w, int h)
+{
+    clImage * image;
+    clBool ok = clTrue;
+    int pixelBytes = clDepthToBytes(C, reader->depth) * 4;
+    uint8_t * row;
+
+    clImageAdjustRectForSize(C, reader->width, reader->height, &x, &y, &w, &h);
+    row = clAllocate((size_t)pixelBytes * reader->width);
+    if (reader->skipRowsFunc) {
+        ok = reader->skipRowsFunc(C, reader, y);
+    } else {
+        for (int j = 0; ok && (j < y); ++j) {
+            ok = reader->readRowsFunc(C, reader, row, 1);
+        }
+    }
+
+    image = clImageCreate(C, w, h, reader->depth, reader->profile);
+    for (int j = 0; ok && (j < h); ++j) {
+        ok = reader->readRowsFunc(C, reader, row, 1);
+        memcpy(&image->pixels[(size_t)pixelBytes * w * j], &row[(size_t)pixelBytes * x], (size_t)pixelBytes * w);
+    }
+    clFree(row);
+    if (!ok) {
+        clImageDestroy(C, image);
+        image = NULL;
+    }
+    return image;
+}
+
+struct clImage * clContextReadRegion(clContext * C, const char * filename, const char * iccOverride, int x, int y, int w, int h)
+{
+    clImage * image = NULL;
+    clFormat * format;
+    clRowReader * reader = NULL;
+    const char * formatName;
+
+    if ((x < 0) || (y < 0) || (w <= 0) || (h <= 0)) {
+        return clContextRead(C, filename, iccOverride, NULL);
+    }
+
+    formatName = clFormatDetect(C, filename);
+    if (!formatName) {
+        return NULL;
+    }
+
+    clRaw input = CL_RAW_EMPTY;
+    if (!clRawReadFile(C, &input, filename)) {
+        return NULL;
+    }
+
+    format = clContextFindFormat(C, formatName);
+    COLORIST_ASSERT(format);
+    if (format->readRowsFunc && !format->readRegionFunc) {
+        // Without a region reader, reading rows still stops at the end of the rect and only holds the rect
+        reader = format->readRowsFunc(C, formatName, &input);
+    }
+    if (format->readRegionFunc) {
+        image = format->readRegionFunc(C, formatName, &input, x, y, w, h);
+    } else if (reader) {
+        image = readRegionRows(C, reader, x, y, w, h);
+        clRowReaderDestroy(C, reader);
+    } else if (format->readFunc) {
+        image = format->readFunc(C, formatName, &input);
+        if (image) {
+            image = clImageCrop(C, image, x, y, w, h, clFalse);
         }
+    } else {
+        clContextLogError(C, "Unimplemented file reader '%s'", formatName);
+    }
+
+    if (image && iccOverride) {
+        image = applyICCOverride(C, image, iccOverride);
     }
 
     clRawFree(C, &input);
     return image;
 }
 
+struct clImage * clContextReadScaled(clContext * C, const char * filename, const char * iccOverride, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight)
+{
+    clImage * image = NULL;
+    clFormat * format;
+    const char * formatName = clFormatDetect(C, filename);
+    if (!formatName) {
+        return NULL;
+    }
+
+    clRaw input = CL_RAW_EMPTY;
+    if (!clRawReadFile(C, &input, filename)) {
+        return NULL;
+    }
+
+    format = clContextFindFormat(C, formatName);
+    COLORIST_ASSERT(format);
+    if (format->readScaledFunc) {
+        image = format->readScaledFunc(C, formatName, &input, minWidth, minHeight, outFullWidth, outFullHeight);
+    } else if (format->readFunc) {
+        image = format->readFunc(C, formatName, &input);
+        if (image) {
+            *outFullWidth = image->width;
+            *outFullHeight = image->height;
+        }
+    } else {
+        clContextLogError(C, "Unimplemented file reader '%s'", formatName);
+    }
+
+    if (image && iccOverride) {
+        image = applyICCOverride(C, image, iccOverride);
+    }
+
+    clRawFree(C, &input);
+    return image;
+}
+
+clBool clContextReadRows(clContext * C, const char * filename, const char * iccOverride, clRowReader ** outReader)
+{
+    clRowReader * reader;
+    clFormat * format;
+    clRaw * input;
+    const char * formatName = clFormatDetect(C, filename);
+    *outReader = NULL;
+    if (!formatName) {
+        return clFalse;
+    }
+
+    format = clContextFindFormat(C, formatName);
+    COLORIST_ASSERT(format);
+    if (!format->readRowsFunc) {
+        return clTrue;
+    }
+
+    input = clAllocateStruct(clRaw);
+    if (!clRawReadFile(C, input, filename)) {
+        clFree(input);
+        return clFalse;
+    }
+    reader = format->readRowsFunc(C, formatName, input);
+    if (!reader) {
+        clRawFree(C, input);
+        clFree(input);
+        return clTrue;
+    }
+    reader->input = input;
+
+    if (iccOverride) {
+        clProfile * overrideProfile = clProfileRead(C, iccOverride);
+        if (!overrideProfile) {
+            clContextLogError(C, "Bad ICC override file [-i]: %s", iccOverride);
+            clRowReaderDestroy(C, reader);
+            return clFalse;
+        }
+        clContextLog(C, "profile", 1, "Overriding src profile with file: %s", iccOverride);
+        clProfileDestroy(C, reader->profile);
+        reader->profile = overrideProfile; // take ownership
+    }
+
+    *outReader = reader;
+    return clTrue;
+}
+
+void clRowReaderDestroy(clContext * C, clRowReader * reader)
+{
+    clProfile * profile = reader->profile;
+    clRaw * input = reader->input;
+    reader->destroyFunc(C, reader);
+    if (profile) {
+        clProfileDestroy(C, profile);
+    }
+    if (input) {
+        clRawFree(C, input);
+        clFree(input);
+    }
+}
+
 clBool clContextWrite(clContext * C, struct clImage * image, const char * filename, const char * formatName, int quality, int rate)
 {
     clBool result = clFalse;
@@ -86,6 +268,25 @@ clBool clContextWrite(clContext * C, struct clImage * image, const char * filena
     return result;
 }
 
+clRowWriter * clContextWriteRows(clContext * C, const char * filename, const char * formatName, int width, int height, int depth, struct clProfile * profile, int quality, int rate)
+{
+    clFormat * format = clContextFindFormat(C, formatName);
+    COLORIST_ASSERT(format);
+    if (!format->writeRowsFunc) {
+        return NULL;
+    }
+
+    clWriteParams writeParams;
+    writeParams.quality = quality;
+    writeParams.rate = rate;
+    return format->writeRowsFunc(C, formatName, filename, width, height, depth, profile, &writeParams);
+}
+
+void clRowWriterDestroy(clContext * C, clRowWriter * writer)
+{
+    writer->destroyFunc(C, writer);
+}
+
 char * clContextWriteURI(struct clContext * C, clImage * image, const char * formatName, int quality, int rate)
 {
     char * output = NULL;
@@ -76,7 +76,7 @@ typedef struct BITMAPV5HEADER
 
 #define LCS_GM_ABS_COLORIMETRIC 8
 
-#define APPEND(PTR, SIZE) memcpy(p, PTR, SIZE); p += (SIZE);
+#define APPEND(PTR, SIZE) clRawSinkWrite(&sink, sink.raw->size, (const uint8_t *)(PTR), (SIZE));
 
 struct clImage * clFormatReadBMP(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWriteBMP(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
@@ -256,7 +256,7 @@ clBool clFormatWriteBMP(struct clContext * C, struct clImage * image, const char
     int packedPixelBytes = 0;
     uint32_t * packedPixels = NULL;
     int pixelCount = image->width * image->height;
-    uint8_t * p;
+    clRawSink sink;
 
     clRaw rawProfile = CL_RAW_EMPTY;
     if (!clProfilePack(C, image->profile, &rawProfile)) {
@@ -318,8 +318,8 @@ clBool clFormatWriteBMP(struct clContext * C, struct clImage * image, const char
     fileHeader.bfOffBits = (uint32_t)(sizeof(magic) + sizeof(fileHeader) + sizeof(info) + rawProfile.size);
     fileHeader.bfSize = fileHeader.bfOffBits + packedPixelBytes;
 
-    clRawRealloc(C, output, fileHeader.bfSize);
-    p = output->ptr;
+    clRawSinkStart(C, &sink, output);
+    clRawSinkReserve(&sink, fileHeader.bfSize);
     APPEND(&magic, sizeof(magic));
     APPEND(&fileHeader, sizeof(fileHeader));
     APPEND(&info, sizeof(info));
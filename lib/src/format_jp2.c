@@ -17,6 +17,8 @@
 
 struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWriteJP2(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+struct clImage * clFormatReadRegionJP2(struct clContext * C, const char * formatName, struct clRaw * input, int x, int y, int w, int h);
+struct clImage * clFormatReadScaledJP2(struct clContext * C, const char * formatName, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight);
 
 static void error_callback(const char * msg, void * client_data)
 {
@@ -40,6 +42,7 @@ struct opjCallbackInfo
 {
     struct clContext * C;
     clRaw * raw;
+    clRawSink sink; // writing only
     OPJ_OFF_T offset;
 };
 
@@ -57,11 +60,7 @@ static OPJ_SIZE_T readCallback(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_
 static OPJ_SIZE_T writeCallback(void * p_buffer, OPJ_SIZE_T p_nb_bytes, void * p_user_data)
 {
     struct opjCallbackInfo * ci = (struct opjCallbackInfo *)p_user_data;
-    if ((ci->offset + p_nb_bytes) > ci->raw->size) {
-        size_t newSize = (size_t)(ci->offset + p_nb_bytes);
-        clRawRealloc(ci->C, ci->raw, newSize);
-    }
-    memcpy(ci->raw->ptr + ci->offset, p_buffer, p_nb_bytes);
+    clRawSinkWrite(&ci->sink, (size_t)ci->offset, p_buffer, p_nb_bytes);
     ci->offset += p_nb_bytes;
     return p_nb_bytes;
 }
@@ -80,13 +79,13 @@ static OPJ_BOOL seekCallback(OPJ_OFF_T p_nb_bytes, void * p_user_data)
     return OPJ_TRUE;
 }
 
-struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName, struct clRaw * input)
+// If rect is set ({ x, y, w, h }), only the tiles and code-blocks covering it are decoded. If
+// minWidth or minHeight are set, as many of the highest resolution levels as fit them are skipped.
+static clImage * readJP2(struct clContext * C, struct clRaw * input, const int * rect, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight)
 {
-    COLORIST_UNUSED(formatName);
-
     clImage * image = NULL;
     clProfile * profile = NULL;
-    int i, pixelCount, dstDepth;
+    int i, pixelCount, dstDepth, width, height;
 
     opj_dparameters_t parameters;
     opj_codec_t * opjCodec = NULL;
@@ -141,6 +140,42 @@ struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName,
         return NULL;
     }
 
+    *outFullWidth = opjImage->x1 - opjImage->x0;
+    *outFullHeight = opjImage->y1 - opjImage->y0;
+    if ((minWidth > 0) || (minHeight > 0)) {
+        opj_codestream_info_v2_t * cstrInfo = opj_get_cstr_info(opjCodec);
+        int maxReduction = 31;
+        for (i = 0; i < (int)cstrInfo->nbcomps; ++i) {
+            int componentMax = (int)cstrInfo->m_default_tile_info.tccp_info[i].numresolutions - 1;
+            maxReduction = (maxReduction < componentMax) ? maxReduction : componentMax;
+        }
+        opj_destroy_cstr_info(&cstrInfo);
+
+        int reduction = clFormatScaleReduction(C, *outFullWidth, *outFullHeight, minWidth, minHeight, maxReduction);
+        if ((reduction > 0) && !opj_set_decoded_resolution_factor(opjCodec, (OPJ_UINT32)reduction)) {
+            clContextLogError(C, "Failed to set %s resolution factor", errorExtName);
+            opj_stream_destroy(opjStream);
+            opj_destroy_codec(opjCodec);
+            opj_image_destroy(opjImage);
+            return NULL;
+        }
+    }
+
+    if (rect) {
+        int x = rect[0];
+        int y = rect[1];
+        int w = rect[2];
+        int h = rect[3];
+        clImageAdjustRectForSize(C, opjImage->x1 - opjImage->x0, opjImage->y1 - opjImage->y0, &x, &y, &w, &h);
+        if (!opj_set_decode_area(opjCodec, opjImage, opjImage->x0 + x, opjImage->y0 + y, opjImage->x0 + x + w, opjImage->y0 + y + h)) {
+            clContextLogError(C, "Failed to set %s decode area", errorExtName);
+            opj_stream_destroy(opjStream);
+            opj_destroy_codec(opjCodec);
+            opj_image_destroy(opjImage);
+            return NULL;
+        }
+    }
+
     if (!opj_decode(opjCodec, opjStream, opjImage)) {
         clContextLogError(C, "Failed to decode %s!", errorExtName);
         opj_destroy_codec(opjCodec);
@@ -177,8 +212,11 @@ struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName,
     }
     maxChannel = (1 << dstDepth) - 1;
 
-    clImageLogCreate(C, opjImage->x1, opjImage->y1, dstDepth, profile);
-    image = clImageCreate(C, opjImage->x1, opjImage->y1, dstDepth, profile);
+    // Components hold just the decode area, at the decoded resolution
+    width = (int)opjImage->comps[0].w;
+    height = (int)opjImage->comps[0].h;
+    clImageLogCreate(C, width, height, dstDepth, profile);
+    image = clImageCreate(C, width, height, dstDepth, profile);
     if (profile) {
         clProfileDestroy(C, profile);
     }
@@ -238,6 +276,30 @@ struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName,
     return image;
 }
 
+struct clImage * clFormatReadJP2(struct clContext * C, const char * formatName, struct clRaw * input)
+{
+    COLORIST_UNUSED(formatName);
+
+    int fullWidth, fullHeight;
+    return readJP2(C, input, NULL, 0, 0, &fullWidth, &fullHeight);
+}
+
+struct clImage * clFormatReadRegionJP2(struct clContext * C, const char * formatName, struct clRaw * input, int x, int y, int w, int h)
+{
+    COLORIST_UNUSED(formatName);
+
+    int fullWidth, fullHeight;
+    const int rect[4] = { x, y, w, h };
+    return readJP2(C, input, rect, 0, 0, &fullWidth, &fullHeight);
+}
+
+struct clImage * clFormatReadScaledJP2(struct clContext * C, const char * formatName, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight)
+{
+    COLORIST_UNUSED(formatName);
+
+    return readJP2(C, input, NULL, minWidth, minHeight, outFullWidth, outFullHeight);
+}
+
 clBool clFormatWriteJP2(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
 {
     const OPJ_COLOR_SPACE color_space = OPJ_CLRSPC_SRGB;
@@ -257,6 +319,7 @@ clBool clFormatWriteJP2(struct clContext * C, struct clImage * image, const char
     ci.C = C;
     ci.raw = output;
     ci.offset = 0;
+    clRawSinkStart(C, &ci.sink, output);
 
     opjStream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_FALSE);
     opj_stream_set_user_data(opjStream, &ci, NULL);
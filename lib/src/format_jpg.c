@@ -14,6 +14,7 @@
 #include "jpeglib.h"
 
 #include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -30,18 +31,69 @@ static void my_error_exit(j_common_ptr cinfo)
     longjmp(myerr->setjmp_buffer, 1);
 }
 
+// Destination manager handing libjpeg the spare capacity of a clRawSink directly
+#define JPEG_SINK_CHUNK_SIZE (64 * 1024)
+
+typedef struct jpegSinkDestination
+{
+    struct jpeg_destination_mgr pub;
+    clRawSink sink;
+} jpegSinkDestination;
+
+static void jpegSinkNextBuffer(jpegSinkDestination * dest)
+{
+    clRawSinkReserve(&dest->sink, JPEG_SINK_CHUNK_SIZE);
+    dest->pub.next_output_byte = dest->sink.raw->ptr + dest->sink.raw->size;
+    dest->pub.free_in_buffer = dest->sink.capacity - dest->sink.raw->size;
+}
+
+static void jpegSinkInitDestination(j_compress_ptr cinfo)
+{
+    jpegSinkNextBuffer((jpegSinkDestination *)cinfo->dest);
+}
+
+static boolean jpegSinkEmptyOutputBuffer(j_compress_ptr cinfo)
+{
+    jpegSinkDestination * dest = (jpegSinkDestination *)cinfo->dest;
+    dest->sink.raw->size = dest->sink.capacity; // libjpeg only calls this once the buffer is full
+    jpegSinkNextBuffer(dest);
+    return TRUE;
+}
+
+static void jpegSinkTermDestination(j_compress_ptr cinfo)
+{
+    jpegSinkDestination * dest = (jpegSinkDestination *)cinfo->dest;
+    dest->sink.raw->size = dest->sink.capacity - dest->pub.free_in_buffer;
+}
+
 static void setup_read_icc_profile(j_decompress_ptr cinfo);
 static boolean read_icc_profile(struct clContext * C, j_decompress_ptr cinfo, JOCTET ** icc_data_ptr, unsigned int * icc_data_len);
 static void write_icc_profile(j_compress_ptr cinfo, const JOCTET * icc_data_ptr, unsigned int icc_data_len);
 
 struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWriteJPG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clRowReader * clFormatReadRowsJPG(struct clContext * C, const char * formatName, struct clRaw * input);
+struct clImage * clFormatReadScaledJPG(struct clContext * C, const char * formatName, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight);
+clRowWriter * clFormatWriteRowsJPG(struct clContext * C, const char * formatName, const char * filename, int width, int height, int depth, struct clProfile * profile, struct clWriteParams * writeParams);
 
-struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName, struct clRaw * input)
+static void rgbToRGBA(const uint8_t * src, uint8_t * dst, int width)
 {
-    COLORIST_UNUSED(formatName);
+    int i;
+    for (i = 0; i < width; ++i) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 255;
+        src += 3;
+        dst += 4;
+    }
+}
 
+// The IDCT can scale by 1/2, 1/4 or 1/8 instead of producing every pixel and throwing most away later
+static clImage * readJPG(struct clContext * C, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight)
+{
     clImage * image = NULL;
+    int reduction;
 
     struct my_error_mgr jerr;
     struct jpeg_decompress_struct cinfo;
@@ -59,6 +111,13 @@ struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName,
     setup_read_icc_profile(&cinfo);
     jpeg_mem_src(&cinfo, input->ptr, (unsigned long)input->size);
     jpeg_read_header(&cinfo, TRUE);
+    *outFullWidth = cinfo.image_width;
+    *outFullHeight = cinfo.image_height;
+    reduction = clFormatScaleReduction(C, cinfo.image_width, cinfo.image_height, minWidth, minHeight, 3);
+    if (reduction > 0) {
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = 1 << reduction;
+    }
     jpeg_start_decompress(&cinfo);
 
     int row_stride = cinfo.output_width * cinfo.output_components;
@@ -87,18 +146,7 @@ struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName,
     int row = 0;
     while (cinfo.output_scanline < cinfo.output_height) {
         jpeg_read_scanlines(&cinfo, buffer, 1);
-        {
-            uint8_t * pixelRow = &image->pixels[row * 4 * image->width];
-            unsigned int i;
-            for (i = 0; i < cinfo.output_width; ++i) {
-                uint8_t * dst = &pixelRow[i * 4];
-                uint8_t * src = &buffer[0][i * 3];
-                dst[0] = src[0];
-                dst[1] = src[1];
-                dst[2] = src[2];
-                dst[3] = 255;
-            }
-        }
+        rgbToRGBA(buffer[0], &image->pixels[row * 4 * image->width], cinfo.output_width);
         ++row;
     }
 
@@ -107,45 +155,152 @@ struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName,
     return image;
 }
 
+struct clImage * clFormatReadJPG(struct clContext * C, const char * formatName, struct clRaw * input)
+{
+    COLORIST_UNUSED(formatName);
+
+    int fullWidth, fullHeight;
+    return readJPG(C, input, 0, 0, &fullWidth, &fullHeight);
+}
+
+struct clImage * clFormatReadScaledJPG(struct clContext * C, const char * formatName, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight)
+{
+    COLORIST_UNUSED(formatName);
+
+    return readJPG(C, input, minWidth, minHeight, outFullWidth, outFullHeight);
+}
+
+typedef struct jpegRowReader
+{
+    clRowReader base;
+    struct my_error_mgr jerr;
+    struct jpeg_decompress_struct cinfo;
+    JSAMPARRAY buffer;
+} jpegRowReader;
+
+static clBool readRows(struct clContext * C, clRowReader * base, uint8_t * pixels, int rowCount)
+{
+    jpegRowReader * reader = (jpegRowReader *)base;
+    if (setjmp(reader->jerr.setjmp_buffer)) {
+        clContextLogError(C, "Failed to read JPEG rows");
+        return clFalse;
+    }
+    for (int y = 0; y < rowCount; ++y) {
+        jpeg_read_scanlines(&reader->cinfo, reader->buffer, 1);
+        rgbToRGBA(reader->buffer[0], &pixels[y * 4 * base->width], base->width);
+    }
+    return clTrue;
+}
+
+static void readRowsDestroy(struct clContext * C, clRowReader * base)
+{
+    jpegRowReader * reader = (jpegRowReader *)base;
+    jpeg_destroy_decompress(&reader->cinfo);
+    clFree(reader);
+}
+
+clRowReader * clFormatReadRowsJPG(struct clContext * C, const char * formatName, struct clRaw * input)
+{
+    COLORIST_UNUSED(formatName);
+
+    jpegRowReader * reader = clAllocateStruct(jpegRowReader);
+    uint8_t * iccData = NULL;
+    unsigned int iccDataLen;
+
+    reader->base.readRowsFunc = readRows;
+    reader->base.destroyFunc = readRowsDestroy;
+    reader->cinfo.err = jpeg_std_error(&reader->jerr.pub);
+    reader->jerr.pub.error_exit = my_error_exit;
+    if (setjmp(reader->jerr.setjmp_buffer)) {
+        readRowsDestroy(C, &reader->base);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&reader->cinfo);
+    setup_read_icc_profile(&reader->cinfo);
+    jpeg_mem_src(&reader->cinfo, input->ptr, (unsigned long)input->size);
+    jpeg_read_header(&reader->cinfo, TRUE);
+    jpeg_start_decompress(&reader->cinfo);
+    if (reader->cinfo.output_components != 3) {
+        readRowsDestroy(C, &reader->base);
+        return NULL;
+    }
+    reader->buffer = (*reader->cinfo.mem->alloc_sarray)((j_common_ptr) & reader->cinfo, JPOOL_IMAGE, reader->cinfo.output_width * 3, 1);
+
+    if (read_icc_profile(C, &reader->cinfo, &iccData, &iccDataLen)) {
+        reader->base.profile = clProfileParse(C, iccData, iccDataLen, NULL);
+        clFree(iccData);
+        if (!reader->base.profile) {
+            readRowsDestroy(C, &reader->base);
+            return NULL;
+        }
+    }
+
+    reader->base.width = reader->cinfo.output_width;
+    reader->base.height = reader->cinfo.output_height;
+    reader->base.depth = 8;
+    clImageLogCreate(C, reader->base.width, reader->base.height, 8, reader->base.profile);
+    if (!reader->base.profile) {
+        reader->base.profile = clProfileCreateStock(C, CL_PS_SRGB);
+    }
+    return &reader->base;
+}
+
+// Starts compression (the destination must already be set) and writes everything up to the scanlines
+static void writeSetup(j_compress_ptr cinfo, int width, int height, int quality, clRaw * rawProfile)
+{
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, TRUE);
+    jpeg_start_compress(cinfo, TRUE);
+    write_icc_profile(cinfo, rawProfile->ptr, (unsigned int)rawProfile->size);
+}
+
+// Drops alpha and reduces to 8 bits
+static cmsHTRANSFORM createRGBTransform(struct clContext * C, clProfile * profile, int depth)
+{
+    cmsUInt32Number srcFormat = (depth == 16) ? TYPE_RGBA_16 : TYPE_RGBA_8;
+    cmsHTRANSFORM rgbTransform = cmsCreateTransformTHR(C->lcms, profile->handle, srcFormat, profile->handle, TYPE_RGB_8, INTENT_ABSOLUTE_COLORIMETRIC, cmsFLAGS_NOOPTIMIZE);
+    COLORIST_ASSERT(rgbTransform);
+    return rgbTransform;
+}
+
 clBool clFormatWriteJPG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
 {
     COLORIST_UNUSED(formatName);
 
-    cmsUInt32Number srcFormat = (image->depth == 16) ? TYPE_RGBA_16 : TYPE_RGBA_8;
     cmsHTRANSFORM rgbTransform;
 
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
+    jpegSinkDestination dest;
 
     JSAMPROW row_pointer[1];
     int row_stride;
     uint8_t * jpegPixels;
-    unsigned char * outbuffer = NULL;
-    unsigned long outsize = 0;
+
+    clRaw rawProfile = CL_RAW_EMPTY;
+    if (!clProfilePack(C, image->profile, &rawProfile)) {
+        return clFalse;
+    }
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
-    jpeg_mem_dest(&cinfo, &outbuffer, &outsize);
+    clRawSinkStart(C, &dest.sink, output);
+    dest.pub.init_destination = jpegSinkInitDestination;
+    dest.pub.empty_output_buffer = jpegSinkEmptyOutputBuffer;
+    dest.pub.term_destination = jpegSinkTermDestination;
+    cinfo.dest = &dest.pub;
 
     jpegPixels = clAllocate(3 * image->width * image->height);
-    rgbTransform = cmsCreateTransformTHR(C->lcms, image->profile->handle, srcFormat, image->profile->handle, TYPE_RGB_8, INTENT_ABSOLUTE_COLORIMETRIC, cmsFLAGS_NOOPTIMIZE);
-    COLORIST_ASSERT(rgbTransform);
+    rgbTransform = createRGBTransform(C, image->profile, image->depth);
     cmsDoTransform(rgbTransform, image->pixels, jpegPixels, image->width * image->height);
     cmsDeleteTransform(rgbTransform);
 
-    cinfo.image_width = image->width;
-    cinfo.image_height = image->height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, writeParams->quality, TRUE);
-    jpeg_start_compress(&cinfo, TRUE);
-
-    clRaw rawProfile = CL_RAW_EMPTY;
-    if (!clProfilePack(C, image->profile, &rawProfile)) {
-        return clFalse;
-    }
-    write_icc_profile(&cinfo, rawProfile.ptr, (unsigned int)rawProfile.size);
+    writeSetup(&cinfo, image->width, image->height, writeParams->quality, &rawProfile);
 
     row_stride = image->width * 3;
     while (cinfo.next_scanline < cinfo.image_height) {
@@ -155,13 +310,10 @@ clBool clFormatWriteJPG(struct clContext * C, struct clImage * image, const char
 
     jpeg_finish_compress(&cinfo);
 
-    if (outbuffer && outsize) {
-        clRawSet(C, output, outbuffer, outsize);
-    } else {
+    if (!output->size) {
         clContextLogError(C, "ERROR: JPG compression failed");
         clRawFree(C, output);
     }
-    free(outbuffer);
 
     jpeg_destroy_compress(&cinfo);
     clFree(jpegPixels);
@@ -169,6 +321,109 @@ clBool clFormatWriteJPG(struct clContext * C, struct clImage * image, const char
     return (output->size > 0) ? clTrue : clFalse;
 }
 
+typedef struct jpegRowWriter
+{
+    clRowWriter base;
+    struct my_error_mgr jerr;
+    struct jpeg_compress_struct cinfo;
+    cmsHTRANSFORM rgbTransform;
+    uint8_t * rgbRow;
+    size_t rowBytes;
+    int width;
+    FILE * f;
+} jpegRowWriter;
+
+static clBool writeRows(struct clContext * C, clRowWriter * base, const uint8_t * pixels, int rowCount)
+{
+    jpegRowWriter * writer = (jpegRowWriter *)base;
+    JSAMPROW row_pointer[1];
+    if (setjmp(writer->jerr.setjmp_buffer)) {
+        clContextLogError(C, "Failed to write JPEG rows");
+        return clFalse;
+    }
+    row_pointer[0] = writer->rgbRow;
+    for (int y = 0; y < rowCount; ++y) {
+        cmsDoTransform(writer->rgbTransform, &pixels[y * writer->rowBytes], writer->rgbRow, writer->width);
+        (void)jpeg_write_scanlines(&writer->cinfo, row_pointer, 1);
+    }
+    return clTrue;
+}
+
+static clBool writeRowsFinish(struct clContext * C, clRowWriter * base)
+{
+    jpegRowWriter * writer = (jpegRowWriter *)base;
+    FILE * f = writer->f;
+    if (setjmp(writer->jerr.setjmp_buffer)) {
+        clContextLogError(C, "Failed to finish JPEG");
+        return clFalse;
+    }
+    jpeg_finish_compress(&writer->cinfo);
+    writer->f = NULL;
+    if (fclose(f) != 0) {
+        clContextLogError(C, "Failed to write JPEG");
+        return clFalse;
+    }
+    return clTrue;
+}
+
+static void writeRowsDestroy(struct clContext * C, clRowWriter * base)
+{
+    jpegRowWriter * writer = (jpegRowWriter *)base;
+    jpeg_destroy_compress(&writer->cinfo);
+    if (writer->rgbTransform) {
+        cmsDeleteTransform(writer->rgbTransform);
+    }
+    if (writer->rgbRow) {
+        clFree(writer->rgbRow);
+    }
+    if (writer->f) {
+        fclose(writer->f);
+    }
+    clFree(writer);
+}
+
+clRowWriter * clFormatWriteRowsJPG(struct clContext * C, const char * formatName, const char * filename, int width, int height, int depth, struct clProfile * profile, struct clWriteParams * writeParams)
+{
+    COLORIST_UNUSED(formatName);
+
+    jpegRowWriter * writer;
+    clRaw rawProfile = CL_RAW_EMPTY;
+    if (!clProfilePack(C, profile, &rawProfile)) {
+        return NULL;
+    }
+
+    writer = clAllocateStruct(jpegRowWriter);
+    writer->base.writeRowsFunc = writeRows;
+    writer->base.finishFunc = writeRowsFinish;
+    writer->base.destroyFunc = writeRowsDestroy;
+    writer->rowBytes = (size_t)4 * width * clDepthToBytes(C, depth);
+    writer->width = width;
+    writer->cinfo.err = jpeg_std_error(&writer->jerr.pub);
+    writer->jerr.pub.error_exit = my_error_exit;
+    jpeg_create_compress(&writer->cinfo);
+
+    writer->f = fopen(filename, "wb");
+    if (!writer->f) {
+        clContextLogError(C, "Failed to open file for write: %s", filename);
+        clRawFree(C, &rawProfile);
+        writeRowsDestroy(C, &writer->base);
+        return NULL;
+    }
+    if (setjmp(writer->jerr.setjmp_buffer)) {
+        clContextLogError(C, "Failed to write JPEG header");
+        clRawFree(C, &rawProfile);
+        writeRowsDestroy(C, &writer->base);
+        return NULL;
+    }
+
+    writer->rgbTransform = createRGBTransform(C, profile, depth);
+    writer->rgbRow = clAllocate(3 * width);
+    jpeg_stdio_dest(&writer->cinfo, writer->f);
+    writeSetup(&writer->cinfo, width, height, writeParams->quality, &rawProfile);
+    clRawFree(C, &rawProfile);
+    return &writer->base;
+}
+
 // ----------------------------------------------------------------------------
 // Taken from http://www.littlecms.com/1/iccjpeg.c
 // Minor adaptations for compilation / formattingv
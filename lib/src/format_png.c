@@ -12,10 +12,13 @@
 
 #include "png.h"
 
+#include <stdio.h>
 #include <string.h>
 
 struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clRowReader * clFormatReadRowsPNG(struct clContext * C, const char * formatName, struct clRaw * input);
+clRowWriter * clFormatWriteRowsPNG(struct clContext * C, const char * formatName, const char * filename, int width, int height, int depth, struct clProfile * profile, struct clWriteParams * writeParams);
 
 struct readInfo
 {
@@ -33,43 +36,14 @@ static void readCallback(png_structp png, png_bytep data, png_size_t length)
     ri->offset += length;
 }
 
-struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName, struct clRaw * input)
+// Reads the header and sets up expansion to RGBA; returns the resulting depth (8 or 16).
+// Must be called with png's jmpbuf set.
+static int readSetup(struct clContext * C, png_structp png, png_infop info, clProfile ** outProfile)
 {
-    COLORIST_UNUSED(formatName);
-
-    clImage * image = NULL;
-    png_bytep * rowPointers = NULL;
-
-    if (png_sig_cmp(input->ptr, 0, 8)) {
-        clContextLogError(C, "not a PNG");
-        return NULL;
-    }
-
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop info = png_create_info_struct(png);
-    COLORIST_ASSERT(png && info);
-
-    if (setjmp(png_jmpbuf(png))) {
-        if (rowPointers) {
-            clFree(rowPointers);
-        }
-        if (image) {
-            clImageDestroy(C, image);
-        }
-        png_destroy_read_struct(&png, &info, NULL);
-        return NULL;
-    }
-
-    struct readInfo ri;
-    ri.C = C;
-    ri.src = input;
-    ri.offset = 0;
+    clProfile * profile = NULL;
 
-    png_set_read_fn(png, &ri, readCallback);
     png_read_info(png, info);
 
-    clProfile * profile = NULL;
-
     char * iccpProfileName;
     int iccpCompression;
     unsigned char * iccpData;
@@ -79,8 +53,6 @@ struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName,
         profile = clProfileParse(C, iccpData, iccpDataLen, iccpProfileName);
     }
 
-    int rawWidth = png_get_image_width(png, info);
-    int rawHeight = png_get_image_height(png, info);
     png_byte rawColorType = png_get_color_type(png, info);
     png_byte rawBitDepth = png_get_bit_depth(png, info);
 
@@ -110,14 +82,54 @@ struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName,
     }
 
     int imgBitDepth = 8;
-    int imgBytesPerChannel = 1;
     if (rawBitDepth == 16) {
         png_set_swap(png);
         imgBitDepth = 16;
-        imgBytesPerChannel = 2;
     }
 
     png_read_update_info(png, info);
+    *outProfile = profile;
+    return imgBitDepth;
+}
+
+struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName, struct clRaw * input)
+{
+    COLORIST_UNUSED(formatName);
+
+    clImage * image = NULL;
+    png_bytep * rowPointers = NULL;
+
+    if (png_sig_cmp(input->ptr, 0, 8)) {
+        clContextLogError(C, "not a PNG");
+        return NULL;
+    }
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+    COLORIST_ASSERT(png && info);
+
+    if (setjmp(png_jmpbuf(png))) {
+        if (rowPointers) {
+            clFree(rowPointers);
+        }
+        if (image) {
+            clImageDestroy(C, image);
+        }
+        png_destroy_read_struct(&png, &info, NULL);
+        return NULL;
+    }
+
+    struct readInfo ri;
+    ri.C = C;
+    ri.src = input;
+    ri.offset = 0;
+
+    png_set_read_fn(png, &ri, readCallback);
+
+    clProfile * profile = NULL;
+    int imgBitDepth = readSetup(C, png, info, &profile);
+    int rawWidth = png_get_image_width(png, info);
+    int rawHeight = png_get_image_height(png, info);
 
     clImageLogCreate(C, rawWidth, rawHeight, imgBitDepth, profile);
     image = clImageCreate(C, rawWidth, rawHeight, imgBitDepth, profile);
@@ -125,7 +137,7 @@ struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName,
         clProfileDestroy(C, profile);
     }
     rowPointers = (png_bytep *)clAllocate(sizeof(png_bytep) * rawHeight);
-    if (imgBytesPerChannel == 1) {
+    if (imgBitDepth == 8) {
         uint8_t * pixels = image->pixels;
         for (int y = 0; y < rawHeight; ++y) {
             rowPointers[y] = &pixels[4 * y * rawWidth];
@@ -142,27 +154,117 @@ struct clImage * clFormatReadPNG(struct clContext * C, const char * formatName,
     return image;
 }
 
-struct writeInfo
+typedef struct pngRowReader
 {
-    struct clContext * C;
-    clRaw * dst;
-    png_size_t offset;
-};
+    clRowReader base;
+    png_structp png;
+    png_infop info;
+    struct readInfo ri;
+} pngRowReader;
+
+static clBool readRows(struct clContext * C, clRowReader * base, uint8_t * pixels, int rowCount)
+{
+    pngRowReader * reader = (pngRowReader *)base;
+    size_t rowBytes = (size_t)4 * base->width * clDepthToBytes(C, base->depth);
+
+    if (setjmp(png_jmpbuf(reader->png))) {
+        clContextLogError(C, "Failed to read PNG rows");
+        return clFalse;
+    }
+    for (int y = 0; y < rowCount; ++y) {
+        png_read_row(reader->png, &pixels[y * rowBytes], NULL);
+    }
+    return clTrue;
+}
+
+static void readRowsDestroy(struct clContext * C, clRowReader * base)
+{
+    pngRowReader * reader = (pngRowReader *)base;
+    png_destroy_read_struct(&reader->png, &reader->info, NULL);
+    clFree(reader);
+}
+
+clRowReader * clFormatReadRowsPNG(struct clContext * C, const char * formatName, struct clRaw * input)
+{
+    COLORIST_UNUSED(formatName);
+
+    pngRowReader * reader;
+
+    if ((input->size < 8) || png_sig_cmp(input->ptr, 0, 8)) {
+        return NULL;
+    }
+
+    reader = clAllocateStruct(pngRowReader);
+    reader->base.readRowsFunc = readRows;
+    reader->base.destroyFunc = readRowsDestroy;
+    reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    reader->info = png_create_info_struct(reader->png);
+    COLORIST_ASSERT(reader->png && reader->info);
+    reader->ri.C = C;
+    reader->ri.src = input;
+    reader->ri.offset = 0;
+
+    if (setjmp(png_jmpbuf(reader->png))) {
+        if (reader->base.profile) {
+            clProfileDestroy(C, reader->base.profile);
+        }
+        readRowsDestroy(C, &reader->base);
+        return NULL;
+    }
+
+    png_set_read_fn(reader->png, &reader->ri, readCallback);
+    reader->base.depth = readSetup(C, reader->png, reader->info, &reader->base.profile);
+    reader->base.width = png_get_image_width(reader->png, reader->info);
+    reader->base.height = png_get_image_height(reader->png, reader->info);
+
+    if (png_get_interlace_type(reader->png, reader->info) != PNG_INTERLACE_NONE) {
+        // Interlaced rows only come out complete after the last pass
+        if (reader->base.profile) {
+            clProfileDestroy(C, reader->base.profile);
+        }
+        readRowsDestroy(C, &reader->base);
+        return NULL;
+    }
+
+    clImageLogCreate(C, reader->base.width, reader->base.height, reader->base.depth, reader->base.profile);
+    if (!reader->base.profile) {
+        reader->base.profile = clProfileCreateStock(C, CL_PS_SRGB);
+    }
+    return &reader->base;
+}
 
 static void writeCallback(png_structp png, png_bytep data, png_size_t length)
 {
-    struct writeInfo * wi = (struct writeInfo *)png_get_io_ptr(png);
-    if ((wi->offset + length) > wi->dst->size) {
-        size_t newSize = wi->dst->size;
-        if (!newSize)
-            newSize = 8;
-        do {
-            newSize *= 2;
-        } while (newSize < (wi->offset + length));
-        clRawRealloc(wi->C, wi->dst, newSize);
-    }
-    memcpy(wi->dst->ptr + wi->offset, data, length);
-    wi->offset += length;
+    clRawSink * sink = (clRawSink *)png_get_io_ptr(png);
+    clRawSinkWrite(sink, sink->raw->size, data, length);
+}
+
+static void fileWriteCallback(png_structp png, png_bytep data, png_size_t length)
+{
+    FILE * f = (FILE *)png_get_io_ptr(png);
+    if (fwrite(data, 1, length, f) != length) {
+        png_error(png, "write failed");
+    }
+}
+
+// Writes everything up to the image data. Must be called with png's jmpbuf set.
+static void writeSetup(png_structp png, png_infop info, int width, int height, int depth, clProfile * profile, clRaw * rawProfile)
+{
+    png_set_IHDR(
+        png,
+        info,
+        width, height,
+        depth,
+        PNG_COLOR_TYPE_RGBA,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT
+        );
+    png_set_iCCP(png, info, profile->description, 0, rawProfile->ptr, (png_uint_32)rawProfile->size);
+    png_write_info(png, info);
+    if (depth == 16) {
+        png_set_swap(png);
+    }
 }
 
 clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
@@ -190,24 +292,10 @@ clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char
         return clFalse;
     }
 
-    struct writeInfo wi;
-    wi.C = C;
-    wi.offset = 0;
-    wi.dst = output;
-    png_set_write_fn(png, &wi, writeCallback, NULL);
-
-    png_set_IHDR(
-        png,
-        info,
-        image->width, image->height,
-        image->depth,
-        PNG_COLOR_TYPE_RGBA,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT
-        );
-    png_set_iCCP(png, info, image->profile->description, 0, rawProfile.ptr, (png_uint_32)rawProfile.size);
-    png_write_info(png, info);
+    clRawSink sink;
+    clRawSinkStart(C, &sink, output);
+    png_set_write_fn(png, &sink, writeCallback, NULL);
+    writeSetup(png, info, image->width, image->height, image->depth, image->profile, &rawProfile);
 
     rowPointers = (png_bytep *)clAllocate(sizeof(png_bytep) * image->height);
     int imgBytesPerChannel = (image->depth == 16) ? 2 : 1;
@@ -221,7 +309,6 @@ clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char
         for (int y = 0; y < image->height; ++y) {
             rowPointers[y] = (png_byte *)&pixels[4 * y * image->width];
         }
-        png_set_swap(png);
     }
 
     png_write_image(png, rowPointers);
@@ -230,6 +317,93 @@ clBool clFormatWritePNG(struct clContext * C, struct clImage * image, const char
 
     clFree(rowPointers);
     clRawFree(C, &rawProfile);
-    output->size = wi.offset;
     return clTrue;
 }
+
+typedef struct pngRowWriter
+{
+    clRowWriter base;
+    png_structp png;
+    png_infop info;
+    FILE * f;
+    size_t rowBytes;
+} pngRowWriter;
+
+static clBool writeRows(struct clContext * C, clRowWriter * base, const uint8_t * pixels, int rowCount)
+{
+    pngRowWriter * writer = (pngRowWriter *)base;
+    if (setjmp(png_jmpbuf(writer->png))) {
+        clContextLogError(C, "Failed to write PNG rows");
+        return clFalse;
+    }
+    for (int y = 0; y < rowCount; ++y) {
+        png_write_row(writer->png, &pixels[y * writer->rowBytes]);
+    }
+    return clTrue;
+}
+
+static clBool writeRowsFinish(struct clContext * C, clRowWriter * base)
+{
+    pngRowWriter * writer = (pngRowWriter *)base;
+    FILE * f = writer->f;
+    if (setjmp(png_jmpbuf(writer->png))) {
+        clContextLogError(C, "Failed to finish PNG");
+        return clFalse;
+    }
+    png_write_end(writer->png, NULL);
+    writer->f = NULL;
+    if (fclose(f) != 0) {
+        clContextLogError(C, "Failed to write PNG");
+        return clFalse;
+    }
+    return clTrue;
+}
+
+static void writeRowsDestroy(struct clContext * C, clRowWriter * base)
+{
+    pngRowWriter * writer = (pngRowWriter *)base;
+    png_destroy_write_struct(&writer->png, &writer->info);
+    if (writer->f) {
+        fclose(writer->f);
+    }
+    clFree(writer);
+}
+
+clRowWriter * clFormatWriteRowsPNG(struct clContext * C, const char * formatName, const char * filename, int width, int height, int depth, struct clProfile * profile, struct clWriteParams * writeParams)
+{
+    COLORIST_UNUSED(formatName);
+    COLORIST_UNUSED(writeParams);
+
+    pngRowWriter * writer;
+    clRaw rawProfile = CL_RAW_EMPTY;
+    if (!clProfilePack(C, profile, &rawProfile)) {
+        return NULL;
+    }
+
+    writer = clAllocateStruct(pngRowWriter);
+    writer->base.writeRowsFunc = writeRows;
+    writer->base.finishFunc = writeRowsFinish;
+    writer->base.destroyFunc = writeRowsDestroy;
+    writer->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    writer->info = png_create_info_struct(writer->png);
+    COLORIST_ASSERT(writer->png && writer->info);
+    writer->rowBytes = (size_t)4 * width * clDepthToBytes(C, depth);
+    writer->f = fopen(filename, "wb");
+    if (!writer->f) {
+        clContextLogError(C, "Failed to open file for write: %s", filename);
+        clRawFree(C, &rawProfile);
+        writeRowsDestroy(C, &writer->base);
+        return NULL;
+    }
+
+    if (setjmp(png_jmpbuf(writer->png))) {
+        clContextLogError(C, "Failed to write PNG header");
+        clRawFree(C, &rawProfile);
+        writeRowsDestroy(C, &writer->base);
+        return NULL;
+    }
+    png_set_write_fn(writer->png, writer->f, fileWriteCallback, NULL);
+    writeSetup(writer->png, writer->info, width, height, depth, profile, &rawProfile);
+    clRawFree(C, &rawProfile);
+    return &writer->base;
+}
@@ -5,6 +5,13 @@
 //                  http://www.boost.org/LICENSE_1_0.txt)
 // ---------------------------------------------------------------------------
 
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L // for fseeko() / ftello()
+#endif
+#if !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64 // streamed TIFFs can pass 2GB, even on 32-bit builds
+#endif
+
 #include "colorist/image.h"
 
 #include "colorist/context.h"
@@ -12,15 +19,32 @@
 
 #include "tiffio.h"
 
+#include <stdio.h>
 #include <string.h>
 
+// 64-bit file offsets for streamed output; plain fseek() / ftell() stop at 2GB where long is 32-bit
+#if defined(_WIN32)
+#define tiffFileSeek _fseeki64
+#define tiffFileTell _ftelli64
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/types.h>
+#define tiffFileSeek(F, OFFSET, WHENCE) fseeko(F, (off_t)(OFFSET), WHENCE)
+#define tiffFileTell ftello
+#else
+#define tiffFileSeek(F, OFFSET, WHENCE) fseek(F, (long)(OFFSET), WHENCE)
+#define tiffFileTell ftell
+#endif
+
 struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWriteTIFF(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+clRowReader * clFormatReadRowsTIFF(struct clContext * C, const char * formatName, struct clRaw * input);
+clRowWriter * clFormatWriteRowsTIFF(struct clContext * C, const char * formatName, const char * filename, int width, int height, int depth, struct clProfile * profile, struct clWriteParams * writeParams);
 
 typedef struct tiffCallbackInfo
 {
     struct clContext * C;
     clRaw * raw;
+    clRawSink sink; // writing only
     toff_t offset;
 } tiffCallbackInfo;
 
@@ -36,11 +60,7 @@ static tmsize_t readCallback(tiffCallbackInfo * ci, void * ptr, tmsize_t size)
 
 static tmsize_t writeCallback(tiffCallbackInfo * ci, void * ptr, tmsize_t size)
 {
-    if ((ci->offset + size) > ci->raw->size) {
-        tmsize_t newSize = (tmsize_t)(ci->offset + size);
-        clRawRealloc(ci->C, ci->raw, newSize);
-    }
-    memcpy(ci->raw->ptr + ci->offset, ptr, size);
+    clRawSinkWrite(&ci->sink, (size_t)ci->offset, ptr, (size_t)size);
     ci->offset += size;
     return size;
 }
@@ -74,14 +94,12 @@ static toff_t sizeCallback(tiffCallbackInfo * ci)
     return ci->offset; // this seems bad
 }
 
+// libtiff only maps files opened for reading; handing it the input lets it decode strips in place
 static int mapCallback(tiffCallbackInfo * ci, void ** base, toff_t * size)
 {
-    COLORIST_UNUSED(ci);
-
-    *base = NULL;
-    *size = 0;
-
-    return 0;
+    *base = ci->raw->ptr;
+    *size = ci->raw->size;
+    return 1;
 }
 
 static void unmapCallback(tiffCallbackInfo * ci, void * base, toff_t size)
@@ -91,88 +109,179 @@ static void unmapCallback(tiffCallbackInfo * ci, void * base, toff_t size)
     COLORIST_UNUSED(size);
 }
 
-struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName, struct clRaw * input)
+// Callbacks for writing straight to a file (row streaming)
+
+static tmsize_t fileReadCallback(FILE * f, void * ptr, tmsize_t size)
 {
-    COLORIST_UNUSED(formatName);
+    return (tmsize_t)fread(ptr, 1, (size_t)size, f);
+}
 
-    clProfile * profile = NULL;
-    clImage * image = NULL;
-    TIFF * tiff;
-    int width = 0;
-    int height = 0;
-    int depth = 0;
+static tmsize_t fileWriteCallback(FILE * f, void * ptr, tmsize_t size)
+{
+    return (tmsize_t)fwrite(ptr, 1, (size_t)size, f);
+}
+
+static toff_t fileSeekCallback(FILE * f, toff_t off, int whence)
+{
+    if (tiffFileSeek(f, off, whence) != 0) {
+        return (toff_t)-1;
+    }
+    return (toff_t)tiffFileTell(f);
+}
+
+static int fileCloseCallback(FILE * f)
+{
+    COLORIST_UNUSED(f);
+
+    return 0; // closed by the writer, which checks for errors
+}
+
+static toff_t fileSizeCallback(FILE * f)
+{
+    toff_t pos = (toff_t)tiffFileTell(f);
+    toff_t size;
+    tiffFileSeek(f, 0, SEEK_END);
+    size = (toff_t)tiffFileTell(f);
+    tiffFileSeek(f, pos, SEEK_SET);
+    return size;
+}
+
+static int fileMapCallback(FILE * f, void ** base, toff_t * size)
+{
+    COLORIST_UNUSED(f);
+
+    *base = NULL;
+    *size = 0;
+
+    return 0;
+}
+
+typedef struct tiffHeader
+{
+    int width;
+    int height;
+    int depth;
+    int orientation;
+    clProfile * profile;
+} tiffHeader;
+
+// Errors are only logged if asked to; the row reader declines quietly and lets the whole image reader report them
+static clBool readHeader(struct clContext * C, TIFF * tiff, tiffHeader * header, clBool logErrors)
+{
     int iccLen = 0;
     int channelCount = 0;
-    int orientation = ORIENTATION_TOPLEFT;
     uint8_t * iccBuf = NULL;
-    int rowIndex, rowBytes;
-    tiffCallbackInfo ci;
 
-    ci.C = C;
-    ci.raw = input;
-    ci.offset = 0;
-
-    tiff = TIFFClientOpen("tiff", "rb",
-        (thandle_t)&ci,
-        (TIFFReadWriteProc)readCallback, (TIFFReadWriteProc)writeCallback,
-        (TIFFSeekProc)seekCallback, (TIFFCloseProc)closeCalllback,
-        (TIFFSizeProc)sizeCallback,
-        (TIFFMapFileProc)mapCallback, (TIFFUnmapFileProc)unmapCallback);
-    if (!tiff) {
-        clContextLogError(C, "cannot open TIFF for read");
-        goto readCleanup;
-    }
-
-    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
-    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
-    if ((width <= 0) || (height <= 0)) {
-        clContextLogError(C, "cannot read width and height from TIFF");
-        goto readCleanup;
+    header->width = 0;
+    header->height = 0;
+    header->depth = 0;
+    header->orientation = ORIENTATION_TOPLEFT;
+    header->profile = NULL;
+
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &header->width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &header->height);
+    if ((header->width <= 0) || (header->height <= 0)) {
+        if (logErrors) {
+            clContextLogError(C, "cannot read width and height from TIFF");
+        }
+        return clFalse;
     }
 
     TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &channelCount);
     if ((channelCount != 4)) {
         // TODO: support at least 3 channels
-        clContextLogError(C, "unsupported channelCount(%d) from TIFF", channelCount);
-        goto readCleanup;
+        if (logErrors) {
+            clContextLogError(C, "unsupported channelCount(%d) from TIFF", channelCount);
+        }
+        return clFalse;
     }
 
-    TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &depth);
-    if ((depth <= 0)) {
+    TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &header->depth);
+    if ((header->depth <= 0)) {
         // TODO: convert to 16bit
-        clContextLogError(C, "cannot read depth from TIFF: '%s'");
-        goto readCleanup;
+        if (logErrors) {
+            clContextLogError(C, "cannot read depth from TIFF: '%s'");
+        }
+        return clFalse;
     }
-    if ((depth != 8) && (depth != 16)) {
-        clContextLogError(C, "unsupported depth(%d) from TIFF", depth);
-        goto readCleanup;
+    if ((header->depth != 8) && (header->depth != 16)) {
+        if (logErrors) {
+            clContextLogError(C, "unsupported depth(%d) from TIFF", header->depth);
+        }
+        return clFalse;
     }
 
     if (TIFFGetField(tiff, TIFFTAG_ICCPROFILE, &iccLen, &iccBuf)) {
-        profile = clProfileParse(C, iccBuf, iccLen, NULL);
-        if (!profile) {
-            clContextLogError(C, "cannot parse ICC profile from TIFF");
-            goto readCleanup;
+        header->profile = clProfileParse(C, iccBuf, iccLen, NULL);
+        if (!header->profile) {
+            if (logErrors) {
+                clContextLogError(C, "cannot parse ICC profile from TIFF");
+            }
+            return clFalse;
         }
     }
 
-    if (TIFFGetField(tiff, TIFFTAG_ORIENTATION, &orientation)) {
-        if ((orientation != ORIENTATION_TOPLEFT) && (orientation != ORIENTATION_BOTLEFT)) {
+    if (TIFFGetField(tiff, TIFFTAG_ORIENTATION, &header->orientation)) {
+        if ((header->orientation != ORIENTATION_TOPLEFT) && (header->orientation != ORIENTATION_BOTLEFT)) {
             // TODO: Support other orientations
-            clContextLogError(C, "Unsupported orientation (%d)", orientation);
-            goto readCleanup;
+            if (logErrors) {
+                clContextLogError(C, "Unsupported orientation (%d)", header->orientation);
+            }
+            if (header->profile) {
+                clProfileDestroy(C, header->profile);
+                header->profile = NULL;
+            }
+            return clFalse;
         }
     } else {
         // ?
-        orientation = ORIENTATION_TOPLEFT;
+        header->orientation = ORIENTATION_TOPLEFT;
     }
+    return clTrue;
+}
+
+static TIFF * openInput(tiffCallbackInfo * ci)
+{
+    return TIFFClientOpen("tiff", "rb",
+        (thandle_t)ci,
+        (TIFFReadWriteProc)readCallback, (TIFFReadWriteProc)writeCallback,
+        (TIFFSeekProc)seekCallback, (TIFFCloseProc)closeCalllback,
+        (TIFFSizeProc)sizeCallback,
+        (TIFFMapFileProc)mapCallback, (TIFFUnmapFileProc)unmapCallback);
+}
+
+struct clImage * clFormatReadTIFF(struct clContext * C, const char * formatName, struct clRaw * input)
+{
+    COLORIST_UNUSED(formatName);
+
+    clImage * image = NULL;
+    TIFF * tiff;
+    tiffHeader header;
+    int rowIndex, rowBytes;
+    tiffCallbackInfo ci;
+
+    header.profile = NULL;
 
-    clImageLogCreate(C, width, height, depth, profile);
-    image = clImageCreate(C, width, height, depth, profile);
+    ci.C = C;
+    ci.raw = input;
+    ci.offset = 0;
+
+    tiff = openInput(&ci);
+    if (!tiff) {
+        clContextLogError(C, "cannot open TIFF for read");
+        goto readCleanup;
+    }
+
+    if (!readHeader(C, tiff, &header, clTrue)) {
+        goto readCleanup;
+    }
+
+    clImageLogCreate(C, header.width, header.height, header.depth, header.profile);
+    image = clImageCreate(C, header.width, header.height, header.depth, header.profile);
     rowBytes = image->width * 4 * clDepthToBytes(C, image->depth);
     for (rowIndex = 0; rowIndex < image->height; ++rowIndex) {
         uint8_t * pixelRow;
-        if (orientation == ORIENTATION_TOPLEFT) {
+        if (header.orientation == ORIENTATION_TOPLEFT) {
             pixelRow = &image->pixels[rowIndex * rowBytes];
         } else {
             // ORIENTATION_BOTLEFT
@@ -190,12 +299,102 @@ readCleanup:
     if (tiff) {
         TIFFClose(tiff);
     }
-    if (profile) {
-        clProfileDestroy(C, profile);
+    if (header.profile) {
+        clProfileDestroy(C, header.profile);
     }
     return image;
 }
 
+typedef struct tiffRowReader
+{
+    clRowReader base;
+    TIFF * tiff;
+    tiffCallbackInfo ci;
+    int rowIndex;
+} tiffRowReader;
+
+static clBool readRows(struct clContext * C, clRowReader * base, uint8_t * pixels, int rowCount)
+{
+    tiffRowReader * reader = (tiffRowReader *)base;
+    size_t rowBytes = (size_t)4 * base->width * clDepthToBytes(C, base->depth);
+    for (int y = 0; y < rowCount; ++y) {
+        if (TIFFReadScanline(reader->tiff, &pixels[y * rowBytes], reader->rowIndex, 0) < 0) {
+            clContextLogError(C, "Failed to read TIFF scanline row %d", reader->rowIndex);
+            return clFalse;
+        }
+        ++reader->rowIndex;
+    }
+    return clTrue;
+}
+
+static clBool skipRows(struct clContext * C, clRowReader * base, int rowCount)
+{
+    COLORIST_UNUSED(C);
+
+    // TIFFReadScanline() seeks to the strip holding whichever row is asked for next
+    ((tiffRowReader *)base)->rowIndex += rowCount;
+    return clTrue;
+}
+
+static void readRowsDestroy(struct clContext * C, clRowReader * base)
+{
+    tiffRowReader * reader = (tiffRowReader *)base;
+    if (reader->tiff) {
+        TIFFClose(reader->tiff);
+    }
+    clFree(reader);
+}
+
+clRowReader * clFormatReadRowsTIFF(struct clContext * C, const char * formatName, struct clRaw * input)
+{
+    COLORIST_UNUSED(formatName);
+
+    tiffHeader header;
+    tiffRowReader * reader = clAllocateStruct(tiffRowReader);
+    reader->base.readRowsFunc = readRows;
+    reader->base.skipRowsFunc = skipRows;
+    reader->base.destroyFunc = readRowsDestroy;
+    reader->ci.C = C;
+    reader->ci.raw = input;
+    reader->ci.offset = 0;
+
+    // Anything unusual (including errors) isn't streamed
+    reader->tiff = openInput(&reader->ci);
+    if (!reader->tiff || !readHeader(C, reader->tiff, &header, clFalse)) {
+        readRowsDestroy(C, &reader->base);
+        return NULL;
+    }
+    if (header.orientation != ORIENTATION_TOPLEFT) {
+        // Bottom-up rows would have to be held until the last one arrives
+        if (header.profile) {
+            clProfileDestroy(C, header.profile);
+        }
+        readRowsDestroy(C, &reader->base);
+        return NULL;
+    }
+
+    clImageLogCreate(C, header.width, header.height, header.depth, header.profile);
+    reader->base.width = header.width;
+    reader->base.height = header.height;
+    reader->base.depth = header.depth;
+    reader->base.profile = header.profile ? header.profile : clProfileCreateStock(C, CL_PS_SRGB);
+    return &reader->base;
+}
+
+// Everything but the image data, for both output paths
+static void writeSetup(TIFF * tiff, int width, int height, int depth, clRaw * rawProfile)
+{
+    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, width);
+    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, height);
+    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 4);
+    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, depth);
+    TIFFSetField(tiff, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiff, 0)); // ~8K strips, so libtiff never buffers more than one
+    TIFFSetField(tiff, TIFFTAG_ICCPROFILE, rawProfile->size, rawProfile->ptr);
+}
+
 clBool clFormatWriteTIFF(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
 {
     COLORIST_UNUSED(formatName);
@@ -215,6 +414,7 @@ clBool clFormatWriteTIFF(struct clContext * C, struct clImage * image, const cha
     ci.C = C;
     ci.raw = output;
     ci.offset = 0;
+    clRawSinkStart(C, &ci.sink, output);
 
     tiff = TIFFClientOpen("tiff", "wb",
         (thandle_t)&ci,
@@ -228,17 +428,9 @@ clBool clFormatWriteTIFF(struct clContext * C, struct clImage * image, const cha
         goto writeCleanup;
     }
 
-    rowBytes = image->width * 4 * clDepthToBytes(C, image->depth);
-    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, image->width);
-    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, image->height);
-    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 4);
-    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, image->depth);
-    TIFFSetField(tiff, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-    TIFFSetField(tiff, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tiff, rowBytes));
-    TIFFSetField(tiff, TIFFTAG_ICCPROFILE, rawProfile.size, rawProfile.ptr);
+    writeSetup(tiff, image->width, image->height, image->depth, &rawProfile);
 
+    rowBytes = image->width * 4 * clDepthToBytes(C, image->depth);
     for (rowIndex = 0; rowIndex < image->height; ++rowIndex) {
         uint8_t * pixelRow = &image->pixels[rowIndex * rowBytes];
         if (TIFFWriteScanline(tiff, pixelRow, rowIndex, 0) < 0) {
@@ -255,3 +447,96 @@ writeCleanup:
     clRawFree(C, &rawProfile);
     return writeResult;
 }
+
+typedef struct tiffRowWriter
+{
+    clRowWriter base;
+    TIFF * tiff;
+    FILE * f;
+    size_t rowBytes;
+    int rowIndex;
+} tiffRowWriter;
+
+static clBool writeRows(struct clContext * C, clRowWriter * base, const uint8_t * pixels, int rowCount)
+{
+    tiffRowWriter * writer = (tiffRowWriter *)base;
+    for (int y = 0; y < rowCount; ++y) {
+        // TIFFWriteScanline() doesn't modify the row unless it has to byte swap, which it won't here
+        if (TIFFWriteScanline(writer->tiff, (void *)&pixels[y * writer->rowBytes], writer->rowIndex, 0) < 0) {
+            clContextLogError(C, "Failed to write TIFF scanline row %d", writer->rowIndex);
+            return clFalse;
+        }
+        ++writer->rowIndex;
+    }
+    return clTrue;
+}
+
+static clBool writeRowsFinish(struct clContext * C, clRowWriter * base)
+{
+    tiffRowWriter * writer = (tiffRowWriter *)base;
+    clBool flushed = TIFFFlush(writer->tiff) ? clTrue : clFalse;
+    TIFFClose(writer->tiff);
+    writer->tiff = NULL;
+    if ((fclose(writer->f) != 0) || !flushed) {
+        writer->f = NULL;
+        clContextLogError(C, "Failed to write TIFF");
+        return clFalse;
+    }
+    writer->f = NULL;
+    return clTrue;
+}
+
+static void writeRowsDestroy(struct clContext * C, clRowWriter * base)
+{
+    tiffRowWriter * writer = (tiffRowWriter *)base;
+    if (writer->tiff) {
+        TIFFClose(writer->tiff);
+    }
+    if (writer->f) {
+        fclose(writer->f);
+    }
+    clFree(writer);
+}
+
+clRowWriter * clFormatWriteRowsTIFF(struct clContext * C, const char * formatName, const char * filename, int width, int height, int depth, struct clProfile * profile, struct clWriteParams * writeParams)
+{
+    COLORIST_UNUSED(formatName);
+    COLORIST_UNUSED(writeParams);
+
+    tiffRowWriter * writer;
+    clRaw rawProfile = CL_RAW_EMPTY;
+    if (!clProfilePack(C, profile, &rawProfile)) {
+        clContextLogError(C, "Failed to create ICC profile");
+        return NULL;
+    }
+
+    writer = clAllocateStruct(tiffRowWriter);
+    writer->base.writeRowsFunc = writeRows;
+    writer->base.finishFunc = writeRowsFinish;
+    writer->base.destroyFunc = writeRowsDestroy;
+    writer->rowBytes = (size_t)4 * width * clDepthToBytes(C, depth);
+    writer->f = fopen(filename, "wb");
+    if (!writer->f) {
+        clContextLogError(C, "Failed to open file for write: %s", filename);
+        clRawFree(C, &rawProfile);
+        writeRowsDestroy(C, &writer->base);
+        return NULL;
+    }
+
+    writer->tiff = TIFFClientOpen("tiff", "wb",
+        (thandle_t)writer->f,
+        (TIFFReadWriteProc)fileReadCallback, (TIFFReadWriteProc)fileWriteCallback,
+        (TIFFSeekProc)fileSeekCallback, (TIFFCloseProc)fileCloseCallback,
+        (TIFFSizeProc)fileSizeCallback,
+        (TIFFMapFileProc)fileMapCallback, (TIFFUnmapFileProc)unmapCallback);
+    if (!writer->tiff) {
+        clContextLogError(C, "cannot open TIFF for write");
+        clRawFree(C, &rawProfile);
+        writeRowsDestroy(C, &writer->base);
+        return NULL;
+    }
+
+    writeSetup(writer->tiff, width, height, depth, &rawProfile);
+    clRawFree(C, &rawProfile);
+    return &writer->base;
+}
@@ -18,11 +18,11 @@
 
 struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName, struct clRaw * input);
 clBool clFormatWriteWebP(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams);
+struct clImage * clFormatReadScaledWebP(struct clContext * C, const char * formatName, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight);
 
-struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName, struct clRaw * input)
+// libwebp's rescaler works while decoding, so a reduced size never needs the full size in memory
+static clImage * readWebP(struct clContext * C, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight)
 {
-    COLORIST_UNUSED(formatName);
-
     clImage * image = NULL;
     clProfile * profile = NULL;
 
@@ -31,8 +31,8 @@ struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName,
     WebPMuxFrameInfo frameInfo;
     uint32_t muxFlags;
 
-    int width, height;
-    uint8_t * readPixels = NULL;
+    WebPDecoderConfig config;
+    int width, height, reduction;
 
     memset(&frameInfo, 0, sizeof(frameInfo));
 
@@ -58,21 +58,40 @@ struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName,
         goto readCleanup;
     }
 
-    readPixels = WebPDecodeRGBA(frameInfo.bitstream.bytes, frameInfo.bitstream.size, &width, &height);
-    if (!readPixels) {
+    if (!WebPInitDecoderConfig(&config) || (WebPGetFeatures(frameInfo.bitstream.bytes, frameInfo.bitstream.size, &config.input) != VP8_STATUS_OK)) {
         clContextLogError(C, "Failed to decode WebP");
         goto readCleanup;
     }
+    width = config.input.width;
+    height = config.input.height;
+    *outFullWidth = width;
+    *outFullHeight = height;
+    reduction = clFormatScaleReduction(C, width, height, minWidth, minHeight, 30);
+    if (reduction > 0) {
+        width = (width + (1 << reduction) - 1) >> reduction;
+        height = (height + (1 << reduction) - 1) >> reduction;
+        config.options.use_scaling = 1;
+        config.options.scaled_width = width;
+        config.options.scaled_height = height;
+    }
 
     clImageLogCreate(C, width, height, 8, profile);
     image = clImageCreate(C, width, height, 8, profile);
-    memcpy(image->pixels, readPixels, 4 * width * height);
+
+    config.output.colorspace = MODE_RGBA;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = image->pixels;
+    config.output.u.RGBA.stride = 4 * width;
+    config.output.u.RGBA.size = image->size;
+    if (WebPDecode(frameInfo.bitstream.bytes, frameInfo.bitstream.size, &config) != VP8_STATUS_OK) {
+        clContextLogError(C, "Failed to decode WebP");
+        clImageDestroy(C, image);
+        image = NULL;
+    }
+    WebPFreeDecBuffer(&config.output);
 
 readCleanup:
     WebPDataClear(&frameInfo.bitstream);
-    if (readPixels) {
-        WebPFree(readPixels);
-    }
     if (mux) {
         WebPMuxDelete(mux);
     }
@@ -82,6 +101,21 @@ readCleanup:
     return image;
 }
 
+struct clImage * clFormatReadWebP(struct clContext * C, const char * formatName, struct clRaw * input)
+{
+    COLORIST_UNUSED(formatName);
+
+    int fullWidth, fullHeight;
+    return readWebP(C, input, 0, 0, &fullWidth, &fullHeight);
+}
+
+struct clImage * clFormatReadScaledWebP(struct clContext * C, const char * formatName, struct clRaw * input, int minWidth, int minHeight, int * outFullWidth, int * outFullHeight)
+{
+    COLORIST_UNUSED(formatName);
+
+    return readWebP(C, input, minWidth, minHeight, outFullWidth, outFullHeight);
+}
+
 clBool clFormatWriteWebP(struct clContext * C, struct clImage * image, const char * formatName, struct clRaw * output, struct clWriteParams * writeParams)
 {
     COLORIST_UNUSED(formatName);
@@ -97,6 +131,7 @@ clBool clFormatWriteWebP(struct clContext * C, struct clImage * image, const cha
 
     WebPData iccChunk, imageChunk, assembledChunk;
     WebPMux * mux = NULL;
+    clRawSink sink;
 
     memset(&iccChunk, 0, sizeof(iccChunk));
     memset(&imageChunk, 0, sizeof(imageChunk));
@@ -151,7 +186,8 @@ clBool clFormatWriteWebP(struct clContext * C, struct clImage * image, const cha
         goto writeCleanup;
     }
 
-    clRawSet(C, output, assembledChunk.bytes, assembledChunk.size);
+    clRawSinkStart(C, &sink, output);
+    clRawSinkWrite(&sink, 0, assembledChunk.bytes, assembledChunk.size);
 
 writeCleanup:
     if (mux) {
@@ -10,6 +10,7 @@
 #include "colorist/context.h"
 #include "colorist/pixelmath.h"
 #include "colorist/profile.h"
+#include "colorist/task.h"
 #include "colorist/transform.h"
 
 #include <string.h>
@@ -52,14 +53,12 @@ clImage * clImageCrop(struct clContext * C, clImage * srcImage, int x, int y, in
         return NULL;
     }
 
-    int depthBytes = clDepthToBytes(C, srcImage->depth);
+    int pixelBytes = clDepthToBytes(C, srcImage->depth) * 4;
     clImage * dstImage = clImageCreate(C, w, h, srcImage->depth, srcImage->profile);
     for (int j = 0; j < h; ++j) {
-        for (int i = 0; i < w; ++i) {
-            uint8_t * src = &srcImage->pixels[4 * depthBytes * ((i + x) + (srcImage->width * (j + y)))];
-            uint8_t * dst = &dstImage->pixels[4 * depthBytes * (i + (dstImage->width * j))];
-            memcpy(dst, src, depthBytes * 4);
-        }
+        uint8_t * src = &srcImage->pixels[(size_t)pixelBytes * (x + (srcImage->width * (j + y)))];
+        uint8_t * dst = &dstImage->pixels[(size_t)pixelBytes * dstImage->width * j];
+        memcpy(dst, src, (size_t)pixelBytes * w);
     }
 
     if (!keepSrc) {
@@ -68,39 +67,57 @@ clImage * clImageCrop(struct clContext * C, clImage * srcImage, int x, int y, in
     return dstImage;
 }
 
-clImage * clImageApplyHALD(struct clContext * C, clImage * image, clImage * hald, int haldDims)
+clImage * clImageApplyHALD(struct clContext * C, clImage * image, int taskCount, clImage * hald, int haldDims)
 {
     clImage * appliedImage = clImageCreate(C, image->width, image->height, image->depth, image->profile);
-    int pixelCount = image->width * image->height;
-    int haldDataCount = hald->width * hald->height;
+    float * lattice = clPixelMathHaldCLUTLattice(C, hald->pixels, hald->depth, haldDims);
+    clPixelMathHaldCLUTApplyUNorm(C, taskCount, lattice, haldDims, image->pixels, appliedImage->pixels, image->depth, image->width * image->height);
+    clFree(lattice);
+    return appliedImage;
+}
 
-    float * haldData = clAllocate(4 * sizeof(float) * haldDataCount);
-    clPixelMathUNormToFloat(C, hald->pixels, hald->depth, haldData, haldDataCount);
-    float * srcFloats = clAllocate(4 * sizeof(float) * pixelCount);
-    clPixelMathUNormToFloat(C, image->pixels, image->depth, srcFloats, pixelCount);
-    float * dstFloats = clAllocate(4 * sizeof(float) * pixelCount);
+void clImageApplyHALDInPlace(struct clContext * C, clImage * image, int taskCount, clImage * hald, int haldDims)
+{
+    float * lattice = clPixelMathHaldCLUTLattice(C, hald->pixels, hald->depth, haldDims);
+    clPixelMathHaldCLUTApplyUNorm(C, taskCount, lattice, haldDims, image->pixels, image->pixels, image->depth, image->width * image->height);
+    clFree(lattice);
+}
 
+static clBool imageIsOpaque8(clImage * image)
+{
+    int pixelCount = image->width * image->height;
     for (int i = 0; i < pixelCount; ++i) {
-        clPixelMathHaldCLUTLookup(C, haldData, haldDims, &srcFloats[i * 4], &dstFloats[i * 4]);
+        if (image->pixels[(4 * i) + 3] != 255) {
+            return clFalse;
+        }
     }
-    clPixelMathFloatToUNorm(C, dstFloats, appliedImage->pixels, appliedImage->depth, pixelCount);
-
-    clFree(dstFloats);
-    clFree(srcFloats);
-    clFree(haldData);
-    return appliedImage;
+    return clTrue;
 }
 
-clImage * clImageResize(struct clContext * C, clImage * image, int width, int height, clFilter resizeFilter)
+clImage * clImageResize(struct clContext * C, clImage * image, int taskCount, int width, int height, clFilter resizeFilter)
 {
     clImage * resizedImage = clImageCreate(C, width, height, image->depth, image->profile);
+
+    if (resizeFilter == CL_FILTER_NEAREST) {
+        // Nothing to filter, just copy pixels
+        clPixelMathResizeNearest(C, taskCount, clDepthToBytes(C, image->depth) * 4, image->width, image->height, image->pixels, width, height, resizedImage->pixels);
+        return resizedImage;
+    }
+
+    if ((image->depth == 8) && imageIsOpaque8(image)) {
+        // The float path filters in premultiplied alpha; with nothing to premultiply, 8-bit images
+        // can be filtered in fixed point without expanding them to floats.
+        clPixelMathResizeU8(C, taskCount, image->width, image->height, image->pixels, width, height, resizedImage->pixels, resizeFilter);
+        return resizedImage;
+    }
+
     int pixelCount = image->width * image->height;
     int resizedPixelCount = resizedImage->width * resizedImage->height;
     float * srcFloats = clAllocate(4 * sizeof(float) * pixelCount);
     float * dstFloats = clAllocate(4 * sizeof(float) * resizedPixelCount);
 
     clPixelMathUNormToFloat(C, image->pixels, image->depth, srcFloats, pixelCount);
-    clPixelMathResize(C, image->width, image->height, srcFloats, resizedImage->width, resizedImage->height, dstFloats, resizeFilter);
+    clPixelMathResize(C, taskCount, image->width, image->height, srcFloats, resizedImage->width, resizedImage->height, dstFloats, resizeFilter);
     clPixelMathFloatToUNorm(C, dstFloats, resizedImage->pixels, resizedImage->depth, resizedPixelCount);
     clFree(dstFloats);
     clFree(srcFloats);
@@ -108,6 +125,11 @@ clImage * clImageResize(struct clContext * C, clImage * image, int width, int he
 }
 
 clBool clImageAdjustRect(struct clContext * C, clImage * image, int * x, int * y, int * w, int * h)
+{
+    return clImageAdjustRectForSize(C, image->width, image->height, x, y, w, h);
+}
+
+clBool clImageAdjustRectForSize(struct clContext * C, int width, int height, int * x, int * y, int * w, int * h)
 {
     COLORIST_UNUSED(C);
 
@@ -115,13 +137,13 @@ clBool clImageAdjustRect(struct clContext * C, clImage * image, int * x, int * y
         return clFalse;
     }
 
-    *x = (*x < image->width) ? *x : image->width - 1;
-    *y = (*y < image->height) ? *y : image->height - 1;
+    *x = (*x < width) ? *x : width - 1;
+    *y = (*y < height) ? *y : height - 1;
 
     int endX = *x + *w;
     int endY = *y + *h;
-    endX = (endX < image->width) ? endX : image->width;
-    endY = (endY < image->height) ? endY : image->height;
+    endX = (endX < width) ? endX : width;
+    endY = (endY < height) ? endY : height;
 
     *w = endX - *x;
     *h = endY - *y;
@@ -193,11 +215,12 @@ clImage * clImageRotate(struct clContext * C, clImage * image, int cwTurns)
     return rotated;
 }
 
-clImage * clImageConvert(struct clContext * C, clImage * srcImage, int taskCount, int width, int height, int depth, struct clProfile * dstProfile, clTonemap tonemap)
+clImage * clImageConvert(struct clContext * C, clImage * srcImage, int taskCount, int width, int height, int depth, struct clProfile * dstProfile, clTonemap tonemap, int lutSize, clImage * hald, int haldDims)
 {
     Timer t;
     clImage * dstImage = NULL;
     clTransform * transform = NULL;
+    float * haldLattice = NULL;
 
     // Create destination image
     dstImage = clImageCreate(C, width, height, depth, dstProfile);
@@ -210,17 +233,234 @@ clImage * clImageConvert(struct clContext * C, clImage * srcImage, int taskCount
 
     // Create the transform
     transform = clTransformCreate(C, srcImage->profile, CL_XF_RGBA, srcImage->depth, dstImage->profile, CL_XF_RGBA, depth, tonemap);
+    transform->lutSize = lutSize;
+    if (hald) {
+        // Applied to each pixel as it is converted (or baked into the LUT along with everything else)
+        haldLattice = clPixelMathHaldCLUTLattice(C, hald->pixels, hald->depth, haldDims);
+        transform->haldLattice = haldLattice;
+        transform->haldDims = haldDims;
+    }
     clTransformPrepare(C, transform);
     float luminanceScale = clTransformGetLuminanceScale(C, transform);
 
     // Perform conversion
-    clContextLog(C, "convert", 0, "Converting (%s, lum scale %gx, %s)...", clTransformCMMName(C, transform), luminanceScale, transform->tonemapEnabled ? "tonemap" : "clip");
+    clContextLog(C, "convert", 0, "Converting (%s, lum scale %gx, %s%s)...", clTransformCMMName(C, transform), luminanceScale, transform->tonemapEnabled ? "tonemap" : "clip", hald ? ", Hald CLUT" : "");
     timerStart(&t);
     clTransformRun(C, transform, taskCount, srcImage->pixels, dstImage->pixels, srcImage->width * srcImage->height);
     clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
 
     // Cleanup
     clTransformDestroy(C, transform);
+    if (haldLattice) {
+        clFree(haldLattice);
+    }
+    return dstImage;
+}
+
+// Pixels per band in clImageConvertRows(); only one band of source and destination rows is ever held
+#define CONVERT_ROWS_BAND_PIXELS (256 * 1024)
+
+clBool clImageConvertRows(struct clContext * C, clRowReader * reader, clRowWriter * writer, int taskCount, int depth, struct clProfile * dstProfile, clTonemap tonemap, int lutSize, clImage * hald, int haldDims)
+{
+    Timer t;
+    clBool result = clTrue;
+    clTransform * transform = NULL;
+    float * haldLattice = NULL;
+    int srcRowBytes = clDepthToBytes(C, reader->depth) * 4 * reader->width;
+    int dstRowBytes = clDepthToBytes(C, depth) * 4 * reader->width;
+    int bandRows = CONVERT_ROWS_BAND_PIXELS / reader->width;
+    uint8_t * srcPixels;
+    uint8_t * dstPixels;
+
+    // Show image details; neither image is ever whole, so only their headers are dumped
+    {
+        clImage srcHeader = { reader->width, reader->height, reader->depth, 0, NULL, reader->profile };
+        clImage dstHeader = { reader->width, reader->height, depth, 0, NULL, dstProfile };
+        clContextLog(C, "details", 0, "Source:");
+        clImageDebugDump(C, &srcHeader, 0, 0, 0, 0, 1);
+        clContextLog(C, "details", 0, "Destination:");
+        clImageDebugDump(C, &dstHeader, 0, 0, 0, 0, 1);
+    }
+
+    // Create the transform
+    transform = clTransformCreate(C, reader->profile, CL_XF_RGBA, reader->depth, dstProfile, CL_XF_RGBA, depth, tonemap);
+    transform->lutSize = lutSize;
+    if (hald) {
+        haldLattice = clPixelMathHaldCLUTLattice(C, hald->pixels, hald->depth, haldDims);
+        transform->haldLattice = haldLattice;
+        transform->haldDims = haldDims;
+    }
+    clTransformPrepare(C, transform);
+    float luminanceScale = clTransformGetLuminanceScale(C, transform);
+
+    if (bandRows < 1) {
+        bandRows = 1;
+    }
+    if (bandRows > reader->height) {
+        bandRows = reader->height;
+    }
+    srcPixels = clAllocate((size_t)srcRowBytes * bandRows);
+    dstPixels = clAllocate((size_t)dstRowBytes * bandRows);
+
+    // Perform conversion, one band at a time from the decoder to the encoder
+    clContextLog(C, "convert", 0, "Converting %d rows at a time (%s, lum scale %gx, %s%s)...", bandRows, clTransformCMMName(C, transform), luminanceScale, transform->tonemapEnabled ? "tonemap" : "clip", hald ? ", Hald CLUT" : "");
+    timerStart(&t);
+    for (int y = 0; y < reader->height; y += bandRows) {
+        int rowCount = reader->height - y;
+        if (rowCount > bandRows) {
+            rowCount = bandRows;
+        }
+        if (!reader->readRowsFunc(C, reader, srcPixels, rowCount)) {
+            result = clFalse;
+            break;
+        }
+        clTransformRun(C, transform, taskCount, srcPixels, dstPixels, reader->width * rowCount);
+        if (!writer->writeRowsFunc(C, writer, dstPixels, rowCount)) {
+            result = clFalse;
+            break;
+        }
+    }
+    if (result) {
+        result = writer->finishFunc(C, writer);
+    }
+    clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
+
+    // Cleanup
+    clFree(dstPixels);
+    clFree(srcPixels);
+    clTransformDestroy(C, transform);
+    if (haldLattice) {
+        clFree(haldLattice);
+    }
+    return result;
+}
+
+// Output pixels per band in clImageResizeConvert(); each in-flight band holds this many RGBA floats
+// plus the source rows feeding them.
+#define RESIZE_CONVERT_BAND_PIXELS (256 * 1024)
+
+typedef struct clResizeConvertTask
+{
+    struct clContext * C;
+    clImage * srcImage;
+    clImage * dstImage;
+    clTransform * transform;
+    clFilter resizeFilter;
+    int dstY;
+    int dstRowCount;
+} clResizeConvertTask;
+
+static void resizeConvertTaskFunc(clResizeConvertTask * info)
+{
+    struct clContext * C = info->C;
+    clImage * srcImage = info->srcImage;
+    clImage * dstImage = info->dstImage;
+    int srcPixelBytes = clDepthToBytes(C, srcImage->depth) * 4;
+    int dstPixelBytes = clDepthToBytes(C, dstImage->depth) * 4;
+    int dstPixelCount = dstImage->width * info->dstRowCount;
+    int srcY, srcRowCount, srcPixelCount;
+    float * srcFloats;
+    float * dstFloats;
+
+    clPixelMathResizeBandSrcRows(C, srcImage->height, dstImage->height, info->dstY, info->dstRowCount, info->resizeFilter, &srcY, &srcRowCount);
+    srcPixelCount = srcImage->width * srcRowCount;
+
+    srcFloats = clAllocate(4 * sizeof(float) * srcPixelCount);
+    dstFloats = clAllocate(4 * sizeof(float) * dstPixelCount);
+    clPixelMathUNormToFloat(C, &srcImage->pixels[(size_t)srcPixelBytes * srcImage->width * srcY], srcImage->depth, srcFloats, srcPixelCount);
+    clPixelMathResizeBand(C, srcImage->width, srcImage->height, srcY, srcRowCount, srcFloats, dstImage->width, dstImage->height, info->dstY, info->dstRowCount, dstFloats, info->resizeFilter);
+
+    // The sharper filters ring past [0,1]; keep the resized values in range of the source encoding
+    for (int i = 0; i < dstPixelCount * 4; ++i) {
+        dstFloats[i] = CL_CLAMP(dstFloats[i], 0.0f, 1.0f);
+    }
+
+    clTransformRun(C, info->transform, 1, dstFloats, &dstImage->pixels[(size_t)dstPixelBytes * dstImage->width * info->dstY], dstPixelCount);
+    clFree(dstFloats);
+    clFree(srcFloats);
+}
+
+clImage * clImageResizeConvert(struct clContext * C, clImage * srcImage, int taskCount, int width, int height, clFilter resizeFilter, int depth, struct clProfile * dstProfile, clTonemap tonemap, clImage * hald, int haldDims)
+{
+    Timer t;
+    clImage * dstImage = NULL;
+    clTransform * transform = NULL;
+    float * haldLattice = NULL;
+    clResizeConvertTask * infos;
+    int bandRows, bandCount;
+
+    // Create destination image
+    dstImage = clImageCreate(C, width, height, depth, dstProfile);
+
+    // Show image details
+    clContextLog(C, "details", 0, "Source:");
+    clImageDebugDump(C, srcImage, 0, 0, 0, 0, 1);
+    clContextLog(C, "details", 0, "Destination:");
+    clImageDebugDump(C, dstImage, 0, 0, 0, 0, 1);
+
+    // Create the transform; resized bands are handed to it as floats
+    transform = clTransformCreate(C, srcImage->profile, CL_XF_RGBA, 32, dstImage->profile, CL_XF_RGBA, depth, tonemap);
+    if (hald) {
+        haldLattice = clPixelMathHaldCLUTLattice(C, hald->pixels, hald->depth, haldDims);
+        transform->haldLattice = haldLattice;
+        transform->haldDims = haldDims;
+    }
+    clTransformPrepare(C, transform);
+    float luminanceScale = clTransformGetLuminanceScale(C, transform);
+
+    if (taskCount < 1) {
+        taskCount = 1;
+    }
+    bandRows = RESIZE_CONVERT_BAND_PIXELS / width;
+    if (bandRows > ((height + taskCount - 1) / taskCount)) {
+        // Small image; make sure every thread still gets a band
+        bandRows = (height + taskCount - 1) / taskCount;
+    }
+    if (bandRows < 1) {
+        bandRows = 1;
+    }
+    bandCount = (height + bandRows - 1) / bandRows;
+
+    // Perform resize and conversion, one band of output rows at a time
+    clContextLog(C, "convert", 0, "Resizing and converting (%s, lum scale %gx, %s%s)...", clTransformCMMName(C, transform), luminanceScale, transform->tonemapEnabled ? "tonemap" : "clip", hald ? ", Hald CLUT" : "");
+    clContextLog(C, "convert", 1, "Using %d threads (%d bands of up to %d rows).", taskCount, bandCount, bandRows);
+    timerStart(&t);
+
+    infos = clAllocate(bandCount * sizeof(clResizeConvertTask));
+    for (int i = 0; i < bandCount; ++i) {
+        infos[i].C = C;
+        infos[i].srcImage = srcImage;
+        infos[i].dstImage = dstImage;
+        infos[i].transform = transform;
+        infos[i].resizeFilter = resizeFilter;
+        infos[i].dstY = i * bandRows;
+        infos[i].dstRowCount = ((height - infos[i].dstY) < bandRows) ? (height - infos[i].dstY) : bandRows;
+    }
+    if (taskCount == 1) {
+        for (int i = 0; i < bandCount; ++i) {
+            resizeConvertTaskFunc(&infos[i]);
+        }
+    } else {
+        // Bands are queued all at once; since each one allocates its floats only while it runs,
+        // at most taskCount bands are held in memory at a time.
+        clTaskPool * pool = clContextTaskPool(C, taskCount);
+        clTaskBatch batch;
+        clTask * tasks = clAllocate(bandCount * sizeof(clTask));
+        clTaskBatchInit(&batch, taskCount);
+        for (int i = 0; i < bandCount; ++i) {
+            clTaskPoolSubmit(C, pool, &batch, &tasks[i], (clTaskFunc)resizeConvertTaskFunc, &infos[i]);
+        }
+        clTaskPoolWait(C, pool, &batch);
+        clFree(tasks);
+    }
+    clFree(infos);
+    clContextLog(C, "timing", -1, TIMING_FORMAT, timerElapsedSeconds(&t));
+
+    // Cleanup
+    clTransformDestroy(C, transform);
+    if (haldLattice) {
+        clFree(haldLattice);
+    }
     return dstImage;
 }
 
@@ -230,11 +470,7 @@ void clImageColorGrade(struct clContext * C, clImage * image, int taskCount, int
     clProfileQuery(C, image->profile, NULL, NULL, &srcLuminance);
     srcLuminance = (srcLuminance != 0) ? srcLuminance : COLORIST_DEFAULT_LUMINANCE;
 
-    int pixelCount = image->width * image->height;
-    float * floatPixels = clAllocate(4 * sizeof(float) * pixelCount);
-    clPixelMathUNormToFloat(C, image->pixels, image->depth, floatPixels, pixelCount);
-    clPixelMathColorGrade(C, taskCount, image->profile, floatPixels, pixelCount, image->width, srcLuminance, dstColorDepth, outLuminance, outGamma, verbose);
-    clFree(floatPixels);
+    clPixelMathColorGradeUNorm(C, taskCount, image->profile, image->pixels, image->depth, image->width * image->height, image->width, srcLuminance, dstColorDepth, outLuminance, outGamma, verbose);
 }
 
 void clImageDestroy(clContext * C, clImage * image)
@@ -6,6 +6,7 @@
 #include "colorist/transform.h"
 
 #include <math.h>
+#include <string.h>
 
 // (1.0 - 4.0) by 0.05
 #define GAMMA_RANGE_START 20
@@ -40,86 +41,314 @@ float clPixelMathRoundNormalized(float normalizedValue, float factor)
     return clPixelMathRoundf(normalizedValue * factor);
 }
 
-static float gammaErrorTerm(float gamma, float * pixels, int pixelCount, float maxChannel, float luminanceScale)
+// The gamma error term only depends on each channel's (luminance scaled, clamped) value, so it is
+// evaluated over a histogram of those values instead of over every pixel. 8 and 16-bit pixels are
+// counted per code, which is exact; floats are binned into 16-bit codes after luminance scaling.
+#define GRADE_FLOAT_HISTOGRAM_BINS 65536
+
+// The gamma search first tries every GAMMA_COARSE_STEP'th candidate, then halves the step around
+// the best one until it is down to single candidates. This assumes the error is unimodal in gamma;
+// a second dip between coarse candidates would be missed.
+#define GAMMA_COARSE_STEP 4
+
+typedef struct clGradeHistogram
 {
-    float invGamma = 1.0f / gamma;
-    float errorTerm = 0.0f;
-    float channelErrorTerm;
-    float scaledChannel;
-    float * pixel = pixels;
+    float * values;   // channel value of each non-empty bin
+    double * weights; // channels counted in each non-empty bin
+    int binCount;     // non-empty bins
+} clGradeHistogram;
+
+// One slice of the image, scanned for its largest channel or counted into a histogram
+typedef struct clGradeSliceTask
+{
+    const uint8_t * pixels; // first pixel of the slice
+    int depth;              // 32 for floats, otherwise the UNorm depth
+    int pixelCount;
+    float luminanceScale;   // floats only; UNorm pixels are counted by code
+    uint64_t * counts;      // histogram pass: one per bin
+    int maxIndex;           // max pass: pixel (within the slice) with the largest RGB channel
+    float maxChannel;       // max pass: its value, normalized
+} clGradeSliceTask;
+
+static int gradeBinCount(int depth)
+{
+    return (depth == 32) ? GRADE_FLOAT_HISTOGRAM_BINS : (1 << depth);
+}
+
+static void gradeMaxTaskFunc(clGradeSliceTask * info)
+{
+    int maxIndex = 0;
+
+    if (info->depth == 32) {
+        const float * pixels = (const float *)info->pixels;
+        float maxChannel = 0.0f;
+        for (int i = 0; i < info->pixelCount; ++i) {
+            const float * pixel = &pixels[i * 4];
+            for (int channel = 0; channel < 3; ++channel) {
+                if (maxChannel < pixel[channel]) {
+                    maxIndex = i;
+                    maxChannel = pixel[channel];
+                }
+            }
+        }
+        info->maxChannel = maxChannel;
+    } else {
+        int maxCode = 0;
+        if (info->depth > 8) {
+            const uint16_t * pixels = (const uint16_t *)info->pixels;
+            for (int i = 0; i < info->pixelCount; ++i) {
+                const uint16_t * pixel = &pixels[i * 4];
+                for (int channel = 0; channel < 3; ++channel) {
+                    if (maxCode < pixel[channel]) {
+                        maxIndex = i;
+                        maxCode = pixel[channel];
+                    }
+                }
+            }
+        } else {
+            for (int i = 0; i < info->pixelCount; ++i) {
+                const uint8_t * pixel = &info->pixels[i * 4];
+                for (int channel = 0; channel < 3; ++channel) {
+                    if (maxCode < pixel[channel]) {
+                        maxIndex = i;
+                        maxCode = pixel[channel];
+                    }
+                }
+            }
+        }
+        info->maxChannel = (float)maxCode / (float)((1 << info->depth) - 1);
+    }
+    info->maxIndex = maxIndex;
+}
+
+static void gradeHistogramTaskFunc(clGradeSliceTask * info)
+{
+    uint64_t * counts = info->counts;
+
+    memset(counts, 0, sizeof(uint64_t) * gradeBinCount(info->depth));
+    if (info->depth == 32) {
+        const float * pixels = (const float *)info->pixels;
+        const float binMax = (float)(GRADE_FLOAT_HISTOGRAM_BINS - 1);
+        for (int i = 0; i < info->pixelCount; ++i) {
+            const float * pixel = &pixels[i * 4];
+            for (int channel = 0; channel < 3; ++channel) {
+                // CL_CLAMP() passes NaN through, so anything not above 0 (including NaN) goes to bin 0
+                float scaledChannel = pixel[channel] * info->luminanceScale;
+                int bin = (scaledChannel > 0.0f) ? (int)((CL_CLAMP(scaledChannel, 0.0f, 1.0f) * binMax) + 0.5f) : 0;
+                ++counts[CL_CLAMP(bin, 0, GRADE_FLOAT_HISTOGRAM_BINS - 1)];
+            }
+        }
+    } else if (info->depth > 8) {
+        const uint16_t * pixels = (const uint16_t *)info->pixels;
+        for (int i = 0; i < info->pixelCount; ++i) {
+            const uint16_t * pixel = &pixels[i * 4];
+            ++counts[pixel[0]];
+            ++counts[pixel[1]];
+            ++counts[pixel[2]];
+        }
+    } else {
+        for (int i = 0; i < info->pixelCount; ++i) {
+            const uint8_t * pixel = &info->pixels[i * 4];
+            ++counts[pixel[0]];
+            ++counts[pixel[1]];
+            ++counts[pixel[2]];
+        }
+    }
+}
+
+// Splits the pixels into taskCount slices (fewer for tiny images), and runs func over each of them
+// on the pool. Returns the slice count; infos must have room for taskCount slices.
+static int gradeSlicesRun(struct clContext * C, int taskCount, const uint8_t * pixels, int depth, int pixelCount, clTaskFunc func, clGradeSliceTask * infos)
+{
+    int pixelBytes = (depth == 32) ? (4 * sizeof(float)) : (4 * ((depth > 8) ? 2 : 1));
+    int slicePixels, sliceCount;
+
+    if (taskCount > pixelCount) {
+        taskCount = pixelCount;
+    }
+    if (taskCount < 1) {
+        taskCount = 1;
+    }
+    slicePixels = (pixelCount + taskCount - 1) / taskCount;
+    if (slicePixels < 1) {
+        // No pixels: still run one empty slice, so its results (zeroed counts, no max) are initialized
+        slicePixels = 1;
+    }
+    sliceCount = (pixelCount + slicePixels - 1) / slicePixels;
+    if (sliceCount < 1) {
+        sliceCount = 1;
+    }
+    for (int i = 0; i < sliceCount; ++i) {
+        int sliceStart = i * slicePixels;
+        infos[i].pixels = pixels + ((size_t)sliceStart * pixelBytes);
+        infos[i].depth = depth;
+        infos[i].pixelCount = ((pixelCount - sliceStart) < slicePixels) ? (pixelCount - sliceStart) : slicePixels;
+    }
+
+    if (sliceCount == 1) {
+        func(&infos[0]);
+    } else {
+        clTaskPool * pool = clContextTaskPool(C, sliceCount);
+        clTaskBatch batch;
+        clTask * tasks = clAllocate(sliceCount * sizeof(clTask));
+        clTaskBatchInit(&batch, sliceCount);
+        for (int i = 0; i < sliceCount; ++i) {
+            clTaskPoolSubmit(C, pool, &batch, &tasks[i], func, &infos[i]);
+        }
+        clTaskPoolWait(C, pool, &batch);
+        clFree(tasks);
+    }
+    return sliceCount;
+}
 
-    for (int i = 0; i < pixelCount; ++i) {
-        scaledChannel = pixel[0] * luminanceScale;
-        scaledChannel = CL_CLAMP(scaledChannel, 0.0f, 1.0f);
-        channelErrorTerm = fabsf(scaledChannel - powf(clPixelMathRoundf(powf(scaledChannel, invGamma) * maxChannel) / maxChannel, gamma));
-        errorTerm += channelErrorTerm; // * channelErrorTerm;
+static void gradeHistogramCreate(struct clContext * C, clGradeHistogram * histogram, int taskCount, const uint8_t * pixels, int depth, int pixelCount, float luminanceScale)
+{
+    const int binCount = gradeBinCount(depth);
+    const float binMax = (float)(binCount - 1);
+    clGradeSliceTask * infos = clAllocate(sizeof(clGradeSliceTask) * taskCount);
+    uint64_t * counts;
+    int sliceCount;
 
-        scaledChannel = pixel[1] * luminanceScale;
-        scaledChannel = CL_CLAMP(scaledChannel, 0.0f, 1.0f);
-        channelErrorTerm = fabsf(scaledChannel - powf(clPixelMathRoundf(powf(scaledChannel, invGamma) * maxChannel) / maxChannel, gamma));
-        errorTerm += channelErrorTerm; // * channelErrorTerm;
+    // Every slice counts into its own bins; they're summed into the first slice's
+    for (int i = 0; i < taskCount; ++i) {
+        infos[i].luminanceScale = luminanceScale;
+        infos[i].counts = clAllocate(sizeof(uint64_t) * binCount);
+    }
+    sliceCount = gradeSlicesRun(C, taskCount, pixels, depth, pixelCount, (clTaskFunc)gradeHistogramTaskFunc, infos);
+    counts = infos[0].counts;
+    for (int i = 1; i < sliceCount; ++i) {
+        for (int bin = 0; bin < binCount; ++bin) {
+            counts[bin] += infos[i].counts[bin];
+        }
+    }
 
-        scaledChannel = pixel[2] * luminanceScale;
-        scaledChannel = CL_CLAMP(scaledChannel, 0.0f, 1.0f);
-        channelErrorTerm = fabsf(scaledChannel - powf(clPixelMathRoundf(powf(scaledChannel, invGamma) * maxChannel) / maxChannel, gamma));
-        errorTerm += channelErrorTerm; // * channelErrorTerm;
+    histogram->binCount = 0;
+    for (int bin = 0; bin < binCount; ++bin) {
+        if (counts[bin]) {
+            ++histogram->binCount;
+        }
+    }
+    histogram->values = clAllocate(sizeof(float) * histogram->binCount);
+    histogram->weights = clAllocate(sizeof(double) * histogram->binCount);
+    histogram->binCount = 0;
+    for (int bin = 0; bin < binCount; ++bin) {
+        if (counts[bin]) {
+            float value = (float)bin / binMax;
+            if (depth != 32) {
+                // Codes are counted as they are; scale them now
+                value = CL_CLAMP(value * luminanceScale, 0.0f, 1.0f);
+            }
+            histogram->values[histogram->binCount] = value;
+            histogram->weights[histogram->binCount] = (double)counts[bin];
+            ++histogram->binCount;
+        }
+    }
 
-        pixel += 4;
+    for (int i = 0; i < taskCount; ++i) {
+        clFree(infos[i].counts);
     }
-    return errorTerm;
+    clFree(infos);
+}
+
+static void gradeHistogramDestroy(struct clContext * C, clGradeHistogram * histogram)
+{
+    clFree(histogram->values);
+    clFree(histogram->weights);
+}
+
+static float gammaErrorTerm(float gamma, const clGradeHistogram * histogram, float maxChannel)
+{
+    float invGamma = 1.0f / gamma;
+    double errorTerm = 0.0;
+
+    for (int i = 0; i < histogram->binCount; ++i) {
+        float value = histogram->values[i];
+        float channelErrorTerm = fabsf(value - powf(clPixelMathRoundf(powf(value, invGamma) * maxChannel) / maxChannel, gamma));
+        errorTerm += histogram->weights[i] * channelErrorTerm;
+    }
+    return (float)errorTerm;
 }
 
 typedef struct clGammaErrorTermTask
 {
     int gammaInt;
     float gamma;
-    float * pixels;
-    int pixelCount;
+    const clGradeHistogram * histogram;
     float maxChannel;
-    float luminanceScale;
     float outErrorTerm;
 } clGammaErrorTermTask;
 
 static void gammaErrorTermTaskFunc(clGammaErrorTermTask * info)
 {
-    info->outErrorTerm = gammaErrorTerm(info->gamma, info->pixels, info->pixelCount, info->maxChannel, info->luminanceScale);
+    info->outErrorTerm = gammaErrorTerm(info->gamma, info->histogram, info->maxChannel);
 }
 
-void clPixelMathColorGrade(struct clContext * C, int taskCount, struct clProfile * pixelProfile, float * pixels, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose)
+// Evaluates every attempt on the pool, and updates the best gamma (the lowest one, on ties)
+static void gammaAttemptsRun(struct clContext * C, clTaskPool * pool, int taskCount, clGammaErrorTermTask * infos, int attemptCount, int * bestGammaInt, float * bestErrorTerm, clBool verbose)
+{
+    clTaskBatch batch;
+    clTask tasks[GAMMA_RANGE_END - GAMMA_RANGE_START + 1];
+
+    clTaskBatchInit(&batch, taskCount);
+    for (int i = 0; i < attemptCount; ++i) {
+        infos[i].gamma = (float)infos[i].gammaInt / GAMMA_INT_DIVISOR;
+        infos[i].outErrorTerm = 0;
+        clTaskPoolSubmit(C, pool, &batch, &tasks[i], (clTaskFunc)gammaErrorTermTaskFunc, &infos[i]);
+    }
+    clTaskPoolWait(C, pool, &batch);
+
+    for (int i = 0; i < attemptCount; ++i) {
+        if ((*bestErrorTerm < 0.0f) || (*bestErrorTerm > infos[i].outErrorTerm) || ((*bestErrorTerm == infos[i].outErrorTerm) && (*bestGammaInt > infos[i].gammaInt))) {
+            *bestErrorTerm = infos[i].outErrorTerm;
+            *bestGammaInt = infos[i].gammaInt;
+        }
+        if (verbose)
+            clContextLog(C, "grading", 2, "attempt: gamma %.3g, err: %g     best -> gamma: %g, err: %g", infos[i].gamma, infos[i].outErrorTerm, (float)*bestGammaInt / GAMMA_INT_DIVISOR, *bestErrorTerm);
+    }
+}
+
+static void colorGrade(struct clContext * C, int taskCount, struct clProfile * pixelProfile, const uint8_t * pixels, int depth, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose)
 {
     int maxLuminance = 0;
     float bestGamma = 0.0f;
 
+    COLORIST_ASSERT(taskCount);
+
     // Find max luminance
     if (*outLuminance == 0) {
-        float * pixel;
         int indexWithMaxChannel = 0;
         float maxChannel = 0.0f;
         float maxPixel[4];
         float xyz[3];
         int pixelX, pixelY;
         float pixelLuminance, maxLuminanceFloat;
+        clGradeSliceTask * infos = clAllocate(sizeof(clGradeSliceTask) * taskCount);
+        int sliceCount;
+        int sliceStart = 0;
 
         clTransform * toXYZ = clTransformCreate(C, pixelProfile, CL_XF_RGBA, 32, NULL, CL_XF_XYZ, 32, CL_TONEMAP_OFF);
 
-        pixel = pixels;
-        for (int i = 0; i < pixelCount; ++i) {
-            if (maxChannel < pixel[0]) {
-                indexWithMaxChannel = i;
-                maxChannel = pixel[0];
+        // Slices are combined in order, so the first pixel with the largest channel wins regardless of taskCount
+        sliceCount = gradeSlicesRun(C, taskCount, pixels, depth, pixelCount, (clTaskFunc)gradeMaxTaskFunc, infos);
+        for (int i = 0; i < sliceCount; ++i) {
+            if (maxChannel < infos[i].maxChannel) {
+                indexWithMaxChannel = sliceStart + infos[i].maxIndex;
+                maxChannel = infos[i].maxChannel;
             }
-            if (maxChannel < pixel[1]) {
-                indexWithMaxChannel = i;
-                maxChannel = pixel[1];
-            }
-            if (maxChannel < pixel[2]) {
-                indexWithMaxChannel = i;
-                maxChannel = pixel[2];
-            }
-            pixel += 4;
+            sliceStart += infos[i].pixelCount;
         }
+        clFree(infos);
 
-        clTransformRun(C, toXYZ, 1, &pixels[indexWithMaxChannel * 4], xyz, 1);
+        if (depth == 32) {
+            memcpy(maxPixel, &((const float *)pixels)[indexWithMaxChannel * 4], sizeof(maxPixel));
+        } else {
+            float maxCode = (float)((1 << depth) - 1);
+            for (int channel = 0; channel < 4; ++channel) {
+                int code = (depth > 8) ? ((const uint16_t *)pixels)[(indexWithMaxChannel * 4) + channel] : pixels[(indexWithMaxChannel * 4) + channel];
+                maxPixel[channel] = (float)code / maxCode;
+            }
+        }
+        clTransformRun(C, toXYZ, 1, maxPixel, xyz, 1);
         pixelX = indexWithMaxChannel % imageWidth;
         pixelY = indexWithMaxChannel / imageWidth;
         pixelLuminance = xyz[1];
@@ -143,53 +372,43 @@ void clPixelMathColorGrade(struct clContext * C, int taskCount, struct clProfile
     // Find best gamma
     if (*outGamma <= 0.0f) {
         float luminanceScale = (float)srcLuminance / maxLuminance;
-        int gammaInt;
         int minGammaInt = 0;
         float minErrorTerm = -1.0f;
         float maxChannel = (float)((1 << dstColorDepth) - 1);
-        clTask ** tasks;
-        clGammaErrorTermTask * infos;
-        int tasksInFlight = 0;
-        COLORIST_ASSERT(taskCount);
-
-        clContextLog(C, "grading", 1, "Using %d thread%s to find best gamma.", taskCount, (taskCount == 1) ? "" : "s");
-
-        tasks = clAllocate(taskCount * sizeof(clTask *));
-        infos = clAllocate(taskCount * sizeof(clGammaErrorTermTask));
-        for (gammaInt = GAMMA_RANGE_START; gammaInt <= GAMMA_RANGE_END; ++gammaInt) {
-            float gammaAttempt = (float)gammaInt / GAMMA_INT_DIVISOR;
-
-            infos[tasksInFlight].gammaInt = gammaInt;
-            infos[tasksInFlight].gamma = gammaAttempt;
-            infos[tasksInFlight].pixels = pixels;
-            infos[tasksInFlight].pixelCount = pixelCount;
-            infos[tasksInFlight].maxChannel = maxChannel;
-            infos[tasksInFlight].luminanceScale = luminanceScale;
-            infos[tasksInFlight].outErrorTerm = 0;
-            tasks[tasksInFlight] = clTaskCreate(C, (clTaskFunc)gammaErrorTermTaskFunc, &infos[tasksInFlight]);
-            ++tasksInFlight;
-
-            if ((tasksInFlight == taskCount) || (gammaInt == GAMMA_RANGE_END)) {
-                for (int i = 0; i < tasksInFlight; ++i) {
-                    clTaskJoin(C, tasks[i]);
-                    if (minErrorTerm < 0.0f) {
-                        minErrorTerm = infos[i].outErrorTerm;
-                        minGammaInt = infos[i].gammaInt;
-                    } else if (minErrorTerm > infos[i].outErrorTerm) {
-                        minErrorTerm = infos[i].outErrorTerm;
-                        minGammaInt = infos[i].gammaInt;
-                    }
-                    if (verbose)
-                        clContextLog(C, "grading", 2, "attempt: gamma %.3g, err: %g     best -> gamma: %g, err: %g", infos[i].gamma, infos[i].outErrorTerm, (float)minGammaInt / GAMMA_INT_DIVISOR, minErrorTerm);
-                    clTaskDestroy(C, tasks[i]);
+        clTaskPool * pool = clContextTaskPool(C, taskCount);
+        clGradeHistogram histogram;
+        clGammaErrorTermTask infos[GAMMA_RANGE_END - GAMMA_RANGE_START + 1];
+        int attemptCount = 0;
+
+        gradeHistogramCreate(C, &histogram, taskCount, pixels, depth, pixelCount, luminanceScale);
+        clContextLog(C, "grading", 1, "Using %d thread%s to find best gamma (%d histogram bins).", taskCount, (taskCount == 1) ? "" : "s", histogram.binCount);
+
+        for (int gammaInt = GAMMA_RANGE_START; gammaInt <= GAMMA_RANGE_END; gammaInt += GAMMA_COARSE_STEP) {
+            infos[attemptCount].gammaInt = gammaInt;
+            infos[attemptCount].histogram = &histogram;
+            infos[attemptCount].maxChannel = maxChannel;
+            ++attemptCount;
+        }
+        gammaAttemptsRun(C, pool, taskCount, infos, attemptCount, &minGammaInt, &minErrorTerm, verbose);
+
+        for (int step = GAMMA_COARSE_STEP / 2; step > 0; step /= 2) {
+            int centerGammaInt = minGammaInt;
+            attemptCount = 0;
+            for (int direction = -1; direction <= 1; direction += 2) {
+                int gammaInt = centerGammaInt + (direction * step);
+                if ((gammaInt >= GAMMA_RANGE_START) && (gammaInt <= GAMMA_RANGE_END)) {
+                    infos[attemptCount].gammaInt = gammaInt;
+                    infos[attemptCount].histogram = &histogram;
+                    infos[attemptCount].maxChannel = maxChannel;
+                    ++attemptCount;
                 }
-                tasksInFlight = 0;
             }
+            gammaAttemptsRun(C, pool, taskCount, infos, attemptCount, &minGammaInt, &minErrorTerm, verbose);
         }
+
         bestGamma = (float)minGammaInt / GAMMA_INT_DIVISOR;
         clContextLog(C, "grading", 1, "Found best gamma: %g", bestGamma);
-        clFree(tasks);
-        clFree(infos);
+        gradeHistogramDestroy(C, &histogram);
     } else {
         bestGamma = *outGamma;
         clContextLog(C, "grading", 1, "Using requested gamma: %g", bestGamma);
@@ -198,3 +417,13 @@ void clPixelMathColorGrade(struct clContext * C, int taskCount, struct clProfile
     *outLuminance = maxLuminance;
     *outGamma = bestGamma;
 }
+
+void clPixelMathColorGrade(struct clContext * C, int taskCount, struct clProfile * pixelProfile, float * pixels, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose)
+{
+    colorGrade(C, taskCount, pixelProfile, (const uint8_t *)pixels, 32, pixelCount, imageWidth, srcLuminance, dstColorDepth, outLuminance, outGamma, verbose);
+}
+
+void clPixelMathColorGradeUNorm(struct clContext * C, int taskCount, struct clProfile * pixelProfile, const uint8_t * pixels, int depth, int pixelCount, int imageWidth, int srcLuminance, int dstColorDepth, int * outLuminance, float * outGamma, clBool verbose)
+{
+    colorGrade(C, taskCount, pixelProfile, pixels, depth, pixelCount, imageWidth, srcLuminance, dstColorDepth, outLuminance, outGamma, verbose);
+}
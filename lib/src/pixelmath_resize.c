@@ -1,12 +1,103 @@
 #include "colorist/pixelmath.h"
 
 #include "colorist/context.h"
+#include "colorist/task.h"
 
 #include "stb_image_resize.h"
 
+#include <math.h>
 #include <string.h>
 
-void clPixelMathResize(struct clContext * C, int srcW, int srcH, float * srcPixels, int dstW, int dstH, float * dstPixels, clFilter filter)
+typedef struct clResizeTask
+{
+    struct clContext * C;
+    int srcW;
+    int srcH;
+    float * srcPixels;
+    int dstW;
+    int dstH;
+    int dstY;
+    int dstRowCount;
+    float * dstPixels;
+    clFilter filter;
+} clResizeTask;
+
+static void resizeTaskFunc(clResizeTask * info)
+{
+    int srcY, srcRowCount;
+    clPixelMathResizeBandSrcRows(info->C, info->srcH, info->dstH, info->dstY, info->dstRowCount, info->filter, &srcY, &srcRowCount);
+    clPixelMathResizeBand(info->C,
+                          info->srcW, info->srcH, srcY, srcRowCount, &info->srcPixels[4 * (size_t)info->srcW * srcY],
+                          info->dstW, info->dstH, info->dstY, info->dstRowCount, &info->dstPixels[4 * (size_t)info->dstW * info->dstY],
+                          info->filter);
+}
+
+void clPixelMathResize(struct clContext * C, int taskCount, int srcW, int srcH, float * srcPixels, int dstW, int dstH, float * dstPixels, clFilter filter)
+{
+    if (taskCount > dstH) {
+        taskCount = dstH;
+    }
+
+    if (taskCount <= 1) {
+        clPixelMathResizeBand(C, srcW, srcH, 0, srcH, srcPixels, dstW, dstH, 0, dstH, dstPixels, filter);
+    } else {
+        // One band of output rows per thread; every band costs about the same, and each extra band
+        // re-reads the source rows its filter overlaps with its neighbors.
+        int bandRows = (dstH + taskCount - 1) / taskCount;
+        int bandCount = (dstH + bandRows - 1) / bandRows;
+        clTaskPool * pool = clContextTaskPool(C, taskCount);
+        clTaskBatch batch;
+        clTask * tasks = clAllocate(bandCount * sizeof(clTask));
+        clResizeTask * infos = clAllocate(bandCount * sizeof(clResizeTask));
+
+        clContextLog(C, "resize", 1, "Using %d threads to resize (%d bands of up to %d rows).", taskCount, bandCount, bandRows);
+
+        clTaskBatchInit(&batch, taskCount);
+        for (int i = 0; i < bandCount; ++i) {
+            infos[i].C = C;
+            infos[i].srcW = srcW;
+            infos[i].srcH = srcH;
+            infos[i].srcPixels = srcPixels;
+            infos[i].dstW = dstW;
+            infos[i].dstH = dstH;
+            infos[i].dstY = i * bandRows;
+            infos[i].dstRowCount = ((dstH - infos[i].dstY) < bandRows) ? (dstH - infos[i].dstY) : bandRows;
+            infos[i].dstPixels = dstPixels;
+            infos[i].filter = filter;
+            clTaskPoolSubmit(C, pool, &batch, &tasks[i], (clTaskFunc)resizeTaskFunc, &infos[i]);
+        }
+        clTaskPoolWait(C, pool, &batch);
+
+        clFree(tasks);
+        clFree(infos);
+    }
+}
+
+void clPixelMathResizeBandSrcRows(struct clContext * C, int srcH, int dstH, int dstY, int dstRowCount, clFilter filter, int * outSrcY, int * outSrcRowCount)
+{
+    int firstRow, lastRow;
+    COLORIST_UNUSED(C);
+
+    if (filter == CL_FILTER_NEAREST) {
+        // Same math as the nearest neighbor loop in clPixelMathResizeBand(), which is monotonic in j
+        float scaleH = (float)srcH / (float)dstH;
+        firstRow = (int)(((float)dstY + 0.5f) * scaleH);
+        lastRow = (int)(((float)(dstY + dstRowCount - 1) + 0.5f) * scaleH);
+    } else {
+        // Every STB filter reaches at most 2 pixels out (scaled up by the shrink factor when
+        // downsampling); pad by a little extra to cover float rounding in the sample ranges.
+        double scaleH = (double)srcH / (double)dstH;
+        int margin = (int)ceil(2.0 * ((scaleH > 1.0) ? scaleH : 1.0)) + 2;
+        firstRow = (int)floor((double)dstY * scaleH) - margin;
+        lastRow = (int)ceil((double)(dstY + dstRowCount) * scaleH) + margin;
+    }
+    firstRow = CL_CLAMP(firstRow, 0, srcH - 1);
+    lastRow = CL_CLAMP(lastRow, 0, srcH - 1);
+    *outSrcY = firstRow;
+    *outSrcRowCount = lastRow - firstRow + 1;
+}
+
+void clPixelMathResizeBand(struct clContext * C, int srcW, int srcH, int srcY, int srcRowCount, float * srcPixels, int dstW, int dstH, int dstY, int dstRowCount, float * dstPixels, clFilter filter)
 {
     COLORIST_UNUSED(C);
 
@@ -14,20 +105,20 @@ void clPixelMathResize(struct clContext * C, int srcW, int srcH, float * srcPixe
         // colorist's very own super-obvious nearest neighbor implementation
         float scaleW = (float)srcW / (float)dstW;
         float scaleH = (float)srcH / (float)dstH;
-        for (int j = 0; j < dstH; ++j) {
+        for (int j = 0; j < dstRowCount; ++j) {
+            int srcRow = (int)(((float)(dstY + j) + 0.5f) * scaleH);
+            srcRow = CL_CLAMP(srcRow, srcY, srcY + srcRowCount - 1) - srcY;
             for (int i = 0; i < dstW; ++i) {
                 float * srcPixel;
                 float * dstPixel;
                 int srcX = (int)(((float)i + 0.5f) * scaleW);
-                int srcY = (int)(((float)j + 0.5f) * scaleH);
                 srcX = CL_CLAMP(srcX, 0, srcW - 1);
-                srcY = CL_CLAMP(srcY, 0, srcH - 1);
-                srcPixel = &srcPixels[4 * (srcX + (srcY * srcW))];
+                srcPixel = &srcPixels[4 * (srcX + (srcRow * srcW))];
                 dstPixel = &dstPixels[4 * (i + (j * dstW))];
                 memcpy(dstPixel, srcPixel, 4 * sizeof(float));
             }
         }
-    } else {
+    } else if ((srcY == 0) && (srcRowCount == srcH) && (dstY == 0) && (dstRowCount == dstH)) {
         // use STB!
         stbir_resize_float_generic(
             srcPixels, srcW, srcH, srcW * 4 * sizeof(float),
@@ -35,5 +126,354 @@ void clPixelMathResize(struct clContext * C, int srcW, int srcH, float * srcPixe
             4, 3, 0,
             STBIR_EDGE_CLAMP, (stbir_filter)filter, STBIR_COLORSPACE_LINEAR,
             NULL);
+    } else {
+        // Resize a band of rows: keep the full image's scale, and shift it (in output pixels) so
+        // the band's first output row lines up with where it lands in the full image.
+        float scaleW = (float)dstW / (float)srcW;
+        float scaleH = (float)dstH / (float)srcH;
+        float shiftY = (float)((double)dstY - ((double)srcY * (double)dstH / (double)srcH));
+        stbir_resize_subpixel(
+            srcPixels, srcW, srcRowCount, srcW * 4 * sizeof(float),
+            dstPixels, dstW, dstRowCount, dstW * 4 * sizeof(float),
+            STBIR_TYPE_FLOAT, 4, 3, 0,
+            STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP, (stbir_filter)filter, (stbir_filter)filter, STBIR_COLORSPACE_LINEAR,
+            NULL,
+            scaleW, scaleH, 0.0f, shiftY);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+// Native depth resizing
+
+typedef struct clResizeNearestTask
+{
+    int pixelBytes;
+    int srcW;
+    int srcH;
+    const uint8_t * srcPixels;
+    int dstW;
+    int dstH;
+    int dstY;
+    int dstRowCount;
+    uint8_t * dstPixels;
+    const int * srcOffsets;
+} clResizeNearestTask;
+
+static void resizeNearestTaskFunc(clResizeNearestTask * info)
+{
+    float scaleH = (float)info->srcH / (float)info->dstH;
+    for (int j = info->dstY; j < (info->dstY + info->dstRowCount); ++j) {
+        int srcY = (int)(((float)j + 0.5f) * scaleH);
+        const uint8_t * srcRow = &info->srcPixels[(size_t)info->pixelBytes * info->srcW * CL_CLAMP(srcY, 0, info->srcH - 1)];
+        uint8_t * dstPixel = &info->dstPixels[(size_t)info->pixelBytes * info->dstW * j];
+        for (int i = 0; i < info->dstW; ++i) {
+            memcpy(dstPixel, &srcRow[info->srcOffsets[i]], info->pixelBytes);
+            dstPixel += info->pixelBytes;
+        }
+    }
+}
+
+void clPixelMathResizeNearest(struct clContext * C, int taskCount, int pixelBytes, int srcW, int srcH, uint8_t * srcPixels, int dstW, int dstH, uint8_t * dstPixels)
+{
+    // Same sampling as the float nearest neighbor in clPixelMathResizeBand(), just copying whole
+    // pixels at whatever depth they're stored in
+    float scaleW = (float)srcW / (float)dstW;
+    int * srcOffsets = clAllocate(dstW * sizeof(int));
+    clResizeNearestTask * infos;
+    int bandRows, bandCount;
+
+    for (int i = 0; i < dstW; ++i) {
+        int srcX = (int)(((float)i + 0.5f) * scaleW);
+        srcOffsets[i] = pixelBytes * CL_CLAMP(srcX, 0, srcW - 1);
+    }
+
+    if (taskCount > dstH) {
+        taskCount = dstH;
+    }
+    if (taskCount < 1) {
+        taskCount = 1;
+    }
+    bandRows = (dstH + taskCount - 1) / taskCount;
+    bandCount = (dstH + bandRows - 1) / bandRows;
+    infos = clAllocate(bandCount * sizeof(clResizeNearestTask));
+    for (int i = 0; i < bandCount; ++i) {
+        infos[i].pixelBytes = pixelBytes;
+        infos[i].srcW = srcW;
+        infos[i].srcH = srcH;
+        infos[i].srcPixels = srcPixels;
+        infos[i].dstW = dstW;
+        infos[i].dstH = dstH;
+        infos[i].dstY = i * bandRows;
+        infos[i].dstRowCount = ((dstH - infos[i].dstY) < bandRows) ? (dstH - infos[i].dstY) : bandRows;
+        infos[i].dstPixels = dstPixels;
+        infos[i].srcOffsets = srcOffsets;
+    }
+
+    if (bandCount == 1) {
+        resizeNearestTaskFunc(&infos[0]);
+    } else {
+        clTaskPool * pool = clContextTaskPool(C, taskCount);
+        clTaskBatch batch;
+        clTask * tasks = clAllocate(bandCount * sizeof(clTask));
+
+        clContextLog(C, "resize", 1, "Using %d threads to resize (%d bands of up to %d rows).", taskCount, bandCount, bandRows);
+        clTaskBatchInit(&batch, taskCount);
+        for (int i = 0; i < bandCount; ++i) {
+            clTaskPoolSubmit(C, pool, &batch, &tasks[i], (clTaskFunc)resizeNearestTaskFunc, &infos[i]);
+        }
+        clTaskPoolWait(C, pool, &batch);
+        clFree(tasks);
+    }
+
+    clFree(infos);
+    clFree(srcOffsets);
+}
+
+// Weights are Q14; the vertical pass leaves Q6 intermediates, so a horizontal sum of even the
+// ringiest filter stays comfortably inside 32 bits.
+#define RESIZE_WEIGHT_BITS 14
+#define RESIZE_INTERMEDIATE_BITS 6
+
+// Per-output-pixel filter taps along one axis: dst pixel i reads count[i] source pixels starting at
+// first[i], weighted by weights[i * maxTaps ...]. Edge clamping is folded into the weights.
+typedef struct clResizeWeights
+{
+    int maxTaps;
+    int * first;
+    int * count;
+    int32_t * weights;
+} clResizeWeights;
+
+// The kernels and support widths below match stb_image_resize's, so the fixed point path filters
+// the same way as the float one
+static float resizeKernel(clFilter filter, float x, float s)
+{
+    x = fabsf(x);
+    switch (filter) {
+        case CL_FILTER_BOX: {
+            float t = 0.5f + (s / 2);
+            if (x >= t)
+                return 0.0f;
+            if (x <= (0.5f - (s / 2)))
+                return 1.0f;
+            return (t - x) / s;
+        }
+        case CL_FILTER_TRIANGLE:
+            return (x <= 1.0f) ? (1.0f - x) : 0.0f;
+        case CL_FILTER_CUBICBSPLINE:
+            if (x < 1.0f)
+                return (4 + x * x * (3 * x - 6)) / 6;
+            if (x < 2.0f)
+                return (8 + x * (-12 + x * (6 - x))) / 6;
+            return 0.0f;
+        case CL_FILTER_CATMULLROM:
+            if (x < 1.0f)
+                return 1 - x * x * (2.5f - 1.5f * x);
+            if (x < 2.0f)
+                return 2 - x * (4 + x * (0.5f * x - 2.5f));
+            return 0.0f;
+        case CL_FILTER_MITCHELL:
+            if (x < 1.0f)
+                return (16 + x * x * (21 * x - 36)) / 18;
+            if (x < 2.0f)
+                return (32 + x * (-60 + x * (36 - 7 * x))) / 18;
+            return 0.0f;
+        case CL_FILTER_AUTO:
+        case CL_FILTER_NEAREST:
+        case CL_FILTER_INVALID:
+        default:
+            break;
+    }
+    return 0.0f;
+}
+
+static float resizeSupport(clFilter filter, float s)
+{
+    switch (filter) {
+        case CL_FILTER_BOX:
+            return 0.5f + (s / 2);
+        case CL_FILTER_TRIANGLE:
+            return 1.0f;
+        case CL_FILTER_CUBICBSPLINE:
+        case CL_FILTER_CATMULLROM:
+        case CL_FILTER_MITCHELL:
+            return 2.0f;
+        case CL_FILTER_AUTO:
+        case CL_FILTER_NEAREST:
+        case CL_FILTER_INVALID:
+        default:
+            break;
     }
+    return 0.0f;
+}
+
+static void resizeWeightsCreate(struct clContext * C, clResizeWeights * rw, clFilter filter, int srcSize, int dstSize)
+{
+    float scale = (float)dstSize / (float)srcSize;
+    clBool upsampling = (scale > 1.0f) ? clTrue : clFalse;
+    if (filter == CL_FILTER_AUTO) {
+        // stb_image_resize's defaults, chosen per axis
+        filter = upsampling ? CL_FILTER_CATMULLROM : CL_FILTER_MITCHELL;
+    }
+    float s = upsampling ? (1.0f / scale) : scale;
+    float radius = upsampling ? resizeSupport(filter, s) : (resizeSupport(filter, s) / scale);
+    int maxSpan = (int)ceilf(radius * 2.0f) + 3;
+    float * tmp = clAllocate(maxSpan * sizeof(float));
+
+    rw->maxTaps = (maxSpan < srcSize) ? maxSpan : srcSize;
+    rw->first = clAllocate(dstSize * sizeof(int));
+    rw->count = clAllocate(dstSize * sizeof(int));
+    rw->weights = clAllocate((size_t)dstSize * rw->maxTaps * sizeof(int32_t));
+
+    for (int i = 0; i < dstSize; ++i) {
+        float center = ((float)i + 0.5f) / scale;
+        int lo = (int)floorf(center - radius);
+        int hi = lo + maxSpan - 1;
+        int first = (lo > 0) ? lo : 0;
+        int last = (hi < (srcSize - 1)) ? hi : (srcSize - 1);
+        int count = last - first + 1;
+        int32_t * weights = &rw->weights[(size_t)i * rw->maxTaps];
+        float total = 0.0f;
+        int32_t fixedTotal = 0;
+        int largest = 0;
+
+        memset(tmp, 0, count * sizeof(float));
+        for (int k = lo; k <= hi; ++k) {
+            float d = center - ((float)k + 0.5f);
+            float w = upsampling ? resizeKernel(filter, d, s) : (resizeKernel(filter, d * scale, s) * scale);
+            tmp[CL_CLAMP(k, first, last) - first] += w;
+            total += w;
+        }
+
+        for (int k = 0; k < count; ++k) {
+            weights[k] = (int32_t)clPixelMathRoundf(tmp[k] / total * (float)(1 << RESIZE_WEIGHT_BITS));
+            fixedTotal += weights[k];
+            if (weights[k] > weights[largest]) {
+                largest = k;
+            }
+        }
+        // Rounding can leave the taps a hair off of unity; don't let that tint flat areas
+        weights[largest] += (1 << RESIZE_WEIGHT_BITS) - fixedTotal;
+
+        rw->first[i] = first;
+        rw->count[i] = count;
+    }
+    clFree(tmp);
+}
+
+static void resizeWeightsDestroy(struct clContext * C, clResizeWeights * rw)
+{
+    clFree(rw->first);
+    clFree(rw->count);
+    clFree(rw->weights);
+}
+
+typedef struct clResizeU8Task
+{
+    struct clContext * C;
+    int srcW;
+    uint8_t * srcPixels;
+    int dstW;
+    int dstY;
+    int dstRowCount;
+    uint8_t * dstPixels;
+    clResizeWeights * horizontal;
+    clResizeWeights * vertical;
+} clResizeU8Task;
+
+static void resizeU8TaskFunc(clResizeU8Task * info)
+{
+    struct clContext * C = info->C;
+    int srcChannels = 4 * info->srcW;
+    int32_t * row = clAllocate(srcChannels * sizeof(int32_t));
+
+    for (int j = info->dstY; j < (info->dstY + info->dstRowCount); ++j) {
+        // Vertical pass: blend the contributing source rows into one Q6 row
+        const int32_t * vWeights = &info->vertical->weights[(size_t)j * info->vertical->maxTaps];
+        const uint8_t * srcRow = &info->srcPixels[(size_t)srcChannels * info->vertical->first[j]];
+        int vCount = info->vertical->count[j];
+        memset(row, 0, srcChannels * sizeof(int32_t));
+        for (int k = 0; k < vCount; ++k) {
+            const int32_t w = vWeights[k];
+            const uint8_t * srcChannel = &srcRow[(size_t)k * srcChannels];
+            for (int c = 0; c < srcChannels; ++c) {
+                row[c] += w * srcChannel[c];
+            }
+        }
+        for (int c = 0; c < srcChannels; ++c) {
+            row[c] = (row[c] + (1 << (RESIZE_WEIGHT_BITS - RESIZE_INTERMEDIATE_BITS - 1))) >> (RESIZE_WEIGHT_BITS - RESIZE_INTERMEDIATE_BITS);
+        }
+
+        // Horizontal pass: filter that row into the destination
+        uint8_t * dstPixel = &info->dstPixels[(size_t)4 * info->dstW * j];
+        for (int i = 0; i < info->dstW; ++i) {
+            const int32_t * hWeights = &info->horizontal->weights[(size_t)i * info->horizontal->maxTaps];
+            const int32_t * rowPixel = &row[4 * info->horizontal->first[i]];
+            int hCount = info->horizontal->count[i];
+            int32_t sum[4] = { 0, 0, 0, 0 };
+            for (int k = 0; k < hCount; ++k) {
+                sum[0] += hWeights[k] * rowPixel[4 * k + 0];
+                sum[1] += hWeights[k] * rowPixel[4 * k + 1];
+                sum[2] += hWeights[k] * rowPixel[4 * k + 2];
+                sum[3] += hWeights[k] * rowPixel[4 * k + 3];
+            }
+            for (int c = 0; c < 4; ++c) {
+                int32_t v = (sum[c] + (1 << (RESIZE_WEIGHT_BITS + RESIZE_INTERMEDIATE_BITS - 1))) >> (RESIZE_WEIGHT_BITS + RESIZE_INTERMEDIATE_BITS);
+                dstPixel[c] = (uint8_t)CL_CLAMP(v, 0, 255);
+            }
+            dstPixel += 4;
+        }
+    }
+    clFree(row);
+}
+
+void clPixelMathResizeU8(struct clContext * C, int taskCount, int srcW, int srcH, uint8_t * srcPixels, int dstW, int dstH, uint8_t * dstPixels, clFilter filter)
+{
+    clResizeWeights horizontal, vertical;
+    clResizeU8Task * infos;
+    int bandRows, bandCount;
+
+    resizeWeightsCreate(C, &horizontal, filter, srcW, dstW);
+    resizeWeightsCreate(C, &vertical, filter, srcH, dstH);
+
+    if (taskCount > dstH) {
+        taskCount = dstH;
+    }
+    if (taskCount < 1) {
+        taskCount = 1;
+    }
+    bandRows = (dstH + taskCount - 1) / taskCount;
+    bandCount = (dstH + bandRows - 1) / bandRows;
+    infos = clAllocate(bandCount * sizeof(clResizeU8Task));
+    for (int i = 0; i < bandCount; ++i) {
+        infos[i].C = C;
+        infos[i].srcW = srcW;
+        infos[i].srcPixels = srcPixels;
+        infos[i].dstW = dstW;
+        infos[i].dstY = i * bandRows;
+        infos[i].dstRowCount = ((dstH - infos[i].dstY) < bandRows) ? (dstH - infos[i].dstY) : bandRows;
+        infos[i].dstPixels = dstPixels;
+        infos[i].horizontal = &horizontal;
+        infos[i].vertical = &vertical;
+    }
+
+    if (bandCount == 1) {
+        resizeU8TaskFunc(&infos[0]);
+    } else {
+        clTaskPool * pool = clContextTaskPool(C, taskCount);
+        clTaskBatch batch;
+        clTask * tasks = clAllocate(bandCount * sizeof(clTask));
+
+        clContextLog(C, "resize", 1, "Using %d threads to resize (%d bands of up to %d rows).", taskCount, bandCount, bandRows);
+        clTaskBatchInit(&batch, taskCount);
+        for (int i = 0; i < bandCount; ++i) {
+            clTaskPoolSubmit(C, pool, &batch, &tasks[i], (clTaskFunc)resizeU8TaskFunc, &infos[i]);
+        }
+        clTaskPoolWait(C, pool, &batch);
+        clFree(tasks);
+    }
+
+    clFree(infos);
+    resizeWeightsDestroy(C, &horizontal);
+    resizeWeightsDestroy(C, &vertical);
 }
@@ -1,6 +1,7 @@
 #include "colorist/pixelmath.h"
 
 #include "colorist/context.h"
+#include "colorist/task.h"
 
 void clPixelMathUNormToFloat(struct clContext * C, uint8_t * inPixels, int inDepth, float * outPixels, int pixelCount)
 {
@@ -160,3 +161,175 @@ void clPixelMathHaldCLUTLookup(struct clContext * C, float * haldData, int haldD
     // Copy alpha directly
     dst[3] = src[3];
 }
+
+// Pixels unpacked to floats at a time when applying a Hald CLUT to 8/16-bit pixels
+#define HALD_BLOCK_PIXELS 256
+
+static void haldInterpolate(const float * lattice, int dims, const float * srcPixels, float * dstPixels, int pixelCount)
+{
+    const float scale = (float)(dims - 1);
+    const int strideR = 3;
+    const int strideG = 3 * dims;
+    const int strideB = 3 * dims * dims;
+
+    // Tetrahedral interpolation, written without data dependent branches (just selects) so the
+    // compiler is free to vectorize it
+    for (int i = 0; i < pixelCount; ++i) {
+        const float * src = &srcPixels[i * 4];
+        float * dst = &dstPixels[i * 4];
+        float fr = CL_CLAMP(src[0], 0.0f, 1.0f) * scale;
+        float fg = CL_CLAMP(src[1], 0.0f, 1.0f) * scale;
+        float fb = CL_CLAMP(src[2], 0.0f, 1.0f) * scale;
+        int ir = (int)fr;
+        int ig = (int)fg;
+        int ib = (int)fb;
+        ir = (ir < dims - 2) ? ir : dims - 2;
+        ig = (ig < dims - 2) ? ig : dims - 2;
+        ib = (ib < dims - 2) ? ib : dims - 2;
+        float dr = fr - (float)ir;
+        float dg = fg - (float)ig;
+        float db = fb - (float)ib;
+
+        // The tetrahedron walks from c000 to c111 along the axes in order of decreasing fractional
+        // distance. Ties go to R, then G, then B for the largest and B, G, R for the smallest, so
+        // the two are never the same axis.
+        int largest = ((dr >= dg) && (dr >= db)) ? strideR : ((dg >= db) ? strideG : strideB);
+        int smallest = ((db <= dg) && (db <= dr)) ? strideB : ((dg <= dr) ? strideG : strideR);
+        float hi = (dr > dg) ? ((dr > db) ? dr : db) : ((dg > db) ? dg : db);
+        float lo = (dr < dg) ? ((dr < db) ? dr : db) : ((dg < db) ? dg : db);
+        float mid = (dr + dg + db) - hi - lo;
+
+        const float * c000 = &lattice[(ir * strideR) + (ig * strideG) + (ib * strideB)];
+        const float * c1 = c000 + largest;
+        const float * c2 = c000 + (strideR + strideG + strideB) - smallest;
+        const float * c111 = c000 + strideR + strideG + strideB;
+        float w0 = 1.0f - hi;
+        float w1 = hi - mid;
+        float w2 = mid - lo;
+        float w3 = lo;
+        float alpha = src[3];
+        dst[0] = (w0 * c000[0]) + (w1 * c1[0]) + (w2 * c2[0]) + (w3 * c111[0]);
+        dst[1] = (w0 * c000[1]) + (w1 * c1[1]) + (w2 * c2[1]) + (w3 * c111[1]);
+        dst[2] = (w0 * c000[2]) + (w1 * c1[2]) + (w2 * c2[2]) + (w3 * c111[2]);
+        dst[3] = alpha;
+    }
+}
+
+typedef struct clHaldTask
+{
+    const float * lattice;
+    int haldDims;
+    const void * srcPixels;
+    void * dstPixels;
+    int depth; // 32 for floats, otherwise the UNorm depth of both srcPixels and dstPixels
+    int pixelCount;
+} clHaldTask;
+
+static void haldTaskFunc(clHaldTask * info)
+{
+    float block[HALD_BLOCK_PIXELS * 4];
+    float maxChannel;
+
+    if (info->depth == 32) {
+        haldInterpolate(info->lattice, info->haldDims, (const float *)info->srcPixels, (float *)info->dstPixels, info->pixelCount);
+        return;
+    }
+
+    // Stream 8/16-bit pixels through a small float block, so they never need a float copy
+    maxChannel = (float)((1 << info->depth) - 1);
+    for (int blockStart = 0; blockStart < info->pixelCount; blockStart += HALD_BLOCK_PIXELS) {
+        int blockChannels = 4 * (((info->pixelCount - blockStart) < HALD_BLOCK_PIXELS) ? (info->pixelCount - blockStart) : HALD_BLOCK_PIXELS);
+        size_t channelOffset = (size_t)blockStart * 4;
+        if (info->depth > 8) {
+            const uint16_t * src = (const uint16_t *)info->srcPixels + channelOffset;
+            for (int i = 0; i < blockChannels; ++i) {
+                block[i] = (float)src[i] / maxChannel;
+            }
+        } else {
+            const uint8_t * src = (const uint8_t *)info->srcPixels + channelOffset;
+            for (int i = 0; i < blockChannels; ++i) {
+                block[i] = (float)src[i] / maxChannel;
+            }
+        }
+        haldInterpolate(info->lattice, info->haldDims, block, block, blockChannels / 4);
+        if (info->depth > 8) {
+            uint16_t * dst = (uint16_t *)info->dstPixels + channelOffset;
+            for (int i = 0; i < blockChannels; ++i) {
+                dst[i] = (uint16_t)clPixelMathRoundNormalized(block[i], maxChannel);
+            }
+        } else {
+            uint8_t * dst = (uint8_t *)info->dstPixels + channelOffset;
+            for (int i = 0; i < blockChannels; ++i) {
+                dst[i] = (uint8_t)clPixelMathRoundNormalized(block[i], maxChannel);
+            }
+        }
+    }
+}
+
+static void haldRun(struct clContext * C, int taskCount, const float * lattice, int haldDims, const void * srcPixels, void * dstPixels, int depth, int pixelCount)
+{
+    int pixelBytes = (depth == 32) ? (4 * sizeof(float)) : (4 * ((depth > 8) ? 2 : 1));
+
+    if (taskCount > pixelCount) {
+        taskCount = pixelCount;
+    }
+
+    if (taskCount <= 1) {
+        clHaldTask info;
+        info.lattice = lattice;
+        info.haldDims = haldDims;
+        info.srcPixels = srcPixels;
+        info.dstPixels = dstPixels;
+        info.depth = depth;
+        info.pixelCount = pixelCount;
+        haldTaskFunc(&info);
+    } else {
+        int slicePixels = (pixelCount + taskCount - 1) / taskCount;
+        int sliceCount = (pixelCount + slicePixels - 1) / slicePixels;
+        clTaskPool * pool = clContextTaskPool(C, taskCount);
+        clTaskBatch batch;
+        clTask * tasks = clAllocate(sliceCount * sizeof(clTask));
+        clHaldTask * infos = clAllocate(sliceCount * sizeof(clHaldTask));
+
+        clContextLog(C, "hald", 1, "Using %d threads to apply Hald CLUT.", taskCount);
+        clTaskBatchInit(&batch, taskCount);
+        for (int i = 0; i < sliceCount; ++i) {
+            int sliceStart = i * slicePixels;
+            infos[i].lattice = lattice;
+            infos[i].haldDims = haldDims;
+            infos[i].srcPixels = (const uint8_t *)srcPixels + ((size_t)sliceStart * pixelBytes);
+            infos[i].dstPixels = (uint8_t *)dstPixels + ((size_t)sliceStart * pixelBytes);
+            infos[i].depth = depth;
+            infos[i].pixelCount = ((pixelCount - sliceStart) < slicePixels) ? (pixelCount - sliceStart) : slicePixels;
+            clTaskPoolSubmit(C, pool, &batch, &tasks[i], (clTaskFunc)haldTaskFunc, &infos[i]);
+        }
+        clTaskPoolWait(C, pool, &batch);
+
+        clFree(tasks);
+        clFree(infos);
+    }
+}
+
+void clPixelMathHaldCLUTApply(struct clContext * C, int taskCount, const float * lattice, int haldDims, const float * srcPixels, float * dstPixels, int pixelCount)
+{
+    haldRun(C, taskCount, lattice, haldDims, srcPixels, dstPixels, 32, pixelCount);
+}
+
+void clPixelMathHaldCLUTApplyUNorm(struct clContext * C, int taskCount, const float * lattice, int haldDims, const uint8_t * srcPixels, uint8_t * dstPixels, int depth, int pixelCount)
+{
+    haldRun(C, taskCount, lattice, haldDims, srcPixels, dstPixels, depth, pixelCount);
+}
+
+float * clPixelMathHaldCLUTLattice(struct clContext * C, const uint8_t * haldPixels, int haldDepth, int haldDims)
+{
+    int nodeCount = haldDims * haldDims * haldDims;
+    float * lattice = clAllocate(3 * sizeof(float) * nodeCount);
+    float maxChannel = (float)((1 << haldDepth) - 1);
+    for (int i = 0; i < nodeCount; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            float v = (haldDepth > 8) ? (float)((const uint16_t *)haldPixels)[(i * 4) + c] : (float)haldPixels[(i * 4) + c];
+            lattice[(i * 3) + c] = v / maxChannel;
+        }
+    }
+    return lattice;
+}
@@ -188,27 +188,13 @@ size_t clProfileSize(struct clContext * C, clProfile * profile)
 
 clProfile * clProfileRead(struct clContext * C, const char * filename)
 {
-    clProfile * profile = NULL;
-    long bytes;
-    FILE * f;
-    f = fopen(filename, "rb");
-    if (!f) {
+    clProfile * profile;
+    clRaw rawProfile = CL_RAW_EMPTY;
+    if (!clRawReadFile(C, &rawProfile, filename)) {
         clContextLogError(C, "Can't open ICC file for read: %s", filename);
         return NULL;
     }
-    fseek(f, 0, SEEK_END);
-    bytes = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    clRaw rawProfile = CL_RAW_EMPTY;
-    clRawRealloc(C, &rawProfile, bytes);
-    size_t bytesRead = fread(rawProfile.ptr, 1, bytes, f);
-    fclose(f);
-    if ((long)bytesRead != bytes) {
-        clContextLogError(C, "Failed to read %ld bytes from %s, got %zu", bytes, bytesRead);
-    } else {
-        profile = clProfileParse(C, rawProfile.ptr, rawProfile.size, NULL);
-    }
+    profile = clProfileParse(C, rawProfile.ptr, rawProfile.size, NULL);
     clRawFree(C, &rawProfile);
     return profile;
 }
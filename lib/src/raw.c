@@ -5,6 +5,10 @@
 //                  http://www.boost.org/LICENSE_1_0.txt)
 // ---------------------------------------------------------------------------
 
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L // for posix_madvise()
+#endif
+
 #include "colorist/raw.h"
 
 #include "colorist/context.h"
@@ -16,18 +20,96 @@
 #include <stdio.h>
 #include <string.h>
 
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(COLORIST_EMSCRIPTEN)
+#define COLORIST_RAW_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Files smaller than this are simply read; mapping them costs more than the copy it saves
+#define RAW_MMAP_MIN_SIZE (256 * 1024)
+#endif
+
+// Frees or unmaps raw->ptr, leaving raw untouched otherwise
+static void rawRelease(struct clContext * C, clRaw * raw)
+{
+#ifdef COLORIST_RAW_MMAP
+    if (raw->mapped) {
+        munmap(raw->ptr, raw->size);
+        return;
+    }
+#endif
+    if (raw->ptr) {
+        clFree(raw->ptr);
+    }
+}
+
 void clRawRealloc(struct clContext * C, clRaw * raw, size_t newSize)
 {
     if (raw->size != newSize) {
-        uint8_t * old = raw->ptr;
-        size_t oldSize = raw->size;
+        clRaw old = *raw;
         raw->ptr = clAllocate(newSize);
         raw->size = newSize;
-        if (oldSize) {
-            size_t bytesToCopy = (oldSize < raw->size) ? oldSize : raw->size;
-            memcpy(raw->ptr, old, bytesToCopy);
+        raw->mapped = clFalse;
+        if (old.ptr) {
+            size_t bytesToCopy = (old.size < raw->size) ? old.size : raw->size;
+            if (bytesToCopy) {
+                memcpy(raw->ptr, old.ptr, bytesToCopy);
+            }
+            rawRelease(C, &old);
+        }
+    }
+}
+
+// Smallest allocation a clRawSink starts with
+#define RAW_SINK_MIN_CAPACITY 4096
+
+void clRawSinkStart(struct clContext * C, clRawSink * sink, clRaw * raw)
+{
+    sink->C = C;
+    sink->raw = raw;
+    if (raw->mapped) {
+        clRawFree(C, raw);
+    }
+    sink->capacity = raw->ptr ? raw->size : 0;
+    raw->size = 0;
+}
+
+void clRawSinkReserve(clRawSink * sink, size_t size)
+{
+    struct clContext * C = sink->C;
+    clRaw * raw = sink->raw;
+    size_t needed = raw->size + size;
+    if (needed > sink->capacity) {
+        uint8_t * old = raw->ptr;
+        size_t newCapacity = sink->capacity ? sink->capacity : RAW_SINK_MIN_CAPACITY;
+        while (newCapacity < needed) {
+            newCapacity *= 2;
+        }
+        raw->ptr = clAllocate(newCapacity);
+        if (old) {
+            memcpy(raw->ptr, old, raw->size);
             clFree(old);
         }
+        sink->capacity = newCapacity;
+    }
+}
+
+void clRawSinkWrite(clRawSink * sink, size_t offset, const uint8_t * data, size_t size)
+{
+    clRaw * raw = sink->raw;
+    size_t end = offset + size;
+    if (end > raw->size) {
+        clRawSinkReserve(sink, end - raw->size);
+        if (offset > raw->size) {
+            // Seeked past the end; don't leave stale bytes from a reused allocation in the gap
+            memset(raw->ptr + raw->size, 0, offset - raw->size);
+        }
+    }
+    memcpy(raw->ptr + offset, data, size);
+    if (end > raw->size) {
+        raw->size = end;
     }
 }
 
@@ -70,6 +152,46 @@ clBool clRawDeflate(struct clContext * C, clRaw * dst, const clRaw * src)
     return ret;
 }
 
+// Output chunk size for clRawDeflateStream()
+#define DEFLATE_STREAM_CHUNK_SIZE (64 * 1024)
+
+clBool clRawDeflateStream(struct clContext * C, const clRaw * src, clRawWriteFunc writeFunc, void * userData)
+{
+    clBool ret = clTrue;
+    uint8_t * chunk;
+    z_stream z;
+    int err;
+
+    memset(&z, 0, sizeof(z));
+    err = deflateInit(&z, Z_DEFAULT_COMPRESSION);
+    if (err != Z_OK) {
+        clContextLogError(C, "failed to compress %d bytes!", (int)src->size);
+        return clFalse;
+    }
+
+    chunk = clAllocate(DEFLATE_STREAM_CHUNK_SIZE);
+    z.avail_in = (uInt)src->size;
+    z.next_in = src->ptr;
+    do {
+        z.avail_out = DEFLATE_STREAM_CHUNK_SIZE;
+        z.next_out = chunk;
+        err = deflate(&z, Z_FINISH);
+        if ((err != Z_OK) && (err != Z_STREAM_END)) {
+            clContextLogError(C, "failed to compress %d bytes!", (int)src->size);
+            ret = clFalse;
+            break;
+        }
+        if (!writeFunc(userData, chunk, DEFLATE_STREAM_CHUNK_SIZE - z.avail_out)) {
+            ret = clFalse;
+            break;
+        }
+    } while (err != Z_STREAM_END);
+    deflateEnd(&z);
+
+    clFree(chunk);
+    return ret;
+}
+
 // Original implementation copyright:
 
 /*
@@ -138,6 +260,106 @@ char * clRawToBase64(struct clContext * C, clRaw * src)
     return (char *)out;
 }
 
+// Streaming flavor of the above; output is identical to clRawToBase64() on all of the input at once
+
+static clBool base64StreamFlush(clRawBase64Stream * stream)
+{
+    if (!stream->failed && stream->bufferSize) {
+        if (!stream->writeFunc(stream->userData, (const uint8_t *)stream->buffer, stream->bufferSize)) {
+            stream->failed = clTrue;
+        }
+    }
+    stream->bufferSize = 0;
+    return !stream->failed;
+}
+
+static clBool base64StreamEncode(clRawBase64Stream * stream, const uint8_t in[3])
+{
+    char * pos;
+    if (stream->bufferSize + 4 > CL_RAW_BASE64_STREAM_BUFFER_SIZE) {
+        if (!base64StreamFlush(stream)) {
+            return clFalse;
+        }
+    }
+    pos = &stream->buffer[stream->bufferSize];
+    pos[0] = (char)base64_table[in[0] >> 2];
+    pos[1] = (char)base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+    pos[2] = (char)base64_table[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+    pos[3] = (char)base64_table[in[2] & 0x3f];
+    stream->bufferSize += 4;
+    return clTrue;
+}
+
+void clRawBase64StreamStart(clRawBase64Stream * stream, clRawWriteFunc writeFunc, void * userData)
+{
+    stream->writeFunc = writeFunc;
+    stream->userData = userData;
+    stream->carryCount = 0;
+    stream->bufferSize = 0;
+    stream->failed = clFalse;
+}
+
+clBool clRawBase64StreamWrite(void * userData, const uint8_t * data, size_t size)
+{
+    clRawBase64Stream * stream = (clRawBase64Stream *)userData;
+    const uint8_t * end = data + size;
+    uint8_t group[3];
+
+    if (stream->failed) {
+        return clFalse;
+    }
+
+    // Finish the group left over from the last write
+    if (stream->carryCount && ((size_t)(stream->carryCount) + size >= 3)) {
+        int i;
+        for (i = 0; i < stream->carryCount; ++i) {
+            group[i] = stream->carry[i];
+        }
+        for (; i < 3; ++i) {
+            group[i] = *data++;
+        }
+        stream->carryCount = 0;
+        if (!base64StreamEncode(stream, group)) {
+            return clFalse;
+        }
+    }
+
+    while (end - data >= 3) {
+        if (!base64StreamEncode(stream, data)) {
+            return clFalse;
+        }
+        data += 3;
+    }
+
+    while (data < end) {
+        stream->carry[stream->carryCount++] = *data++;
+    }
+    return clTrue;
+}
+
+clBool clRawBase64StreamFinish(clRawBase64Stream * stream)
+{
+    if (stream->carryCount && !stream->failed) {
+        char * pos;
+        if (stream->bufferSize + 4 > CL_RAW_BASE64_STREAM_BUFFER_SIZE) {
+            base64StreamFlush(stream);
+        }
+        pos = &stream->buffer[stream->bufferSize];
+        pos[0] = (char)base64_table[stream->carry[0] >> 2];
+        if (stream->carryCount == 1) {
+            pos[1] = (char)base64_table[(stream->carry[0] & 0x03) << 4];
+            pos[2] = '=';
+        } else {
+            pos[1] = (char)base64_table[((stream->carry[0] & 0x03) << 4) | (stream->carry[1] >> 4)];
+            pos[2] = (char)base64_table[(stream->carry[1] & 0x0f) << 2];
+        }
+        pos[3] = '=';
+        stream->bufferSize += 4;
+        stream->carryCount = 0;
+    }
+    return base64StreamFlush(stream);
+}
+
 void clRawSet(struct clContext * C, clRaw * raw, const uint8_t * data, size_t len)
 {
     if (len) {
@@ -150,9 +372,10 @@ void clRawSet(struct clContext * C, clRaw * raw, const uint8_t * data, size_t le
 
 void clRawFree(struct clContext * C, clRaw * raw)
 {
-    clFree(raw->ptr);
+    rawRelease(C, raw);
     raw->ptr = NULL;
     raw->size = 0;
+    raw->mapped = clFalse;
 }
 
 struct cJSON * clRawToStructArray(struct clContext * C, clRaw * raw, int width, int height, clStructArraySchema * schema, int schemaCount)
@@ -182,11 +405,49 @@ struct cJSON * clRawToStructArray(struct clContext * C, clRaw * raw, int width,
     return json;
 }
 
+#ifdef COLORIST_RAW_MMAP
+// Maps large regular files read-only instead of copying them into memory. Returns clFalse
+// (without logging) whenever the file should just be read instead.
+static clBool rawMapFile(struct clContext * C, clRaw * raw, const char * filename)
+{
+    struct stat st;
+    void * ptr;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return clFalse;
+    }
+    if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size < RAW_MMAP_MIN_SIZE) || ((uint64_t)st.st_size > (uint64_t)SIZE_MAX)) {
+        close(fd);
+        return clFalse;
+    }
+    ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        return clFalse;
+    }
+    // Decoders mostly walk their input front to back
+    posix_madvise(ptr, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    clRawFree(C, raw);
+    raw->ptr = (uint8_t *)ptr;
+    raw->size = (size_t)st.st_size;
+    raw->mapped = clTrue;
+    return clTrue;
+}
+#endif
+
+// The result may be a read-only mapping of the file; treat it as const and release it with clRawFree()
 clBool clRawReadFile(struct clContext * C, clRaw * raw, const char * filename)
 {
     long bytes;
     FILE * f;
 
+#ifdef COLORIST_RAW_MMAP
+    if (rawMapFile(C, raw, filename)) {
+        return clTrue;
+    }
+#endif
+
     f = fopen(filename, "rb");
     if (!f) {
         clContextLogError(C, "Failed to open file for read: %s", filename);
@@ -264,3 +525,17 @@ int clFileSize(const char * filename)
     fclose(f);
     return (int)bytes;
 }
+
+clBool clFileSame(const char * filename1, const char * filename2)
+{
+#ifdef COLORIST_RAW_MMAP
+    struct stat st1, st2;
+    if ((stat(filename1, &st1) != 0) || (stat(filename2, &st2) != 0)) {
+        return clFalse;
+    }
+    return ((st1.st_dev == st2.st_dev) && (st1.st_ino == st2.st_ino)) ? clTrue : clFalse;
+#else
+    // Inputs are read fully into memory here, so only a literal match matters for streaming
+    return !strcmp(filename1, filename2) ? clTrue : clFalse;
+#endif
+}
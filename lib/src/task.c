@@ -9,34 +9,182 @@
 
 #include "colorist/context.h"
 
-static void nativeTaskStart(clContext * C, clTask * task);
-static void nativeTaskJoin(clContext * C, clTask * task);
+#include <string.h>
 
-clTask * clTaskCreate(struct clContext * C, clTaskFunc func, void * userData)
+static void nativePoolCreate(clContext * C, clTaskPool * pool);
+static void nativePoolDestroy(clContext * C, clTaskPool * pool); // Joins all threads
+static clBool nativePoolAddThread(clContext * C, clTaskPool * pool); // Lock must be held
+static void nativePoolLock(clTaskPool * pool);
+static void nativePoolUnlock(clTaskPool * pool);
+static void nativePoolWaitForWork(clTaskPool * pool);  // Lock must be held
+static void nativePoolWakeWorkers(clTaskPool * pool);  // Lock must be held
+static void nativePoolWaitForBatch(clTaskPool * pool); // Lock must be held
+static void nativePoolBatchDone(clTaskPool * pool);    // Lock must be held
+
+// Pops the next task from the first queued batch still under its limit. Lock must be held.
+static clTask * poolPop(clTaskPool * pool)
 {
-    clTask * task = clAllocateStruct(clTask);
-    task->func = func;
-    task->nativeData = NULL;
-    task->userData = userData;
-    task->joined = clFalse;
-    nativeTaskStart(C, task);
-    return task;
+    clTaskBatch * prev = NULL;
+    for (clTaskBatch * batch = pool->head; batch != NULL; prev = batch, batch = batch->next) {
+        clTask * task;
+        if ((batch->limit > 0) && (batch->running >= batch->limit)) {
+            continue;
+        }
+
+        task = batch->head;
+        batch->head = task->next;
+        if (batch->head == NULL) {
+            // Nothing left to queue; drop the batch from the pool's list
+            batch->tail = NULL;
+            if (prev) {
+                prev->next = batch->next;
+            } else {
+                pool->head = batch->next;
+            }
+            if (pool->tail == batch) {
+                pool->tail = prev;
+            }
+            batch->next = NULL;
+        }
+        ++batch->running;
+        return task;
+    }
+    return NULL;
+}
+
+// Lock must NOT be held
+static void poolRun(clTaskPool * pool, clTask * task)
+{
+    clTaskBatch * batch = task->batch;
+
+    task->func(task->userData);
+
+    nativePoolLock(pool);
+    --batch->pending;
+    --batch->running;
+    if (batch->pending == 0) {
+        nativePoolBatchDone(pool);
+    } else if (batch->head && (batch->limit > 0) && (batch->running == (batch->limit - 1))) {
+        // The batch was at its limit; someone can pick up its next task
+        nativePoolWakeWorkers(pool);
+    }
+    nativePoolUnlock(pool);
+}
+
+static void poolWorker(clTaskPool * pool)
+{
+    nativePoolLock(pool);
+    for (;;) {
+        clTask * task = poolPop(pool);
+        if (task) {
+            nativePoolUnlock(pool);
+            poolRun(pool, task);
+            nativePoolLock(pool);
+        } else if (pool->quit) {
+            break;
+        } else {
+            nativePoolWaitForWork(pool);
+        }
+    }
+    nativePoolUnlock(pool);
+}
+
+clTaskPool * clTaskPoolCreate(struct clContext * C, int threadCount)
+{
+    clTaskPool * pool = clAllocateStruct(clTaskPool);
+    pool->nativeData = NULL;
+    pool->threadCount = 0;
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->quit = clFalse;
+    nativePoolCreate(C, pool);
+    clTaskPoolReserve(C, pool, threadCount);
+    return pool;
+}
+
+clBool clTaskPoolReserve(struct clContext * C, clTaskPool * pool, int threadCount)
+{
+    clBool success = clTrue;
+    nativePoolLock(pool);
+    while (pool->threadCount < threadCount) {
+        if (!nativePoolAddThread(C, pool)) {
+            success = clFalse;
+            break;
+        }
+        ++pool->threadCount;
+    }
+    nativePoolUnlock(pool);
+    return success;
+}
+
+void clTaskPoolDestroy(struct clContext * C, clTaskPool * pool)
+{
+    nativePoolLock(pool);
+    COLORIST_ASSERT(pool->head == NULL);
+    pool->quit = clTrue;
+    nativePoolWakeWorkers(pool);
+    nativePoolUnlock(pool);
+
+    nativePoolDestroy(C, pool);
+    COLORIST_ASSERT(pool->nativeData == NULL);
+    clFree(pool);
 }
 
-void clTaskJoin(struct clContext * C, clTask * task)
+void clTaskBatchInit(clTaskBatch * batch, int limit)
 {
-    if (!task->joined) {
-        nativeTaskJoin(C, task);
-        task->joined = clTrue;
+    batch->pending = 0;
+    batch->limit = limit;
+    batch->running = 0;
+    batch->head = NULL;
+    batch->tail = NULL;
+    batch->next = NULL;
+}
+
+void clTaskPoolSubmit(struct clContext * C, clTaskPool * pool, clTaskBatch * batch, clTask * task, clTaskFunc func, void * userData)
+{
+    COLORIST_UNUSED(C);
+
+    task->func = func;
+    task->userData = userData;
+    task->batch = batch;
+    task->next = NULL;
+
+    nativePoolLock(pool);
+    ++batch->pending;
+    if (batch->tail) {
+        batch->tail->next = task;
+    } else {
+        // First queued task; the batch joins the end of the pool's list
+        batch->head = task;
+        if (pool->tail) {
+            pool->tail->next = batch;
+        } else {
+            pool->head = batch;
+        }
+        pool->tail = batch;
     }
+    batch->tail = task;
+    nativePoolWakeWorkers(pool);
+    nativePoolUnlock(pool);
 }
 
-void clTaskDestroy(struct clContext * C, clTask * task)
+void clTaskPoolWait(struct clContext * C, clTaskPool * pool, clTaskBatch * batch)
 {
-    clTaskJoin(C, task);
-    COLORIST_ASSERT(task->joined);
-    COLORIST_ASSERT(task->nativeData == NULL);
-    clFree(task);
+    COLORIST_UNUSED(C);
+
+    nativePoolLock(pool);
+    while (batch->pending > 0) {
+        // Help out instead of idling. This may run another batch's task, which is harmless.
+        clTask * task = poolPop(pool);
+        if (task) {
+            nativePoolUnlock(pool);
+            poolRun(pool, task);
+            nativePoolLock(pool);
+        } else {
+            nativePoolWaitForBatch(pool);
+        }
+    }
+    nativePoolUnlock(pool);
 }
 
 #ifdef _WIN32
@@ -52,37 +200,92 @@ int clTaskLimit(void)
     return numCPU;
 }
 
-typedef struct clNativeTask
+typedef struct clNativePool
 {
-    HANDLE hThread;
-} clNativeTask;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE workCond;
+    CONDITION_VARIABLE batchCond;
+    HANDLE * threads;
+} clNativePool;
 
-static DWORD WINAPI taskThreadProc(LPVOID lpParameter)
+static DWORD WINAPI poolThreadProc(LPVOID lpParameter)
 {
-    clTask * task = (clTask *)lpParameter;
-    task->func(task->userData);
+    poolWorker((clTaskPool *)lpParameter);
     return 0;
 }
 
-static void nativeTaskStart(clContext * C, clTask * task)
+static void nativePoolCreate(clContext * C, clTaskPool * pool)
 {
+    clNativePool * nativePool = clAllocateStruct(clNativePool);
+    InitializeCriticalSection(&nativePool->lock);
+    InitializeConditionVariable(&nativePool->workCond);
+    InitializeConditionVariable(&nativePool->batchCond);
+    nativePool->threads = NULL;
+    pool->nativeData = nativePool;
+}
+
+static void nativePoolDestroy(clContext * C, clTaskPool * pool)
+{
+    clNativePool * nativePool = (clNativePool *)pool->nativeData;
+    for (int i = 0; i < pool->threadCount; ++i) {
+        WaitForSingleObject(nativePool->threads[i], INFINITE);
+        CloseHandle(nativePool->threads[i]);
+    }
+    if (nativePool->threads) {
+        clFree(nativePool->threads);
+    }
+    DeleteCriticalSection(&nativePool->lock);
+    clFree(nativePool);
+    pool->nativeData = NULL;
+}
+
+static clBool nativePoolAddThread(clContext * C, clTaskPool * pool)
+{
+    clNativePool * nativePool = (clNativePool *)pool->nativeData;
+    HANDLE * threads = clAllocate(sizeof(HANDLE) * (pool->threadCount + 1));
     DWORD threadId;
-    clNativeTask * nativeTask = clAllocateStruct(clNativeTask);
-    task->nativeData = nativeTask;
-    nativeTask->hThread = CreateThread(NULL, 0, taskThreadProc, task, 0, &threadId);
+    if (nativePool->threads) {
+        memcpy(threads, nativePool->threads, sizeof(HANDLE) * pool->threadCount);
+        clFree(nativePool->threads);
+    }
+    nativePool->threads = threads;
+    nativePool->threads[pool->threadCount] = CreateThread(NULL, 0, poolThreadProc, pool, 0, &threadId);
+    return (nativePool->threads[pool->threadCount] != NULL) ? clTrue : clFalse;
 }
 
-static void nativeTaskJoin(clContext * C, clTask * task)
+static void nativePoolLock(clTaskPool * pool)
 {
-    clNativeTask * nativeTask = (clNativeTask *)task->nativeData;
-    WaitForSingleObject(nativeTask->hThread, INFINITE);
-    CloseHandle(nativeTask->hThread);
-    clFree(task->nativeData);
-    task->nativeData = NULL;
+    EnterCriticalSection(&((clNativePool *)pool->nativeData)->lock);
 }
 
-#else /* ifdef _WIN32 */
+static void nativePoolUnlock(clTaskPool * pool)
+{
+    LeaveCriticalSection(&((clNativePool *)pool->nativeData)->lock);
+}
+
+static void nativePoolWaitForWork(clTaskPool * pool)
+{
+    clNativePool * nativePool = (clNativePool *)pool->nativeData;
+    SleepConditionVariableCS(&nativePool->workCond, &nativePool->lock, INFINITE);
+}
+
+static void nativePoolWakeWorkers(clTaskPool * pool)
+{
+    WakeAllConditionVariable(&((clNativePool *)pool->nativeData)->workCond);
+}
 
+static void nativePoolWaitForBatch(clTaskPool * pool)
+{
+    clNativePool * nativePool = (clNativePool *)pool->nativeData;
+    SleepConditionVariableCS(&nativePool->batchCond, &nativePool->lock, INFINITE);
+}
+
+static void nativePoolBatchDone(clTaskPool * pool)
+{
+    WakeAllConditionVariable(&((clNativePool *)pool->nativeData)->batchCond);
+}
+
+#else /* ifdef _WIN32 */
 #ifdef __APPLE__
 
 #include <sys/sysctl.h>
@@ -125,31 +328,88 @@ int clTaskLimit()
 
 #include <pthread.h>
 
-typedef struct clNativeTask
+typedef struct clNativePool
 {
-    pthread_t pthread;
-} clNativeTask;
+    pthread_mutex_t mutex;
+    pthread_cond_t workCond;
+    pthread_cond_t batchCond;
+    pthread_t * threads;
+} clNativePool;
 
-static void * taskThreadProc(void * userData)
+static void * poolThreadProc(void * userData)
 {
-    clTask * task = (clTask *)userData;
-    task->func(task->userData);
-    pthread_exit(NULL);
+    poolWorker((clTaskPool *)userData);
+    return NULL;
+}
+
+static void nativePoolCreate(clContext * C, clTaskPool * pool)
+{
+    clNativePool * nativePool = clAllocateStruct(clNativePool);
+    pthread_mutex_init(&nativePool->mutex, NULL);
+    pthread_cond_init(&nativePool->workCond, NULL);
+    pthread_cond_init(&nativePool->batchCond, NULL);
+    nativePool->threads = NULL;
+    pool->nativeData = nativePool;
+}
+
+static void nativePoolDestroy(clContext * C, clTaskPool * pool)
+{
+    clNativePool * nativePool = (clNativePool *)pool->nativeData;
+    for (int i = 0; i < pool->threadCount; ++i) {
+        pthread_join(nativePool->threads[i], NULL);
+    }
+    if (nativePool->threads) {
+        clFree(nativePool->threads);
+    }
+    pthread_cond_destroy(&nativePool->batchCond);
+    pthread_cond_destroy(&nativePool->workCond);
+    pthread_mutex_destroy(&nativePool->mutex);
+    clFree(nativePool);
+    pool->nativeData = NULL;
+}
+
+static clBool nativePoolAddThread(clContext * C, clTaskPool * pool)
+{
+    clNativePool * nativePool = (clNativePool *)pool->nativeData;
+    pthread_t * threads = clAllocate(sizeof(pthread_t) * (pool->threadCount + 1));
+    if (nativePool->threads) {
+        memcpy(threads, nativePool->threads, sizeof(pthread_t) * pool->threadCount);
+        clFree(nativePool->threads);
+    }
+    nativePool->threads = threads;
+    return (pthread_create(&nativePool->threads[pool->threadCount], NULL, poolThreadProc, pool) == 0) ? clTrue : clFalse;
+}
+
+static void nativePoolLock(clTaskPool * pool)
+{
+    pthread_mutex_lock(&((clNativePool *)pool->nativeData)->mutex);
+}
+
+static void nativePoolUnlock(clTaskPool * pool)
+{
+    pthread_mutex_unlock(&((clNativePool *)pool->nativeData)->mutex);
+}
+
+static void nativePoolWaitForWork(clTaskPool * pool)
+{
+    clNativePool * nativePool = (clNativePool *)pool->nativeData;
+    pthread_cond_wait(&nativePool->workCond, &nativePool->mutex);
+}
+
+static void nativePoolWakeWorkers(clTaskPool * pool)
+{
+    pthread_cond_broadcast(&((clNativePool *)pool->nativeData)->workCond);
 }
 
-static void nativeTaskStart(clContext * C, clTask * task)
+static void nativePoolWaitForBatch(clTaskPool * pool)
 {
-    clNativeTask * nativeTask = clAllocateStruct(clNativeTask);
-    task->nativeData = nativeTask;
-    pthread_create(&nativeTask->pthread, NULL, taskThreadProc, task);
+    clNativePool * nativePool = (clNativePool *)pool->nativeData;
+    pthread_cond_wait(&nativePool->batchCond, &nativePool->mutex);
 }
 
-static void nativeTaskJoin(clContext * C, clTask * task)
+static void nativePoolBatchDone(clTaskPool * pool)
 {
-    clNativeTask * nativeTask = (clNativeTask *)task->nativeData;
-    pthread_join(nativeTask->pthread, NULL);
-    clFree(task->nativeData);
-    task->nativeData = NULL;
+    pthread_cond_broadcast(&((clNativePool *)pool->nativeData)->batchCond);
 }
 
 #endif /* ifdef _WIN32 */
@@ -1,4 +1,5 @@
 #include "colorist/transform.h"
+#include "transform_ccmm.h"
 
 #include "colorist/context.h"
 #include "colorist/pixelmath.h"
@@ -14,6 +15,9 @@
 // this close.)
 #define AUTO_TONEMAP_LUMINANCE_SCALE_THRESHOLD (1.001f)
 
+// Pixels are unpacked into a stack block of RGBA floats, transformed, and packed into the destination
+#define TRANSFORM_BLOCK_PIXELS 256
+
 #define SRC_8_HAS_ALPHA() (srcPixelBytes > 3)
 #define SRC_16_HAS_ALPHA() (srcPixelBytes > 7)
 #define SRC_FLOAT_HAS_ALPHA() (srcPixelBytes > 15)
@@ -23,6 +27,10 @@
 #define DST_FLOAT_HAS_ALPHA() (dstPixelBytes > 15)
 
 static cmsUInt32Number clTransformFormatToLCMSFormat(struct clContext * C, clTransformFormat format);
+static cmsUInt32Number clTransformFormatToLCMSNativeFormat(struct clContext * C, clTransformFormat format, int depth);
+static void transformBuildTables(struct clContext * C, struct clTransform * transform);
+static clBool transformUsesLUT(struct clContext * C, struct clTransform * transform);
+static void transformBuildLUT(struct clContext * C, struct clTransform * transform, clBool useCCMM);
 
 // ----------------------------------------------------------------------------
 // Debug Helpers
@@ -214,6 +222,9 @@ void clTransformPrepare(struct clContext * C, struct clTransform * transform)
             gb_mat3_mul(&transform->ccmmCombined, &transform->ccmmSrcToXYZ, &transform->ccmmXYZToDst);
             DEBUG_PRINT_MATRIX("MA*MB", &transform->ccmmCombined);
 
+            transformBuildTables(C, transform);
+            transform->ccmmFunc = clTransformCCMMChooseFunc(C, transform, clTrue, &transform->ccmmFuncName);
+
             transform->ccmmReady = clTrue;
         }
     } else {
@@ -255,446 +266,559 @@ void clTransformPrepare(struct clContext * C, struct clTransform * transform)
                 dstProfileHandle, dstFormat,
                 INTENT_ABSOLUTE_COLORIMETRIC, cmsFLAGS_COPY_ALPHA | cmsFLAGS_NOOPTIMIZE);
 
+            if (!transform->luminanceScaleEnabled && !transformUsesLUT(C, transform) && !transform->haldLattice) {
+                // Nothing for us to do between the two profiles, so let LittleCMS convert 8-bit pixels
+                // directly with its own optimized integer pipelines.
+                cmsUInt32Number srcNativeFormat = clTransformFormatToLCMSNativeFormat(C, transform->srcFormat, transform->srcDepth);
+                cmsUInt32Number dstNativeFormat = clTransformFormatToLCMSNativeFormat(C, transform->dstFormat, transform->dstDepth);
+                if (srcNativeFormat && dstNativeFormat) {
+                    transform->lcmsNative = cmsCreateTransformTHR(C->lcms,
+                        srcProfileHandle, srcNativeFormat,
+                        dstProfileHandle, dstNativeFormat,
+                        INTENT_ABSOLUTE_COLORIMETRIC, cmsFLAGS_COPY_ALPHA);
+                }
+            }
+
             transform->lcmsReady = clTrue;
         }
     }
+
+    if (!transform->lut && transformUsesLUT(C, transform)) {
+        transformBuildLUT(C, transform, useCCMM);
+    }
 }
 
 // SMPTE ST.2084: https://ieeexplore.ieee.org/servlet/opac?punumber=7291450
 
-static const float PQ_C1 = 0.8359375;       // 3424.0 / 4096.0
-static const float PQ_C2 = 18.8515625;      // 2413.0 / 4096.0 * 32.0
-static const float PQ_C3 = 18.6875;         // 2392.0 / 4096.0 * 32.0
-static const float PQ_M1 = 0.1593017578125; // 2610.0 / 4096.0 / 4.0
-static const float PQ_M2 = 78.84375;        // 2523.0 / 4096.0 * 128.0
-
 // SMPTE ST.2084: Equation 4.1
 // L = ( (max(N^(1/m2) - c1, 0)) / (c2 - c3*N^(1/m2)) )^(1/m1)
 static float PQ_EOTF(float N)
 {
-    float N1m2 = powf(N, 1 / PQ_M2);
-    float N1m2c1 = N1m2 - PQ_C1;
+    float N1m2 = powf(N, 1 / CL_PQ_M2);
+    float N1m2c1 = N1m2 - CL_PQ_C1;
     if (N1m2c1 < 0.0f)
         N1m2c1 = 0.0f;
-    float c2c3N1m2 = PQ_C2 - (PQ_C3 * N1m2);
-    return powf(N1m2c1 / c2c3N1m2, 1 / PQ_M1);
+    float c2c3N1m2 = CL_PQ_C2 - (CL_PQ_C3 * N1m2);
+    return powf(N1m2c1 / c2c3N1m2, 1 / CL_PQ_M1);
 }
 
 // SMPTE ST.2084: Equation 5.2
 // N = ( (c1 + (c2 * L^m1)) / (1 + (c3 * L^m1)) )^m2
 static float PQ_OETF(float L)
 {
-    float Lm1 = powf(L, PQ_M1);
-    float c2Lm1 = PQ_C2 * Lm1;
-    float c3Lm1 = PQ_C3 * Lm1;
-    return powf((PQ_C1 + c2Lm1) / (1 + c3Lm1), PQ_M2);
+    float Lm1 = powf(L, CL_PQ_M1);
+    float c2Lm1 = CL_PQ_C2 * Lm1;
+    float c3Lm1 = CL_PQ_C3 * Lm1;
+    return powf((CL_PQ_C1 + c2Lm1) / (1 + c3Lm1), CL_PQ_M2);
 }
 
-// The real color conversion function
-static void transformFloatToFloat(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
+CL_CCMM_INLINE void transformScaleLuminance(struct clContext * C, struct clTransform * transform, clBool useCCMM, clBool tonemap, float XYZ[3])
 {
-    for (int i = 0; i < pixelCount; ++i) {
-        float * srcPixel = (float *)&srcPixels[i * srcPixelBytes];
-        float * dstPixel = (float *)&dstPixels[i * dstPixelBytes];
-        gbVec3 src;
-        float XYZ[3];
+    float xyY[3];
 
-        if (useCCMM) {
-            switch (transform->ccmmSrcEOTF) {
-                default:
-                case CL_XTF_NONE:
-                    memcpy(&src, srcPixel, sizeof(src));
-                    break;
-                case CL_XTF_GAMMA:
-                    src.x = powf((srcPixel[0] >= 0.0f) ? srcPixel[0] : 0.0f, transform->ccmmSrcGamma);
-                    src.y = powf((srcPixel[1] >= 0.0f) ? srcPixel[1] : 0.0f, transform->ccmmSrcGamma);
-                    src.z = powf((srcPixel[2] >= 0.0f) ? srcPixel[2] : 0.0f, transform->ccmmSrcGamma);
-                    break;
-                case CL_XTF_PQ:
-                    src.x = PQ_EOTF((srcPixel[0] >= 0.0f) ? srcPixel[0] : 0.0f);
-                    src.y = PQ_EOTF((srcPixel[1] >= 0.0f) ? srcPixel[1] : 0.0f);
-                    src.z = PQ_EOTF((srcPixel[2] >= 0.0f) ? srcPixel[2] : 0.0f);
-                    break;
-            }
+    // if tonemapping is necessary, luminance scale MUST be enabled
+    COLORIST_ASSERT(!tonemap || transform->luminanceScaleEnabled);
 
-            gb_mat3_mul_vec3((gbVec3 *)XYZ, &transform->ccmmSrcToXYZ, src);
-        } else {
-            // Use LCMS
-            cmsDoTransform(transform->lcmsSrcToXYZ, srcPixel, XYZ, 1);
-        }
+    // Convert to xyY
+    clTransformXYZToXYY(C, xyY, XYZ, transform->whitePointX, transform->whitePointY);
 
-        // if tonemapping is necessary, luminance scale MUST be enabled
-        COLORIST_ASSERT(!transform->tonemapEnabled || transform->luminanceScaleEnabled);
+    // Apply srcCurveScale as CCMM, if any (LCMS implicitly does this)
+    if (useCCMM) {
+        xyY[2] *= transform->srcCurveScale;
+    }
 
-        if (transform->luminanceScaleEnabled) {
-            float xyY[3];
+    // Luminance scale
+    xyY[2] *= transform->srcLuminanceScale;
+    xyY[2] /= transform->dstLuminanceScale;
 
-            // Convert to xyY
-            clTransformXYZToXYY(C, xyY, XYZ, transform->whitePointX, transform->whitePointY);
+    // Apply inverse dstCurveScale prior to tonemapping to ensure tonemap gets [0-1] range
+    xyY[2] /= transform->dstCurveScale;
 
-            // Apply srcCurveScale as CCMM, if any (LCMS implicitly does this)
-            if (useCCMM) {
-                xyY[2] *= transform->srcCurveScale;
-            }
+    // Tonemap
+    if (tonemap) {
+        // reinhard tonemap
+        xyY[2] = xyY[2] / (1.0f + xyY[2]);
+    }
 
-            // Luminance scale
-            xyY[2] *= transform->srcLuminanceScale;
-            xyY[2] /= transform->dstLuminanceScale;
+    if (!useCCMM) {
+        // Re-apply dst scale for LCMS as it expects the XYZ->Dst input to be overranged
+        xyY[2] *= transform->dstCurveScale;
+    }
 
-            // Apply inverse dstCurveScale prior to tonemapping to ensure tonemap gets [0-1] range
-            xyY[2] /= transform->dstCurveScale;
+    // Convert to XYZ
+    clTransformXYYToXYZ(C, XYZ, xyY);
+}
 
-            // Tonemap
-            if (transform->tonemapEnabled) {
-                // reinhard tonemap
-                xyY[2] = xyY[2] / (1.0f + xyY[2]);
-            }
+CL_CCMM_INLINE float ccmmEOTF(struct clTransform * transform, clTransformTransferFunction eotf, float v)
+{
+    switch (eotf) {
+        case CL_XTF_GAMMA:
+            return powf((v >= 0.0f) ? v : 0.0f, transform->ccmmSrcGamma);
+        case CL_XTF_PQ:
+            return PQ_EOTF((v >= 0.0f) ? v : 0.0f);
+        case CL_XTF_NONE:
+        default:
+            break;
+    }
+    return v;
+}
 
-            if (!useCCMM) {
-                // Re-apply dst scale for LCMS as it expects the XYZ->Dst input to be overranged
-                xyY[2] *= transform->dstCurveScale;
-            }
+CL_CCMM_INLINE float ccmmOETF(struct clTransform * transform, clTransformTransferFunction oetf, float v)
+{
+    switch (oetf) {
+        case CL_XTF_GAMMA:
+            return powf((v >= 0.0f) ? v : 0.0f, transform->ccmmDstInvGamma);
+        case CL_XTF_PQ:
+            return PQ_OETF((v >= 0.0f) ? v : 0.0f);
+        case CL_XTF_NONE:
+        default:
+            break;
+    }
+    return v;
+}
 
-            // Convert to XYZ
-            clTransformXYYToXYZ(C, XYZ, xyY);
-        }
+CL_CCMM_INLINE void ccmmScalarLoop(struct clContext * C, struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, clBool scaleLuminance, clBool tonemap, clBool clamp, float * pixels, int pixelCount)
+{
+    for (int i = 0; i < pixelCount; ++i) {
+        float * pixel = &pixels[i * 4];
+        gbVec3 src;
+        float XYZ[3];
+        float tmp[3];
 
-        if (useCCMM) {
-            float tmp[3];
-            memcpy(&src, XYZ, sizeof(src));
-
-            switch (transform->ccmmDstOETF) {
-                case CL_XTF_NONE:
-                    gb_mat3_mul_vec3((gbVec3 *)dstPixel, &transform->ccmmXYZToDst, src);
-                    if (transform->dstProfile) {                         // don't clamp XYZ
-                        dstPixel[0] = CL_CLAMP(dstPixel[0], 0.0f, 1.0f); // clamp
-                        dstPixel[1] = CL_CLAMP(dstPixel[1], 0.0f, 1.0f); // clamp
-                        dstPixel[2] = CL_CLAMP(dstPixel[2], 0.0f, 1.0f); // clamp
-                    }
-                    break;
-                case CL_XTF_GAMMA:
-                    gb_mat3_mul_vec3((gbVec3 *)tmp, &transform->ccmmXYZToDst, src);
-                    if (transform->dstProfile) {               // don't clamp XYZ
-                        tmp[0] = CL_CLAMP(tmp[0], 0.0f, 1.0f); // clamp
-                        tmp[1] = CL_CLAMP(tmp[1], 0.0f, 1.0f); // clamp
-                        tmp[2] = CL_CLAMP(tmp[2], 0.0f, 1.0f); // clamp
-                    }
-                    dstPixel[0] = powf((tmp[0] >= 0.0f) ? tmp[0] : 0.0f, transform->ccmmDstInvGamma);
-                    dstPixel[1] = powf((tmp[1] >= 0.0f) ? tmp[1] : 0.0f, transform->ccmmDstInvGamma);
-                    dstPixel[2] = powf((tmp[2] >= 0.0f) ? tmp[2] : 0.0f, transform->ccmmDstInvGamma);
-                    break;
-                case CL_XTF_PQ:
-                    gb_mat3_mul_vec3((gbVec3 *)tmp, &transform->ccmmXYZToDst, src);
-                    if (transform->dstProfile) {               // don't clamp XYZ
-                        tmp[0] = CL_CLAMP(tmp[0], 0.0f, 1.0f); // clamp
-                        tmp[1] = CL_CLAMP(tmp[1], 0.0f, 1.0f); // clamp
-                        tmp[2] = CL_CLAMP(tmp[2], 0.0f, 1.0f); // clamp
-                    }
-                    dstPixel[0] = PQ_OETF((tmp[0] >= 0.0f) ? tmp[0] : 0.0f);
-                    dstPixel[1] = PQ_OETF((tmp[1] >= 0.0f) ? tmp[1] : 0.0f);
-                    dstPixel[2] = PQ_OETF((tmp[2] >= 0.0f) ? tmp[2] : 0.0f);
-                    break;
-            }
-        } else {
-            // LittleCMS
-            cmsDoTransform(transform->lcmsXYZToDst, XYZ, dstPixel, 1);
-            if (transform->dstProfile) {                         // don't clamp XYZ
-                dstPixel[0] = CL_CLAMP(dstPixel[0], 0.0f, 1.0f); // clamp
-                dstPixel[1] = CL_CLAMP(dstPixel[1], 0.0f, 1.0f); // clamp
-                dstPixel[2] = CL_CLAMP(dstPixel[2], 0.0f, 1.0f); // clamp
-            }
+        src.x = ccmmEOTF(transform, srcEOTF, pixel[0]);
+        src.y = ccmmEOTF(transform, srcEOTF, pixel[1]);
+        src.z = ccmmEOTF(transform, srcEOTF, pixel[2]);
+
+        gb_mat3_mul_vec3((gbVec3 *)XYZ, &transform->ccmmSrcToXYZ, src);
+
+        if (scaleLuminance) {
+            transformScaleLuminance(C, transform, clTrue, tonemap, XYZ);
         }
 
-        if (DST_FLOAT_HAS_ALPHA()) {
-            if (SRC_FLOAT_HAS_ALPHA()) {
-                // Copy alpha
-                dstPixel[3] = srcPixel[3];
-            } else {
-                // Full alpha
-                dstPixel[3] = 1.0f;
-            }
+        memcpy(&src, XYZ, sizeof(src));
+        gb_mat3_mul_vec3((gbVec3 *)tmp, &transform->ccmmXYZToDst, src);
+        if (clamp) {                               // don't clamp XYZ
+            tmp[0] = CL_CLAMP(tmp[0], 0.0f, 1.0f); // clamp
+            tmp[1] = CL_CLAMP(tmp[1], 0.0f, 1.0f); // clamp
+            tmp[2] = CL_CLAMP(tmp[2], 0.0f, 1.0f); // clamp
         }
+
+        pixel[0] = ccmmOETF(transform, dstOETF, tmp[0]);
+        pixel[1] = ccmmOETF(transform, dstOETF, tmp[1]);
+        pixel[2] = ccmmOETF(transform, dstOETF, tmp[2]);
     }
 }
 
-// ----------------------------------------------------------------------------
-// Transform wrappers for RGB/RGBA
+// Reference CCMM kernel, and the fallback for CPUs without any SIMD kernel (see transform_simd.c)
+void clTransformCCMMScalar(struct clContext * C, struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, float * pixels, int pixelCount)
+{
+    clBool clamp = transform->dstProfile ? clTrue : clFalse;
+    ccmmScalarLoop(C, transform, srcEOTF, dstOETF, transform->luminanceScaleEnabled, transform->tonemapEnabled, clamp, pixels, pixelCount);
+}
 
-static void transformFloatToRGB8(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
+CL_CCMM_SPECIALIZE(, ccmmScalar, ccmmScalarLoop)
+
+clTransformCCMMFunc clTransformCCMMScalarSpecialized(struct clTransform * transform)
 {
-    static const float maxChannel = 255.0f;
+    return ccmmScalarSpecialized(transform);
+}
 
-    for (int i = 0; i < pixelCount; ++i) {
-        float tmpPixel[4];
-        float * srcPixel = (float *)&srcPixels[i * srcPixelBytes];
-        uint8_t * dstPixel = &dstPixels[i * dstPixelBytes];
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)srcPixel, srcPixelBytes, (uint8_t *)tmpPixel, dstPixelBytes, 1);
-        dstPixel[0] = (uint8_t)clPixelMathRoundNormalized(tmpPixel[0], maxChannel);
-        dstPixel[1] = (uint8_t)clPixelMathRoundNormalized(tmpPixel[1], maxChannel);
-        dstPixel[2] = (uint8_t)clPixelMathRoundNormalized(tmpPixel[2], maxChannel);
-        if (DST_8_HAS_ALPHA()) {
-            if (SRC_FLOAT_HAS_ALPHA()) {
-                // reformat alpha
-                dstPixel[3] = (uint8_t)clPixelMathRoundNormalized(tmpPixel[3], maxChannel);
-            } else {
-                // RGB -> RGBA, set full opacity
-                dstPixel[3] = 255;
-            }
+// ----------------------------------------------------------------------------
+// Transfer function tables for integer sources/destinations
+
+// The OETF table is indexed directly by the bits of the (linear) float being encoded: each octave
+// in [2^-OCTAVES, 1] is split into 2^STEP_BITS evenly spaced samples, and lookups linearly
+// interpolate between them. Anything smaller than the first octave is rare and evaluated exactly.
+#define OETF_TABLE_OCTAVES 20
+#define OETF_TABLE_STEP_BITS 8
+#define OETF_TABLE_SIZE ((OETF_TABLE_OCTAVES << OETF_TABLE_STEP_BITS) + 1)
+#define OETF_TABLE_SHIFT (23 - OETF_TABLE_STEP_BITS)
+#define OETF_TABLE_BASE_BITS ((uint32_t)(127 - OETF_TABLE_OCTAVES) << 23)
+#define OETF_TABLE_MIN (1.0f / (float)(1 << OETF_TABLE_OCTAVES))
+
+static void transformBuildTables(struct clContext * C, struct clTransform * transform)
+{
+    if (transformUsesLUT(C, transform)) {
+        // The curves are baked into the LUT along with everything else
+        return;
+    }
+
+    if (!clTransformFormatIsFloat(C, transform->srcFormat, transform->srcDepth) && (transform->ccmmSrcEOTF != CL_XTF_NONE)) {
+        // One entry per possible code, using the exact same normalization as unpacking does
+        const int tableSize = (transform->srcDepth == 8) ? 256 : 65536;
+        const float srcRescale = 1.0f / (float)((1 << transform->srcDepth) - 1);
+        transform->ccmmSrcEOTFTable = clAllocate(sizeof(float) * tableSize);
+        for (int i = 0; i < tableSize; ++i) {
+            transform->ccmmSrcEOTFTable[i] = ccmmEOTF(transform, transform->ccmmSrcEOTF, (float)i * srcRescale);
+        }
+    }
+
+    // A Hald CLUT works on encoded values, so the OETF can't be deferred to packing
+    if (!clTransformFormatIsFloat(C, transform->dstFormat, transform->dstDepth) && (transform->ccmmDstOETF != CL_XTF_NONE) && !transform->haldLattice) {
+        transform->ccmmDstOETFTable = clAllocate(sizeof(float) * OETF_TABLE_SIZE);
+        for (int i = 0; i < OETF_TABLE_SIZE; ++i) {
+            uint32_t bits = OETF_TABLE_BASE_BITS + ((uint32_t)i << OETF_TABLE_SHIFT);
+            float v;
+            memcpy(&v, &bits, sizeof(v));
+            transform->ccmmDstOETFTable[i] = ccmmOETF(transform, transform->ccmmDstOETF, v);
         }
     }
 }
 
-static void transformFloatToRGB16(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, uint8_t * dstPixels, int dstPixelBytes, int dstDepth, int pixelCount)
+static float transformLookupOETF(struct clTransform * transform, float v)
 {
-    const int dstMaxChannel = (1 << dstDepth) - 1;
-    const float dstRescale = (float)dstMaxChannel;
+    uint32_t offset;
+    uint32_t index;
+    float t;
 
-    for (int i = 0; i < pixelCount; ++i) {
-        float tmpPixel[4];
-        float * srcPixel = (float *)&srcPixels[i * srcPixelBytes];
-        uint16_t * dstPixel = (uint16_t *)&dstPixels[i * dstPixelBytes];
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)srcPixel, srcPixelBytes, (uint8_t *)tmpPixel, dstPixelBytes, 1);
-        dstPixel[0] = (uint16_t)clPixelMathRoundNormalized(tmpPixel[0], dstRescale);
-        dstPixel[1] = (uint16_t)clPixelMathRoundNormalized(tmpPixel[1], dstRescale);
-        dstPixel[2] = (uint16_t)clPixelMathRoundNormalized(tmpPixel[2], dstRescale);
-        if (DST_16_HAS_ALPHA()) {
-            if (SRC_FLOAT_HAS_ALPHA()) {
-                // reformat alpha
-                dstPixel[3] = (uint16_t)clPixelMathRoundNormalized(tmpPixel[3], dstRescale);
-            } else {
-                // RGB -> RGBA, set full opacity
-                dstPixel[3] = (uint16_t)dstMaxChannel;
-            }
-        }
+    if (!(v >= OETF_TABLE_MIN)) { // also catches NaN
+        return ccmmOETF(transform, transform->ccmmDstOETF, v);
     }
+    if (v >= 1.0f) {
+        return transform->ccmmDstOETFTable[OETF_TABLE_SIZE - 1];
+    }
+    memcpy(&offset, &v, sizeof(offset));
+    offset -= OETF_TABLE_BASE_BITS;
+    index = offset >> OETF_TABLE_SHIFT;
+    t = (float)(offset & ((1 << OETF_TABLE_SHIFT) - 1)) * (1.0f / (float)(1 << OETF_TABLE_SHIFT));
+    return transform->ccmmDstOETFTable[index] + ((transform->ccmmDstOETFTable[index + 1] - transform->ccmmDstOETFTable[index]) * t);
 }
 
-static void transformRGB8ToFloat(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
+// The real color conversion function. Works in-place on tightly packed RGBA float pixels.
+static void transformBlockExact(struct clContext * C, struct clTransform * transform, clBool useCCMM, float * pixels, int pixelCount)
 {
-    static const float srcRescale = 1.0f / 255.0f;
+    if (useCCMM) {
+        transform->ccmmFunc(C, transform, transform->ccmmSrcEOTF, transform->ccmmDstOETF, pixels, pixelCount);
+        return;
+    }
 
-    for (int i = 0; i < pixelCount; ++i) {
-        float tmpPixel[4];
-        uint8_t * srcPixel = &srcPixels[i * srcPixelBytes];
-        tmpPixel[0] = (float)srcPixel[0] * srcRescale;
-        tmpPixel[1] = (float)srcPixel[1] * srcRescale;
-        tmpPixel[2] = (float)srcPixel[2] * srcRescale;
-        if (DST_FLOAT_HAS_ALPHA()) {
-            if (SRC_8_HAS_ALPHA()) {
-                // reformat alpha
-                tmpPixel[3] = (float)srcPixel[3] * srcRescale;
-            } else {
-                // RGB -> RGBA, set full opacity
-                tmpPixel[3] = 1.0f;
-            }
+    // LittleCMS
+    if (!transform->luminanceScaleEnabled) {
+        // No luminance scaling; go straight from src to dst in a single pass
+        cmsDoTransform(transform->lcmsCombined, pixels, pixels, (cmsUInt32Number)pixelCount);
+    } else {
+        float XYZ[TRANSFORM_BLOCK_PIXELS * 3];
+        COLORIST_ASSERT(pixelCount <= TRANSFORM_BLOCK_PIXELS);
+
+        cmsDoTransform(transform->lcmsSrcToXYZ, pixels, XYZ, (cmsUInt32Number)pixelCount);
+        for (int i = 0; i < pixelCount; ++i) {
+            transformScaleLuminance(C, transform, clFalse, transform->tonemapEnabled, &XYZ[i * 3]);
+        }
+        cmsDoTransform(transform->lcmsXYZToDst, XYZ, pixels, (cmsUInt32Number)pixelCount);
+    }
+    if (transform->dstProfile) { // don't clamp XYZ
+        for (int i = 0; i < pixelCount; ++i) {
+            float * pixel = &pixels[i * 4];
+            pixel[0] = CL_CLAMP(pixel[0], 0.0f, 1.0f); // clamp
+            pixel[1] = CL_CLAMP(pixel[1], 0.0f, 1.0f); // clamp
+            pixel[2] = CL_CLAMP(pixel[2], 0.0f, 1.0f); // clamp
         }
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)tmpPixel, dstPixelBytes, dstPixels, dstPixelBytes, 1);
     }
 }
 
-static void transformRGB16ToFloat(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, int srcDepth, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
+// Same as transformBlockExact(), minus any transfer function already baked into a table (those are applied during unpack/pack instead)
+static void transformBlock(struct clContext * C, struct clTransform * transform, clBool useCCMM, float * pixels, int pixelCount)
 {
-    const float srcRescale = 1.0f / (float)((1 << srcDepth) - 1);
+    if (useCCMM && (transform->ccmmSrcEOTFTable || transform->ccmmDstOETFTable)) {
+        clTransformTransferFunction srcEOTF = transform->ccmmSrcEOTFTable ? CL_XTF_NONE : transform->ccmmSrcEOTF;
+        clTransformTransferFunction dstOETF = transform->ccmmDstOETFTable ? CL_XTF_NONE : transform->ccmmDstOETF;
+        transform->ccmmFunc(C, transform, srcEOTF, dstOETF, pixels, pixelCount);
+        return;
+    }
+    transformBlockExact(C, transform, useCCMM, pixels, pixelCount);
+}
+
+// ----------------------------------------------------------------------------
+// Baked 3D LUT
+
+// Samples per axis used to measure the LUT's error in verbose mode. Deliberately coprime with
+// the usual LUT sizes, so that (almost) no sample lands on a grid point.
+#define LUT_ERROR_SAMPLES 37
+
+// Only integer sources are guaranteed to stay inside the LUT's [0,1] domain
+static clBool transformUsesLUT(struct clContext * C, struct clTransform * transform)
+{
+    return (transform->lutSize > 1) && !clTransformFormatIsFloat(C, transform->srcFormat, transform->srcDepth);
+}
+
+// Tetrahedral interpolation of the RGB channels of tightly packed RGBA float pixels, in-place
+static void transformLUTBlock(struct clTransform * transform, float * pixels, int pixelCount)
+{
+    const int size = transform->lutSize;
+    const float scale = (float)(size - 1);
+    const int strideR = 3;
+    const int strideG = 3 * size;
+    const int strideB = 3 * size * size;
 
     for (int i = 0; i < pixelCount; ++i) {
-        float tmpPixel[4];
-        uint16_t * srcPixel = (uint16_t *)&srcPixels[i * srcPixelBytes];
-        tmpPixel[0] = (float)srcPixel[0] * srcRescale;
-        tmpPixel[1] = (float)srcPixel[1] * srcRescale;
-        tmpPixel[2] = (float)srcPixel[2] * srcRescale;
-        if (DST_FLOAT_HAS_ALPHA()) {
-            if (SRC_16_HAS_ALPHA()) {
-                // reformat alpha
-                tmpPixel[3] = (float)srcPixel[3] * srcRescale;
+        float * pixel = &pixels[i * 4];
+        float fr = CL_CLAMP(pixel[0], 0.0f, 1.0f) * scale;
+        float fg = CL_CLAMP(pixel[1], 0.0f, 1.0f) * scale;
+        float fb = CL_CLAMP(pixel[2], 0.0f, 1.0f) * scale;
+        int ir = (int)fr;
+        int ig = (int)fg;
+        int ib = (int)fb;
+        if (ir > size - 2)
+            ir = size - 2;
+        if (ig > size - 2)
+            ig = size - 2;
+        if (ib > size - 2)
+            ib = size - 2;
+        float dr = fr - (float)ir;
+        float dg = fg - (float)ig;
+        float db = fb - (float)ib;
+
+        // Pick the tetrahedron containing the point; its corners are walked from c000 to c111
+        // along the axes in order of decreasing fractional distance.
+        const float * c000 = &transform->lut[(ir * strideR) + (ig * strideG) + (ib * strideB)];
+        const float * c111 = c000 + strideR + strideG + strideB;
+        const float * c1;
+        const float * c2;
+        float w1, w2, w3;
+        if (dr >= dg) {
+            if (dg >= db) {
+                c1 = c000 + strideR;
+                c2 = c1 + strideG;
+                w1 = dr;
+                w2 = dg;
+                w3 = db;
+            } else if (dr >= db) {
+                c1 = c000 + strideR;
+                c2 = c1 + strideB;
+                w1 = dr;
+                w2 = db;
+                w3 = dg;
             } else {
-                // RGB -> RGBA, set full opacity
-                tmpPixel[3] = 1.0f;
+                c1 = c000 + strideB;
+                c2 = c1 + strideR;
+                w1 = db;
+                w2 = dr;
+                w3 = dg;
             }
+        } else {
+            if (db >= dg) {
+                c1 = c000 + strideB;
+                c2 = c1 + strideG;
+                w1 = db;
+                w2 = dg;
+                w3 = dr;
+            } else if (db >= dr) {
+                c1 = c000 + strideG;
+                c2 = c1 + strideB;
+                w1 = dg;
+                w2 = db;
+                w3 = dr;
+            } else {
+                c1 = c000 + strideG;
+                c2 = c1 + strideR;
+                w1 = dg;
+                w2 = dr;
+                w3 = db;
+            }
+        }
+
+        for (int channel = 0; channel < 3; ++channel) {
+            pixel[channel] = c000[channel] + (w1 * (c1[channel] - c000[channel])) + (w2 * (c2[channel] - c1[channel])) + (w3 * (c111[channel] - c2[channel]));
         }
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)tmpPixel, dstPixelBytes, dstPixels, dstPixelBytes, 1);
     }
 }
 
-static void transformRGB8ToRGB8(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
+static void transformMeasureLUT(struct clContext * C, struct clTransform * transform, clBool useCCMM)
 {
-    const float srcRescale = 1.0f / 255.0f;
-    const float dstRescale = 255.0f;
+    const int sampleCount = LUT_ERROR_SAMPLES * LUT_ERROR_SAMPLES * LUT_ERROR_SAMPLES;
+    float exact[TRANSFORM_BLOCK_PIXELS * 4];
+    float baked[TRANSFORM_BLOCK_PIXELS * 4];
+    double errorSum = 0.0;
+    float errorMax = 0.0f;
+
+    for (int blockStart = 0; blockStart < sampleCount; blockStart += TRANSFORM_BLOCK_PIXELS) {
+        int blockPixelCount = sampleCount - blockStart;
+        if (blockPixelCount > TRANSFORM_BLOCK_PIXELS) {
+            blockPixelCount = TRANSFORM_BLOCK_PIXELS;
+        }
+        for (int i = 0; i < blockPixelCount; ++i) {
+            int sample = blockStart + i;
+            exact[(i * 4) + 0] = ((float)(sample % LUT_ERROR_SAMPLES) + 0.5f) / (float)LUT_ERROR_SAMPLES;
+            exact[(i * 4) + 1] = ((float)((sample / LUT_ERROR_SAMPLES) % LUT_ERROR_SAMPLES) + 0.5f) / (float)LUT_ERROR_SAMPLES;
+            exact[(i * 4) + 2] = ((float)(sample / (LUT_ERROR_SAMPLES * LUT_ERROR_SAMPLES)) + 0.5f) / (float)LUT_ERROR_SAMPLES;
+            exact[(i * 4) + 3] = 1.0f;
+        }
+        memcpy(baked, exact, sizeof(float) * 4 * blockPixelCount);
+        transformBlockExact(C, transform, useCCMM, exact, blockPixelCount);
+        if (transform->haldLattice) {
+            clPixelMathHaldCLUTApply(C, 1, transform->haldLattice, transform->haldDims, exact, exact, blockPixelCount);
+        }
+        transformLUTBlock(transform, baked, blockPixelCount);
+
+        for (int i = 0; i < blockPixelCount * 4; ++i) {
+            if ((i & 3) != 3) {
+                float error = fabsf(exact[i] - baked[i]);
+                errorSum += error;
+                if (errorMax < error) {
+                    errorMax = error;
+                }
+            }
+        }
+    }
 
-    for (int i = 0; i < pixelCount; ++i) {
-        float tmpSrc[4];
-        float tmpDst[4];
-        uint8_t * srcPixel = &srcPixels[i * srcPixelBytes];
-        uint8_t * dstPixel = &dstPixels[i * dstPixelBytes];
-        int tmpSrcBytes;
-        int tmpDstBytes;
+    clContextLog(C, "convert", 1, "3D LUT %dx%dx%d: max error %g, mean error %g (%d samples)",
+                 transform->lutSize, transform->lutSize, transform->lutSize,
+                 errorMax, (float)(errorSum / (sampleCount * 3)), sampleCount);
+}
 
-        tmpSrc[0] = (float)srcPixel[0] * srcRescale;
-        tmpSrc[1] = (float)srcPixel[1] * srcRescale;
-        tmpSrc[2] = (float)srcPixel[2] * srcRescale;
-        if (SRC_8_HAS_ALPHA()) {
-            tmpSrc[3] = (float)srcPixel[3] * srcRescale;
-            tmpSrcBytes = 16;
-        } else {
-            tmpSrcBytes = 12;
+// Samples the entire exact pipeline (curves, luminance scaling, tonemapping, Hald CLUT) at every grid point
+static void transformBuildLUT(struct clContext * C, struct clTransform * transform, clBool useCCMM)
+{
+    const int size = transform->lutSize;
+    const int gridCount = size * size * size;
+    const float step = 1.0f / (float)(size - 1);
+    float block[TRANSFORM_BLOCK_PIXELS * 4];
+
+    transform->lut = clAllocate(sizeof(float) * 3 * gridCount);
+    for (int blockStart = 0; blockStart < gridCount; blockStart += TRANSFORM_BLOCK_PIXELS) {
+        int blockPixelCount = gridCount - blockStart;
+        if (blockPixelCount > TRANSFORM_BLOCK_PIXELS) {
+            blockPixelCount = TRANSFORM_BLOCK_PIXELS;
         }
-        if (DST_8_HAS_ALPHA()) {
-            tmpDstBytes = 16;
-        } else {
-            tmpDstBytes = 12;
+        for (int i = 0; i < blockPixelCount; ++i) {
+            int gridIndex = blockStart + i;
+            block[(i * 4) + 0] = (float)(gridIndex % size) * step;
+            block[(i * 4) + 1] = (float)((gridIndex / size) % size) * step;
+            block[(i * 4) + 2] = (float)(gridIndex / (size * size)) * step;
+            block[(i * 4) + 3] = 1.0f;
+        }
+        transformBlockExact(C, transform, useCCMM, block, blockPixelCount);
+        if (transform->haldLattice) {
+            clPixelMathHaldCLUTApply(C, 1, transform->haldLattice, transform->haldDims, block, block, blockPixelCount);
         }
+        for (int i = 0; i < blockPixelCount; ++i) {
+            memcpy(&transform->lut[(blockStart + i) * 3], &block[i * 4], sizeof(float) * 3);
+        }
+    }
 
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)tmpSrc, tmpSrcBytes, (uint8_t *)tmpDst, tmpDstBytes, 1);
+    if (C->verbose) {
+        transformMeasureLUT(C, transform, useCCMM);
+    }
+}
 
-        dstPixel[0] = (uint8_t)clPixelMathRoundNormalized(tmpDst[0], dstRescale);
-        dstPixel[1] = (uint8_t)clPixelMathRoundNormalized(tmpDst[1], dstRescale);
-        dstPixel[2] = (uint8_t)clPixelMathRoundNormalized(tmpDst[2], dstRescale);
-        if (DST_8_HAS_ALPHA()) {
-            if (SRC_8_HAS_ALPHA()) {
-                // reformat alpha
-                dstPixel[3] = (uint8_t)clPixelMathRoundNormalized(tmpDst[3], dstRescale);
-            } else {
-                // RGB -> RGBA, set full opacity
-                dstPixel[3] = 255;
-            }
+// ----------------------------------------------------------------------------
+// Block staging for RGB/RGBA
+
+static void unpackFloat(uint8_t * srcPixels, int srcPixelBytes, float * block, int pixelCount)
+{
+    for (int i = 0; i < pixelCount; ++i) {
+        float * srcPixel = (float *)&srcPixels[i * srcPixelBytes];
+        float * blockPixel = &block[i * 4];
+        memcpy(blockPixel, srcPixel, sizeof(float) * 3); // all float formats are at least 3 floats
+        if (SRC_FLOAT_HAS_ALPHA()) {
+            blockPixel[3] = srcPixel[3];
+        } else {
+            // RGB -> RGBA, set full opacity
+            blockPixel[3] = 1.0f;
         }
     }
 }
 
-static void transformRGB8ToRGB16(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, uint8_t * dstPixels, int dstPixelBytes, int dstDepth, int pixelCount)
+static void unpackRGB8(uint8_t * srcPixels, int srcPixelBytes, const float * eotfTable, float * block, int pixelCount)
 {
     static const float srcRescale = 1.0f / 255.0f;
-    const int dstMaxChannel = (1 << dstDepth) - 1;
-    const float dstRescale = (float)dstMaxChannel;
 
     for (int i = 0; i < pixelCount; ++i) {
-        float tmpSrc[4];
-        float tmpDst[4];
         uint8_t * srcPixel = &srcPixels[i * srcPixelBytes];
-        uint16_t * dstPixel = (uint16_t *)&dstPixels[i * dstPixelBytes];
-        int tmpSrcBytes;
-        int tmpDstBytes;
-
-        tmpSrc[0] = (float)srcPixel[0] * srcRescale;
-        tmpSrc[1] = (float)srcPixel[1] * srcRescale;
-        tmpSrc[2] = (float)srcPixel[2] * srcRescale;
-        if (SRC_8_HAS_ALPHA()) {
-            tmpSrc[3] = (float)srcPixel[3] * srcRescale;
-            tmpSrcBytes = 16;
+        float * blockPixel = &block[i * 4];
+        if (eotfTable) {
+            blockPixel[0] = eotfTable[srcPixel[0]];
+            blockPixel[1] = eotfTable[srcPixel[1]];
+            blockPixel[2] = eotfTable[srcPixel[2]];
         } else {
-            tmpSrcBytes = 12;
+            blockPixel[0] = (float)srcPixel[0] * srcRescale;
+            blockPixel[1] = (float)srcPixel[1] * srcRescale;
+            blockPixel[2] = (float)srcPixel[2] * srcRescale;
         }
-        if (DST_16_HAS_ALPHA()) {
-            tmpDstBytes = 16;
+        if (SRC_8_HAS_ALPHA()) {
+            blockPixel[3] = (float)srcPixel[3] * srcRescale;
         } else {
-            tmpDstBytes = 12;
-        }
-
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)tmpSrc, tmpSrcBytes, (uint8_t *)tmpDst, tmpDstBytes, 1);
-
-        dstPixel[0] = (uint16_t)clPixelMathRoundNormalized(tmpDst[0], dstRescale);
-        dstPixel[1] = (uint16_t)clPixelMathRoundNormalized(tmpDst[1], dstRescale);
-        dstPixel[2] = (uint16_t)clPixelMathRoundNormalized(tmpDst[2], dstRescale);
-        if (DST_16_HAS_ALPHA()) {
-            if (SRC_8_HAS_ALPHA()) {
-                // reformat alpha
-                dstPixel[3] = (uint16_t)clPixelMathRoundNormalized(tmpDst[3], dstRescale);
-            } else {
-                // RGB -> RGBA, set full opacity
-                dstPixel[3] = (uint16_t)dstMaxChannel;
-            }
+            // RGB -> RGBA, set full opacity
+            blockPixel[3] = 1.0f;
         }
     }
 }
 
-static void transformRGB16ToRGB8(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, int srcDepth, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
+static void unpackRGB16(uint8_t * srcPixels, int srcPixelBytes, int srcDepth, const float * eotfTable, float * block, int pixelCount)
 {
-    const int srcMaxChannel = (1 << srcDepth) - 1;
-    const float srcRescale = 1.0f / (float)srcMaxChannel;
-    static const float dstRescale = 255.0f;
+    const float srcRescale = 1.0f / (float)((1 << srcDepth) - 1);
 
     for (int i = 0; i < pixelCount; ++i) {
-        float tmpSrc[4];
-        float tmpDst[4];
         uint16_t * srcPixel = (uint16_t *)&srcPixels[i * srcPixelBytes];
-        uint8_t * dstPixel = &dstPixels[i * dstPixelBytes];
-        int tmpSrcBytes;
-        int tmpDstBytes;
-
-        tmpSrc[0] = (float)srcPixel[0] * srcRescale;
-        tmpSrc[1] = (float)srcPixel[1] * srcRescale;
-        tmpSrc[2] = (float)srcPixel[2] * srcRescale;
-        if (SRC_16_HAS_ALPHA()) {
-            tmpSrc[3] = (float)srcPixel[3] * srcRescale;
-            tmpSrcBytes = 16;
+        float * blockPixel = &block[i * 4];
+        if (eotfTable) {
+            blockPixel[0] = eotfTable[srcPixel[0]];
+            blockPixel[1] = eotfTable[srcPixel[1]];
+            blockPixel[2] = eotfTable[srcPixel[2]];
         } else {
-            tmpSrcBytes = 12;
+            blockPixel[0] = (float)srcPixel[0] * srcRescale;
+            blockPixel[1] = (float)srcPixel[1] * srcRescale;
+            blockPixel[2] = (float)srcPixel[2] * srcRescale;
         }
-        if (DST_8_HAS_ALPHA()) {
-            tmpDstBytes = 16;
+        if (SRC_16_HAS_ALPHA()) {
+            blockPixel[3] = (float)srcPixel[3] * srcRescale;
         } else {
-            tmpDstBytes = 12;
+            // RGB -> RGBA, set full opacity
+            blockPixel[3] = 1.0f;
         }
+    }
+}
 
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)tmpSrc, tmpSrcBytes, (uint8_t *)tmpDst, tmpDstBytes, 1);
-
-        dstPixel[0] = (uint8_t)clPixelMathRoundNormalized(tmpDst[0], dstRescale);
-        dstPixel[1] = (uint8_t)clPixelMathRoundNormalized(tmpDst[1], dstRescale);
-        dstPixel[2] = (uint8_t)clPixelMathRoundNormalized(tmpDst[2], dstRescale);
-        if (DST_8_HAS_ALPHA()) {
-            if (SRC_16_HAS_ALPHA()) {
-                // reformat alpha
-                dstPixel[3] = (uint8_t)clPixelMathRoundNormalized(tmpDst[3], dstRescale);
-            } else {
-                // RGB -> RGBA, set full opacity
-                dstPixel[3] = 255;
-            }
+static void packFloat(float * block, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
+{
+    for (int i = 0; i < pixelCount; ++i) {
+        float * blockPixel = &block[i * 4];
+        float * dstPixel = (float *)&dstPixels[i * dstPixelBytes];
+        memcpy(dstPixel, blockPixel, sizeof(float) * 3);
+        if (DST_FLOAT_HAS_ALPHA()) {
+            dstPixel[3] = blockPixel[3];
         }
     }
 }
 
-static void transformRGB16ToRGB16(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, int srcDepth, uint8_t * dstPixels, int dstPixelBytes, int dstDepth, int pixelCount)
+static void packRGB8(struct clTransform * transform, clBool useOETFTable, float * block, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
 {
-    const int srcMaxChannel = (1 << srcDepth) - 1;
-    const float srcRescale = 1.0f / (float)srcMaxChannel;
-    const int dstMaxChannel = (1 << dstDepth) - 1;
-    const float dstRescale = (float)dstMaxChannel;
+    static const float dstRescale = 255.0f;
 
     for (int i = 0; i < pixelCount; ++i) {
-        float tmpSrc[4];
-        float tmpDst[4];
-        uint16_t * srcPixel = (uint16_t *)&srcPixels[i * srcPixelBytes];
-        uint16_t * dstPixel = (uint16_t *)&dstPixels[i * dstPixelBytes];
-        int tmpSrcBytes;
-        int tmpDstBytes;
-
-        tmpSrc[0] = (float)srcPixel[0] * srcRescale;
-        tmpSrc[1] = (float)srcPixel[1] * srcRescale;
-        tmpSrc[2] = (float)srcPixel[2] * srcRescale;
-        if (SRC_16_HAS_ALPHA()) {
-            tmpSrc[3] = (float)srcPixel[3] * srcRescale;
-            tmpSrcBytes = 16;
-        } else {
-            tmpSrcBytes = 12;
+        float * blockPixel = &block[i * 4];
+        uint8_t * dstPixel = &dstPixels[i * dstPixelBytes];
+        if (useOETFTable) {
+            blockPixel[0] = transformLookupOETF(transform, blockPixel[0]);
+            blockPixel[1] = transformLookupOETF(transform, blockPixel[1]);
+            blockPixel[2] = transformLookupOETF(transform, blockPixel[2]);
         }
-        if (DST_16_HAS_ALPHA()) {
-            tmpDstBytes = 16;
-        } else {
-            tmpDstBytes = 12;
+        dstPixel[0] = (uint8_t)clPixelMathRoundNormalized(blockPixel[0], dstRescale);
+        dstPixel[1] = (uint8_t)clPixelMathRoundNormalized(blockPixel[1], dstRescale);
+        dstPixel[2] = (uint8_t)clPixelMathRoundNormalized(blockPixel[2], dstRescale);
+        if (DST_8_HAS_ALPHA()) {
+            dstPixel[3] = (uint8_t)clPixelMathRoundNormalized(blockPixel[3], dstRescale);
         }
+    }
+}
 
-        transformFloatToFloat(C, transform, useCCMM, (uint8_t *)tmpSrc, tmpSrcBytes, (uint8_t *)tmpDst, tmpDstBytes, 1);
+static void packRGB16(struct clTransform * transform, clBool useOETFTable, float * block, uint8_t * dstPixels, int dstPixelBytes, int dstDepth, int pixelCount)
+{
+    const float dstRescale = (float)((1 << dstDepth) - 1);
 
-        dstPixel[0] = (uint16_t)clPixelMathRoundNormalized(tmpDst[0], dstRescale);
-        dstPixel[1] = (uint16_t)clPixelMathRoundNormalized(tmpDst[1], dstRescale);
-        dstPixel[2] = (uint16_t)clPixelMathRoundNormalized(tmpDst[2], dstRescale);
+    for (int i = 0; i < pixelCount; ++i) {
+        float * blockPixel = &block[i * 4];
+        uint16_t * dstPixel = (uint16_t *)&dstPixels[i * dstPixelBytes];
+        if (useOETFTable) {
+            blockPixel[0] = transformLookupOETF(transform, blockPixel[0]);
+            blockPixel[1] = transformLookupOETF(transform, blockPixel[1]);
+            blockPixel[2] = transformLookupOETF(transform, blockPixel[2]);
+        }
+        dstPixel[0] = (uint16_t)clPixelMathRoundNormalized(blockPixel[0], dstRescale);
+        dstPixel[1] = (uint16_t)clPixelMathRoundNormalized(blockPixel[1], dstRescale);
+        dstPixel[2] = (uint16_t)clPixelMathRoundNormalized(blockPixel[2], dstRescale);
         if (DST_16_HAS_ALPHA()) {
-            if (SRC_16_HAS_ALPHA()) {
-                // reformat alpha
-                dstPixel[3] = (uint16_t)clPixelMathRoundNormalized(tmpDst[3], dstRescale);
-            } else {
-                // RGB -> RGBA, set full opacity
-                dstPixel[3] = (uint16_t)dstMaxChannel;
-            }
+            dstPixel[3] = (uint16_t)clPixelMathRoundNormalized(blockPixel[3], dstRescale);
         }
     }
 }
@@ -922,6 +1046,59 @@ static void reformatRGB16ToRGB8(struct clContext * C, uint8_t * srcPixels, int s
 #define USES_UINT8_T(V) ((V) == 8)
 #define USES_UINT16_T(V) (((V) >= 9) && ((V) <= 16))
 
+// Returns clFalse if either depth is unsupported
+static clBool transformPixels(struct clContext * C, struct clTransform * transform, clBool useCCMM, uint8_t * srcPixels, int srcPixelBytes, uint8_t * dstPixels, int dstPixelBytes, int pixelCount)
+{
+    int srcDepth = transform->srcDepth;
+    int dstDepth = transform->dstDepth;
+    clBool srcIsFloat = clTransformFormatIsFloat(C, transform->srcFormat, srcDepth);
+    clBool dstIsFloat = clTransformFormatIsFloat(C, transform->dstFormat, dstDepth);
+    float block[TRANSFORM_BLOCK_PIXELS * 4];
+
+    // The curve tables belong to the CCMM; LittleCMS applies its own curves
+    const float * srcEOTFTable = useCCMM ? transform->ccmmSrcEOTFTable : NULL;
+    clBool useOETFTable = (useCCMM && transform->ccmmDstOETFTable) ? clTrue : clFalse;
+
+    if ((!srcIsFloat && !USES_UINT8_T(srcDepth) && !USES_UINT16_T(srcDepth)) || (!dstIsFloat && !USES_UINT8_T(dstDepth) && !USES_UINT16_T(dstDepth))) {
+        return clFalse;
+    }
+
+    for (int blockStart = 0; blockStart < pixelCount; blockStart += TRANSFORM_BLOCK_PIXELS) {
+        int blockPixelCount = pixelCount - blockStart;
+        uint8_t * blockSrcPixels = &srcPixels[blockStart * srcPixelBytes];
+        uint8_t * blockDstPixels = &dstPixels[blockStart * dstPixelBytes];
+        if (blockPixelCount > TRANSFORM_BLOCK_PIXELS) {
+            blockPixelCount = TRANSFORM_BLOCK_PIXELS;
+        }
+
+        if (srcIsFloat) {
+            unpackFloat(blockSrcPixels, srcPixelBytes, block, blockPixelCount);
+        } else if (USES_UINT8_T(srcDepth)) {
+            unpackRGB8(blockSrcPixels, srcPixelBytes, srcEOTFTable, block, blockPixelCount);
+        } else {
+            unpackRGB16(blockSrcPixels, srcPixelBytes, srcDepth, srcEOTFTable, block, blockPixelCount);
+        }
+
+        if (transform->lut) {
+            transformLUTBlock(transform, block, blockPixelCount);
+        } else {
+            transformBlock(C, transform, useCCMM, block, blockPixelCount);
+            if (transform->haldLattice) {
+                clPixelMathHaldCLUTApply(C, 1, transform->haldLattice, transform->haldDims, block, block, blockPixelCount);
+            }
+        }
+
+        if (dstIsFloat) {
+            packFloat(block, blockDstPixels, dstPixelBytes, blockPixelCount);
+        } else if (USES_UINT8_T(dstDepth)) {
+            packRGB8(transform, useOETFTable, block, blockDstPixels, dstPixelBytes, blockPixelCount);
+        } else {
+            packRGB16(transform, useOETFTable, block, blockDstPixels, dstPixelBytes, dstDepth, blockPixelCount);
+        }
+    }
+    return clTrue;
+}
+
 static void clCCMMTransform(struct clContext * C, struct clTransform * transform, clBool useCCMM, void * srcPixels, void * dstPixels, int pixelCount)
 {
     int srcDepth = transform->srcDepth;
@@ -934,7 +1111,7 @@ static void clCCMMTransform(struct clContext * C, struct clTransform * transform
 
     // After this point, find a single valid return point from this function, or die
 
-    if (clProfileMatches(C, transform->srcProfile, transform->dstProfile)) {
+    if (!transform->haldLattice && clProfileMatches(C, transform->srcProfile, transform->dstProfile)) {
         // No color conversion necessary, just format conversion
 
         if (clTransformFormatIsFloat(C, transform->srcFormat, srcDepth) && clTransformFormatIsFloat(C, transform->dstFormat, dstDepth)) {
@@ -989,56 +1166,19 @@ static void clCCMMTransform(struct clContext * C, struct clTransform * transform
         }
     } else {
         // Color conversion is required
-
-        if (clTransformFormatIsFloat(C, transform->srcFormat, srcDepth) && clTransformFormatIsFloat(C, transform->dstFormat, dstDepth)) {
-            // Float to Float
-            transformFloatToFloat(C, transform, useCCMM, srcPixels, srcPixelBytes, dstPixels, dstPixelBytes, pixelCount);
+        if (!useCCMM && transform->lcmsNative) {
+            cmsDoTransform(transform->lcmsNative, srcPixels, dstPixels, (cmsUInt32Number)pixelCount);
+            if ((transform->srcFormat == CL_XF_RGB) && (transform->dstFormat == CL_XF_RGBA)) {
+                // RGB -> RGBA, set full opacity (LittleCMS only copies alpha between matching formats)
+                uint8_t * dstPixel = dstPixels;
+                for (int i = 0; i < pixelCount; ++i, dstPixel += dstPixelBytes) {
+                    dstPixel[3] = 255;
+                }
+            }
             return;
         }
-
-        if (clTransformFormatIsFloat(C, transform->srcFormat, srcDepth)) {
-            // Float -> 8 or 16
-            if (USES_UINT8_T(dstDepth)) {
-                transformFloatToRGB8(C, transform, useCCMM, srcPixels, srcPixelBytes, dstPixels, dstPixelBytes, pixelCount);
-                return;
-            }
-
-            if (USES_UINT16_T(dstDepth)) {
-                transformFloatToRGB16(C, transform, useCCMM, srcPixels, srcPixelBytes, dstPixels, dstPixelBytes, dstDepth, pixelCount);
-                return;
-            }
-        } else if (clTransformFormatIsFloat(C, transform->dstFormat, dstDepth)) {
-            // 8 or 16 -> Float
-            if (USES_UINT8_T(srcDepth)) {
-                transformRGB8ToFloat(C, transform, useCCMM, srcPixels, srcPixelBytes, dstPixels, dstPixelBytes, pixelCount);
-                return;
-            }
-
-            if (USES_UINT16_T(srcDepth)) {
-                transformRGB16ToFloat(C, transform, useCCMM, srcPixels, srcPixelBytes, srcDepth, dstPixels, dstPixelBytes, pixelCount);
-                return;
-            }
-        } else {
-            // 8 or 16 -> 8 or 16
-            if (USES_UINT8_T(srcDepth) && USES_UINT8_T(dstDepth)) {
-                transformRGB8ToRGB8(C, transform, useCCMM, srcPixels, srcPixelBytes, dstPixels, dstPixelBytes, pixelCount);
-                return;
-            }
-
-            if (USES_UINT8_T(srcDepth) && USES_UINT16_T(dstDepth)) {
-                transformRGB8ToRGB16(C, transform, useCCMM, srcPixels, srcPixelBytes, dstPixels, dstPixelBytes, dstDepth, pixelCount);
-                return;
-            }
-
-            if (USES_UINT16_T(srcDepth) && USES_UINT8_T(dstDepth)) {
-                transformRGB16ToRGB8(C, transform, useCCMM, srcPixels, srcPixelBytes, srcDepth, dstPixels, dstPixelBytes, pixelCount);
-                return;
-            }
-
-            if (USES_UINT16_T(srcDepth) && USES_UINT16_T(dstDepth)) {
-                transformRGB16ToRGB16(C, transform, useCCMM, srcPixels, srcPixelBytes, srcDepth, dstPixels, dstPixelBytes, dstDepth, pixelCount);
-                return;
-            }
+        if (transformPixels(C, transform, useCCMM, srcPixels, srcPixelBytes, dstPixels, dstPixelBytes, pixelCount)) {
+            return;
         }
     }
 
@@ -1089,19 +1229,38 @@ clTransform * clTransformCreate(struct clContext * C, struct clProfile * srcProf
     transform->srcDepth = srcDepth;
     transform->dstDepth = dstDepth;
     transform->tonemap = tonemap;
-
+    transform->lutSize = 0;
+    transform->lut = NULL;
+    transform->haldLattice = NULL;
+    transform->haldDims = 0;
+    transform->chunkPixels = 0;
+
+    transform->ccmmSrcEOTFTable = NULL;
+    transform->ccmmDstOETFTable = NULL;
+    transform->ccmmFunc = NULL;
+    transform->ccmmFuncName = NULL;
     transform->ccmmReady = clFalse;
 
     transform->lcmsXYZProfile = NULL;
     transform->lcmsSrcToXYZ = NULL;
     transform->lcmsXYZToDst = NULL;
     transform->lcmsCombined = NULL;
+    transform->lcmsNative = NULL;
     transform->lcmsReady = clFalse;
     return transform;
 }
 
 void clTransformDestroy(struct clContext * C, clTransform * transform)
 {
+    if (transform->lut) {
+        clFree(transform->lut);
+    }
+    if (transform->ccmmSrcEOTFTable) {
+        clFree(transform->ccmmSrcEOTFTable);
+    }
+    if (transform->ccmmDstOETFTable) {
+        clFree(transform->ccmmDstOETFTable);
+    }
     if (transform->lcmsSrcToXYZ) {
         cmsDeleteTransform(transform->lcmsSrcToXYZ);
     }
@@ -1111,6 +1270,9 @@ void clTransformDestroy(struct clContext * C, clTransform * transform)
     if (transform->lcmsCombined) {
         cmsDeleteTransform(transform->lcmsCombined);
     }
+    if (transform->lcmsNative) {
+        cmsDeleteTransform(transform->lcmsNative);
+    }
     if (transform->lcmsXYZProfile) {
         cmsCloseProfile(transform->lcmsXYZProfile);
     }
@@ -1121,16 +1283,36 @@ static cmsUInt32Number clTransformFormatToLCMSFormat(struct clContext * C, clTra
 {
     COLORIST_UNUSED(C);
 
+    // LittleCMS only ever sees staged blocks, which are always 4 floats per pixel (see transformPixels()).
+    // The alpha channel is carried along as an extra channel, and left alone.
     switch (format) {
-        case CL_XF_XYZ:  return TYPE_XYZ_FLT;
-        case CL_XF_RGB:  return TYPE_RGB_FLT;
-        case CL_XF_RGBA: return TYPE_RGB_FLT; // CCMM deals with the alpha
+        case CL_XF_XYZ:  return TYPE_XYZ_FLT | EXTRA_SH(1);
+        case CL_XF_RGB:  return TYPE_RGBA_FLT;
+        case CL_XF_RGBA: return TYPE_RGBA_FLT;
     }
 
     COLORIST_FAILURE("clTransformFormatToLCMSFormat: Unknown transform format");
     return TYPE_RGBA_FLT;
 }
 
+// Returns 0 if LittleCMS shouldn't read/write this format directly. Only 8-bit qualifies; LittleCMS'
+// precalculated 16-bit pipelines drift over a percent away from the float path on out-of-gamut
+// colors, which is too lossy for 16-bit output.
+static cmsUInt32Number clTransformFormatToLCMSNativeFormat(struct clContext * C, clTransformFormat format, int depth)
+{
+    COLORIST_UNUSED(C);
+
+    if (depth != 8) {
+        return 0;
+    }
+    switch (format) {
+        case CL_XF_XYZ:  return 0;
+        case CL_XF_RGB:  return TYPE_RGB_8;
+        case CL_XF_RGBA: return TYPE_RGBA_8;
+    }
+    return 0;
+}
+
 clBool clTransformFormatIsFloat(struct clContext * C, clTransformFormat format, int depth)
 {
     COLORIST_UNUSED(C);
@@ -1197,6 +1379,11 @@ float clTransformGetLuminanceScale(struct clContext * C, clTransform * transform
     return transform->srcLuminanceScale / transform->dstLuminanceScale * transform->srcCurveScale / transform->dstCurveScale;
 }
 
+// Pixels per unit of work clTransformRun() queues on the task pool (unless transform->chunkPixels
+// overrides it). Small enough to stay cache friendly and to leave plenty of chunks for whichever
+// threads finish early; large enough that queueing overhead is noise.
+#define TRANSFORM_DEFAULT_CHUNK_PIXELS (32 * 1024)
+
 typedef struct clTransformTask
 {
     clContext * C;
@@ -1205,11 +1392,29 @@ typedef struct clTransformTask
     void * outPixels;
     int pixelCount;
     clBool useCCMM;
+    double seconds; // for verbose chunk stats
 } clTransformTask;
 
 static void transformTaskFunc(clTransformTask * info)
 {
+    Timer t;
+    timerStart(&t);
     clCCMMTransform(info->C, info->transform, info->useCCMM, info->inPixels, info->outPixels, info->pixelCount);
+    info->seconds = timerElapsedSeconds(&t);
+}
+
+static void transformLogChunkStats(struct clContext * C, clTransformTask * infos, int chunkCount, int chunkPixels)
+{
+    double totalSeconds = 0.0;
+    double minSeconds = infos[0].seconds;
+    double maxSeconds = infos[0].seconds;
+    for (int i = 0; i < chunkCount; ++i) {
+        totalSeconds += infos[i].seconds;
+        minSeconds = (minSeconds < infos[i].seconds) ? minSeconds : infos[i].seconds;
+        maxSeconds = (maxSeconds > infos[i].seconds) ? maxSeconds : infos[i].seconds;
+    }
+    clContextLog(C, "convert", 1, "Chunk times (%d chunks of up to %d pixels): min %.3fms, mean %.3fms, max %.3fms (%.3fms of work total)",
+                 chunkCount, chunkPixels, minSeconds * 1000.0, totalSeconds * 1000.0 / chunkCount, maxSeconds * 1000.0, totalSeconds * 1000.0);
 }
 
 void clTransformRun(struct clContext * C, clTransform * transform, int taskCount, void * srcPixels, void * dstPixels, int pixelCount)
@@ -1225,10 +1430,6 @@ void clTransformRun(struct clContext * C, clTransform * transform, int taskCount
         taskCount = pixelCount;
     }
 
-    if (taskCount > 1) {
-        clContextLog(C, "convert", 1, "Using %d threads to pixel transform.", taskCount);
-    }
-
     if (taskCount == 1) {
         // Don't bother making any new threads
         clTransformTask info;
@@ -1240,28 +1441,45 @@ void clTransformRun(struct clContext * C, clTransform * transform, int taskCount
         info.useCCMM = useCCMM;
         transformTaskFunc(&info);
     } else {
+        // Queue the image as many small chunks rather than one slice per thread, so that a slow
+        // thread (or a slow region of the image) doesn't hold up the rest: whichever thread is free
+        // picks up the next chunk.
         uint8_t * uSrcPixels = (uint8_t *)srcPixels;
         uint8_t * uDstPixels = (uint8_t *)dstPixels;
-        int pixelsPerTask = pixelCount / taskCount;
-        int lastTaskPixelCount = pixelCount - (pixelsPerTask * (taskCount - 1));
-        clTask ** tasks;
+        int chunkPixels = (transform->chunkPixels > 0) ? transform->chunkPixels : TRANSFORM_DEFAULT_CHUNK_PIXELS;
+        int chunkCount;
+        clTaskPool * pool = clContextTaskPool(C, taskCount);
+        clTaskBatch batch;
+        clTask * tasks;
         clTransformTask * infos;
         int i;
 
-        tasks = clAllocate(taskCount * sizeof(clTask *));
-        infos = clAllocate(taskCount * sizeof(clTransformTask));
-        for (i = 0; i < taskCount; ++i) {
+        if (chunkPixels > ((pixelCount + taskCount - 1) / taskCount)) {
+            // Small image; make sure every thread still gets some work
+            chunkPixels = (pixelCount + taskCount - 1) / taskCount;
+        }
+        chunkCount = (pixelCount + chunkPixels - 1) / chunkPixels;
+
+        clContextLog(C, "convert", 1, "Using %d threads to pixel transform (%d chunks of up to %d pixels).", taskCount, chunkCount, chunkPixels);
+
+        tasks = clAllocate(chunkCount * sizeof(clTask));
+        infos = clAllocate(chunkCount * sizeof(clTransformTask));
+        clTaskBatchInit(&batch, taskCount);
+        for (i = 0; i < chunkCount; ++i) {
+            int chunkStart = i * chunkPixels;
             infos[i].C = C;
             infos[i].transform = transform;
-            infos[i].inPixels = &uSrcPixels[i * pixelsPerTask * srcPixelBytes];
-            infos[i].outPixels = &uDstPixels[i * pixelsPerTask * dstPixelBytes];
-            infos[i].pixelCount = (i == (taskCount - 1)) ? lastTaskPixelCount : pixelsPerTask;
+            infos[i].inPixels = &uSrcPixels[(size_t)chunkStart * srcPixelBytes];
+            infos[i].outPixels = &uDstPixels[(size_t)chunkStart * dstPixelBytes];
+            infos[i].pixelCount = ((pixelCount - chunkStart) < chunkPixels) ? (pixelCount - chunkStart) : chunkPixels;
             infos[i].useCCMM = useCCMM;
-            tasks[i] = clTaskCreate(C, (clTaskFunc)transformTaskFunc, &infos[i]);
+            infos[i].seconds = 0.0;
+            clTaskPoolSubmit(C, pool, &batch, &tasks[i], (clTaskFunc)transformTaskFunc, &infos[i]);
         }
+        clTaskPoolWait(C, pool, &batch);
 
-        for (i = 0; i < taskCount; ++i) {
-            clTaskDestroy(C, tasks[i]);
+        if (C->verbose) {
+            transformLogChunkStats(C, infos, chunkCount, chunkPixels);
         }
 
         clFree(tasks);
@@ -0,0 +1,97 @@
+// ---------------------------------------------------------------------------
+//                         Copyright Joe Drago 2018.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+// Internal to transform.c and transform_simd.c: the CCMM kernels and the macros generating them
+
+#ifndef COLORIST_TRANSFORM_CCMM_H
+#define COLORIST_TRANSFORM_CCMM_H
+
+#include "colorist/transform.h"
+
+// SMPTE ST.2084 constants, shared by all CCMM kernels
+#define CL_PQ_C1 (0.8359375f)       // 3424.0 / 4096.0
+#define CL_PQ_C2 (18.8515625f)      // 2413.0 / 4096.0 * 32.0
+#define CL_PQ_C3 (18.6875f)         // 2392.0 / 4096.0 * 32.0
+#define CL_PQ_M1 (0.1593017578125f) // 2610.0 / 4096.0 / 4.0
+#define CL_PQ_M2 (78.84375f)        // 2523.0 / 4096.0 * 128.0
+
+// CCMM pixel math kernel: EOTF -> XYZ -> luminance scale/tonemap -> dst -> OETF, done in-place on
+// tightly packed RGBA float pixels. Alpha is left untouched. srcEOTF/dstOETF are passed explicitly
+// (rather than read from the transform) so a curve already applied via a lookup table can be skipped.
+typedef void (* clTransformCCMMFunc)(struct clContext * C, struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, float * pixels, int pixelCount);
+
+// CCMM kernel specialization. Each kernel is written once as an always-inlined loop which takes every
+// per-transform decision as a parameter:
+//
+//     LOOP(C, transform, srcEOTF, dstOETF, scaleLuminance, tonemap, clamp, pixels, pixelCount)
+//
+// CL_CCMM_SPECIALIZE() then stamps out one copy of that loop per reachable combination of constants,
+// and a NAME##Specialized(transform) chooser used once by clTransformPrepare(). The transfer functions
+// are switched on once per call instead of once per pixel, as tables can override them per block.
+#if defined(_MSC_VER)
+#define CL_CCMM_INLINE static __forceinline
+#else
+#define CL_CCMM_INLINE static inline __attribute__((always_inline))
+#endif
+
+#define CL_CCMM_CURVES(LOOP, SRC, SCALE, TONEMAP, CLAMP)                                                     \
+    switch (dstOETF) {                                                                                       \
+        case CL_XTF_GAMMA:                                                                                   \
+            LOOP(C, transform, SRC, CL_XTF_GAMMA, SCALE, TONEMAP, CLAMP, pixels, pixelCount);                \
+            break;                                                                                           \
+        case CL_XTF_PQ:                                                                                      \
+            LOOP(C, transform, SRC, CL_XTF_PQ, SCALE, TONEMAP, CLAMP, pixels, pixelCount);                   \
+            break;                                                                                           \
+        case CL_XTF_NONE:                                                                                    \
+        default:                                                                                             \
+            LOOP(C, transform, SRC, CL_XTF_NONE, SCALE, TONEMAP, CLAMP, pixels, pixelCount);                 \
+            break;                                                                                           \
+    }
+
+#define CL_CCMM_VARIANT(ATTR, NAME, LOOP, SCALE, TONEMAP, CLAMP)                                             \
+    ATTR static void NAME(struct clContext * C, struct clTransform * transform,                              \
+        clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF,                            \
+        float * pixels, int pixelCount)                                                                      \
+    {                                                                                                        \
+        switch (srcEOTF) {                                                                                   \
+            case CL_XTF_GAMMA:                                                                               \
+                CL_CCMM_CURVES(LOOP, CL_XTF_GAMMA, SCALE, TONEMAP, CLAMP)                                    \
+                break;                                                                                       \
+            case CL_XTF_PQ:                                                                                  \
+                CL_CCMM_CURVES(LOOP, CL_XTF_PQ, SCALE, TONEMAP, CLAMP)                                       \
+                break;                                                                                       \
+            case CL_XTF_NONE:                                                                                \
+            default:                                                                                         \
+                CL_CCMM_CURVES(LOOP, CL_XTF_NONE, SCALE, TONEMAP, CLAMP)                                     \
+                break;                                                                                       \
+        }                                                                                                    \
+    }
+
+// Tonemapping always implies luminance scaling, and only XYZ destinations (no dstProfile) skip the clamp
+#define CL_CCMM_SPECIALIZE(ATTR, NAME, LOOP)                                                                 \
+    CL_CCMM_VARIANT(ATTR, NAME##Plain, LOOP, clFalse, clFalse, clFalse)                                      \
+    CL_CCMM_VARIANT(ATTR, NAME##Clamp, LOOP, clFalse, clFalse, clTrue)                                       \
+    CL_CCMM_VARIANT(ATTR, NAME##Scale, LOOP, clTrue, clFalse, clFalse)                                       \
+    CL_CCMM_VARIANT(ATTR, NAME##ScaleClamp, LOOP, clTrue, clFalse, clTrue)                                   \
+    CL_CCMM_VARIANT(ATTR, NAME##Tonemap, LOOP, clTrue, clTrue, clFalse)                                      \
+    CL_CCMM_VARIANT(ATTR, NAME##TonemapClamp, LOOP, clTrue, clTrue, clTrue)                                  \
+    static clTransformCCMMFunc NAME##Specialized(struct clTransform * transform)                             \
+    {                                                                                                        \
+        if (!transform->luminanceScaleEnabled)                                                               \
+            return transform->dstProfile ? NAME##Clamp : NAME##Plain;                                        \
+        if (!transform->tonemapEnabled)                                                                      \
+            return transform->dstProfile ? NAME##ScaleClamp : NAME##Scale;                                   \
+        return transform->dstProfile ? NAME##TonemapClamp : NAME##Tonemap;                                   \
+    }
+
+// CCMM kernels. clTransformCCMMChooseFunc() returns the fastest one this CPU supports (see transform_simd.c),
+// either generic or specialized for the transform's current luminance scale/tonemap/clamp settings.
+void clTransformCCMMScalar(struct clContext * C, struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, float * pixels, int pixelCount);
+clTransformCCMMFunc clTransformCCMMScalarSpecialized(struct clTransform * transform);
+clTransformCCMMFunc clTransformCCMMChooseFunc(struct clContext * C, struct clTransform * transform, clBool specialized, const char ** outName);
+
+#endif // ifndef COLORIST_TRANSFORM_CCMM_H
@@ -0,0 +1,542 @@
+// ---------------------------------------------------------------------------
+//                         Copyright Joe Drago 2018.
+//         Distributed under the Boost Software License, Version 1.0.
+//            (See accompanying file LICENSE_1_0.txt or copy at
+//                  http://www.boost.org/LICENSE_1_0.txt)
+// ---------------------------------------------------------------------------
+
+#include "colorist/transform.h"
+#include "transform_ccmm.h"
+
+#include "colorist/context.h"
+
+#include <string.h>
+
+// SSE2 is part of the x86_64 baseline, and AVX2 is detected at runtime. Everything else
+// (Emscripten, ARM, 32bit x86 without SSE2) uses clTransformCCMMScalar().
+#if !defined(COLORIST_EMSCRIPTEN) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)))
+#define COLORIST_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER)
+#define COLORIST_AVX2 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#pragma warning(disable : 4752) // found Intel(R) Advanced Vector Extensions; consider using /arch:AVX
+#define AVX2_TARGET
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+#endif
+
+// Both SIMD kernels approximate powf() with exp(y * log(x)), using the Cephes single precision
+// polynomials for exp() and log(). This is accurate to a few ULP over the range of values that
+// show up in gamma/PQ curves, well below 16bit quantization.
+
+#if defined(COLORIST_SSE2)
+
+// ----------------------------------------------------------------------------
+// SSE2
+
+static __m128 sse2Log(__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128i e;
+    __m128 fe, mask, tmp, y, z;
+
+    x = _mm_max_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x00800000))); // smallest normal float
+
+    e = _mm_srli_epi32(_mm_castps_si128(x), 23);
+    e = _mm_sub_epi32(e, _mm_set1_epi32(0x7f));
+    fe = _mm_add_ps(_mm_cvtepi32_ps(e), one);
+
+    // mantissa in [0.5, 1)
+    x = _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000)));
+    x = _mm_or_ps(x, _mm_set1_ps(0.5f));
+
+    mask = _mm_cmplt_ps(x, _mm_set1_ps(0.707106781186547524f));
+    tmp = _mm_and_ps(x, mask);
+    x = _mm_sub_ps(x, one);
+    fe = _mm_sub_ps(fe, _mm_and_ps(one, mask));
+    x = _mm_add_ps(x, tmp);
+
+    z = _mm_mul_ps(x, x);
+    y = _mm_set1_ps(7.0376836292E-2f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.1514610310E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.1676998740E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.2420140846E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.4249322787E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.6668057665E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(2.0000714765E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-2.4999993993E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(3.3333331174E-1f));
+    y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+
+    y = _mm_add_ps(y, _mm_mul_ps(fe, _mm_set1_ps(-2.12194440E-4f)));
+    y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+    x = _mm_add_ps(x, y);
+    x = _mm_add_ps(x, _mm_mul_ps(fe, _mm_set1_ps(0.693359375f)));
+    return x;
+}
+
+static __m128 sse2Exp(__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128i n;
+    __m128 fx, tmp, y, z;
+
+    x = _mm_min_ps(x, _mm_set1_ps(88.3762626647949f));
+    x = _mm_max_ps(x, _mm_set1_ps(-88.3762626647949f));
+
+    // n = floor(x / ln(2) + 0.5)
+    fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f));
+    tmp = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+    fx = _mm_sub_ps(tmp, _mm_and_ps(_mm_cmpgt_ps(tmp, fx), one));
+
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(0.693359375f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(-2.12194440E-4f)));
+
+    z = _mm_mul_ps(x, x);
+    y = _mm_set1_ps(1.9875691500E-4f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507E-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073E-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894E-2f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, z), x);
+    y = _mm_add_ps(y, one);
+
+    // y * 2^n
+    n = _mm_add_epi32(_mm_cvttps_epi32(fx), _mm_set1_epi32(0x7f));
+    n = _mm_slli_epi32(n, 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(n));
+}
+
+// x^y, treating any x <= 0 as 0
+static __m128 sse2Pow(__m128 x, __m128 y)
+{
+    __m128 positive = _mm_cmpgt_ps(x, _mm_setzero_ps());
+    return _mm_and_ps(positive, sse2Exp(_mm_mul_ps(y, sse2Log(x))));
+}
+
+static __m128 sse2PQEOTF(__m128 N)
+{
+    __m128 N1m2 = sse2Pow(N, _mm_set1_ps(1 / CL_PQ_M2));
+    __m128 N1m2c1 = _mm_max_ps(_mm_sub_ps(N1m2, _mm_set1_ps(CL_PQ_C1)), _mm_setzero_ps());
+    __m128 c2c3N1m2 = _mm_sub_ps(_mm_set1_ps(CL_PQ_C2), _mm_mul_ps(_mm_set1_ps(CL_PQ_C3), N1m2));
+    return sse2Pow(_mm_div_ps(N1m2c1, c2c3N1m2), _mm_set1_ps(1 / CL_PQ_M1));
+}
+
+static __m128 sse2PQOETF(__m128 L)
+{
+    __m128 Lm1 = sse2Pow(L, _mm_set1_ps(CL_PQ_M1));
+    __m128 c2Lm1 = _mm_mul_ps(_mm_set1_ps(CL_PQ_C2), Lm1);
+    __m128 c3Lm1 = _mm_mul_ps(_mm_set1_ps(CL_PQ_C3), Lm1);
+    return sse2Pow(_mm_div_ps(_mm_add_ps(_mm_set1_ps(CL_PQ_C1), c2Lm1), _mm_add_ps(_mm_set1_ps(1.0f), c3Lm1)), _mm_set1_ps(CL_PQ_M2));
+}
+
+static __m128 sse2Select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+CL_CCMM_INLINE __m128 sse2EOTF(struct clTransform * transform, clTransformTransferFunction eotf, __m128 v)
+{
+    switch (eotf) {
+        case CL_XTF_GAMMA:
+            return sse2Pow(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(transform->ccmmSrcGamma));
+        case CL_XTF_PQ:
+            return sse2PQEOTF(_mm_max_ps(v, _mm_setzero_ps()));
+        case CL_XTF_NONE:
+        default:
+            break;
+    }
+    return v;
+}
+
+CL_CCMM_INLINE __m128 sse2OETF(struct clTransform * transform, clTransformTransferFunction oetf, __m128 v)
+{
+    switch (oetf) {
+        case CL_XTF_GAMMA:
+            return sse2Pow(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(transform->ccmmDstInvGamma));
+        case CL_XTF_PQ:
+            return sse2PQOETF(_mm_max_ps(v, _mm_setzero_ps()));
+        case CL_XTF_NONE:
+        default:
+            break;
+    }
+    return v;
+}
+
+// Transforms four pixels, one channel per register
+CL_CCMM_INLINE void sse2Transform(struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, clBool scaleLuminance, clBool tonemap, clBool clamp, __m128 * r, __m128 * g, __m128 * b)
+{
+    const float * m;
+    __m128 R = sse2EOTF(transform, srcEOTF, *r);
+    __m128 G = sse2EOTF(transform, srcEOTF, *g);
+    __m128 B = sse2EOTF(transform, srcEOTF, *b);
+    __m128 X, Y, Z;
+
+    m = transform->ccmmSrcToXYZ.e;
+    X = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0]), R), _mm_mul_ps(_mm_set1_ps(m[1]), G)), _mm_mul_ps(_mm_set1_ps(m[2]), B));
+    Y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[3]), R), _mm_mul_ps(_mm_set1_ps(m[4]), G)), _mm_mul_ps(_mm_set1_ps(m[5]), B));
+    Z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[6]), R), _mm_mul_ps(_mm_set1_ps(m[7]), G)), _mm_mul_ps(_mm_set1_ps(m[8]), B));
+
+    if (scaleLuminance) {
+        // Same math as clTransformXYZToXYY() -> scale/tonemap -> clTransformXYYToXYZ()
+        __m128 sum = _mm_add_ps(_mm_add_ps(X, Y), Z);
+        __m128 validSum = _mm_cmpgt_ps(sum, _mm_setzero_ps());
+        __m128 x = sse2Select(validSum, _mm_div_ps(X, sum), _mm_set1_ps(transform->whitePointX));
+        __m128 y = sse2Select(validSum, _mm_div_ps(Y, sum), _mm_set1_ps(transform->whitePointY));
+        __m128 L = _mm_and_ps(validSum, Y);
+        __m128 validL;
+
+        L = _mm_mul_ps(L, _mm_set1_ps(transform->srcCurveScale));
+        L = _mm_mul_ps(L, _mm_set1_ps(transform->srcLuminanceScale));
+        L = _mm_div_ps(L, _mm_set1_ps(transform->dstLuminanceScale));
+        L = _mm_div_ps(L, _mm_set1_ps(transform->dstCurveScale));
+        if (tonemap) {
+            L = _mm_div_ps(L, _mm_add_ps(_mm_set1_ps(1.0f), L));
+        }
+
+        validL = _mm_cmpgt_ps(L, _mm_setzero_ps());
+        X = _mm_and_ps(validL, _mm_div_ps(_mm_mul_ps(x, L), y));
+        Y = _mm_and_ps(validL, L);
+        Z = _mm_and_ps(validL, _mm_div_ps(_mm_mul_ps(_mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), x), y), L), y));
+    }
+
+    m = transform->ccmmXYZToDst.e;
+    R = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0]), X), _mm_mul_ps(_mm_set1_ps(m[1]), Y)), _mm_mul_ps(_mm_set1_ps(m[2]), Z));
+    G = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[3]), X), _mm_mul_ps(_mm_set1_ps(m[4]), Y)), _mm_mul_ps(_mm_set1_ps(m[5]), Z));
+    B = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[6]), X), _mm_mul_ps(_mm_set1_ps(m[7]), Y)), _mm_mul_ps(_mm_set1_ps(m[8]), Z));
+    if (clamp) { // don't clamp XYZ
+        R = _mm_min_ps(_mm_max_ps(R, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+        G = _mm_min_ps(_mm_max_ps(G, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+        B = _mm_min_ps(_mm_max_ps(B, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+    }
+
+    *r = sse2OETF(transform, dstOETF, R);
+    *g = sse2OETF(transform, dstOETF, G);
+    *b = sse2OETF(transform, dstOETF, B);
+}
+
+CL_CCMM_INLINE void sse2TransformPixels(struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, clBool scaleLuminance, clBool tonemap, clBool clamp, float * pixels)
+{
+    __m128 p0 = _mm_loadu_ps(&pixels[0]);
+    __m128 p1 = _mm_loadu_ps(&pixels[4]);
+    __m128 p2 = _mm_loadu_ps(&pixels[8]);
+    __m128 p3 = _mm_loadu_ps(&pixels[12]);
+    _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+    sse2Transform(transform, srcEOTF, dstOETF, scaleLuminance, tonemap, clamp, &p0, &p1, &p2);
+    _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+    _mm_storeu_ps(&pixels[0], p0);
+    _mm_storeu_ps(&pixels[4], p1);
+    _mm_storeu_ps(&pixels[8], p2);
+    _mm_storeu_ps(&pixels[12], p3);
+}
+
+CL_CCMM_INLINE void sse2Loop(struct clContext * C, struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, clBool scaleLuminance, clBool tonemap, clBool clamp, float * pixels, int pixelCount)
+{
+    int i = 0;
+
+    COLORIST_UNUSED(C);
+
+    for (; (i + 4) <= pixelCount; i += 4) {
+        sse2TransformPixels(transform, srcEOTF, dstOETF, scaleLuminance, tonemap, clamp, &pixels[i * 4]);
+    }
+    if (i < pixelCount) {
+        // Leftovers; pad out to a full register with black
+        float tail[16];
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, &pixels[i * 4], sizeof(float) * 4 * (pixelCount - i));
+        sse2TransformPixels(transform, srcEOTF, dstOETF, scaleLuminance, tonemap, clamp, tail);
+        memcpy(&pixels[i * 4], tail, sizeof(float) * 4 * (pixelCount - i));
+    }
+}
+
+static void clTransformCCMMSSE2(struct clContext * C, struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, float * pixels, int pixelCount)
+{
+    clBool clamp = transform->dstProfile ? clTrue : clFalse;
+    sse2Loop(C, transform, srcEOTF, dstOETF, transform->luminanceScaleEnabled, transform->tonemapEnabled, clamp, pixels, pixelCount);
+}
+
+CL_CCMM_SPECIALIZE(, sse2, sse2Loop)
+
+#endif // defined(COLORIST_SSE2)
+
+#if defined(COLORIST_AVX2)
+
+// ----------------------------------------------------------------------------
+// AVX2 (identical math to the SSE2 kernel, eight pixels wide)
+
+AVX2_TARGET static __m256 avx2Log(__m256 x)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256i e;
+    __m256 fe, mask, tmp, y, z;
+
+    x = _mm256_max_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x00800000))); // smallest normal float
+
+    e = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+    e = _mm256_sub_epi32(e, _mm256_set1_epi32(0x7f));
+    fe = _mm256_add_ps(_mm256_cvtepi32_ps(e), one);
+
+    // mantissa in [0.5, 1)
+    x = _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(~0x7f800000)));
+    x = _mm256_or_ps(x, _mm256_set1_ps(0.5f));
+
+    mask = _mm256_cmp_ps(x, _mm256_set1_ps(0.707106781186547524f), _CMP_LT_OQ);
+    tmp = _mm256_and_ps(x, mask);
+    x = _mm256_sub_ps(x, one);
+    fe = _mm256_sub_ps(fe, _mm256_and_ps(one, mask));
+    x = _mm256_add_ps(x, tmp);
+
+    z = _mm256_mul_ps(x, x);
+    y = _mm256_set1_ps(7.0376836292E-2f);
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(-1.1514610310E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.1676998740E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(-1.2420140846E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.4249322787E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(-1.6668057665E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(2.0000714765E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(-2.4999993993E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(3.3333331174E-1f));
+    y = _mm256_mul_ps(_mm256_mul_ps(y, x), z);
+
+    y = _mm256_add_ps(y, _mm256_mul_ps(fe, _mm256_set1_ps(-2.12194440E-4f)));
+    y = _mm256_sub_ps(y, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+    x = _mm256_add_ps(x, y);
+    x = _mm256_add_ps(x, _mm256_mul_ps(fe, _mm256_set1_ps(0.693359375f)));
+    return x;
+}
+
+AVX2_TARGET static __m256 avx2Exp(__m256 x)
+{
+    __m256i n;
+    __m256 fx, y, z;
+
+    x = _mm256_min_ps(x, _mm256_set1_ps(88.3762626647949f));
+    x = _mm256_max_ps(x, _mm256_set1_ps(-88.3762626647949f));
+
+    // n = floor(x / ln(2) + 0.5)
+    fx = _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _mm256_set1_ps(0.5f));
+    fx = _mm256_floor_ps(fx);
+
+    x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(0.693359375f)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(-2.12194440E-4f)));
+
+    z = _mm256_mul_ps(x, x);
+    y = _mm256_set1_ps(1.9875691500E-4f);
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.3981999507E-3f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073E-3f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894E-2f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201E-1f));
+    y = _mm256_add_ps(_mm256_mul_ps(y, z), x);
+    y = _mm256_add_ps(y, _mm256_set1_ps(1.0f));
+
+    // y * 2^n
+    n = _mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(0x7f));
+    n = _mm256_slli_epi32(n, 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(n));
+}
+
+// x^y, treating any x <= 0 as 0
+AVX2_TARGET static __m256 avx2Pow(__m256 x, __m256 y)
+{
+    __m256 positive = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ);
+    return _mm256_and_ps(positive, avx2Exp(_mm256_mul_ps(y, avx2Log(x))));
+}
+
+AVX2_TARGET static __m256 avx2PQEOTF(__m256 N)
+{
+    __m256 N1m2 = avx2Pow(N, _mm256_set1_ps(1 / CL_PQ_M2));
+    __m256 N1m2c1 = _mm256_max_ps(_mm256_sub_ps(N1m2, _mm256_set1_ps(CL_PQ_C1)), _mm256_setzero_ps());
+    __m256 c2c3N1m2 = _mm256_sub_ps(_mm256_set1_ps(CL_PQ_C2), _mm256_mul_ps(_mm256_set1_ps(CL_PQ_C3), N1m2));
+    return avx2Pow(_mm256_div_ps(N1m2c1, c2c3N1m2), _mm256_set1_ps(1 / CL_PQ_M1));
+}
+
+AVX2_TARGET static __m256 avx2PQOETF(__m256 L)
+{
+    __m256 Lm1 = avx2Pow(L, _mm256_set1_ps(CL_PQ_M1));
+    __m256 c2Lm1 = _mm256_mul_ps(_mm256_set1_ps(CL_PQ_C2), Lm1);
+    __m256 c3Lm1 = _mm256_mul_ps(_mm256_set1_ps(CL_PQ_C3), Lm1);
+    return avx2Pow(_mm256_div_ps(_mm256_add_ps(_mm256_set1_ps(CL_PQ_C1), c2Lm1), _mm256_add_ps(_mm256_set1_ps(1.0f), c3Lm1)), _mm256_set1_ps(CL_PQ_M2));
+}
+
+AVX2_TARGET CL_CCMM_INLINE __m256 avx2EOTF(struct clTransform * transform, clTransformTransferFunction eotf, __m256 v)
+{
+    switch (eotf) {
+        case CL_XTF_GAMMA:
+            return avx2Pow(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(transform->ccmmSrcGamma));
+        case CL_XTF_PQ:
+            return avx2PQEOTF(_mm256_max_ps(v, _mm256_setzero_ps()));
+        case CL_XTF_NONE:
+        default:
+            break;
+    }
+    return v;
+}
+
+AVX2_TARGET CL_CCMM_INLINE __m256 avx2OETF(struct clTransform * transform, clTransformTransferFunction oetf, __m256 v)
+{
+    switch (oetf) {
+        case CL_XTF_GAMMA:
+            return avx2Pow(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(transform->ccmmDstInvGamma));
+        case CL_XTF_PQ:
+            return avx2PQOETF(_mm256_max_ps(v, _mm256_setzero_ps()));
+        case CL_XTF_NONE:
+        default:
+            break;
+    }
+    return v;
+}
+
+// Transforms eight pixels, one channel per register
+AVX2_TARGET CL_CCMM_INLINE void avx2Transform(struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, clBool scaleLuminance, clBool tonemap, clBool clamp, __m256 * r, __m256 * g, __m256 * b)
+{
+    const float * m;
+    __m256 R = avx2EOTF(transform, srcEOTF, *r);
+    __m256 G = avx2EOTF(transform, srcEOTF, *g);
+    __m256 B = avx2EOTF(transform, srcEOTF, *b);
+    __m256 X, Y, Z;
+
+    m = transform->ccmmSrcToXYZ.e;
+    X = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[0]), R), _mm256_mul_ps(_mm256_set1_ps(m[1]), G)), _mm256_mul_ps(_mm256_set1_ps(m[2]), B));
+    Y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[3]), R), _mm256_mul_ps(_mm256_set1_ps(m[4]), G)), _mm256_mul_ps(_mm256_set1_ps(m[5]), B));
+    Z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[6]), R), _mm256_mul_ps(_mm256_set1_ps(m[7]), G)), _mm256_mul_ps(_mm256_set1_ps(m[8]), B));
+
+    if (scaleLuminance) {
+        // Same math as clTransformXYZToXYY() -> scale/tonemap -> clTransformXYYToXYZ()
+        __m256 sum = _mm256_add_ps(_mm256_add_ps(X, Y), Z);
+        __m256 validSum = _mm256_cmp_ps(sum, _mm256_setzero_ps(), _CMP_GT_OQ);
+        __m256 x = _mm256_blendv_ps(_mm256_set1_ps(transform->whitePointX), _mm256_div_ps(X, sum), validSum);
+        __m256 y = _mm256_blendv_ps(_mm256_set1_ps(transform->whitePointY), _mm256_div_ps(Y, sum), validSum);
+        __m256 L = _mm256_and_ps(validSum, Y);
+        __m256 validL;
+
+        L = _mm256_mul_ps(L, _mm256_set1_ps(transform->srcCurveScale));
+        L = _mm256_mul_ps(L, _mm256_set1_ps(transform->srcLuminanceScale));
+        L = _mm256_div_ps(L, _mm256_set1_ps(transform->dstLuminanceScale));
+        L = _mm256_div_ps(L, _mm256_set1_ps(transform->dstCurveScale));
+        if (tonemap) {
+            L = _mm256_div_ps(L, _mm256_add_ps(_mm256_set1_ps(1.0f), L));
+        }
+
+        validL = _mm256_cmp_ps(L, _mm256_setzero_ps(), _CMP_GT_OQ);
+        X = _mm256_and_ps(validL, _mm256_div_ps(_mm256_mul_ps(x, L), y));
+        Y = _mm256_and_ps(validL, L);
+        Z = _mm256_and_ps(validL, _mm256_div_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), x), y), L), y));
+    }
+
+    m = transform->ccmmXYZToDst.e;
+    R = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[0]), X), _mm256_mul_ps(_mm256_set1_ps(m[1]), Y)), _mm256_mul_ps(_mm256_set1_ps(m[2]), Z));
+    G = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[3]), X), _mm256_mul_ps(_mm256_set1_ps(m[4]), Y)), _mm256_mul_ps(_mm256_set1_ps(m[5]), Z));
+    B = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[6]), X), _mm256_mul_ps(_mm256_set1_ps(m[7]), Y)), _mm256_mul_ps(_mm256_set1_ps(m[8]), Z));
+    if (clamp) { // don't clamp XYZ
+        R = _mm256_min_ps(_mm256_max_ps(R, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+        G = _mm256_min_ps(_mm256_max_ps(G, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+        B = _mm256_min_ps(_mm256_max_ps(B, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+    }
+
+    *r = avx2OETF(transform, dstOETF, R);
+    *g = avx2OETF(transform, dstOETF, G);
+    *b = avx2OETF(transform, dstOETF, B);
+}
+
+// 4x4 transpose within each 128bit lane. Lane 0 ends up holding pixels 0,2,4,6 and lane 1 holds
+// pixels 1,3,5,7, which is fine as every pixel is independent and the transpose is its own inverse.
+AVX2_TARGET static void avx2Transpose(__m256 * p0, __m256 * p1, __m256 * p2, __m256 * p3)
+{
+    __m256 t0 = _mm256_unpacklo_ps(*p0, *p1);
+    __m256 t1 = _mm256_unpackhi_ps(*p0, *p1);
+    __m256 t2 = _mm256_unpacklo_ps(*p2, *p3);
+    __m256 t3 = _mm256_unpackhi_ps(*p2, *p3);
+    *p0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    *p1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    *p2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    *p3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+AVX2_TARGET CL_CCMM_INLINE void avx2TransformPixels(struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, clBool scaleLuminance, clBool tonemap, clBool clamp, float * pixels)
+{
+    __m256 p0 = _mm256_loadu_ps(&pixels[0]);
+    __m256 p1 = _mm256_loadu_ps(&pixels[8]);
+    __m256 p2 = _mm256_loadu_ps(&pixels[16]);
+    __m256 p3 = _mm256_loadu_ps(&pixels[24]);
+    avx2Transpose(&p0, &p1, &p2, &p3);
+    avx2Transform(transform, srcEOTF, dstOETF, scaleLuminance, tonemap, clamp, &p0, &p1, &p2);
+    avx2Transpose(&p0, &p1, &p2, &p3);
+    _mm256_storeu_ps(&pixels[0], p0);
+    _mm256_storeu_ps(&pixels[8], p1);
+    _mm256_storeu_ps(&pixels[16], p2);
+    _mm256_storeu_ps(&pixels[24], p3);
+}
+
+AVX2_TARGET CL_CCMM_INLINE void avx2Loop(struct clContext * C, struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, clBool scaleLuminance, clBool tonemap, clBool clamp, float * pixels, int pixelCount)
+{
+    int i = 0;
+
+    for (; (i + 8) <= pixelCount; i += 8) {
+        avx2TransformPixels(transform, srcEOTF, dstOETF, scaleLuminance, tonemap, clamp, &pixels[i * 4]);
+    }
+    if (i < pixelCount) {
+        // Leftovers are rare enough (last pixels of a block) to hand to SSE2
+        sse2Loop(C, transform, srcEOTF, dstOETF, scaleLuminance, tonemap, clamp, &pixels[i * 4], pixelCount - i);
+    }
+}
+
+AVX2_TARGET static void clTransformCCMMAVX2(struct clContext * C, struct clTransform * transform, clTransformTransferFunction srcEOTF, clTransformTransferFunction dstOETF, float * pixels, int pixelCount)
+{
+    clBool clamp = transform->dstProfile ? clTrue : clFalse;
+    avx2Loop(C, transform, srcEOTF, dstOETF, transform->luminanceScaleEnabled, transform->tonemapEnabled, clamp, pixels, pixelCount);
+}
+
+CL_CCMM_SPECIALIZE(AVX2_TARGET, avx2, avx2Loop)
+
+static clBool cpuHasAVX2(void)
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return clFalse;
+    }
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27))) { // OSXSAVE
+        return clFalse;
+    }
+    if ((_xgetbv(0) & 6) != 6) { // OS saves XMM and YMM state
+        return clFalse;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) ? clTrue : clFalse;
+#else
+    return __builtin_cpu_supports("avx2") ? clTrue : clFalse;
+#endif
+}
+
+#endif // defined(COLORIST_AVX2)
+
+// ----------------------------------------------------------------------------
+// Runtime dispatch
+
+clTransformCCMMFunc clTransformCCMMChooseFunc(struct clContext * C, struct clTransform * transform, clBool specialized, const char ** outName)
+{
+    COLORIST_UNUSED(C);
+
+#if defined(COLORIST_AVX2)
+    if (cpuHasAVX2()) {
+        *outName = "AVX2";
+        return specialized ? avx2Specialized(transform) : clTransformCCMMAVX2;
+    }
+#endif
+#if defined(COLORIST_SSE2)
+    *outName = "SSE2";
+    return specialized ? sse2Specialized(transform) : clTransformCCMMSSE2;
+#else
+    *outName = "Scalar";
+    return specialized ? clTransformCCMMScalarSpecialized(transform) : clTransformCCMMScalar;
+#endif
+}